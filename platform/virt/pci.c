@@ -146,7 +146,8 @@ void pci_platform_init_bar(pci_dev dev, int bar_idx)
     }
 }
 
-u64 pci_platform_allocate_msi(pci_dev dev, thunk h, const char *name, u32 *address, u32 *data)
+u64 pci_platform_allocate_msi(pci_dev dev, thunk h, const char *name, u32 target_cpu,
+                              u32 *address, u32 *data)
 {
     u64 v = allocate_msi_interrupt();
     if (v == INVALID_PHYSICAL)
@@ -157,7 +158,7 @@ u64 pci_platform_allocate_msi(pci_dev dev, thunk h, const char *name, u32 *addre
         deallocate_msi_interrupt(v);
         return INVALID_PHYSICAL;
     }
-    msi_format(address, data, v);
+    msi_format(address, data, v, target_cpu);
     return v;
 }
 
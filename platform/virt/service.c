@@ -288,7 +288,8 @@ static void __attribute__((noinline)) init_service_new_stack(void)
     bytes pagesize = is_low_memory_machine(kh) ? PAGESIZE : PAGESIZE_2M;
     init_tuples(locking_heap_wrapper(heap_general(kh),
                 allocate_tagged_region(kh, tag_table_tuple, pagesize)));
-    init_symbols(allocate_tagged_region(kh, tag_symbol, pagesize), heap_locked(kh));
+    init_symbols(locking_heap_wrapper(heap_general(kh),
+                 allocate_tagged_region(kh, tag_symbol, pagesize)), heap_locked(kh));
     init_management(allocate_tagged_region(kh, tag_function_tuple, pagesize), heap_general(kh));
     init_debug("calling runtime init\n");
     kernel_runtime_init(kh);
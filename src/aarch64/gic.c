@@ -282,7 +282,8 @@ void dev_irq_disable(u32 dev_id, int vector)
     }
 }
 
-void msi_format(u32 *address, u32 *data, int vector)
+/* All LPIs are mapped to a single collection, so target_cpu is not used. */
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu)
 {
     if (gic.its_base) {
         *address = gic.its_base + GITS_TRANSLATER - DEVICE_BASE;
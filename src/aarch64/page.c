@@ -36,6 +36,11 @@ void page_invalidate_flush()
 
 }
 
+void page_invalidate_idle(void)
+{
+
+}
+
 flush_entry get_page_flush_entry()
 {
     return 0;
@@ -23,8 +23,19 @@
 #define RUNLOOP_TIMER_MAX_PERIOD_US     100000
 #define RUNLOOP_TIMER_MIN_PERIOD_US     1000
 
-/* length of thread scheduling queue */
-#define MAX_THREADS 8192
+/* number of independently locked symbol table shards (log2) */
+#define SYMBOL_SHARD_ORDER              4
+
+/* per-process futex hash table size */
+#define FUTEX_HASH_ORDER                8
+
+/* coarse clock timers may fire this late so as to share a timer interrupt */
+#define TIMER_COARSE_SLACK_US           4000
+
+/* fair scheduler: period in which each runnable thread should get to run
+   once, and the minimum time slice */
+#define SCHED_LATENCY_US            6000
+#define SCHED_MIN_GRANULARITY_US    750
 
 /* size of free context queues */
 #define FREE_KERNEL_CONTEXT_QUEUE_SIZE  8
@@ -33,6 +44,11 @@
 /* per-cpu queue */
 #define CPU_QUEUE_SIZE 512
 
+/* per-cpu deferred work queues */
+#define BH_QUEUE_SIZE       2048
+#define RUN_QUEUE_SIZE      2048
+#define ASYNC_QUEUE_1_SIZE  8192
+
 /* locking */
 #define MUTEX_ACQUIRE_SPIN_LIMIT (1ull << 20)
 
@@ -54,9 +70,20 @@
 #define XENNET_RX_SERVICEQUEUE_DEPTH 512
 #define XENNET_TX_SERVICEQUEUE_DEPTH 512
 
+/* NVMe: maximum number of I/O queue pairs (one per cpu, up to this and the
+   controller limit), log2 of entries per queue, and number of outstanding
+   commands on a queue above which submitters reap completions directly */
+#define NVME_MAX_IO_QUEUES      64
+#define NVME_IOQ_MAX_ORDER      10
+#define NVME_IOQ_POLL_THRESHOLD 32
+
+/* virtio-blk: largest request built by merging adjacent requests */
+#define VIRTIO_BLK_MERGE_MAX    (1 * MB)
+
 /* mm stuff */
 #define PAGECACHE_DRAIN_CUTOFF (64 * MB)
 #define PAGECACHE_SCAN_PERIOD_SECONDS 5
+#define PAGECACHE_SHARDS 8      /* power of 2 */
 #define LOW_MEMORY_THRESHOLD   (64 * MB)
 
 /* don't go below this minimum amount of physical memory when inflating balloon */
@@ -68,6 +95,13 @@
 /* must be large enough for vendor code that use malloc/free interface */
 #define MAX_MCACHE_ORDER 16
 
+/* per-cpu magazines for the locked kernel heap: objects per size class per
+   cpu, objects moved to or from the shared mcache at a time, and largest
+   cached object order */
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH 16
+#define MAGAZINE_MAX_ORDER 12
+
 /* ftrace buffer size */
 #define DEFAULT_TRACE_ARRAY_SIZE        (512ULL << 20)
 
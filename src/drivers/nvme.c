@@ -34,8 +34,8 @@
 #define NVME_AQ_IDX     0   /* admin queue index */
 #define NVME_AQ_MSIX    0   /* admin queue MSI-X slot */
 
-#define NVME_IOQ_IDX    1   /* I/O queue index and identifier */
-#define NVME_IOQ_MSIX   1   /* I/O queue MSI-X slot */
+/* I/O queues are numbered from 1, and each uses the MSI-X slot matching its
+ * queue identifier. */
 
 /* command Dword 0 */
 #define NVME_CID(id)    ((id) << 16)
@@ -77,6 +77,11 @@
 #define NVME_OPC_MI_RECV    0x1E
 #define NVME_OPC_DBL_CFG    0x7C
 
+/* Set Features command */
+#define NVME_FEAT_NUM_QUEUES    0x07
+#define NVME_NSQA(dw0)  ((dw0) & 0xFFFF)    /* zero-based */
+#define NVME_NCQA(dw0)  ((dw0) >> 16)       /* zero-based */
+
 /* Identify command */
 #define CNS_IDENTIFY_NAMESPACE  0
 #define CNS_IDENTIFY_CONTROLLER 1
@@ -167,9 +172,9 @@ typedef struct nvme_cq {
 declare_closure_struct(1, 0, void, nvme_admin_irq,
                        struct nvme *, n);
 declare_closure_struct(1, 0, void, nvme_io_irq,
-                       struct nvme *, n);
+                       struct nvme_ioq *, q);
 declare_closure_struct(1, 0, void, nvme_bh_service,
-                       struct nvme *, n);
+                       struct nvme_ioq *, q);
 declare_closure_struct(3, 3, void, nvme_io,
                        struct nvme *, n, u32, namespace, boolean, write,
                        void *, buf, range, blocks, status_handler, sh);
@@ -185,19 +190,33 @@ typedef struct nvme {
     closure_struct(nvme_admin_irq, admin_irq);
     thunk ac_handler;   /* admin completion handler */
     int ioq_order;     /* I/O queue size */
-    struct nvme_sq iosq;    /* I/O submission queue */
-    struct nvme_cq iocq;    /* I/O completion queue */
+    int ioq_max;        /* length of the ioqs array */
+    int ioq_count;      /* number of I/O queue pairs in use */
+    struct nvme_ioq **ioqs;
     int attach_id;
-    closure_struct(nvme_io_irq, io_irq);
+    closure_struct(nvme_io, r);
+    closure_struct(nvme_io, w);
+    closure_struct(storage_simple_req_handler, req_handler);
+} *nvme;
+
+/* An I/O submission and completion queue pair, with its own interrupt vector,
+ * command identifiers and request lists. Requests are submitted to the queue
+ * assigned to the current cpu, and queue interrupts are steered to the cpu
+ * with the same index, so that submission and completion of most requests
+ * don't contend with other cpus. */
+typedef struct nvme_ioq {
+    nvme n;
+    int idx;    /* queue identifier and MSI-X slot */
+    struct nvme_sq sq;
+    struct nvme_cq cq;
     struct list pending_reqs, free_reqs, done_reqs;
     vector cmds;
     struct list free_cmds;
+    u64 outstanding;    /* commands submitted and not yet completed */
+    closure_struct(nvme_io_irq, irq);
     closure_struct(nvme_bh_service, bh_service);
-    closure_struct(nvme_io, r);
-    closure_struct(nvme_io, w);
-    closure_struct(storage_simple_req_handler, req_handler);
     struct spinlock lock;
-} *nvme;
+} *nvme_ioq;
 
 typedef struct nvme_ioreq {
     struct list l;
@@ -294,38 +313,38 @@ static inline void nvme_cq_doorbell(nvme n, int q_idx, nvme_cq q)
     pci_bar_write_4(&n->bar, cqhdbl, q->head);
 }
 
-static nvme_ioreq nvme_get_ioreq(nvme n)
+static nvme_ioreq nvme_get_ioreq(nvme_ioq q)
 {
     nvme_ioreq req;
-    spin_lock(&n->lock);
-    list l = list_get_next(&n->free_reqs);
+    u64 irqflags = spin_lock_irq(&q->lock);
+    list l = list_get_next(&q->free_reqs);
     if (l) {
         list_delete(l);
         req = struct_from_list(l, nvme_ioreq, l);
     } else {
         nvme_debug("new request allocation");
-        req = allocate(n->general, sizeof(*req));
+        req = allocate(q->n->general, sizeof(*req));
     }
-    spin_unlock(&n->lock);
+    spin_unlock_irq(&q->lock, irqflags);
     return req;
 }
 
-/* Called with the lock held. */
-static nvme_iocmd nvme_get_iocmd(nvme n, boolean allocate)
+/* Called with the queue lock held. */
+static nvme_iocmd nvme_get_iocmd(nvme_ioq q, boolean allocate)
 {
-    list l = list_get_next(&n->free_cmds);
+    list l = list_get_next(&q->free_cmds);
     if (l) {
         list_delete(l);
         return struct_from_list(l, nvme_iocmd, l);
-    } else if (allocate && (vector_length(n->cmds) <= NVME_CID_MAX)) {
+    } else if (allocate && (vector_length(q->cmds) <= NVME_CID_MAX)) {
         nvme_debug("new command allocation");
-        nvme_iocmd cmd = allocate(n->general, sizeof(*cmd));
+        nvme_iocmd cmd = allocate(q->n->general, sizeof(*cmd));
         if (cmd == INVALID_ADDRESS) {
             nvme_debug("command allocation failed");
             return cmd;
         }
-        cmd->id = vector_length(n->cmds);
-        vector_push(n->cmds, cmd);
+        cmd->id = vector_length(q->cmds);
+        vector_push(q->cmds, cmd);
         return cmd;
     } else {
         nvme_debug("no available commands");
@@ -333,21 +352,21 @@ static nvme_iocmd nvme_get_iocmd(nvme n, boolean allocate)
     }
 }
 
-/* Called with the lock held. */
-static void nvme_service_pending(nvme n, boolean allocate)
+/* Called with the queue lock held. The doorbell is rung once for all the
+ * commands queued in a call. */
+static void nvme_service_pending(nvme_ioq q, boolean allocate)
 {
     boolean new_reqs = false;
     list l;
-    while ((l = list_get_next(&n->pending_reqs))) {
-        nvme_iocmd cmd = nvme_get_iocmd(n, allocate);
+    while ((l = list_get_next(&q->pending_reqs))) {
+        nvme_iocmd cmd = nvme_get_iocmd(q, allocate);
         if (cmd == INVALID_ADDRESS)
             break;
-        struct nvme_sqe *sqe = nvme_get_sqe(&n->iosq);
+        struct nvme_sqe *sqe = nvme_get_sqe(&q->sq);
         if (!sqe) {
-            list_insert_before(list_begin(&n->free_cmds), &cmd->l);
+            list_insert_before(list_begin(&q->free_cmds), &cmd->l);
             break;
         }
-        new_reqs = true;
         nvme_ioreq req = struct_from_list(l, nvme_ioreq, l);
         sqe->cdw0 = NVME_CID(cmd->id) | NVME_CMD_PRP |
                 (req->write ? NVME_OPC_WRITE : NVME_OPC_READ);
@@ -365,28 +384,67 @@ static void nvme_service_pending(nvme n, boolean allocate)
         }
         if (nlb == range_span(req->blocks))
             list_delete(l);
-        nvme_debug("request sectors [0x%x, 0x%x), cmd ID 0x%0x",
+        nvme_debug("queue %d: request sectors [0x%x, 0x%x), cmd ID 0x%0x", q->idx,
                    req->blocks.start, req->blocks.start + nlb, cmd->id);
         sqe->cdw10 = req->blocks.start;
         sqe->cdw12 = nlb - 1;
         cmd->req = req;
         req->pending_cmds++;
         req->blocks.start += nlb;
+        q->outstanding++;
         new_reqs = true;
     }
     if (new_reqs)
-        nvme_sq_doorbell(n, NVME_IOQ_IDX, &n->iosq);
+        nvme_sq_doorbell(q->n, q->idx, &q->sq);
+}
+
+/* Called with the queue lock held, either from the queue interrupt or by a
+ * submitter when the queue is busy. */
+static void nvme_service_completions(nvme_ioq q)
+{
+    boolean done_empty = list_empty(&q->done_reqs);
+    boolean completed = false;
+    struct nvme_cqe *cqe;
+    while ((cqe = nvme_get_cqe(&q->cq))) {
+        q->sq.head = NVME_SQ_HEAD(cqe->dw2);
+        nvme_iocmd cmd = vector_get(q->cmds, NVME_CMD_ID(cqe->dw3));
+        nvme_debug("  queue %d: cmd ID 0x%0x complete", q->idx, cmd->id);
+        nvme_ioreq req = cmd->req;
+        list_insert_before(list_begin(&q->free_cmds), &cmd->l);
+        q->outstanding--;
+        completed = true;
+        int sc = NVME_STATUS_CODE(cqe->dw3);
+        u64 remaining = range_span(req->blocks);
+        if ((sc != NVME_SC_OK) && (remaining != 0))
+            list_delete(&req->l);   /* remove from pending list */
+        if (sc != NVME_SC_OK)
+            req->sc = sc;
+        boolean req_complete = !(--req->pending_cmds) && (!remaining || (sc != NVME_SC_OK));
+        if (req_complete)
+            list_push_back(&q->done_reqs, &req->l);
+    }
+    if (!completed)
+        return;
+    nvme_cq_doorbell(q->n, q->idx, &q->cq);
+    nvme_service_pending(q, false);
+    if (done_empty && !list_empty(&q->done_reqs))
+        enqueue(bhqueue, &q->bh_service);
+}
+
+static inline nvme_ioq nvme_current_ioq(nvme n)
+{
+    return n->ioqs[current_cpu()->id % n->ioq_count];
 }
 
 define_closure_function(3, 3, void, nvme_io,
                         nvme, n, u32, namespace, boolean, write,
                         void *, buf, range, blocks, status_handler, sh)
 {
-    nvme n = bound(n);
+    nvme_ioq q = nvme_current_ioq(bound(n));
     u32 namespace = bound(namespace);
     boolean write = bound(write);
-    nvme_debug("[%d] %s %R", namespace, write ? "write" : "read", blocks);
-    nvme_ioreq req = nvme_get_ioreq(n);
+    nvme_debug("[%d] %s %R (queue %d)", namespace, write ? "write" : "read", blocks, q->idx);
+    nvme_ioreq req = nvme_get_ioreq(q);
     if (req == INVALID_ADDRESS) {
         apply(sh, timm("result", "request allocation failed"));
         return;
@@ -398,61 +456,45 @@ define_closure_function(3, 3, void, nvme_io,
     req->pending_cmds = 0;
     req->sh = sh;
     req->sc = NVME_SC_OK;
-    u64 irqflags = spin_lock_irq(&n->lock);
-    list_push_back(&n->pending_reqs, &req->l);
-    nvme_service_pending(n, true);
-    spin_unlock_irq(&n->lock, irqflags);
+    u64 irqflags = spin_lock_irq(&q->lock);
+    list_push_back(&q->pending_reqs, &req->l);
+
+    /* Under load, reap completions here rather than waiting for the interrupt,
+     * which also frees up submission queue entries for this request. */
+    if (q->outstanding >= NVME_IOQ_POLL_THRESHOLD)
+        nvme_service_completions(q);
+    nvme_service_pending(q, true);
+    spin_unlock_irq(&q->lock, irqflags);
 }
 
 define_closure_function(1, 0, void, nvme_io_irq,
-                        nvme, n)
+                        nvme_ioq, q)
 {
     nvme_debug("%s", __func__);
-    nvme n = bound(n);
-    spin_lock(&n->lock);
-    boolean done_empty = list_empty(&n->done_reqs);
-    struct nvme_cqe *cqe;
-    while ((cqe = nvme_get_cqe(&n->iocq))) {
-        n->iosq.head = NVME_SQ_HEAD(cqe->dw2);
-        nvme_iocmd cmd = vector_get(n->cmds, NVME_CMD_ID(cqe->dw3));
-        nvme_debug("  cmd ID 0x%0x complete", cmd->id);
-        nvme_ioreq req = cmd->req;
-        list_insert_before(list_begin(&n->free_cmds), &cmd->l);
-        int sc = NVME_STATUS_CODE(cqe->dw3);
-        u64 remaining = range_span(req->blocks);
-        if ((sc != NVME_SC_OK) && (remaining != 0))
-            list_delete(&req->l);   /* remove from pending list */
-        if (sc != NVME_SC_OK)
-            req->sc = sc;
-        boolean req_complete = !(--req->pending_cmds) && (!remaining || (sc != NVME_SC_OK));
-        if (req_complete)
-            list_push_back(&n->done_reqs, &req->l);
-    }
-    nvme_cq_doorbell(n, NVME_IOQ_IDX, &n->iocq);
-    nvme_service_pending(n, false);
-    if (done_empty && !list_empty(&n->done_reqs))
-        enqueue(bhqueue, &n->bh_service);
-    spin_unlock(&n->lock);
+    nvme_ioq q = bound(q);
+    spin_lock(&q->lock);
+    nvme_service_completions(q);
+    spin_unlock(&q->lock);
 }
 
 define_closure_function(1, 0, void, nvme_bh_service,
-                        nvme, n)
+                        nvme_ioq, q)
 {
     nvme_debug("%s", __func__);
-    nvme n = bound(n);
+    nvme_ioq q = bound(q);
     list l;
-    u64 irqflags = spin_lock_irq(&n->lock);
-    while ((l = list_get_next(&n->done_reqs))) {
+    u64 irqflags = spin_lock_irq(&q->lock);
+    while ((l = list_get_next(&q->done_reqs))) {
         list_delete(l);
-        spin_unlock_irq(&n->lock, irqflags);
+        spin_unlock_irq(&q->lock, irqflags);
         nvme_ioreq req = struct_from_list(l, nvme_ioreq, l);
         apply(req->sh, (req->sc == NVME_SC_OK) ? STATUS_OK :
                 timm("result", "NVMe status code 0x%x", req->sc));
-        irqflags = spin_lock_irq(&n->lock);
-        list_insert_before(list_begin(&n->free_reqs), l);
+        irqflags = spin_lock_irq(&q->lock);
+        list_insert_before(list_begin(&q->free_reqs), l);
     }
-    nvme_service_pending(n, true);
-    spin_unlock_irq(&n->lock, irqflags);
+    nvme_service_pending(q, true);
+    spin_unlock_irq(&q->lock, irqflags);
 }
 
 closure_function(4, 0, void, nvme_ns_attach,
@@ -710,10 +752,84 @@ static boolean nvme_get_active_namespaces(nvme n, u32 start_id, storage_attach a
     return true;
 }
 
-closure_function(2, 0, void, nvme_create_iosq_resp,
-                 nvme, n, storage_attach, a)
+static nvme_ioq nvme_alloc_ioq(nvme n, int idx)
+{
+    nvme_ioq q = allocate(n->general, sizeof(*q));
+    if (q == INVALID_ADDRESS)
+        return q;
+    if (!nvme_init_cq(n, &q->cq, n->ioq_order))
+        goto free_q;
+    if (!nvme_init_sq(n, &q->sq, n->ioq_order))
+        goto deinit_cq;
+
+    /* Zero out all submission queue entries, so that when submitting an entry
+     * only used fields need to be set. This relies on the fact that all I/O
+     * commands use the same set of fields. */
+    zero(q->sq.ring, U64_FROM_BIT(q->sq.order) * sizeof(struct nvme_sqe));
+
+    q->cmds = allocate_vector(n->general, U64_FROM_BIT(n->ioq_order));
+    if (q->cmds == INVALID_ADDRESS)
+        goto deinit_sq;
+    q->n = n;
+    q->idx = idx;
+    list_init(&q->pending_reqs);
+    list_init(&q->free_reqs);
+    list_init(&q->done_reqs);
+    list_init(&q->free_cmds);
+    q->outstanding = 0;
+    init_closure(&q->bh_service, nvme_bh_service, q);
+    spin_lock_init(&q->lock);
+    return q;
+  deinit_sq:
+    nvme_deinit_sq(n, &q->sq);
+  deinit_cq:
+    nvme_deinit_cq(n, &q->cq);
+  free_q:
+    deallocate(n->general, q, sizeof(*q));
+    return INVALID_ADDRESS;
+}
+
+static void nvme_free_ioq(nvme n, nvme_ioq q)
+{
+    deallocate_vector(q->cmds);
+    nvme_deinit_sq(n, &q->sq);
+    nvme_deinit_cq(n, &q->cq);
+    deallocate(n->general, q, sizeof(*q));
+}
+
+static boolean nvme_create_iocq(nvme n, int idx, storage_attach a);
+
+/* Carry on with the I/O queues created so far. */
+static void nvme_ioqs_ready(nvme n, int count, storage_attach a)
+{
+    n->ioq_count = count;
+    nvme_debug("using %d I/O queue(s)", n->ioq_count);
+    if (n->vs >= NVME_VER(1, 1, 0))
+        nvme_get_active_namespaces(n, 0, a);
+    else
+        nvme_identify_controller(n, a);
+}
+
+/* Release an I/O queue that could not be created. A completion queue
+ * created without its submission queue receives no completions, so its
+ * memory can be freed as well. */
+static void nvme_ioq_create_failed(nvme n, nvme_ioq q, storage_attach a)
+{
+    int idx = q->idx;
+    n->ioqs[idx - 1] = 0;
+    pci_teardown_msix(n->d, idx);
+    nvme_free_ioq(n, q);
+    if (idx > 1)
+        nvme_ioqs_ready(n, idx - 1, a);
+    else
+        msg_err("failed to create I/O queue\n");
+}
+
+closure_function(3, 0, void, nvme_create_iosq_resp,
+                 nvme, n, nvme_ioq, q, storage_attach, a)
 {
     nvme n = bound(n);
+    nvme_ioq q = bound(q);
     storage_attach a = bound(a);
     struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
     if (cqe) {
@@ -721,90 +837,130 @@ closure_function(2, 0, void, nvme_create_iosq_resp,
         int sc = NVME_STATUS_CODE(cqe->dw3);
         nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
         if (sc == NVME_SC_OK) {
-            nvme_debug("I/O SQ created");
-            if (n->vs >= NVME_VER(1, 1, 0))
-                nvme_get_active_namespaces(n, 0, a);
-            else
-                nvme_identify_controller(n, a);
+            nvme_debug("I/O SQ %d created", q->idx);
+            if ((q->idx == n->ioq_count) || !nvme_create_iocq(n, q->idx + 1, a))
+                nvme_ioqs_ready(n, q->idx, a);
         } else {
-            msg_err("failed to create I/O SQ: status code 0x%x\n", sc);
+            msg_err("failed to create I/O SQ %d: status code 0x%x\n", q->idx, sc);
+            nvme_ioq_create_failed(n, q, a);
         }
     }
     closure_finish();
 }
 
-static boolean nvme_create_iosq(nvme n, storage_attach a)
+static boolean nvme_create_iosq(nvme n, nvme_ioq q, storage_attach a)
 {
-    if (!nvme_init_sq(n, &n->iosq, n->ioq_order)) {
-        msg_err("failed to initialize queue\n");
-        return false;
-    }
-    n->ac_handler = closure(n->general, nvme_create_iosq_resp, n, a);
+    n->ac_handler = closure(n->general, nvme_create_iosq_resp, n, q, a);
     if (n->ac_handler == INVALID_ADDRESS) {
         msg_err("failed to allocate completion handler\n");
-        nvme_deinit_sq(n, &n->iosq);
         return false;
     }
-
-    /* Zero out all submission queue entries, so that when submitting an entry
-     * only used fields need to be set. This relies on the fact that all I/O
-     * commands use the same set of fields. */
-    zero(n->iosq.ring, U64_FROM_BIT(n->iosq.order) * sizeof(struct nvme_sqe));
-
     struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
     assert(cmd);
     zero(cmd, sizeof(*cmd));
     cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_CRE_IOSQ;
-    cmd->dptr.prp1 = physical_from_virtual(n->iosq.ring);
-    cmd->cdw10 = (MASK(n->ioq_order) << 16) | NVME_IOQ_IDX; /* queue size and queue ID */
-    cmd->cdw11 = (NVME_IOQ_IDX << 16) | 0x01;  /* completion queue ID, physically contiguous */
+    cmd->dptr.prp1 = physical_from_virtual(q->sq.ring);
+    cmd->cdw10 = (MASK(n->ioq_order) << 16) | q->idx;  /* queue size and queue ID */
+    cmd->cdw11 = (q->idx << 16) | 0x01;    /* completion queue ID, physically contiguous */
     nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
     return true;
 }
 
-closure_function(2, 0, void, nvme_create_iocq_resp,
-                 nvme, n, storage_attach, a)
+closure_function(3, 0, void, nvme_create_iocq_resp,
+                 nvme, n, nvme_ioq, q, storage_attach, a)
 {
     nvme n = bound(n);
+    nvme_ioq q = bound(q);
     struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
     if (cqe) {
         n->asq.head = NVME_SQ_HEAD(cqe->dw2);
         int sc = NVME_STATUS_CODE(cqe->dw3);
         nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
         if (sc == NVME_SC_OK) {
-            nvme_debug("I/O CQ created");
-            nvme_create_iosq(n, bound(a));
+            nvme_debug("I/O CQ %d created", q->idx);
+            if (!nvme_create_iosq(n, q, bound(a)))
+                nvme_ioq_create_failed(n, q, bound(a));
         } else {
-            msg_err("failed to create I/O CQ: status code 0x%x\n", sc);
+            msg_err("failed to create I/O CQ %d: status code 0x%x\n", q->idx, sc);
+            nvme_ioq_create_failed(n, q, bound(a));
         }
     }
     closure_finish();
 }
 
-static boolean nvme_create_iocq(nvme n, storage_attach a)
+/* Queue idx is served by the cpus whose id modulo the number of queues is
+ * idx - 1, the first of which receives its interrupts. */
+static boolean nvme_create_iocq(nvme n, int idx, storage_attach a)
 {
-    if (!nvme_init_cq(n, &n->iocq, n->ioq_order)) {
-        msg_err("failed to initialize queue\n");
+    nvme_ioq q = nvme_alloc_ioq(n, idx);
+    if (q == INVALID_ADDRESS) {
+        msg_err("failed to allocate I/O queue %d\n", idx);
         return false;
     }
-    n->ac_handler = closure(n->general, nvme_create_iocq_resp, n, a);
+    n->ac_handler = closure(n->general, nvme_create_iocq_resp, n, q, a);
     if (n->ac_handler == INVALID_ADDRESS) {
         msg_err("failed to allocate completion handler\n");
-        nvme_deinit_cq(n, &n->iocq);
-        return false;
+        goto free_q;
     }
-    if (pci_setup_msix(n->d, NVME_IOQ_MSIX, init_closure(&n->io_irq, nvme_io_irq, n),
-                       "nvme I/O") == INVALID_PHYSICAL) {
+    if (pci_setup_msix_cpu(n->d, idx, init_closure(&q->irq, nvme_io_irq, q), "nvme I/O",
+                           idx - 1) == INVALID_PHYSICAL) {
         msg_err("failed to allocate MSI-X vector\n");
-        return false;
+        deallocate_closure(n->ac_handler);
+        goto free_q;
     }
+    n->ioqs[idx - 1] = q;
     struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
     assert(cmd);
     zero(cmd, sizeof(*cmd));
     cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_CRE_IOCQ;
-    cmd->dptr.prp1 = physical_from_virtual(n->iocq.ring);
-    cmd->cdw10 = (MASK(n->ioq_order) << 16) | NVME_IOQ_IDX; /* queue size and queue ID */
-    cmd->cdw11 = (NVME_IOQ_MSIX << 16) | 0x03;  /* interrupts enabled, physically contiguous */
+    cmd->dptr.prp1 = physical_from_virtual(q->cq.ring);
+    cmd->cdw10 = (MASK(n->ioq_order) << 16) | idx;  /* queue size and queue ID */
+    cmd->cdw11 = (idx << 16) | 0x03;    /* MSI-X slot, interrupts enabled, physically contiguous */
+    nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
+    return true;
+  free_q:
+    nvme_free_ioq(n, q);
+    return false;
+}
+
+closure_function(2, 0, void, nvme_set_num_queues_resp,
+                 nvme, n, storage_attach, a)
+{
+    nvme n = bound(n);
+    struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
+    if (cqe) {
+        n->asq.head = NVME_SQ_HEAD(cqe->dw2);
+        int sc = NVME_STATUS_CODE(cqe->dw3);
+        nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
+        if (sc == NVME_SC_OK) {
+            int allocated = MIN(NVME_NSQA(cqe->dw0), NVME_NCQA(cqe->dw0)) + 1;
+            nvme_debug("controller allocated %d I/O queue pair(s)", allocated);
+            n->ioq_count = MIN(n->ioq_count, allocated);
+        } else {
+            msg_err("failed to set number of queues: status code 0x%x\n", sc);
+            n->ioq_count = 1;
+        }
+        if (!nvme_create_iocq(n, 1, bound(a)))
+            msg_err("failed to create I/O queue\n");
+    }
+    closure_finish();
+}
+
+/* Request one I/O queue pair per cpu, within the limits of available MSI-X
+ * vectors; the controller may allocate fewer. */
+static boolean nvme_set_num_queues(nvme n, storage_attach a)
+{
+    n->ac_handler = closure(n->general, nvme_set_num_queues_resp, n, a);
+    if (n->ac_handler == INVALID_ADDRESS) {
+        msg_err("failed to allocate completion handler\n");
+        return false;
+    }
+    struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
+    assert(cmd);
+    zero(cmd, sizeof(*cmd));
+    cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_SET_FEAT;
+    cmd->cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd->cdw11 = ((n->ioq_count - 1) << 16) | (n->ioq_count - 1);
     nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
     return true;
 }
@@ -858,13 +1014,20 @@ closure_function(3, 1, boolean, nvme_probe,
     n->ioq_order = find_order(mqes);
     if (mqes != U64_FROM_BIT(n->ioq_order))
         n->ioq_order--;
+    n->ioq_order = MIN(n->ioq_order, NVME_IOQ_MAX_ORDER);
     nvme_debug("new controller (version %d.%d.%d), MQES %d, I/O queue order %d",
                NVME_VS_MJR(n->vs), NVME_VS_MNR(n->vs), NVME_VS_TER(n->vs), mqes, n->ioq_order);
-    n->cmds = allocate_vector(general, NVME_CID_MAX + 1);
-    if (n->cmds == INVALID_ADDRESS) {
-        msg_err("failed to allocate request vector\n");
+    n->ioq_max = MIN(MIN(total_processors, NVME_MAX_IO_QUEUES), pci_get_msix_count(d) - 1);
+    if (n->ioq_max < 1) {
+        msg_err("insufficient MSI-X vectors\n");
         goto deinit_acq;
     }
+    n->ioqs = allocate_zero(general, n->ioq_max * sizeof(n->ioqs[0]));
+    if (n->ioqs == INVALID_ADDRESS) {
+        msg_err("failed to allocate I/O queue array\n");
+        goto deinit_acq;
+    }
+    n->ioq_count = n->ioq_max;
     pci_bar_write_4(&n->bar, NVME_AQA, NVME_AQA_ACQS(U64_FROM_BIT(NVME_ACQ_ORDER)) |
                     NVME_AQA_ASQS(U64_FROM_BIT(NVME_ASQ_ORDER)));
     pci_bar_write_8(&n->bar, NVME_ASQ, physical_from_virtual(n->asq.ring));
@@ -879,7 +1042,7 @@ closure_function(3, 1, boolean, nvme_probe,
             kernel_delay(milliseconds(1 << retries));
         } else {
             msg_err("failed to enable controller\n");
-            goto free_cmds;
+            goto free_ioqs;
         }
     }
     n->d = d;
@@ -887,21 +1050,16 @@ closure_function(3, 1, boolean, nvme_probe,
     if (pci_setup_msix(d, NVME_AQ_MSIX, init_closure(&n->admin_irq, nvme_admin_irq, n),
                        "nvme admin") == INVALID_PHYSICAL) {
         msg_err("failed to allocate MSI-X vector\n");
-        goto free_cmds;
+        goto free_ioqs;
     }
     n->attach_id = -1;
-    list_init(&n->pending_reqs);
-    list_init(&n->free_reqs);
-    list_init(&n->done_reqs);
-    list_init(&n->free_cmds);
-    spin_lock_init(&n->lock);
-    init_closure(&n->bh_service, nvme_bh_service, n);
-    if (nvme_create_iocq(n, bound(a))) {
+    if (nvme_set_num_queues(n, bound(a))) {
         d->driver_data = n;
         return true;
     }
-  free_cmds:
-    deallocate_vector(n->cmds);
+    pci_teardown_msix(d, NVME_AQ_MSIX);
+  free_ioqs:
+    deallocate(general, n->ioqs, n->ioq_max * sizeof(n->ioqs[0]));
   deinit_acq:
     nvme_deinit_cq(n, &n->acq);
   deinit_asq:
@@ -916,11 +1074,16 @@ closure_function(2, 0, void, nvme_detach_complete,
 {
     nvme_debug("detach complete");
     nvme n = bound(n);
-    pci_teardown_msix(n->d, NVME_IOQ_MSIX);
-    nvme_deinit_cq(n, &n->iocq);
+    for (int i = 0; i < n->ioq_max; i++) {
+        nvme_ioq q = n->ioqs[i];
+        if (!q)
+            continue;
+        pci_teardown_msix(n->d, q->idx);
+        nvme_free_ioq(n, q);
+    }
+    deallocate(n->general, n->ioqs, n->ioq_max * sizeof(n->ioqs[0]));
     pci_teardown_msix(n->d, NVME_AQ_MSIX);
     pci_disable_msix(n->d);
-    deallocate_vector(n->cmds);
     pci_bar_deinit(&n->bar);
     nvme_deinit_cq(n, &n->acq);
     nvme_deinit_sq(n, &n->asq);
@@ -185,18 +185,42 @@ closure_function(2, 2, void, fsstarted,
 #endif
 
 static balloon_deflater mm_balloon_deflater;
+static vector mm_cleaners;
 
 void mm_register_balloon_deflater(balloon_deflater deflater)
 {
     mm_balloon_deflater = deflater;
 }
 
+void mm_register_mem_cleaner(mem_cleaner cleaner)
+{
+    if (!mm_cleaners) {
+        mm_cleaners = allocate_vector(heap_locked(&heaps), 2);
+        assert(mm_cleaners != INVALID_ADDRESS);
+    }
+    vector_push(mm_cleaners, cleaner);
+}
+
 void mm_service(void)
 {
     heap phys = (heap)heap_physical(init_heaps);
     u64 free = heap_free(phys);
     mm_debug("%s: total %ld, alloc %ld, free %ld\n", __func__,
              heap_total(phys), heap_allocated(phys), free);
+
+    /* memory released by cleaners holds no data, so take it before the pagecache */
+    if (mm_cleaners && free < PAGECACHE_DRAIN_CUTOFF) {
+        mem_cleaner cleaner;
+        vector_foreach(mm_cleaners, cleaner) {
+            u64 cleaned = apply(cleaner, PAGECACHE_DRAIN_CUTOFF - free);
+            if (cleaned > 0)
+                mm_debug("   cleaned %ld bytes\n", cleaned);
+            free = heap_free(phys);
+            if (free >= PAGECACHE_DRAIN_CUTOFF)
+                break;
+        }
+    }
+
     if (free < PAGECACHE_DRAIN_CUTOFF) {
         u64 drain_bytes = PAGECACHE_DRAIN_CUTOFF - free;
         u64 drained = pagecache_drain(drain_bytes);
@@ -367,6 +391,11 @@ void kernel_runtime_init(kernel_heaps kh)
     init_scheduler_cpus(misc);
     start_secondary_cores(kh);
 
+    /* Secondary cpus allocate from the locked heap before their cpu-local
+       pointer is set up, so the per-cpu magazines are enabled only after
+       they have started. */
+    locking_heap_init_percpu(locked, present_processors);
+
     init_debug("probe fs, register storage drivers");
     init_volumes(locked);
 
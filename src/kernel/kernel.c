@@ -137,14 +137,15 @@ cpuinfo init_cpuinfo(heap backed, int cpu)
     /* state */
     ci->id = cpu;
     ci->state = cpu_not_present;
-    ci->thread_queue = allocate_queue(backed, MAX_THREADS);
-    assert(ci->thread_queue != INVALID_ADDRESS);
+    init_sched_runq(&ci->thread_queue, heap_locked(get_kernel_heaps()));
     ci->free_kernel_contexts = allocate_queue(backed, FREE_KERNEL_CONTEXT_QUEUE_SIZE);
     assert(ci->free_kernel_contexts != INVALID_ADDRESS);
     ci->free_syscall_contexts = allocate_queue(backed, FREE_SYSCALL_CONTEXT_QUEUE_SIZE);
     assert(ci->free_syscall_contexts != INVALID_ADDRESS);
     ci->cpu_queue = allocate_queue(backed, CPU_QUEUE_SIZE);
     assert(ci->cpu_queue != INVALID_ADDRESS);
+    init_sched_queues(ci, backed);
+    ci->steal_victim = cpu + 1;
     ci->last_timer_update = 0;
     ci->frcount = 0;
     ci->mcs_prev = 0;
@@ -40,6 +40,65 @@ typedef struct kernel_context {
 
 extern boolean shutting_down;
 
+/* per-cpu queue of deferred kernel work, with statistics maintained by the
+   owning cpu */
+typedef struct sched_queue {
+    queue q;
+    u64 serviced;               /* items run from the local queue */
+    u64 stolen;                 /* items taken from other cpus' queues */
+    u64 max_depth;              /* high-water mark, sampled at service time */
+    timestamp service_time;     /* total time spent draining */
+    timestamp max_service_time; /* longest single drain */
+    timestamp drain_start;      /* nonzero while a drain is in progress */
+} *sched_queue;
+
+/* scheduling classes, in order of precedence */
+#define SCHED_CLASS_RT      0   /* fixed priority, runs until it blocks or yields */
+#define SCHED_CLASS_FAIR    1   /* weighted fair share, weight derived from nice */
+
+#define SCHED_RT_PRIO_MIN   1
+#define SCHED_RT_PRIO_MAX   99
+#define SCHED_NICE_MIN      -20
+#define SCHED_NICE_MAX      19
+
+/* Entry on a cpu thread queue: t resumes the task, which may only run on the
+   cpus set in affinity (or any cpu if affinity is null). class, rt_priority
+   and nice may be changed at any time; they take effect the next time the
+   task is queued. */
+typedef struct sched_task {
+    thunk t;
+    bitmap affinity;
+    u8 class;
+    u8 rt_priority;
+    s8 nice;
+    boolean rt_fifo;        /* realtime task without a time slice (SCHED_FIFO) */
+    boolean yielded;        /* requeue behind tasks of equal priority */
+
+    /* owned by the scheduler */
+    u8 queued_class;
+    u8 queued_prio;
+    u32 weight;
+    s64 vruntime;           /* relative to the runqueue minimum while not queued */
+    u64 seq;
+    u64 pending_runtime;    /* run time not yet charged to vruntime */
+    timestamp exec_start;
+} *sched_task;
+
+/* per-cpu queue of runnable tasks */
+typedef struct sched_runq {
+    struct spinlock lock;
+    pqueue rt;
+    pqueue fair;
+    u64 nr_running;
+    u64 fair_weight;
+    s64 min_vruntime;
+    u64 seq;
+    u64 head_seq;           /* counts down for tasks that requeue at the head */
+} *sched_runq;
+
+void init_sched_task(sched_task st, thunk t, bitmap affinity);
+void sched_task_exit(sched_task st);
+
 /* per-cpu, architecture-independent invariants */
 typedef struct cpuinfo *cpuinfo;
 
@@ -48,10 +107,19 @@ struct cpuinfo {
     u32 id;
     int state;
     queue cpu_queue;
-    queue thread_queue;
+    struct sched_runq thread_queue;
+    sched_task current_task;    /* task last dispatched from the runloop */
+    u8 current_class;           /* class and priority of current_task at dispatch; */
+    u8 current_prio;            /* may be read from other cpus */
+    struct sched_queue bh_queue;    /* kernel from interrupt */
+    struct sched_queue run_queue;
+    struct sched_queue async_queue; /* async 1 arg completions */
+    u32 steal_victim;               /* next cpu to look at for kernel work */
     timestamp last_timer_update;
     u64 frcount;
     u64 inval_gen; /* Generation number for invalidates */
+    boolean inval_lazy;         /* idle; invalidates deferred to wakeup */
+    boolean inval_ipi_pending;  /* flush ipi sent but not yet serviced */
 
     cpuinfo mcs_prev;
     cpuinfo mcs_next;
@@ -170,9 +238,12 @@ static inline __attribute__((always_inline)) void set_current_context(cpuinfo ci
 }
 
 #ifdef KERNEL
-extern queue bhqueue;
-extern queue runqueue;
-extern queue async_queue_1;
+/* Deferred work is queued on the current cpu so that completions run where
+   they were raised; idle cpus steal from other queues (see runloop). */
+#define bhqueue         (current_cpu()->bh_queue.q)
+#define runqueue        (current_cpu()->run_queue.q)
+#define async_queue_1   (current_cpu()->async_queue.q)
+
 extern timerqueue kernel_timers;
 extern thunk timer_interrupt_handler;
 
@@ -493,6 +564,7 @@ void unmap_and_free_phys(u64 virtual, u64 length);
 
 heap allocate_tagged_region(kernel_heaps kh, u64 tag, bytes pagesize);
 heap locking_heap_wrapper(heap meta, heap parent);
+void locking_heap_init_percpu(heap h, u64 ncpus);
 
 #endif
 
@@ -508,7 +580,7 @@ void init_clock(void);
 
 void process_bhqueue();
 
-void msi_format(u32 *address, u32 *data, int vector);
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu);
 
 u64 allocate_ipi_interrupt(void);
 void deallocate_ipi_interrupt(u64 irq);
@@ -528,11 +600,19 @@ static inline boolean in_interrupt(void)
 
 void init_scheduler(heap);
 void init_scheduler_cpus(heap h);
+cpuinfo schedule_task(sched_task st, cpuinfo ci);
+void init_sched_queues(cpuinfo ci, heap h);
+void init_sched_runq(sched_runq rq, heap h);
+void init_scheduler_management(tuple root);
 void mm_service(void);
 
 typedef closure_type(balloon_deflater, u64, u64);
 void mm_register_balloon_deflater(balloon_deflater deflater);
 
+/* returns the number of bytes released */
+typedef closure_type(mem_cleaner, u64, u64);
+void mm_register_mem_cleaner(mem_cleaner cleaner);
+
 kernel_heaps get_kernel_heaps(void);
 
 static inline boolean is_low_memory_machine(kernel_heaps kh)
@@ -1,6 +1,30 @@
 #include <kernel.h>
 #include <management.h>
 
+/* Per-cpu magazines
+
+   Once enabled with locking_heap_init_percpu(), small allocations are
+   served from per-cpu magazines of free objects, one per size class
+   (cache) of the parent mcache. The fast path only disables interrupts
+   on the local cpu; the heap lock is taken to refill an empty magazine
+   or to drain a full one, moving MAGAZINE_BATCH objects to or from the
+   parent at a time. Deallocations of unknown size (-1ull), sizes above
+   MAGAZINE_MAX_ORDER and objects that do not belong to the cache of
+   their size class bypass the magazines. */
+
+typedef struct magazine {
+    u64 count;
+    u64 objs[MAGAZINE_SIZE];
+} *magazine;
+
+typedef struct heaplock_cpu {
+    u64 alloc_hits;
+    u64 alloc_misses;
+    u64 free_hits;
+    u64 free_misses;
+    struct magazine mags[0];
+} *heaplock_cpu;
+
 typedef struct heaplock {
     struct heap h;
     struct spinlock lock;
@@ -8,14 +32,72 @@ typedef struct heaplock {
     heap meta;
     tuple mgmt;
     tuple parent_mgmt;
+    heaplock_cpu *cpus;
+    u64 ncpus;
+    int nclasses;
+    bytes *class_size;          /* object size of each parent cache */
 } *heaplock;
 
 #define lock_heap(hl) u64 _flags = spin_lock_irq(&hl->lock)
 #define unlock_heap(hl) spin_unlock_irq(&hl->lock, _flags)
 
+static inline int heaplock_class(heaplock hl, bytes size)
+{
+    if (!hl->cpus || size > U64_FROM_BIT(MAGAZINE_MAX_ORDER))
+        return -1;
+    return mcache_class(hl->parent, size);
+}
+
+/* called with interrupts disabled */
+static inline heaplock_cpu heaplock_local(heaplock hl)
+{
+    u64 id = current_cpu()->id;
+    return id < hl->ncpus ? hl->cpus[id] : 0;
+}
+
+static void heaplock_refill(heaplock hl, magazine m, int class)
+{
+    bytes size = hl->class_size[class];
+    spin_lock(&hl->lock);
+    while (m->count < MAGAZINE_BATCH) {
+        u64 a = allocate_u64(hl->parent, size);
+        if (a == INVALID_PHYSICAL)
+            break;
+        m->objs[m->count++] = a;
+    }
+    spin_unlock(&hl->lock);
+}
+
+static void heaplock_drain(heaplock hl, magazine m, int class, u64 keep)
+{
+    bytes size = hl->class_size[class];
+    spin_lock(&hl->lock);
+    while (m->count > keep)
+        deallocate_u64(hl->parent, m->objs[--m->count], size);
+    spin_unlock(&hl->lock);
+}
+
 static u64 heaplock_alloc(heap h, bytes size)
 {
     heaplock hl = (heaplock)h;
+    int class = heaplock_class(hl, size);
+    if (class >= 0) {
+        u64 flags = irq_disable_save();
+        heaplock_cpu hc = heaplock_local(hl);
+        if (hc) {
+            magazine m = &hc->mags[class];
+            if (m->count > 0) {
+                hc->alloc_hits++;
+            } else {
+                hc->alloc_misses++;
+                heaplock_refill(hl, m, class);
+            }
+            u64 a = m->count > 0 ? m->objs[--m->count] : INVALID_PHYSICAL;
+            irq_restore(flags);
+            return a;
+        }
+        irq_restore(flags);
+    }
     lock_heap(hl);
     u64 a = allocate_u64(hl->parent, size);
     unlock_heap(hl);
@@ -25,26 +107,98 @@ static u64 heaplock_alloc(heap h, bytes size)
 static void heaplock_dealloc(heap h, u64 x, bytes size)
 {
     heaplock hl = (heaplock)h;
+    int class = heaplock_class(hl, size);
+
+    /* The object may have been allocated directly from the parent, before
+       the magazines were enabled or under a different size. */
+    if (class >= 0 && mcache_class_owns(hl->parent, class, x)) {
+        u64 flags = irq_disable_save();
+        heaplock_cpu hc = heaplock_local(hl);
+        if (hc) {
+            magazine m = &hc->mags[class];
+            if (m->count < MAGAZINE_SIZE) {
+                hc->free_hits++;
+            } else {
+                hc->free_misses++;
+                heaplock_drain(hl, m, class, MAGAZINE_SIZE - MAGAZINE_BATCH);
+            }
+            m->objs[m->count++] = x;
+            irq_restore(flags);
+            return;
+        }
+        irq_restore(flags);
+    }
     lock_heap(hl);
     deallocate_u64(hl->parent, x, size);
     unlock_heap(hl);
 }
 
+/* Under memory pressure, return the objects cached in the magazines of this
+   cpu to the parent, largest classes first. Magazines are only touched by
+   their own cpu, so each cpu drains its own as it runs mm_service(). */
+closure_function(1, 1, u64, heaplock_mem_cleaner,
+                 heaplock, hl,
+                 u64, clean_bytes)
+{
+    heaplock hl = bound(hl);
+    u64 cleaned = 0;
+    u64 flags = irq_disable_save();
+    heaplock_cpu hc = heaplock_local(hl);
+    if (hc) {
+        for (int class = hl->nclasses - 1; class >= 0 && cleaned < clean_bytes; class--) {
+            magazine m = &hc->mags[class];
+            if (m->count == 0)
+                continue;
+            cleaned += m->count * hl->class_size[class];
+            heaplock_drain(hl, m, class, 0);
+        }
+    }
+    irq_restore(flags);
+    return cleaned;
+}
+
+/* racy snapshot; only used for reporting */
+static bytes heaplock_cpu_cached(heaplock hl, heaplock_cpu hc)
+{
+    bytes cached = 0;
+    for (int class = 0; class < hl->nclasses; class++)
+        cached += hc->mags[class].count * hl->class_size[class];
+    return cached;
+}
+
+static bytes heaplock_cached(heaplock hl)
+{
+    bytes cached = 0;
+    if (hl->cpus) {
+        for (u64 i = 0; i < hl->ncpus; i++)
+            cached += heaplock_cpu_cached(hl, hl->cpus[i]);
+    }
+    return cached;
+}
+
 /* assuming no contention on destroy */
 static void heaplock_destroy(heap h)
 {
     heaplock hl = (heaplock)h;
+    if (hl->cpus) {
+        for (u64 i = 0; i < hl->ncpus; i++) {
+            for (int class = 0; class < hl->nclasses; class++)
+                heaplock_drain(hl, &hl->cpus[i]->mags[class], class, 0);
+        }
+    }
     destroy_heap(hl->parent);
     deallocate(hl->meta, hl, sizeof(*hl));
 }
 
+/* objects sitting in magazines are not counted as allocated */
 static bytes heaplock_allocated(heap h)
 {
     heaplock hl = (heaplock)h;
+    bytes cached = heaplock_cached(hl);
     lock_heap(hl);
     bytes count = heap_allocated(hl->parent);
     unlock_heap(hl);
-    return count;
+    return count - cached;
 }
 
 static bytes heaplock_total(heap h)
@@ -85,6 +239,49 @@ closure_function(1, 1, boolean, heaplock_iterate,
     return result;
 }
 
+closure_function(2, 0, value, heaplock_get_stat,
+                 u64 *, p, value, v)
+{
+    return value_rewrite_u64(bound(v), *bound(p));
+}
+
+closure_function(3, 0, value, heaplock_get_cached,
+                 heaplock, hl, heaplock_cpu, hc, value, v)
+{
+    return value_rewrite_u64(bound(v), heaplock_cpu_cached(bound(hl), bound(hc)));
+}
+
+#define register_heaplock_stat(hl, hc, n, t, name)                      \
+    v = value_from_u64(hl->meta, 0);                                    \
+    s = sym(name);                                                      \
+    set(t, s, v);                                                       \
+    tuple_notifier_register_get_notify(n, s, closure(hl->meta, heaplock_get_stat, &hc->name, v));
+
+static tuple heaplock_magazines_management(heaplock hl)
+{
+    value v;
+    symbol s;
+    tuple mags = allocate_tuple();
+    assert(mags != INVALID_ADDRESS);
+    for (u64 i = 0; i < hl->ncpus; i++) {
+        heaplock_cpu hc = hl->cpus[i];
+        tuple t = timm("size", "%d", MAGAZINE_SIZE);
+        assert(t != INVALID_ADDRESS);
+        tuple_notifier n = tuple_notifier_wrap(t);
+        assert(n != INVALID_ADDRESS);
+        register_heaplock_stat(hl, hc, n, t, alloc_hits);
+        register_heaplock_stat(hl, hc, n, t, alloc_misses);
+        register_heaplock_stat(hl, hc, n, t, free_hits);
+        register_heaplock_stat(hl, hc, n, t, free_misses);
+        v = value_from_u64(hl->meta, 0);
+        s = sym(cached);
+        set(t, s, v);
+        tuple_notifier_register_get_notify(n, s, closure(hl->meta, heaplock_get_cached, hl, hc, v));
+        set(mags, intern_u64(i), n);
+    }
+    return mags;
+}
+
 static value heaplock_management(heap h)
 {
     heaplock hl = (heaplock)h;
@@ -98,6 +295,8 @@ static value heaplock_management(heap h)
                                        closure(hl->meta, heaplock_set, hl),
                                        closure(hl->meta, heaplock_iterate, hl));
     set(v, sym(parent), ft);
+    if (hl->cpus)
+        set(v, sym(magazines), heaplock_magazines_management(hl));
 
     value pm = heap_management(hl->parent);
     lock_heap(hl);
@@ -124,6 +323,41 @@ heap locking_heap_wrapper(heap meta, heap parent)
     hl->meta = meta;
     hl->mgmt = 0;
     hl->parent_mgmt = 0;
+    hl->cpus = 0;
+    hl->ncpus = 0;
+    hl->nclasses = 0;
+    hl->class_size = 0;
     spin_lock_init(&hl->lock);
     return (heap)hl;
 }
+
+/* Enable per-cpu magazines for a locking wrapper around an mcache. Every cpu
+   using the heap must have a valid cpu-local pointer by the time this is
+   called; until then, all requests take the heap lock. */
+void locking_heap_init_percpu(heap h, u64 ncpus)
+{
+    heaplock hl = (heaplock)h;
+    assert(!hl->cpus);
+    int nclasses = mcache_class(hl->parent, U64_FROM_BIT(MAGAZINE_MAX_ORDER)) + 1;
+    if (nclasses <= 0)
+        return;
+    bytes cpu_size = sizeof(struct heaplock_cpu) + nclasses * sizeof(struct magazine);
+    heaplock_cpu *cpus = allocate(h, ncpus * sizeof(heaplock_cpu));
+    assert(cpus != INVALID_ADDRESS);
+    for (u64 i = 0; i < ncpus; i++) {
+        cpus[i] = allocate_zero(h, cpu_size);
+        assert(cpus[i] != INVALID_ADDRESS);
+    }
+    bytes *class_size = allocate(h, nclasses * sizeof(bytes));
+    assert(class_size != INVALID_ADDRESS);
+    for (int class = 0; class < nclasses; class++)
+        class_size[class] = mcache_class_size(hl->parent, class);
+    hl->class_size = class_size;
+    hl->nclasses = nclasses;
+    hl->ncpus = ncpus;
+    write_barrier();
+    hl->cpus = cpus;
+    mem_cleaner mc = closure(h, heaplock_mem_cleaner, hl);
+    assert(mc != INVALID_ADDRESS);
+    mm_register_mem_cleaner(mc);
+}
@@ -2,6 +2,10 @@
 
 #include <kernel.h>
 
+/* Page table pages are never freed, so walks need no lock. Entries are
+   installed and modified with atomic operations, leaving pt_lock to guard
+   only the allocation of table pages. Concurrent updates to the same leaf
+   entries are excluded by the callers (vmap and pending fault tracking). */
 #ifdef KERNEL
 static struct spinlock pt_lock;
 #define pagetable_lock() u64 _savedflags = spin_lock_irq(&pt_lock)
@@ -39,6 +43,7 @@ static struct {
     void *initial_map;
     u64 initial_physbase;
     u64 levelmask;              /* bitmap of levels allowed to map */
+    u64 spare_phys;             /* list of table pages lost in install races */
 } pagemem;
 
 BSS_RO_AFTER_INIT boolean bootstrapping;
@@ -49,11 +54,7 @@ physical physical_from_virtual(void *x)
     u64 a = u64_from_pointer(x);
     if (is_linear_backed_address(a))
         return phys_from_linear_backed_virt(a);
-    u64 p;
-    pagetable_lock();
-    p = __physical_from_virtual_locked(x);
-    pagetable_unlock();
-    return p;
+    return __physical_from_virtual_locked(x);
 }
 #endif
 
@@ -79,11 +80,21 @@ void *allocate_table_page(u64 *phys)
         return p;
     }
     page_init_debug("allocate_table_page:");
+    pagetable_lock();
+    if (pagemem.spare_phys) {
+        *phys = pagemem.spare_phys;
+        u64 *p = pointer_from_pteaddr(*phys);
+        pagemem.spare_phys = p[0];
+        pagetable_unlock();
+        p[0] = 0;
+        return p;
+    }
     if (range_span(pagemem.current_phys) == 0) {
         assert(pagemem.pageheap);
         page_init_debug(" [new alloc, va: ");
         u64 va = allocate_u64(pagemem.pageheap, PAGEMEM_ALLOC_SIZE);
         if (va == INVALID_PHYSICAL) {
+            pagetable_unlock();
             msg_err("failed to allocate page table memory\n");
             return INVALID_ADDRESS;
         }
@@ -95,6 +106,7 @@ void *allocate_table_page(u64 *phys)
 
     *phys = pagemem.current_phys.start;
     pagemem.current_phys.start += PAGESIZE;
+    pagetable_unlock();
     void *p = pointer_from_pteaddr(*phys);
     page_init_debug(" phys: ");
     page_init_debug_u64(*phys);
@@ -103,6 +115,28 @@ void *allocate_table_page(u64 *phys)
     return p;
 }
 
+/* Return a zeroed table page that was never installed. */
+static void free_table_page(void *p, u64 phys)
+{
+    pagetable_lock();
+    *(u64 *)p = pagemem.spare_phys;
+    pagemem.spare_phys = phys;
+    pagetable_unlock();
+}
+
+#ifdef KERNEL
+static inline boolean pte_cas(pteptr pp, pte old, pte new)
+{
+    return compare_and_swap_64((u64 *)pp, old, new);
+}
+#else
+static inline boolean pte_cas(pteptr pp, pte old, pte new)
+{
+    pte_set(pp, new);
+    return true;
+}
+#endif
+
 #define PTE_ENTRIES U64_FROM_BIT(9)
 static boolean recurse_ptes(u64 pbase, int level, u64 vstart, u64 len, u64 laddr, entry_handler ph)
 {
@@ -147,11 +181,7 @@ boolean traverse_ptes(u64 vaddr, u64 length, entry_handler ph)
 #ifdef PAGE_TRAVERSE_DEBUG
     rprintf("traverse_ptes vaddr 0x%lx, length 0x%lx\n", vaddr, length);
 #endif
-    pagetable_lock();
-    boolean result = recurse_ptes(get_pagetable_base(vaddr), PT_FIRST_LEVEL,
-                                  vaddr, length, 0, ph);
-    pagetable_unlock();
-    return result;
+    return recurse_ptes(get_pagetable_base(vaddr), PT_FIRST_LEVEL, vaddr, length, 0, ph);
 }
 
 closure_function(0, 3, boolean, dump_entry,
@@ -182,7 +212,6 @@ void dump_page_tables(u64 addr, u64 length)
     early_debug("\n");
 }
 
-/* called with lock held */
 closure_function(0, 3, boolean, validate_entry,
                  int, level, u64, vaddr, pteptr, entry)
 {
@@ -214,17 +243,18 @@ boolean validate_virtual_writable(void * base, u64 length)
     return traverse_ptes(u64_from_pointer(base), length, stack_closure(validate_entry_writable));
 }
 
-/* called with lock held */
 closure_function(2, 3, boolean, update_pte_flags,
                  pageflags, flags, flush_entry, fe,
                  int, level, u64, addr, pteptr, entry)
 {
-    /* we only care about present ptes */
-    pte orig_pte = pte_from_pteptr(entry);
-    if (!pte_is_present(orig_pte) || !pte_is_mapping(level, orig_pte))
-        return true;
-
-    pte_set(entry, (orig_pte & ~PAGE_PROT_FLAGS) | bound(flags).w);
+    /* we only care about present ptes; retry if the mmu updated
+       accessed or dirty bits in the meantime */
+    pte orig_pte;
+    do {
+        orig_pte = pte_from_pteptr(entry);
+        if (!pte_is_present(orig_pte) || !pte_is_mapping(level, orig_pte))
+            return true;
+    } while (!pte_cas(entry, orig_pte, (orig_pte & ~PAGE_PROT_FLAGS) | bound(flags).w));
 #ifdef PAGE_UPDATE_DEBUG
     page_debug("update 0x%lx: pte @ 0x%lx, 0x%lx -> 0x%lx\n", addr, entry, orig_pte,
                pte_from_pteptr(entry));
@@ -252,7 +282,6 @@ void update_map_flags_with_complete(u64 vaddr, u64 length, pageflags flags, stat
 
 static boolean map_level(u64 *table_ptr, int level, range v, u64 *p, u64 flags, flush_entry fe);
 
-/* called with lock held */
 closure_function(3, 3, boolean, remap_entry,
                  u64, new, u64, old, flush_entry, fe,
                  int, level, u64, curr, pteptr, entry)
@@ -279,7 +308,7 @@ closure_function(3, 3, boolean, remap_entry,
                      &phys, flags, bound(fe)));
 
     /* reset old entry */
-    *entry = 0;
+    pte_set(entry, 0);
 
     /* invalidate old mapping (map_page takes care of new)  */
     page_invalidate(bound(fe), curr);
@@ -309,7 +338,6 @@ void remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length)
 #endif
 }
 
-/* called with lock held */
 closure_function(0, 3, boolean, zero_page,
                  int, level, u64, addr, pteptr, entry)
 {
@@ -329,7 +357,6 @@ void zero_mapped_pages(u64 vaddr, u64 length)
     traverse_ptes(vaddr, length, stack_closure(zero_page));
 }
 
-/* called with lock held */
 closure_function(2, 3, boolean, unmap_page,
                  range_handler, rh, flush_entry, fe,
                  int, level, u64, vaddr, pteptr, entry)
@@ -341,7 +368,7 @@ closure_function(2, 3, boolean, unmap_page,
         page_debug("rh %p, level %d, vaddr 0x%lx, entry %p, *entry 0x%lx\n",
                    rh, level, vaddr, entry, *entry);
 #endif
-        *entry = 0;
+        pte_set(entry, 0);
         page_invalidate(bound(fe), vaddr);
         if (rh) {
             apply(rh, irangel(page_from_pte(old_entry),
@@ -351,8 +378,8 @@ closure_function(2, 3, boolean, unmap_page,
     return true;
 }
 
-/* Be warned: the page table lock is held when rh is called; don't try
-   to modify the page table while traversing it */
+/* Be warned: rh is called in the middle of the page table walk; don't try
+   to modify the page table from it */
 void unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh)
 {
     assert(!((virtual & PAGEMASK) || (length & PAGEMASK)));
@@ -365,6 +392,106 @@ void unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh)
 #endif
 }
 
+closure_function(2, 3, boolean, split_block,
+                 u64, vaddr, flush_entry, fe,
+                 int, level, u64, addr, pteptr, entry)
+{
+    pte e = pte_from_pteptr(entry);
+    if (level == PT_PTE_LEVEL || !pte_is_present(e) || !pte_is_mapping(level, e) ||
+        (bound(vaddr) & MASK(pte_order(level, e))) == 0)
+        return true;
+    u64 tp_phys;
+    u64 *tp = allocate_table_page(&tp_phys);
+    if (tp == INVALID_ADDRESS)
+        return false;
+    int shift = pt_level_shift(level + 1);
+
+    /* Refill if the mmu set accessed or dirty bits before the swap. Walks
+       continue into the new table, splitting again at the next level if
+       vaddr is still not aligned to the smaller mapping. */
+    for (;;) {
+        if (!pte_is_present(e) || !pte_is_mapping(level, e)) {
+            zero(tp, PAGESIZE);
+            free_table_page(tp, tp_phys);
+            return true;
+        }
+        u64 phys = page_from_pte(e);
+        u64 flags = flags_from_pte(e);
+        for (int i = 0; i < PTE_ENTRIES; i++) {
+            u64 p = phys + ((u64)i << shift);
+            tp[i] = level + 1 == PT_PTE_LEVEL ? page_pte(p, flags) : block_pte(p, flags);
+        }
+        if (pte_cas(entry, e, new_level_pte(tp_phys)))
+            break;
+        e = pte_from_pteptr(entry);
+    }
+#ifdef PAGE_UPDATE_DEBUG
+    page_debug("level %d, addr 0x%lx, entry 0x%lx -> 0x%lx\n", level, addr, e,
+               pte_from_pteptr(entry));
+#endif
+    page_invalidate(bound(fe), addr);
+    return true;
+}
+
+/* Break up any block mapping that contains vaddr without starting at it, so
+   that the ranges on either side of vaddr can be modified independently. */
+boolean split_block_mapping(u64 vaddr)
+{
+    assert((vaddr & PAGEMASK) == 0);
+    flush_entry fe = get_page_flush_entry();
+    boolean success = traverse_ptes(vaddr, PAGESIZE, stack_closure(split_block, vaddr, fe));
+    page_invalidate_sync(fe, 0);
+    return success;
+}
+
+closure_function(1, 3, boolean, clean_pte,
+                 flush_entry, fe,
+                 int, level, u64, vaddr, pteptr, entry)
+{
+    pte e, clean;
+    do {
+        e = pte_from_pteptr(entry);
+        if (!pte_is_present(e) || !pte_is_mapping(level, e) || !pte_is_dirty(e))
+            return true;
+        clean = e;
+        pt_pte_clean(&clean);
+    } while (!pte_cas(entry, e, clean));
+    page_invalidate(bound(fe), vaddr);
+    return true;
+}
+
+/* Clear the dirty state of pages mapped within a given area, so that later
+   writes can be told apart by unmap_clean_pages_with_handler(). */
+void clean_mapped_pages(u64 vaddr, u64 length)
+{
+    flush_entry fe = get_page_flush_entry();
+    traverse_ptes(vaddr, length, stack_closure(clean_pte, fe));
+    page_invalidate_sync(fe, 0);
+}
+
+closure_function(2, 3, boolean, unmap_clean_page,
+                 range_handler, rh, flush_entry, fe,
+                 int, level, u64, vaddr, pteptr, entry)
+{
+    /* the swap fails if the page was written since it was last checked */
+    pte e = pte_from_pteptr(entry);
+    if (pte_is_present(e) && pte_is_mapping(level, e) && !pte_is_dirty(e) &&
+        pte_cas(entry, e, 0)) {
+        page_invalidate(bound(fe), vaddr);
+        apply(bound(rh), irangel(page_from_pte(e), pte_map_size(level, e)));
+    }
+    return true;
+}
+
+/* As unmap_pages_with_handler(), but leaves dirty pages in place. */
+void unmap_clean_pages_with_handler(u64 virtual, u64 length, range_handler rh)
+{
+    assert(!((virtual & PAGEMASK) || (length & PAGEMASK)));
+    flush_entry fe = get_page_flush_entry();
+    traverse_ptes(virtual, length, stack_closure(unmap_clean_page, rh, fe));
+    page_invalidate_sync(fe, 0);
+}
+
 #define next_addr(a, mask) (a = (a + (mask) + 1) & ~(mask))
 #define INDEX_MASK (PAGEMASK >> 3)
 static boolean map_level(u64 *table_ptr, int level, range v, u64 *p, u64 flags, flush_entry fe)
@@ -410,15 +537,14 @@ static boolean map_level(u64 *table_ptr, int level, range v, u64 *p, u64 flags,
         page_init_debug_u64(pte);
         page_init_debug("\n");
         if (!pte_is_present(pte)) {
+            u64 old = pte;
             if (level == PT_PTE_LEVEL) {
                 pte = page_pte(*p, flags);
-                next_addr(*p, mask);
                 invalidate = true;
             } else if (!flags_has_minpage(flags) && level > PT_FIRST_LEVEL &&
                        (pagemem.levelmask & U64_FROM_BIT(level)) && (v.start & mask) == 0 &&
                        (*p & mask) == 0 && range_span(v) >= U64_FROM_BIT(shift)) {
                 pte = block_pte(*p, flags);
-                next_addr(*p, mask);
                 invalidate = true;
             } else {
                 page_init_debug("      new level: ");
@@ -430,6 +556,18 @@ static boolean map_level(u64 *table_ptr, int level, range v, u64 *p, u64 flags,
                 }
                 /* user and writable are AND of flags from all levels */
                 pte = new_level_pte(tp_phys);
+                page_init_debug("      pte @ ");
+                page_init_debug_u64(u64_from_pointer(&table_ptr[i]));
+                page_init_debug(" = ");
+                page_init_debug_u64(pte);
+                page_init_debug("\n");
+                /* The table is published empty and filled below. If another
+                   cpu installed a table here first, descend into that one. */
+                if (!pte_cas(&table_ptr[i], old, pte)) {
+                    free_table_page(tp, tp_phys);
+                    pte = table_ptr[i];
+                    goto present;
+                }
                 u64 end = vlbase | (((u64)(i + 1)) << shift);
                 /* length instead of end to avoid overflow at end of space */
                 u64 len = MIN(range_span(v), end - v.start);
@@ -440,16 +578,24 @@ static boolean map_level(u64 *table_ptr, int level, range v, u64 *p, u64 flags,
                 page_init_debug("\n");
                 if (!map_level(tp, level + 1, irangel(v.start | vmask, len), p, flags, fe))
                     return false;
+                continue;
             }
             page_init_debug("      pte @ ");
             page_init_debug_u64(u64_from_pointer(&table_ptr[i]));
             page_init_debug(" = ");
             page_init_debug_u64(pte);
             page_init_debug("\n");
-            table_ptr[i] = pte;
+            if (!pte_cas(&table_ptr[i], old, pte)) {
+                msg_err("lost race to install entry: level %d, v %R, pa 0x%lx, "
+                        "flags 0x%lx, index %d, entry 0x%lx\n", level, v, *p,
+                        flags, i, table_ptr[i]);
+                return false;
+            }
+            next_addr(*p, mask);
             if (invalidate)
                 page_invalidate(fe, v.start | vmask);
         } else {
+          present:
             /* fail if page or block already installed */
             if (pte_is_mapping(level, pte)) {
                 msg_err("would overwrite entry: level %d, v %R, pa 0x%lx, "
@@ -486,10 +632,8 @@ void map_with_complete(u64 v, physical p, u64 length, pageflags flags, status_ha
     assert((p & PAGEMASK) == 0);
     range r = irangel(v, pad(length, PAGESIZE));
     flush_entry fe = get_page_flush_entry();
-    pagetable_lock();
     u64 *table_ptr = pointer_from_pteaddr(get_pagetable_base(v));
     if (!map_level(table_ptr, PT_FIRST_LEVEL, r, &p, flags.w, fe)) {
-        pagetable_unlock();
         rprintf("ra %p\n", __builtin_return_address(0));
         print_frame_trace_from_here();
         halt("map failed for v 0x%lx, p 0x%lx, len 0x%lx, flags 0x%lx\n",
@@ -498,7 +642,6 @@ void map_with_complete(u64 v, physical p, u64 length, pageflags flags, status_ha
     page_init_debug("map_level done\n");
     page_invalidate_sync(fe, complete);
     page_init_debug("invalidate sync done\n");
-    pagetable_unlock();
 #ifdef PAGE_DUMP_ALL
     early_debug("map ");
     dump_page_tables(v, length);
@@ -17,6 +17,7 @@ flush_entry get_page_flush_entry();
 void page_invalidate(flush_entry f, u64 address);
 void page_invalidate_sync(flush_entry f, status_handler completion);
 void page_invalidate_flush();
+void page_invalidate_idle(void);
 
 /* mapping and flag update */
 void map_with_complete(u64 virtual, physical p, u64 length, pageflags flags, status_handler complete);
@@ -37,6 +38,9 @@ void zero_mapped_pages(u64 vaddr, u64 length);
 void remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length);
 void unmap(u64 virtual, u64 length);
 void unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh);
+boolean split_block_mapping(u64 vaddr);
+void clean_mapped_pages(u64 vaddr, u64 length);
+void unmap_clean_pages_with_handler(u64 virtual, u64 length, range_handler rh);
 
 static inline void unmap_pages(u64 virtual, u64 length)
 {
@@ -1,5 +1,4 @@
 /* TODO:
-   - keep refault stats
    - interface to physical free page list / shootdown epochs
 
    - would be nice to propagate a priority alone with requests to
@@ -37,6 +36,13 @@ typedef void *nanos_thread;
 
 BSS_RO_AFTER_INIT static pagecache global_pagecache;
 
+/* bounds and adjustment step for the adaptive new list share */
+#define PAGECACHE_SHARE_ORDER   10
+#define PAGECACHE_SHARE_SCALE   U64_FROM_BIT(PAGECACHE_SHARE_ORDER)
+#define PAGECACHE_SHARE_MIN     (PAGECACHE_SHARE_SCALE / 16)
+#define PAGECACHE_SHARE_MAX     (PAGECACHE_SHARE_SCALE - PAGECACHE_SHARE_MIN)
+#define PAGECACHE_SHARE_STEP    (PAGECACHE_SHARE_SCALE / 64)
+
 static inline u64 cache_pagesize(pagecache pc)
 {
     return U64_FROM_BIT(pc->page_order);
@@ -57,6 +63,11 @@ static inline range byte_range_from_page(pagecache pc, pagecache_page pp)
     return range_lshift(irangel(page_offset(pp), 1), pc->page_order);
 }
 
+static inline pagecache_shard page_shard(pagecache pc, pagecache_page pp)
+{
+    return &pc->shards[pp->shard];
+}
+
 static inline void pagelist_enqueue(pagelist pl, pagecache_page pp)
 {
     list_insert_before(&pl->l, &pp->l);
@@ -82,14 +93,34 @@ static inline void pagelist_touch(pagelist pl, pagecache_page pp)
 }
 
 #ifdef KERNEL
-static inline void pagecache_lock_state(pagecache pc)
+static inline void pagecache_lock_shard(pagecache_shard ps)
+{
+    spin_lock(&ps->state_lock);
+}
+
+static inline void pagecache_unlock_shard(pagecache_shard ps)
+{
+    spin_unlock(&ps->state_lock);
+}
+
+static inline void pagecache_lock_state(pagecache pc, pagecache_page pp)
 {
-    spin_lock(&pc->state_lock);
+    pagecache_lock_shard(page_shard(pc, pp));
 }
 
-static inline void pagecache_unlock_state(pagecache pc)
+static inline void pagecache_unlock_state(pagecache pc, pagecache_page pp)
 {
-    spin_unlock(&pc->state_lock);
+    pagecache_unlock_shard(page_shard(pc, pp));
+}
+
+static inline void pagecache_lock_shared_maps(pagecache pc)
+{
+    spin_lock(&pc->shared_maps_lock);
+}
+
+static inline void pagecache_unlock_shared_maps(pagecache pc)
+{
+    spin_unlock(&pc->shared_maps_lock);
 }
 
 /* TODO revisit node locking */
@@ -104,68 +135,79 @@ static inline void pagecache_unlock_node(pagecache_node pn)
 }
 
 #else
-#define pagecache_lock_state(pc)
-#define pagecache_unlock_state(pc)
+#define pagecache_lock_shard(ps)
+#define pagecache_unlock_shard(ps)
+#define pagecache_lock_state(pc, pp)
+#define pagecache_unlock_state(pc, pp)
+#define pagecache_lock_shared_maps(pc)
+#define pagecache_unlock_shared_maps(pc)
 #define pagecache_lock_node(pn)
 #define pagecache_unlock_node(pn)
 #endif
 
 static inline void change_page_state_locked(pagecache pc, pagecache_page pp, int state)
 {
+    pagecache_shard ps = page_shard(pc, pp);
     int old_state = page_state(pp);
     switch (state) {
     case PAGECACHE_PAGESTATE_FREE:
         if (old_state == PAGECACHE_PAGESTATE_NEW) {
-            pagelist_move(&pc->free, &pc->new, pp);
+            pagelist_move(&ps->free, &ps->new, pp);
         } else {
             assert(old_state == PAGECACHE_PAGESTATE_ACTIVE);
-            pagelist_move(&pc->free, &pc->active, pp);
+            pagelist_move(&ps->free, &ps->active, pp);
         }
+        pp->evict_seq = ++ps->evictions;
+        pp->evicted_active = old_state == PAGECACHE_PAGESTATE_ACTIVE;
         break;
     case PAGECACHE_PAGESTATE_ALLOC:
         if (old_state == PAGECACHE_PAGESTATE_FREE)
-            pagelist_remove(&pc->free, pp);
+            pagelist_remove(&ps->free, pp);
         break;
     case PAGECACHE_PAGESTATE_READING:
         assert(old_state == PAGECACHE_PAGESTATE_ALLOC);
         break;
     case PAGECACHE_PAGESTATE_WRITING:
         if (old_state == PAGECACHE_PAGESTATE_NEW) {
-            pagelist_move(&pc->writing, &pc->new, pp);
+            pagelist_move(&ps->writing, &ps->new, pp);
         } else if (old_state == PAGECACHE_PAGESTATE_ACTIVE) {
-            pagelist_move(&pc->writing, &pc->active, pp);
+            pagelist_move(&ps->writing, &ps->active, pp);
         } else if (old_state == PAGECACHE_PAGESTATE_DIRTY) {
-            pagelist_move(&pc->writing, &pc->dirty, pp);
+            pagelist_move(&ps->writing, &ps->dirty, pp);
         } else if (old_state == PAGECACHE_PAGESTATE_WRITING) {
             /* write already pending, move to tail of queue */
-            pagelist_touch(&pc->writing, pp);
+            pagelist_touch(&ps->writing, pp);
         } else {
             assert(old_state == PAGECACHE_PAGESTATE_ALLOC);
-            pagelist_enqueue(&pc->writing, pp);
+            pagelist_enqueue(&ps->writing, pp);
         }
         break;
     case PAGECACHE_PAGESTATE_NEW:
         if (old_state == PAGECACHE_PAGESTATE_ACTIVE) {
-            pagelist_move(&pc->new, &pc->active, pp);
+            pagelist_move(&ps->new, &ps->active, pp);
         } else if (old_state == PAGECACHE_PAGESTATE_WRITING) {
-            pagelist_move(&pc->new, &pc->writing, pp);
+            pagelist_move(&ps->new, &ps->writing, pp);
         } else {
             assert(old_state == PAGECACHE_PAGESTATE_READING);
-            pagelist_enqueue(&pc->new, pp);
+            pagelist_enqueue(&ps->new, pp);
         }
         break;
     case PAGECACHE_PAGESTATE_ACTIVE:
-        assert(old_state == PAGECACHE_PAGESTATE_NEW);
-        pagelist_move(&pc->active, &pc->new, pp);
+        if (old_state == PAGECACHE_PAGESTATE_READING) {
+            pagelist_enqueue(&ps->active, pp);
+        } else {
+            assert(old_state == PAGECACHE_PAGESTATE_NEW);
+            pagelist_move(&ps->active, &ps->new, pp);
+        }
         break;
     case PAGECACHE_PAGESTATE_DIRTY:
         if (old_state == PAGECACHE_PAGESTATE_NEW) {
-            pagelist_move(&pc->dirty, &pc->new, pp);
+            pagelist_move(&ps->dirty, &ps->new, pp);
         } else if (old_state == PAGECACHE_PAGESTATE_ACTIVE) {
-            pagelist_move(&pc->dirty, &pc->active, pp);
+            pagelist_move(&ps->dirty, &ps->active, pp);
         } else {
             assert(old_state == PAGECACHE_PAGESTATE_WRITING);
-            pagelist_move(&pc->dirty, &pc->writing, pp);
+            pagelist_move(&ps->dirty, &ps->writing, pp);
         }
         break;
     default:
@@ -201,6 +243,63 @@ static void enqueue_page_completion_statelocked(pagecache pc, pagecache_page pp,
     list_push_back(l, &c->l);
 }
 
+/* A free page retains the shard eviction count at the time it was
+   released. On refault, the number of evictions since then tells how much
+   larger the cache would have had to be to keep the page. If that is
+   within the resident lists, the page was evicted prematurely: in the
+   manner of ARC ghost lists, shift the new/active split toward the list it
+   was evicted from, and if the distance is within the active list, return
+   the page directly to the active list once read. */
+static void page_refault_locked(pagecache_shard ps, pagecache_page pp)
+{
+    u64 distance = ps->evictions - pp->evict_seq;
+    ps->refaults++;
+    pp->activate = false;
+    if (distance > ps->new.pages + ps->active.pages)
+        return;
+    if (pp->evicted_active)
+        ps->new_share = MAX(ps->new_share - PAGECACHE_SHARE_STEP, PAGECACHE_SHARE_MIN);
+    else
+        ps->new_share = MIN(ps->new_share + PAGECACHE_SHARE_STEP, PAGECACHE_SHARE_MAX);
+    if (distance <= ps->active.pages) {
+        pp->activate = true;
+        ps->refault_activations++;
+    }
+}
+
+/* State of a page after a successful read from storage */
+static inline int page_filled_state(pagecache_page pp)
+{
+    if (pp->activate) {
+        pp->activate = false;
+        return PAGECACHE_PAGESTATE_ACTIVE;
+    }
+    return PAGECACHE_PAGESTATE_NEW;
+}
+
+/* Cache hit on a resident page. A new page is only promoted to the active
+   list on its second hit, so that a single pass over a file doesn't flush
+   the active list. */
+static void page_hit_locked(pagecache pc, pagecache_page pp)
+{
+    pagecache_shard ps = page_shard(pc, pp);
+    switch (page_state(pp)) {
+    case PAGECACHE_PAGESTATE_ACTIVE:
+        /* move to bottom of active list */
+        pagelist_touch(&ps->active, pp);
+        break;
+    case PAGECACHE_PAGESTATE_NEW:
+        if (pp->referenced) {
+            pp->referenced = false;
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+        } else {
+            pp->referenced = true;
+        }
+        break;
+    }
+    fetch_and_add(&ps->hits, 1);
+}
+
 static boolean realloc_pagelocked(pagecache pc, pagecache_page pp)
 {
     pagecache_debug("%s: pc %p pp %p refcount %d state %d\n", __func__, pc, pp, pp->refcount.c, page_state(pp));
@@ -217,6 +316,8 @@ static boolean realloc_pagelocked(pagecache pc, pagecache_page pp)
     fetch_and_add(&pc->total_pages, 1);
     change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ALLOC);
     pp->evicted = false;
+    pp->referenced = false;
+    page_refault_locked(page_shard(pc, pp), pp);
     return true;
 }
 
@@ -231,8 +332,9 @@ static void pagecache_add_sgb(pagecache pc, pagecache_page pp, sg_list sg)
 }
 
 /* Returns true if the page is already cached (or is being fetched from disk), false if a disk read
- * needs to be requested to fetch the page (or re-allocation of a freed page failed). */
-static boolean touch_page_locked(pagecache_node pn, pagecache_page pp, merge m)
+ * needs to be requested to fetch the page (or re-allocation of a freed page failed). Readahead
+ * requests (access false) don't count as hits. */
+static boolean touch_page_locked(pagecache_node pn, pagecache_page pp, merge m, boolean access)
 {
     pagecache_volume pv = pn->pv;
     pagecache pc = pv->pc;
@@ -248,15 +350,15 @@ static boolean touch_page_locked(pagecache_node pn, pagecache_page pp, merge m)
         /* no break */
     case PAGECACHE_PAGESTATE_ALLOC:
         change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_READING);
+        if (access) {
+            pp->referenced = true;
+            fetch_and_add(&page_shard(pc, pp)->misses, 1);
+        }
         return false;
     case PAGECACHE_PAGESTATE_ACTIVE:
-        /* move to bottom of active list */
-        list_delete(&pp->l);
-        list_insert_before(&pc->active.l, &pp->l);
-        break;
     case PAGECACHE_PAGESTATE_NEW:
-        /* cache hit -> active */
-        change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+        if (access)
+            page_hit_locked(pc, pp);
         break;
     }
     return true;
@@ -276,10 +378,10 @@ closure_function(3, 1, void, pagecache_read_page_complete,
         /* TODO need policy for capturing/reporting I/O errors... */
         msg_err("error reading page 0x%lx: %v\n", page_offset(pp) << pc->page_order, s);
     }
-    pagecache_lock_state(pc);
-    change_page_state_locked(bound(pc), pp, PAGECACHE_PAGESTATE_NEW);
+    pagecache_lock_state(pc, pp);
+    change_page_state_locked(bound(pc), pp, page_filled_state(pp));
     pagecache_page_queue_completions_locked(pc, pp, s);
-    pagecache_unlock_state(pc);
+    pagecache_unlock_state(pc, pp);
     sg_list_release(bound(sg));
     deallocate_sg_list(bound(sg));
     closure_finish();
@@ -290,25 +392,29 @@ static boolean touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page p
     pagecache_volume pv = pn->pv;
     pagecache pc = pv->pc;
 
-    pagecache_lock_state(pc);
+    pagecache_lock_state(pc, pp);
     pagecache_debug("%s: pn %p, pp %p, m %p, state %d\n", __func__, pn, pp, m, page_state(pp));
     switch (page_state(pp)) {
     case PAGECACHE_PAGESTATE_READING:
         if (m) {
             enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
         }
-        pagecache_unlock_state(pc);
+        pagecache_unlock_state(pc, pp);
         return false;
     case PAGECACHE_PAGESTATE_FREE:
-        if (!realloc_pagelocked(pc, pp))
+        if (!realloc_pagelocked(pc, pp)) {
+            pagecache_unlock_state(pc, pp);
             return false;
+        }
         /* fall through */
     case PAGECACHE_PAGESTATE_ALLOC:
         if (m) {
             enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
             change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_READING);
+            pp->referenced = true;
+            fetch_and_add(&page_shard(pc, pp)->misses, 1);
         }
-        pagecache_unlock_state(pc);
+        pagecache_unlock_state(pc, pp);
 
         if (m) {
             /* issue page reads */
@@ -322,21 +428,15 @@ static boolean touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page p
         }
         return false;
     case PAGECACHE_PAGESTATE_ACTIVE:
-        /* move to bottom of active list */
-        list_delete(&pp->l);
-        list_insert_before(&pc->active.l, &pp->l);
-        break;
     case PAGECACHE_PAGESTATE_NEW:
-        /* cache hit -> active */
-        change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
-        break;
     case PAGECACHE_PAGESTATE_WRITING:
     case PAGECACHE_PAGESTATE_DIRTY:
+        page_hit_locked(pc, pp);
         break;
     default:
         halt("%s: invalid state %d\n", __func__, page_state(pp));
     }
-    pagecache_unlock_state(pc);
+    pagecache_unlock_state(pc, pp);
     return true;
 }
 
@@ -351,9 +451,9 @@ define_closure_function(2, 0, void, pagecache_page_free,
     assert(pp->refcount.c == 0);
 
     pagecache pc = bound(pc);
-    pagecache_lock_state(pc);
+    pagecache_lock_state(pc, pp);
     change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_FREE);
-    pagecache_unlock_state(pc);
+    pagecache_unlock_state(pc, pp);
     deallocate(pc->contiguous, pp->kvirt, cache_pagesize(pc));
     pp->kvirt = INVALID_ADDRESS;
     pp->phys = INVALID_PHYSICAL;
@@ -362,6 +462,87 @@ define_closure_function(2, 0, void, pagecache_page_free,
     pagecache_debug("%s: total pages now %ld\n", __func__, pre - 1);
 }
 
+#define PAGECACHE_INDEX_SLOTS U64_FROM_BIT(PAGECACHE_INDEX_ORDER)
+
+static inline boolean index_node_covers(pagecache_index_node in, u64 n)
+{
+    int order = in->shift + PAGECACHE_INDEX_ORDER;
+    return order >= 64 || (n >> order) == 0;
+}
+
+/* may be called without pages_lock */
+static pagecache_page page_index_lookup(pagecache_node pn, u64 n)
+{
+    pagecache_index_node in = *(pagecache_index_node volatile *)&pn->index;
+    if (!in || !index_node_covers(in, n))
+        return INVALID_ADDRESS;
+    while (1) {
+        read_barrier();
+        void *p = *(void * volatile *)&in->slots[(n >> in->shift) & MASK(PAGECACHE_INDEX_ORDER)];
+        if (!p)
+            return INVALID_ADDRESS;
+        if (in->shift == 0)
+            return p;
+        in = p;
+    }
+}
+
+static pagecache_index_node allocate_index_node(pagecache pc, int shift)
+{
+    pagecache_index_node in = allocate_zero(pc->h, sizeof(struct pagecache_index_node));
+    if (in != INVALID_ADDRESS)
+        in->shift = shift;
+    return in;
+}
+
+/* Nodes are fully initialized before being published with a write barrier,
+   so that concurrent lockless lookups never see partial state. */
+static boolean page_index_insert_nodelocked(pagecache_node pn, u64 n, pagecache_page pp)
+{
+    pagecache pc = pn->pv->pc;
+    pagecache_index_node in = pn->index;
+    if (!in) {
+        in = allocate_index_node(pc, 0);
+        if (in == INVALID_ADDRESS)
+            return false;
+        write_barrier();
+        pn->index = in;
+    }
+    while (!index_node_covers(in, n)) {
+        pagecache_index_node root = allocate_index_node(pc, in->shift + PAGECACHE_INDEX_ORDER);
+        if (root == INVALID_ADDRESS)
+            return false;
+        root->slots[0] = in;
+        write_barrier();
+        pn->index = in = root;
+    }
+    while (in->shift > 0) {
+        void **slot = &in->slots[(n >> in->shift) & MASK(PAGECACHE_INDEX_ORDER)];
+        if (!*slot) {
+            pagecache_index_node child = allocate_index_node(pc, in->shift - PAGECACHE_INDEX_ORDER);
+            if (child == INVALID_ADDRESS)
+                return false;
+            write_barrier();
+            *slot = child;
+        }
+        in = *slot;
+    }
+    write_barrier();
+    in->slots[n & MASK(PAGECACHE_INDEX_ORDER)] = pp;
+    return true;
+}
+
+static void deallocate_index_node(pagecache pc, pagecache_index_node in)
+{
+    if (in->shift > 0) {
+        for (int i = 0; i < PAGECACHE_INDEX_SLOTS; i++) {
+            if (in->slots[i])
+                deallocate_index_node(pc, in->slots[i]);
+        }
+    }
+    deallocate(pc->h, in, sizeof(*in));
+}
+
 static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset)
 {
     /* allocate - later we can look at blocks of pages at a time */
@@ -384,19 +565,32 @@ static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset)
     pp->node = pn;
     pp->l.next = pp->l.prev = 0;
     pp->evicted = false;
+    pp->shard = offset & (PAGECACHE_SHARDS - 1);
+    pp->referenced = false;
+    pp->evicted_active = false;
+    pp->activate = false;
+    pp->evict_seq = 0;
 #ifdef KERNEL
     pp->phys = physical_from_virtual(p);
 #endif
     list_init(&pp->bh_completions);
+    if (!page_index_insert_nodelocked(pn, offset, pp))
+        goto fail_dealloc_page;
     assert(rbtree_insert_node(&pn->pages, &pp->rbnode));
     fetch_and_add(&pc->total_pages, 1); /* decrement happens without cache lock */
     return pp;
+  fail_dealloc_page:
+    deallocate(pc->h, pp, sizeof(struct pagecache_page));
   fail_dealloc_contiguous:
     deallocate(pc->contiguous, p, pagesize);
     return INVALID_ADDRESS;
 }
 
 #ifndef PAGECACHE_READ_ONLY
+/* Pages hit through the lockless lookup path are only marked as
+   referenced; give active pages a second chance by moving them to the
+   tail. The new list is evicted in FIFO order, as a page hit there only
+   once has not yet shown any reuse. */
 static u64 evict_from_list_locked(pagecache pc, struct pagelist *pl, vector evictlist, u64 pages)
 {
     u64 evicted = 0;
@@ -407,10 +601,14 @@ static u64 evict_from_list_locked(pagecache pc, struct pagelist *pl, vector evic
         pagecache_page pp = struct_from_list(l, pagecache_page, l);
         if (pp->evicted)
             continue;
+        if (pp->referenced && page_state(pp) == PAGECACHE_PAGESTATE_ACTIVE) {
+            pp->referenced = false;
+            pagelist_touch(pl, pp);
+            continue;
+        }
         assert(pp->refcount.c != 0);
-        pagecache_debug("%s: list %s, release pp %p - %R, state %d, count %ld\n", __func__,
-                        pl == &pc->new ? "new" : "active", pp, byte_range_from_page(pc, pp),
-                        page_state(pp), pp->refcount.c);
+        pagecache_debug("%s: release pp %p - %R, state %d, count %ld\n", __func__,
+                        pp, byte_range_from_page(pc, pp), page_state(pp), pp->refcount.c);
         pp->evicted = true;
         vector_push(evictlist, pp);
         evicted++;
@@ -418,15 +616,23 @@ static u64 evict_from_list_locked(pagecache pc, struct pagelist *pl, vector evic
     return evicted;
 }
 
-static void balance_page_lists_locked(pagecache pc)
+static void balance_page_lists_locked(pagecache pc, pagecache_shard ps)
 {
-    /* balance active and new lists */
-    s64 dp = ((s64)pc->active.pages - (s64)pc->new.pages) / 2;
-    pagecache_debug("%s: active %ld, new %ld, dp %ld\n", __func__, pc->active.pages, pc->new.pages, dp);
-    list_foreach(&pc->active.l, l) {
+    /* balance active and new lists according to the adaptive new list share */
+    u64 total = ps->active.pages + ps->new.pages;
+    u64 active_target = total - ((total * ps->new_share) >> PAGECACHE_SHARE_ORDER);
+    s64 dp = (s64)ps->active.pages - (s64)active_target;
+    pagecache_debug("%s: active %ld, new %ld, share %ld, dp %ld\n", __func__, ps->active.pages,
+                    ps->new.pages, ps->new_share, dp);
+    list_foreach(&ps->active.l, l) {
         if (dp <= 0)
             break;
         pagecache_page pp = struct_from_list(l, pagecache_page, l);
+        if (pp->referenced) {
+            pp->referenced = false;
+            pagelist_touch(&ps->active, pp);
+            continue;
+        }
         /* We don't presently have a notion of "time" in the cache, so
            just cull unreferenced buffers in LRU fashion until active
            pages are equivalent to new...loosely inspired by linux
@@ -441,9 +647,7 @@ static void balance_page_lists_locked(pagecache pc)
 
 static pagecache_page page_lookup_nodelocked(pagecache_node pn, u64 n)
 {
-    struct pagecache_page k;
-    k.state_offset = n;
-    return (pagecache_page)rbtree_lookup(&pn->pages, &k.rbnode);
+    return page_index_lookup(pn, n);
 }
 
 static pagecache_page page_lookup_or_alloc_nodelocked(pagecache_node pn, u64 n)
@@ -453,9 +657,9 @@ static pagecache_page page_lookup_or_alloc_nodelocked(pagecache_node pn, u64 n)
         pp = allocate_page_nodelocked(pn, n);
     } else if (page_state(pp) == PAGECACHE_PAGESTATE_FREE) {
         pagecache pc = pn->pv->pc;
-        pagecache_lock_state(pc);
+        pagecache_lock_state(pc, pp);
         realloc_pagelocked(pc, pp);
-        pagecache_unlock_state(pc);
+        pagecache_unlock_state(pc, pp);
     }
     return pp;
 }
@@ -509,14 +713,14 @@ closure_function(6, 1, void, pagecache_write_sg_finish,
         if (bound(complete)) {
             do {
                 assert(pp != INVALID_ADDRESS && page_offset(pp) == pi);
-                pagecache_lock_state(pc);
+                pagecache_lock_state(pc, pp);
                 assert(pp->write_count > 0);
                 if (pp->write_count-- == 1) {
                     if (page_state(pp) != PAGECACHE_PAGESTATE_DIRTY)
                         change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
                     pagecache_page_queue_completions_locked(pc, pp, s);
                 }
-                pagecache_unlock_state(pc);
+                pagecache_unlock_state(pc, pp);
                 refcount_release(&pp->refcount);
                 pi++;
                 pp = (pagecache_page)rbnode_get_next((rbnode)pp);
@@ -565,11 +769,11 @@ closure_function(6, 1, void, pagecache_write_sg_finish,
         } else {
             zero(pp->kvirt + offset, copy_len);
         }
-        pagecache_lock_state(pc);
+        pagecache_lock_state(pc, pp);
         assert(page_state(pp) != PAGECACHE_PAGESTATE_READING);
         change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_WRITING);
         pp->write_count++;
-        pagecache_unlock_state(pc);
+        pagecache_unlock_state(pc, pp);
         offset = 0;
         block_offset = 0;
         pi++;
@@ -680,7 +884,9 @@ closure_function(1, 3, void, pagecache_write_sg,
             }
 
             /* set to writing state to begin queueing dependent operations */
+            pagecache_lock_state(pc, pp);
             change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_WRITING);
+            pagecache_unlock_state(pc, pp);
 
             /* When writing a new page at the end of a node whose length is not page-aligned, zero
                the remaining portion of the page. The filesystem will depend on this to properly
@@ -695,33 +901,39 @@ closure_function(1, 3, void, pagecache_write_sg,
                 zero(pp->kvirt + page_offset, len);
             }
         }
-        pagecache_lock_state(pc);
+        pagecache_lock_state(pc, pp);
         if (page_state(pp) == PAGECACHE_PAGESTATE_FREE)
             realloc_pagelocked(pc, pp);
         refcount_reserve(&pp->refcount);
         if (page_state(pp) == PAGECACHE_PAGESTATE_READING)
             enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
-        pagecache_unlock_state(pc);
+        pagecache_unlock_state(pc, pp);
     }
     pagecache_unlock_node(pn);
     apply(sh, STATUS_OK);
 }
 
-/* evict pages from new and active lists, then rebalance */
-static u64 evict_pages_locked(pagecache pc, u64 pages, vector evictlist)
+#define DRAIN_ITER_MAX   128
+
+/* Evict from the new lists of all shards first. The active lists are only
+   used when no new pages remain. To fill the requested evictions, we are
+   more aggressive there, evicting even in-use pages (rc > 1). */
+static u64 evict_pages(pagecache pc, u64 pages, vector evictlist)
 {
-    u64 evicted = evict_from_list_locked(pc, &pc->new, evictlist, pages);
-    if (evicted < pages) {
-        /* To fill the requested pages evictions, we are more
-           aggressive here, evicting even in-use pages (rc > 1) in the
-           active list. */
-        evicted += evict_from_list_locked(pc, &pc->active, evictlist, pages - evicted);
+    u64 evicted = 0;
+    for (int active = 0; active < 2 && evicted == 0; active++) {
+        u64 per_shard = MAX(1, pages / PAGECACHE_SHARDS);
+        for (int i = 0; i < PAGECACHE_SHARDS && evicted < pages; i++) {
+            pagecache_shard ps = &pc->shards[i];
+            pagecache_lock_shard(ps);
+            evicted += evict_from_list_locked(pc, active ? &ps->active : &ps->new, evictlist,
+                                              MIN(per_shard, pages - evicted));
+            pagecache_unlock_shard(ps);
+        }
     }
     return evicted;
 }
 
-#define DRAIN_ITER_MAX   128
-
 u64 pagecache_drain(u64 drain_bytes)
 {
     pagecache_page pp;
@@ -733,9 +945,7 @@ u64 pagecache_drain(u64 drain_bytes)
     if ((v = allocate_vector(pc->h, DRAIN_ITER_MAX)) == INVALID_ADDRESS)
         return 0;
     while (evicted < pages) {
-        pagecache_lock_state(pc);
-        u64 n = evict_pages_locked(pc, MIN(pages - evicted, DRAIN_ITER_MAX), v);
-        pagecache_unlock_state(pc);
+        u64 n = evict_pages(pc, MIN(pages - evicted, DRAIN_ITER_MAX), v);
         if (n == 0)
             break;
         evicted += n;
@@ -744,9 +954,12 @@ u64 pagecache_drain(u64 drain_bytes)
     }
     deallocate_vector(v);
 
-    pagecache_lock_state(pc);
-    balance_page_lists_locked(pc);
-    pagecache_unlock_state(pc);
+    for (int i = 0; i < PAGECACHE_SHARDS; i++) {
+        pagecache_shard ps = &pc->shards[i];
+        pagecache_lock_shard(ps);
+        balance_page_lists_locked(pc, ps);
+        pagecache_unlock_shard(ps);
+    }
     return evicted << pc->page_order;
 }
 
@@ -756,19 +969,24 @@ u64 pagecache_drain(u64 drain_bytes)
 static void pagecache_finish_pending_writes(pagecache pc, pagecache_volume pv, pagecache_node pn,
                                             status_handler complete)
 {
-    pagecache_page pp = 0;
-    /* If writes are pending, tack completion onto the mostly recently written page. */
-    pagecache_lock_state(pc);
-    list_foreach_reverse(&pc->writing.l, l) {
-        pp = struct_from_list(l, pagecache_page, l);
-        if ((!pn || pp->node == pn) && (!pv || pp->node->pv == pv)) {
-            enqueue_page_completion_statelocked(pc, pp, complete);
-            pagecache_unlock_state(pc);
-            return;
+    merge m = allocate_merge(pc->h, complete);
+    status_handler sh = apply_merge(m);
+
+    /* If writes are pending, tack completion onto the mostly recently
+       written page of each shard. */
+    for (int i = 0; i < PAGECACHE_SHARDS; i++) {
+        pagecache_shard ps = &pc->shards[i];
+        pagecache_lock_shard(ps);
+        list_foreach_reverse(&ps->writing.l, l) {
+            pagecache_page pp = struct_from_list(l, pagecache_page, l);
+            if ((!pn || pp->node == pn) && (!pv || pp->node->pv == pv)) {
+                enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
+                break;
+            }
         }
+        pagecache_unlock_shard(ps);
     }
-    pagecache_unlock_state(pc);
-    apply(complete, STATUS_OK);
+    apply(sh, STATUS_OK);
 }
 
 #ifdef KERNEL
@@ -812,14 +1030,18 @@ closure_function(5, 1, void, pagecache_node_fetch_complete,
     u64 page_count = bound(page_count);
     sg_list sg = bound(sg);
     pagecache_debug("%s: page count %ld, status %v\n", __func__, page_count, s);
-    pagecache_lock_state(pc);
     while (page_count-- > 0) {
-        change_page_state_locked(pc, pp,
-            is_ok(s) ? PAGECACHE_PAGESTATE_NEW : PAGECACHE_PAGESTATE_ALLOC);
+        pagecache_lock_state(pc, pp);
+        if (is_ok(s)) {
+            change_page_state_locked(pc, pp, page_filled_state(pp));
+        } else {
+            pp->activate = false;
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ALLOC);
+        }
         pagecache_page_queue_completions_locked(pc, pp, s);
+        pagecache_unlock_state(pc, pp);
         pp = (pagecache_page)rbnode_get_next((rbnode)pp);
     }
-    pagecache_unlock_state(pc);
     sg_list_release(sg);
     deallocate_sg_list(sg);
     apply(bound(complete), s);
@@ -857,7 +1079,6 @@ static void pagecache_node_fetch_internal(pagecache_node pn, range q, pp_handler
     sg_list read_sg = 0;
     pagecache_page read_pp = 0;
     range read_r;
-    pagecache_lock_state(pc);
     for (u64 pi = k.state_offset; pi < end; pi++) {
         if (pp == INVALID_ADDRESS || page_offset(pp) > pi) {
             pp = allocate_page_nodelocked(pn, pi);
@@ -868,19 +1089,20 @@ static void pagecache_node_fetch_internal(pagecache_node pn, range q, pp_handler
         }
         if (ph)
             apply(ph, pp);
-        if (touch_page_locked(pn, pp, m)) {
+        pagecache_lock_state(pc, pp);
+        boolean cached = touch_page_locked(pn, pp, m, ph != 0);
+        int state = page_state(pp);
+        pagecache_unlock_state(pc, pp);
+        if (cached) {
             /* This page does not need to be fetched: fetch pages accumulated so far in read_sg. */
             if (read_sg) {
-                pagecache_unlock_state(pc);
-                boolean success = pagecache_node_fetch_sg(pc, pn, read_r, read_sg, read_pp, m);
-                pagecache_lock_state(pc);
-                if (!success)
+                if (!pagecache_node_fetch_sg(pc, pn, read_r, read_sg, read_pp, m))
                     break;
                 read_sg = 0;
             }
         } else {
             /* This page needs to be fetched: add it to read_sg. */
-            if (page_state(pp) == PAGECACHE_PAGESTATE_FREE) {
+            if (state == PAGECACHE_PAGESTATE_FREE) {
                 apply(apply_merge(m), timm("result", "failed to allocate page"));
                 break;
             }
@@ -899,7 +1121,6 @@ static void pagecache_node_fetch_internal(pagecache_node pn, range q, pp_handler
         }
         pp = (pagecache_page)rbnode_get_next((rbnode)pp);
     }
-    pagecache_unlock_state(pc);
     pagecache_unlock_node(pn);
     if (read_sg && !pagecache_node_fetch_sg(pc, pn, read_r, read_sg, read_pp, m))
         deallocate_sg_list(read_sg);
@@ -923,6 +1144,40 @@ closure_function(3, 1, void, pagecache_read_pp_handler,
     refcount_reserve(&pp->refcount);
 }
 
+/* Take a reference to a page found with a lockless lookup, provided that it
+   holds valid data. The reference can only be taken while the page is
+   still held by the cache, as a released page may be concurrently freed. */
+static boolean pagecache_page_get_filled(pagecache pc, pagecache_page pp)
+{
+    if (!refcount_reserve_if_held(&pp->refcount))
+        return false;
+    read_barrier();
+    switch (page_state(pp)) {
+    case PAGECACHE_PAGESTATE_ACTIVE:
+        pp->referenced = true;
+        fetch_and_add(&page_shard(pc, pp)->hits, 1);
+        return true;
+    case PAGECACHE_PAGESTATE_NEW:
+        /* only a second hit moves the page to the active list */
+        if (!pp->referenced) {
+            pp->referenced = true;
+            fetch_and_add(&page_shard(pc, pp)->hits, 1);
+            return true;
+        }
+        pagecache_lock_state(pc, pp);
+        page_hit_locked(pc, pp);
+        pagecache_unlock_state(pc, pp);
+        return true;
+    case PAGECACHE_PAGESTATE_WRITING:
+    case PAGECACHE_PAGESTATE_DIRTY:
+        fetch_and_add(&page_shard(pc, pp)->hits, 1);
+        return true;
+    default:
+        refcount_release(&pp->refcount);
+        return false;
+    }
+}
+
 closure_function(1, 3, void, pagecache_read_sg,
                  pagecache_node, pn,
                  sg_list, sg, range, q, status_handler, completion)
@@ -931,6 +1186,27 @@ closure_function(1, 3, void, pagecache_read_sg,
     pagecache pc = pn->pv->pc;
     pagecache_debug("%s: node %p, q %R, sg %p, completion %F\n", __func__, pn, q, sg, completion);
     q = range_intersection(q, irangel(0, pn->length));
+
+    /* Cache hits are served without taking the node lock; the remainder of
+       the range from the first page miss goes through the fetch path. */
+    u64 pi = q.start >> pc->page_order;
+    u64 end = (q.end + MASK(pc->page_order)) >> pc->page_order;
+    for (; pi < end; pi++) {
+        pagecache_page pp = page_index_lookup(pn, pi);
+        if (pp == INVALID_ADDRESS || !pagecache_page_get_filled(pc, pp))
+            break;
+        range i = range_intersection(q, byte_range_from_page(pc, pp));
+        sg_buf sgb = sg_list_tail_add(sg, range_span(i));
+        sgb->buf = pp->kvirt + (i.start & MASK(pc->page_order));
+        sgb->size = range_span(i);
+        sgb->offset = 0;
+        sgb->refcount = &pp->refcount;
+    }
+    if (pi == end) {
+        apply(completion, STATUS_OK);
+        return;
+    }
+    q.start = MAX(q.start, pi << pc->page_order);
     pagecache_node_fetch_internal(pn, q, stack_closure(pagecache_read_pp_handler, pc, q, sg),
                                   completion);
 }
@@ -953,10 +1229,10 @@ closure_function(3, 3, boolean, pagecache_check_dirty_page,
         page_invalidate(bound(fe), vaddr);
         pagecache_page pp = page_lookup_nodelocked(sm->pn, pi);
         assert(pp != INVALID_ADDRESS);
-        pagecache_lock_state(pc);
+        pagecache_lock_state(pc, pp);
         if (page_state(pp) != PAGECACHE_PAGESTATE_DIRTY)
             change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_DIRTY);
-        pagecache_unlock_state(pc);
+        pagecache_unlock_state(pc, pp);
     }
     return true;
 }
@@ -1002,25 +1278,24 @@ closure_function(2, 1, void, pagecache_commit_complete,
         pagecache_debug("%s: write_error now %v\n", __func__, s);
         pp->node->pv->write_error = s;
     }
-    pagecache_lock_state(pc);
+    pagecache_lock_state(pc, pp);
     assert(pp->write_count > 0);
     if (pp->write_count-- == 1) {
         if (page_state(pp) != PAGECACHE_PAGESTATE_DIRTY)
             change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
         pagecache_page_queue_completions_locked(pc, pp, s);
     }
-    pagecache_unlock_state(pc);
+    pagecache_unlock_state(pc, pp);
     closure_finish();
 }
 
-static void pagecache_commit_dirty_pages(pagecache pc)
+static void pagecache_commit_dirty_shard(pagecache pc, pagecache_shard ps)
 {
-    pagecache_debug("%s\n", __func__);
-    pagecache_lock_state(pc);
+    pagecache_lock_shard(ps);
 
     /* It might be more efficient to move these to a temporary list,
        issue writes and then resolve on merge completion... */
-    list_foreach(&pc->dirty.l, l) {
+    list_foreach(&ps->dirty.l, l) {
         pagecache_page pp = struct_from_list(l, pagecache_page, l);
         sg_list sg = allocate_sg_list();
         assert(sg != INVALID_ADDRESS);
@@ -1033,15 +1308,22 @@ static void pagecache_commit_dirty_pages(pagecache pc)
         refcount_reserve(&pp->refcount);
         change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_WRITING);
         pp->write_count++;
-        pagecache_unlock_state(pc);
+        pagecache_unlock_shard(ps);
 
         apply(pp->node->fs_write, sg,
               irangel(page_offset(pp) << pc->page_order, cache_pagesize(pc)),
               closure(pc->h, pagecache_commit_complete, pc, pp));
 
-        pagecache_lock_state(pc);
+        pagecache_lock_shard(ps);
     }
-    pagecache_unlock_state(pc);
+    pagecache_unlock_shard(ps);
+}
+
+static void pagecache_commit_dirty_pages(pagecache pc)
+{
+    pagecache_debug("%s\n", __func__);
+    for (int i = 0; i < PAGECACHE_SHARDS; i++)
+        pagecache_commit_dirty_shard(pc, &pc->shards[i]);
 }
 
 static void pagecache_scan(pagecache pc)
@@ -1070,7 +1352,7 @@ void pagecache_node_add_shared_map(pagecache_node pn, range q /* bytes */, u64 n
     sm->pn = pn;
     sm->node_offset = node_offset;
     pagecache_debug("%s: pn %p, q %R, node_offset 0x%lx\n", __func__, pn, q, node_offset);
-    pagecache_lock_state(pc);
+    pagecache_lock_shared_maps(pc);
     list_insert_before(&pc->shared_maps, &sm->l);
     assert(rangemap_insert(pn->shared_maps, &sm->n));
     if (!timer_is_active(&pc->scan_timer)) {
@@ -1078,7 +1360,7 @@ void pagecache_node_add_shared_map(pagecache_node pn, range q /* bytes */, u64 n
         register_timer(kernel_timers, &pc->scan_timer, CLOCK_ID_MONOTONIC, t, false, t,
                        (timer_handler)&pc->do_scan_timer);
     }
-    pagecache_unlock_state(pc);
+    pagecache_unlock_shared_maps(pc);
 }
 
 closure_function(3, 1, void, close_shared_pages_intersection,
@@ -1338,6 +1620,8 @@ void pagecache_deallocate_node(pagecache_node pn)
     deallocate_closure(pn->cache_write);
 #endif
     destruct_rbtree(&pn->pages, stack_closure(pagecache_page_release));
+    if (pn->index)
+        deallocate_index_node(pn->pv->pc, pn->index);
     list_delete(&pn->l);
     deallocate_rangemap(pn->shared_maps, stack_closure(pagecache_node_assert));
     deallocate(pn->pv->pc->h, pn, sizeof(*pn));
@@ -1371,6 +1655,7 @@ pagecache_node pagecache_allocate_node(pagecache_volume pv, sg_io fs_read, sg_io
     list_insert_before(&pv->nodes, &pn->l);
     init_rbtree(&pn->pages, (rb_key_compare)&pv->pc->page_compare,
                 (rbnode_handler)&pv->pc->page_print_key);
+    pn->index = 0;
     pn->length = 0;
     pn->cache_read = closure(h, pagecache_read_sg, pn);
 #ifndef PAGECACHE_READ_ONLY
@@ -1399,6 +1684,43 @@ u64 pagecache_get_occupancy(void)
     return global_pagecache->total_pages << pagecache_get_page_order();
 }
 
+#ifdef KERNEL
+/* sum of a shard counter over all shards */
+closure_function(3, 0, value, pagecache_get_stat,
+                 pagecache, pc, bytes, offset, value, v)
+{
+    u64 sum = 0;
+    for (int i = 0; i < PAGECACHE_SHARDS; i++)
+        sum += *(u64 *)((void *)&bound(pc)->shards[i] + bound(offset));
+    return value_rewrite_u64(bound(v), sum);
+}
+
+#define register_pagecache_stat(pc, n, t, name)                                 \
+    v = value_from_u64(pc->h, 0);                                               \
+    s = sym(name);                                                              \
+    set(t, s, v);                                                               \
+    tuple_notifier_register_get_notify(n, s, closure(pc->h, pagecache_get_stat, pc, \
+        offsetof(pagecache_shard, name), v));
+
+void init_pagecache_management(tuple root)
+{
+    pagecache pc = global_pagecache;
+    value v;
+    symbol s;
+    tuple t = allocate_tuple();
+    assert(t != INVALID_ADDRESS);
+    tuple_notifier n = tuple_notifier_wrap(t);
+    assert(n != INVALID_ADDRESS);
+    register_pagecache_stat(pc, n, t, hits);
+    register_pagecache_stat(pc, n, t, misses);
+    register_pagecache_stat(pc, n, t, refaults);
+    register_pagecache_stat(pc, n, t, refault_activations);
+    register_pagecache_stat(pc, n, t, evictions);
+    set(t, sym(no_encode), null_value);
+    set(root, sym(pagecache), n);
+}
+#endif
+
 pagecache_volume pagecache_allocate_volume(u64 length, int block_order)
 {
     pagecache pc = global_pagecache;
@@ -1446,15 +1768,24 @@ void init_pagecache(heap general, heap contiguous, heap physical, u64 pagesize)
                                                         sizeof(struct page_completion),
                                                         PAGESIZE));
     assert(pc->completions != INVALID_ADDRESS);
-    spin_lock_init(&pc->state_lock);
+    spin_lock_init(&pc->shared_maps_lock);
 #else
     pc->completions = general;
 #endif
-    page_list_init(&pc->free);
-    page_list_init(&pc->new);
-    page_list_init(&pc->active);
-    page_list_init(&pc->writing);
-    page_list_init(&pc->dirty);
+    for (int i = 0; i < PAGECACHE_SHARDS; i++) {
+        pagecache_shard ps = &pc->shards[i];
+#ifdef KERNEL
+        spin_lock_init(&ps->state_lock);
+#endif
+        page_list_init(&ps->free);
+        page_list_init(&ps->new);
+        page_list_init(&ps->active);
+        page_list_init(&ps->writing);
+        page_list_init(&ps->dirty);
+        ps->evictions = 0;
+        ps->new_share = PAGECACHE_SHARE_SCALE / 2;
+        ps->hits = ps->misses = ps->refaults = ps->refault_activations = 0;
+    }
     list_init(&pc->volumes);
     list_init(&pc->shared_maps);
     init_closure(&pc->page_compare, pagecache_page_compare);
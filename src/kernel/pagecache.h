@@ -48,6 +48,8 @@ boolean pagecache_map_page_if_filled(pagecache_node pn, u64 node_offset, u64 vad
                                      status_handler complete);
 
 void pagecache_node_unmap_pages(pagecache_node pn, range v /* bytes */, u64 node_offset);
+
+void init_pagecache_management(tuple root);
 #endif
 
 
@@ -21,6 +21,35 @@ typedef struct page_completion {
     };
 } *page_completion;
 
+/* Pages are spread over PAGECACHE_SHARDS shards by page offset. Each shard
+   has its own state lock and page lists, so that state changes on
+   unrelated pages do not contend. */
+typedef struct pagecache_shard {
+    /* state_lock covers list access, page state changes and
+       alterations to page completion vecs */
+#ifdef KERNEL
+    struct spinlock state_lock;
+#endif
+    struct pagelist free;      /* see state descriptions */
+    struct pagelist new;
+    struct pagelist active;
+    struct pagelist writing;
+    struct pagelist dirty;     /* phase 2 */
+
+    /* Replacement state: evictions stamps pages released to the free list,
+       so that the refault distance of a page can be measured when it is
+       brought back; new_share is the adaptive share of new list pages,
+       in units of 1/PAGECACHE_SHARE_SCALE. */
+    u64 evictions;
+    u64 new_share;
+
+    /* statistics */
+    word hits;                  /* updated atomically */
+    word misses;
+    word refaults;
+    word refault_activations;
+} *pagecache_shard;
+
 typedef struct pagecache {
     word total_pages;
     int page_order;
@@ -31,16 +60,12 @@ typedef struct pagecache {
 
     void *zero_page;            /* for zero-fill dma */
 
-    /* state_lock covers list access, page state changes and
-       alterations to page completion vecs */
+    struct pagecache_shard shards[PAGECACHE_SHARDS];
+
+    /* shared_maps_lock covers the shared maps list and scan timer */
 #ifdef KERNEL
-    struct spinlock state_lock;
+    struct spinlock shared_maps_lock;
 #endif
-    struct pagelist free;      /* see state descriptions */
-    struct pagelist new;
-    struct pagelist active;
-    struct pagelist writing;
-    struct pagelist dirty;     /* phase 2 */
     struct list volumes;
     struct list shared_maps;
 
@@ -60,6 +85,16 @@ typedef struct pagecache_volume {
     status write_error;         /* pending error from a previous write */
 } *pagecache_volume;
 
+/* Radix index of node pages by page offset. Interior nodes and pages are
+   only inserted (under pages_lock) and are not removed until the node is
+   deallocated, so lookups may walk the index without taking any lock. */
+#define PAGECACHE_INDEX_ORDER   6
+
+typedef struct pagecache_index_node {
+    int shift;                  /* page offset bits below this level */
+    void *slots[U64_FROM_BIT(PAGECACHE_INDEX_ORDER)];
+} *pagecache_index_node;
+
 typedef struct pagecache_node {
     struct list l;              /* volume-wide node list */
     pagecache_volume pv;
@@ -69,7 +104,8 @@ typedef struct pagecache_node {
 #ifdef KERNEL
     struct spinlock pages_lock;
 #endif
-    struct rbtree pages;
+    struct rbtree pages;        /* ordered traversal, under pages_lock */
+    pagecache_index_node index; /* lockless lookup */
     rangemap shared_maps;       /* shared mappings associated with this node */
     u64 length;
 
@@ -109,7 +145,10 @@ struct pagecache_page {
     u64 state_offset;           /* 40 - state and offset in pages */
     void *kvirt;                /* 48 */
     int write_count;            /* 56 */
-    int pad0;                   /* 60 */
+    u8 shard;                   /* 60 */
+    u8 referenced;              /* 61 - hit since last list scan */
+    u8 evicted_active;          /* 62 - free page was evicted from active list */
+    u8 activate;                /* 63 - refaulted page goes to active list once read */
     /* end of first cacheline */
 
     pagecache_node node;
@@ -119,6 +158,7 @@ struct pagecache_page {
 
     closure_struct(pagecache_page_free, free);
     boolean evicted;
+    u64 evict_seq;              /* shard eviction count when last freed */
 };
 
 static inline void pagecache_release_page(pagecache_page pp)
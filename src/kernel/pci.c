@@ -162,12 +162,14 @@ u64 pci_msix_table_slot_addr(pci_dev dev, int msi_slot)
     return pci_msix_table_addr(dev) + (msi_slot * sizeof(u32) * 4);
 }
 
-u64 pci_setup_msix(pci_dev dev, int msi_slot, thunk h, const char *name)
+/* The interrupt is delivered to target_cpu where the platform supports
+   steering MSIs, and to the boot cpu otherwise. */
+u64 pci_setup_msix_cpu(pci_dev dev, int msi_slot, thunk h, const char *name, u32 target_cpu)
 {
-    pci_debug("%s: msi %d: %s\n", __func__, msi_slot, name);
+    pci_debug("%s: msi %d: %s, cpu %d\n", __func__, msi_slot, name, target_cpu);
 
     u32 address, data;
-    u64 vector = pci_platform_allocate_msi(dev, h, name, &address, &data);
+    u64 vector = pci_platform_allocate_msi(dev, h, name, target_cpu, &address, &data);
     if (vector == INVALID_PHYSICAL)
         return vector;
 
@@ -20,9 +20,6 @@ BSS_RO_AFTER_INIT static int wakeup_vector;
 BSS_RO_AFTER_INIT int shutdown_vector;
 boolean shutting_down;
 
-BSS_RO_AFTER_INIT queue bhqueue;                  /* kernel from interrupt */
-BSS_RO_AFTER_INIT queue runqueue;
-BSS_RO_AFTER_INIT queue async_queue_1;            /* queue of async 1 arg completions */
 BSS_RO_AFTER_INIT bitmap idle_cpu_mask;
 
 BSS_RO_AFTER_INIT timerqueue kernel_timers;
@@ -34,6 +31,7 @@ NOTRACE void __attribute__((noreturn)) kernel_sleep(void)
     // handler...we shouldn't return here if we do get interrupted
     cpuinfo ci = current_cpu();
     sched_debug("sleep\n");
+    page_invalidate_idle();
     ci->state = cpu_idle;
     bitmap_set_atomic(idle_cpu_mask, ci->id, 1);
 
@@ -61,23 +59,175 @@ static void wakeup_cpu(u64 cpu)
     }
 }
 
-static thunk migrate_to_self(thunk t, u64 first_cpu, u64 ncpus)
+static inline boolean task_cpu_allowed(sched_task st, u64 cpu)
+{
+    return !st->affinity || bitmap_get(st->affinity, cpu);
+}
+
+#define NICE_0_WEIGHT   1024
+
+/* Weights for nice levels -20 to 19, each step being roughly a 10% change in
+   cpu share relative to a task at an adjacent level (as in Linux). */
+static const u32 sched_nice_to_weight[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+
+void init_sched_task(sched_task st, thunk t, bitmap affinity)
+{
+    zero(st, sizeof(*st));
+    st->t = t;
+    st->affinity = affinity;
+    st->class = SCHED_CLASS_FAIR;
+    st->weight = NICE_0_WEIGHT;
+}
+
+/* A task that is exiting must not be charged after it is freed. This is
+   called on the cpu running the task, the only one that may refer to it. */
+void sched_task_exit(sched_task st)
+{
+    cpuinfo ci = current_cpu();
+    if (ci->current_task == st)
+        ci->current_task = 0;
+}
+
+/* The higher priority task is at the top of each heap; ties go to the task
+   that was queued first. */
+static boolean rt_task_compare(void *a, void *b)
+{
+    sched_task x = a, y = b;
+    return x->queued_prio < y->queued_prio ||
+        (x->queued_prio == y->queued_prio && (s64)(x->seq - y->seq) > 0);
+}
+
+static boolean fair_task_compare(void *a, void *b)
+{
+    sched_task x = a, y = b;
+    return x->vruntime > y->vruntime ||
+        (x->vruntime == y->vruntime && (s64)(x->seq - y->seq) > 0);
+}
+
+void init_sched_runq(sched_runq rq, heap h)
+{
+    spin_lock_init(&rq->lock);
+    rq->rt = allocate_pqueue(h, rt_task_compare);
+    rq->fair = allocate_pqueue(h, fair_task_compare);
+    rq->nr_running = 0;
+    rq->fair_weight = 0;
+    rq->min_vruntime = 0;
+    rq->seq = 0;
+    rq->head_seq = 0;
+}
+
+static inline boolean runq_empty(sched_runq rq)
+{
+    return rq->nr_running == 0;
+}
+
+/* Account run time to a task that has stopped running. This may happen after
+   the task has been queued again, so the charge is applied on the next
+   enqueue. */
+static inline void sched_charge(cpuinfo ci)
+{
+    sched_task st = ci->current_task;
+    if (!st)
+        return;
+    ci->current_task = 0;
+    fetch_and_add(&st->pending_runtime, now(CLOCK_ID_MONOTONIC_RAW) - st->exec_start);
+}
+
+/* A task queued at the head runs before others of equal priority. */
+static void runq_enqueue_locked(sched_runq rq, sched_task st, boolean head)
+{
+    u64 runtime = atomic_swap_64(&st->pending_runtime, 0);
+    st->queued_class = st->class;
+    st->queued_prio = st->rt_priority;
+    st->seq = head ? --rq->head_seq : rq->seq++;
+    if (st->queued_class == SCHED_CLASS_RT) {
+        pqueue_insert(rq->rt, st);
+    } else {
+        st->weight = sched_nice_to_weight[st->nice - SCHED_NICE_MIN];
+        st->vruntime += (runtime * NICE_0_WEIGHT) / st->weight + rq->min_vruntime;
+        rq->fair_weight += st->weight;
+        pqueue_insert(rq->fair, st);
+    }
+    rq->nr_running++;
+}
+
+/* Remove the highest priority task if it may run on cpu (or on any cpu, if
+   cpu is INVALID_PHYSICAL). */
+static sched_task runq_dequeue_locked(sched_runq rq, u64 cpu)
+{
+    pqueue q = rq->rt;
+    sched_task st = pqueue_peek(q);
+    if (st == INVALID_ADDRESS) {
+        q = rq->fair;
+        st = pqueue_peek(q);
+    }
+    if ((st == INVALID_ADDRESS) ||
+        ((cpu != INVALID_PHYSICAL) && !task_cpu_allowed(st, cpu)))
+        return INVALID_ADDRESS;
+    pqueue_pop(q);
+    rq->nr_running--;
+    if (q == rq->fair) {
+        rq->fair_weight -= st->weight;
+        if (st->vruntime > rq->min_vruntime)
+            rq->min_vruntime = st->vruntime;
+        st->vruntime -= rq->min_vruntime;
+    }
+    return st;
+}
+
+static sched_task runq_dequeue(sched_runq rq, u64 cpu)
+{
+    u64 flags = spin_lock_irq(&rq->lock);
+    sched_task st = runq_dequeue_locked(rq, cpu);
+    spin_unlock_irq(&rq->lock, flags);
+    return st;
+}
+
+static void runq_enqueue(sched_runq rq, sched_task st, boolean head)
+{
+    u64 flags = spin_lock_irq(&rq->lock);
+    runq_enqueue_locked(rq, st, head);
+    spin_unlock_irq(&rq->lock, flags);
+}
+
+/* Take a task from the thread queue of cpui that may run on cpu. */
+static sched_task steal_task(cpuinfo cpui, u64 cpu)
+{
+    if (runq_empty(&cpui->thread_queue))
+        return INVALID_ADDRESS;
+    return runq_dequeue(&cpui->thread_queue, cpu);
+}
+
+static sched_task migrate_to_self(cpuinfo ci, sched_task st, u64 first_cpu, u64 ncpus)
 {
     u64 cpu;
     while ((ncpus > 0) &&
             ((cpu = bitmap_range_get_first(idle_cpu_mask, first_cpu, ncpus)) != INVALID_PHYSICAL)) {
         cpuinfo cpui = cpuinfo_from_id(cpu);
-        if (t == INVALID_ADDRESS) {
-            t = dequeue(cpui->thread_queue);
-            if (t != INVALID_ADDRESS)
+        boolean pinned = false;
+        if (st == INVALID_ADDRESS) {
+            st = steal_task(cpui, ci->id);
+            if (st != INVALID_ADDRESS)
                 sched_debug("migrating thread from idle CPU %d to self\n", cpu);
+            else
+                pinned = !runq_empty(&cpui->thread_queue);
         }
-        if ((t != INVALID_ADDRESS) && !queue_empty(cpui->thread_queue))
+        /* wake the cpu if it has work that can't (or needn't) move here */
+        if ((st != INVALID_ADDRESS || pinned) && !runq_empty(&cpui->thread_queue))
             wakeup_cpu(cpu);
         ncpus -= cpu - first_cpu + 1;
         first_cpu = cpu + 1;
     }
-    return t;
+    return st;
 }
 
 static void migrate_from_self(cpuinfo ci, u64 first_cpu, u64 ncpus)
@@ -86,12 +236,12 @@ static void migrate_from_self(cpuinfo ci, u64 first_cpu, u64 ncpus)
     while ((ncpus > 0) &&
             ((cpu = bitmap_range_get_first(idle_cpu_mask, first_cpu, ncpus)) != INVALID_PHYSICAL)) {
         cpuinfo cpui = cpuinfo_from_id(cpu);
-        thunk t;
-        if (!queue_empty(cpui->thread_queue)) {
+        sched_task st;
+        if (!runq_empty(&cpui->thread_queue)) {
             wakeup_cpu(cpu);
-        } else if ((t = dequeue(ci->thread_queue)) != INVALID_ADDRESS) {
+        } else if ((st = steal_task(ci, cpu)) != INVALID_ADDRESS) {
             sched_debug("migrating thread from self to idle CPU %d\n", cpu);
-            enqueue(cpui->thread_queue, t);
+            runq_enqueue(&cpui->thread_queue, st, false);
             wakeup_cpu(cpu);
         }
         ncpus -= cpu - first_cpu + 1;
@@ -99,6 +249,101 @@ static void migrate_from_self(cpuinfo ci, u64 first_cpu, u64 ncpus)
     }
 }
 
+/* Returns true if st should preempt the task running on ci. */
+static boolean sched_should_preempt(cpuinfo ci, sched_task st)
+{
+    /* The running task may exit at any time, so only the class and priority
+       recorded at dispatch are consulted. */
+    if (!ci->current_task || ci->state != cpu_user)
+        return false;
+    if (st->class == SCHED_CLASS_RT)
+        return ci->current_class != SCHED_CLASS_RT || ci->current_prio < st->rt_priority;
+
+    /* A fair task that was running alone may have been given a long slice;
+       cut it short so that the new arrival runs within the latency period. */
+    return ci->current_class == SCHED_CLASS_FAIR &&
+        (s64)(ci->last_timer_update - now(CLOCK_ID_MONOTONIC_RAW)) >
+        (s64)microseconds(SCHED_LATENCY_US);
+}
+
+/* Queue a runnable task on the thread queue of ci. If the task's affinity
+   excludes ci, an allowed cpu is chosen instead, preferring an idle one and
+   then the one with the fewest runnable tasks. A realtime task interrupts a
+   lower priority task running on the chosen cpu. Returns the cpu used. */
+cpuinfo schedule_task(sched_task st, cpuinfo ci)
+{
+    cpuinfo self = current_cpu();
+    boolean head = false;
+    if (self->current_task == st) {
+        /* A SCHED_FIFO task that is preempted, rather than yielding, keeps its
+           place ahead of tasks of equal priority; it is not time-sliced. */
+        head = st->class == SCHED_CLASS_RT && st->rt_fifo && !st->yielded;
+        sched_charge(self);
+    }
+    st->yielded = false;
+    if (!task_cpu_allowed(st, ci->id)) {
+        cpuinfo target = 0;
+        for (u64 cpu = 0; cpu < total_processors; cpu++) {
+            if (!task_cpu_allowed(st, cpu))
+                continue;
+            cpuinfo cpui = cpuinfo_from_id(cpu);
+            if (bitmap_get(idle_cpu_mask, cpu)) {
+                target = cpui;
+                break;
+            }
+            if (!target || cpui->thread_queue.nr_running < target->thread_queue.nr_running)
+                target = cpui;
+        }
+        if (target) {
+            sched_debug("task %p not allowed on CPU %d, moving to CPU %d\n", st, ci->id, target->id);
+            ci = target;
+        }
+    }
+    runq_enqueue(&ci->thread_queue, st, head);
+    if (ci != self) {
+        if (sched_should_preempt(ci, st))
+            send_ipi(ci->id, wakeup_vector);
+        else
+            wakeup_cpu(ci->id);
+    }
+    return ci;
+}
+
+/* Take the next task to run from the thread queue of ci. The affinity of a
+   queued task may be changed to exclude ci; such a task would block the
+   tasks behind it, so it is moved to a cpu it may run on. */
+static sched_task runq_dequeue_local(cpuinfo ci)
+{
+    sched_runq rq = &ci->thread_queue;
+    while (true) {
+        u64 flags = spin_lock_irq(&rq->lock);
+        sched_task st = runq_dequeue_locked(rq, ci->id);
+        sched_task moved = INVALID_ADDRESS;
+        if (st == INVALID_ADDRESS && !runq_empty(rq))
+            moved = runq_dequeue_locked(rq, INVALID_PHYSICAL);
+        spin_unlock_irq(&rq->lock, flags);
+        if (moved == INVALID_ADDRESS)
+            return st;
+        sched_debug("task %p no longer allowed here, requeueing\n", moved);
+        if (schedule_task(moved, ci) == ci)
+            return INVALID_ADDRESS;     /* allowed here again; taken on the next pass */
+    }
+}
+
+/* Time slice for a task about to run on ci: realtime tasks and tasks
+   running alone are bounded only by the runloop timer maximum, while fair
+   tasks competing with others get a share of the scheduling latency
+   proportional to their weight. */
+static timestamp sched_slice(cpuinfo ci, sched_task st)
+{
+    sched_runq rq = &ci->thread_queue;
+    if (st->queued_class == SCHED_CLASS_RT || rq->fair_weight == 0)
+        return kernel_timers->max;
+    timestamp slice = microseconds(SCHED_LATENCY_US) * st->weight /
+        (rq->fair_weight + st->weight);
+    return MIN(MAX(slice, microseconds(SCHED_MIN_GRANULARITY_US)), kernel_timers->max);
+}
+
 static inline boolean update_timer(void)
 {
     timestamp next = kernel_timers->next_expiry;
@@ -124,31 +369,138 @@ closure_function(0, 0, void, timer_interrupt_handler_fn)
     schedule_timer_service();
 }
 
+static inline void run_thunk(thunk t)
+{
+    context c = context_from_closure(t);
+    sched_debug(" run: %F state: %s context: %p\n", t, state_strings[current_cpu()->state], c);
+    if (c)
+        context_apply(c, t);
+    else
+        apply(t);
+}
+
+static inline void run_async_1(applied_async_1 aa)
+{
+    sched_debug(" run: %F arg0: 0x%lx\n", aa->a, aa->arg0);
+    context c = context_from_closure(aa->a);
+    if (c)
+        context_apply_1(c, aa->a, aa->arg0);
+    else
+        apply(aa->a, aa->arg0);
+}
+
 static inline void service_thunk_queue(queue q)
 {
     thunk t;
-    context c;
-    while ((t = dequeue(q)) != INVALID_ADDRESS) {
-        c = context_from_closure(t);
-        sched_debug(" run: %F state: %s context: %p\n", t, state_strings[current_cpu()->state], c);
-        if (c)
-            context_apply(c, t);
-        else
-            apply(t);
+    while ((t = dequeue(q)) != INVALID_ADDRESS)
+        run_thunk(t);
+}
+
+/* A drain may span several trips through the runloop, as items applied in a
+   context don't return here, so the start time is kept in the sched_queue
+   until the queue is found empty. */
+static inline void sched_queue_drain_start(sched_queue sq)
+{
+    u64 depth = queue_length(sq->q);
+    if (depth > sq->max_depth)
+        sq->max_depth = depth;
+    if (!sq->drain_start)
+        sq->drain_start = now(CLOCK_ID_MONOTONIC_RAW);
+}
+
+static inline void sched_queue_drain_finish(sched_queue sq)
+{
+    timestamp t = now(CLOCK_ID_MONOTONIC_RAW) - sq->drain_start;
+    sq->service_time += t;
+    if (t > sq->max_service_time)
+        sq->max_service_time = t;
+    sq->drain_start = 0;
+}
+
+static inline void service_sched_queue(sched_queue sq)
+{
+    thunk t;
+    if (queue_empty(sq->q))
+        return;
+    sched_queue_drain_start(sq);
+    while ((t = dequeue(sq->q)) != INVALID_ADDRESS) {
+        sq->serviced++;
+        run_thunk(t);
     }
+    sched_queue_drain_finish(sq);
 }
 
-static inline void service_async_1(queue q)
+static inline void service_async_1(sched_queue sq)
 {
     struct applied_async_1 aa;
-    while (dequeue_n_irqsafe(q, (void **)&aa, sizeof(aa) / sizeof(u64))) {
-        sched_debug(" run: %F arg0: 0x%lx\n", aa.a, aa.arg0);
-        context c = context_from_closure(aa.a);
-        if (c)
-            context_apply_1(c, aa.a, aa.arg0);
-        else
-            apply(aa.a, aa.arg0);
+    if (queue_empty(sq->q))
+        return;
+    sched_queue_drain_start(sq);
+    while (dequeue_n_irqsafe(sq->q, (void **)&aa, sizeof(aa) / sizeof(u64))) {
+        sq->serviced++;
+        run_async_1(&aa);
     }
+    sched_queue_drain_finish(sq);
+}
+
+/* Bounds on work stealing from the runloop: a pass looks at no more than
+   STEAL_SCAN_CPUS other cpus, starting where the previous pass left off. A
+   cpu with no threads to run takes any pending item; one with threads of its
+   own only takes work from a cpu whose queues hold at least
+   STEAL_BACKLOG_MIN items, as a smaller backlog will be serviced soon enough
+   by its owner. */
+#define STEAL_SCAN_CPUS     4
+#define STEAL_BACKLOG_MIN   2
+
+static inline u64 kernel_backlog(cpuinfo cpui)
+{
+    return queue_length(cpui->bh_queue.q) + queue_length(cpui->async_queue.q) +
+        queue_length(cpui->run_queue.q);
+}
+
+/* Called when this cpu has no local deferred work: take a single item from
+   a cpu with a backlog, looking at bottom halves first, then completions and
+   general runqueue work. The item may not return here. */
+static boolean steal_kernel_work(cpuinfo ci)
+{
+    if (total_processors < 2)
+        return false;
+    u64 cpu = ci->steal_victim;
+    u64 scan = MIN(total_processors - 1, STEAL_SCAN_CPUS);
+    u64 min_backlog = runq_empty(&ci->thread_queue) ? 1 : STEAL_BACKLOG_MIN;
+    for (u64 i = 0; i < scan; i++, cpu++) {
+        if (cpu >= total_processors)
+            cpu = 0;
+        if (cpu == ci->id && ++cpu >= total_processors)
+            cpu = 0;
+        cpuinfo cpui = cpuinfo_from_id(cpu);
+        if (kernel_backlog(cpui) < min_backlog)
+            continue;
+        /* keep draining this victim while its backlog lasts */
+        ci->steal_victim = cpu;
+        thunk t;
+        if ((t = dequeue(cpui->bh_queue.q)) != INVALID_ADDRESS) {
+            sched_debug("stole bh from CPU %d\n", cpu);
+            ci->bh_queue.stolen++;
+            run_thunk(t);
+            return true;
+        }
+        struct applied_async_1 aa;
+        if (dequeue_n(cpui->async_queue.q, (void **)&aa, sizeof(aa) / sizeof(u64))) {
+            sched_debug("stole async completion from CPU %d\n", cpu);
+            ci->async_queue.stolen++;
+            run_async_1(&aa);
+            return true;
+        }
+        if ((t = dequeue(cpui->run_queue.q)) != INVALID_ADDRESS) {
+            sched_debug("stole runqueue item from CPU %d\n", cpu);
+            ci->run_queue.stolen++;
+            run_thunk(t);
+            return true;
+        }
+    }
+    ci->steal_victim = cpu;
+    return false;
 }
 
 NOTRACE void __attribute__((noreturn)) runloop_internal(void)
@@ -158,10 +510,12 @@ NOTRACE void __attribute__((noreturn)) runloop_internal(void)
     disable_interrupts();
     sched_debug("runloop from %s c: %d  a1: %d\n"
                 "    b:%d  r:%d  t:%d\n", state_strings[ci->state],
-                queue_length(ci->cpu_queue), queue_length(async_queue_1),
-                queue_length(bhqueue), queue_length(runqueue),
-                queue_length(ci->thread_queue));
+                queue_length(ci->cpu_queue), queue_length(ci->async_queue.q),
+                queue_length(ci->bh_queue.q), queue_length(ci->run_queue.q),
+                ci->thread_queue.nr_running);
     ci->state = cpu_kernel;
+    /* whatever ran last on this cpu has stopped */
+    sched_charge(ci);
     /* Make sure TLB entries are appropriately flushed before doing any work */
     page_invalidate_flush();
 
@@ -170,29 +524,33 @@ NOTRACE void __attribute__((noreturn)) runloop_internal(void)
     service_thunk_queue(ci->cpu_queue);
 
     /* bhqueue is for deferred operations, enqueued by interrupt handlers */
-    service_thunk_queue(bhqueue);
+    service_sched_queue(&ci->bh_queue);
 
     /* serve deferred status_handlers, some of which may not return */
-    service_async_1(async_queue_1);
+    service_async_1(&ci->async_queue);
+
+    service_sched_queue(&ci->run_queue);
 
-    service_thunk_queue(runqueue);
+    /* local deferred work is done; help out cpus that have a backlog */
+    if (steal_kernel_work(ci))
+        goto retry;
 
     /* should be a list of per-runloop checks - also low-pri background */
     mm_service();
 
-    boolean timer_updated = update_timer();
+    update_timer();
 
     if (!shutting_down) {
-        thunk t = dequeue(ci->thread_queue);
-        if (t == INVALID_ADDRESS) {
+        sched_task st = runq_dequeue_local(ci);
+        if (st == INVALID_ADDRESS) {
             /* Try to steal a thread from an idle CPU (so that it doesn't
              * have to be woken up), and wake up CPUs that have a non-empty
              * thread queue). */
             if (ci->id + 1 < total_processors)
-                t = migrate_to_self(t, ci->id + 1, total_processors - ci->id - 1);
+                st = migrate_to_self(ci, st, ci->id + 1, total_processors - ci->id - 1);
             if (ci->id > 0)
-                t = migrate_to_self(t, 0, ci->id);
-            if (t == INVALID_ADDRESS) {
+                st = migrate_to_self(ci, st, 0, ci->id);
+            if (st == INVALID_ADDRESS) {
                 /* No threads found in idle CPUs: try to steal a thread from a
                  * CPU that is currently running another thread. */
                 for (u64 cpu = ci->id + 1; ; cpu++) {
@@ -202,8 +560,8 @@ NOTRACE void __attribute__((noreturn)) runloop_internal(void)
                         break;
                     cpuinfo cpui = cpuinfo_from_id(cpu);
                     if (cpui->state == cpu_user) {
-                        t = dequeue(cpui->thread_queue);
-                        if (t != INVALID_ADDRESS) {
+                        st = steal_task(cpui, ci->id);
+                        if (st != INVALID_ADDRESS) {
                             sched_debug("migrating thread from CPU %d to self\n", cpu);
                             break;
                         }
@@ -218,22 +576,25 @@ NOTRACE void __attribute__((noreturn)) runloop_internal(void)
             if (ci->id > 0)
                 migrate_from_self(ci, 0, ci->id);
         }
-        if (t != INVALID_ADDRESS) {
-            if (!timer_updated) {
-                /* Before we schedule a thread on this CPU, we want to be sure
-                   that a timer will fire on this core within the interval
-                   kernel_timers->max into the future. Taking the place of a
-                   true time quantum per thread, this acts to prevent a thread
-                   from running for too long and starving out other threads. */
-                timestamp here = now(CLOCK_ID_MONOTONIC_RAW);
-                s64 timeout = ci->last_timer_update - here;
-                if ((timeout < 0) || (timeout > kernel_timers->max)) {
-                    sched_debug("setting CPU scheduler timer\n");
-                    set_platform_timer(kernel_timers->max);
-                    ci->last_timer_update = here + kernel_timers->max;
-                }
+        if (st != INVALID_ADDRESS) {
+            /* Before we schedule a thread on this CPU, we want to be sure
+               that a timer will fire on this core within the thread's time
+               slice, so that it can't run for too long and starve out other
+               threads. A timer set by update_timer() may already be due
+               sooner. */
+            timestamp here = now(CLOCK_ID_MONOTONIC_RAW);
+            timestamp slice = sched_slice(ci, st);
+            s64 timeout = ci->last_timer_update - here;
+            if ((timeout < 0) || (timeout > slice)) {
+                sched_debug("setting CPU scheduler timer\n");
+                set_platform_timer(slice);
+                ci->last_timer_update = here + slice;
             }
-            apply(t);
+            st->exec_start = here;
+            ci->current_class = st->queued_class;
+            ci->current_prio = st->queued_prio;
+            ci->current_task = st;
+            apply(st->t);
         }
     }
 
@@ -241,9 +602,9 @@ NOTRACE void __attribute__((noreturn)) runloop_internal(void)
        runnable items may get stuck waiting for the next interrupt.
 
        Find cost of sleep / wakeup and consider spinning this check for that interval. */
-    if (queue_length(ci->cpu_queue) || queue_length(async_queue_1) ||
-        queue_length(bhqueue) || queue_length(runqueue) ||
-        (!shutting_down && queue_length(ci->thread_queue)))
+    if (queue_length(ci->cpu_queue) || queue_length(ci->async_queue.q) ||
+        queue_length(ci->bh_queue.q) || queue_length(ci->run_queue.q) ||
+        (!shutting_down && !runq_empty(&ci->thread_queue)))
         goto retry;
 
     kernel_sleep();
@@ -277,17 +638,71 @@ void init_scheduler(heap h)
     register_interrupt(shutdown_vector, closure(h, global_shutdown), "shutdown ipi");
     assert(wakeup_vector != INVALID_PHYSICAL);
 
-    /* scheduling queues init */
-    // XXX configs
-    bhqueue = allocate_queue(h, 2048);
-    runqueue = allocate_queue(h, 2048);
-    async_queue_1 = allocate_queue(h, 8192);
     shutting_down = false;
 }
 
+static void init_sched_queue(sched_queue sq, heap h, u64 size)
+{
+    sq->q = allocate_queue(h, size);
+    assert(sq->q != INVALID_ADDRESS);
+}
+
+void init_sched_queues(cpuinfo ci, heap h)
+{
+    init_sched_queue(&ci->bh_queue, h, BH_QUEUE_SIZE);
+    init_sched_queue(&ci->run_queue, h, RUN_QUEUE_SIZE);
+    init_sched_queue(&ci->async_queue, h, ASYNC_QUEUE_1_SIZE);
+}
+
 void init_scheduler_cpus(heap h)
 {
     idle_cpu_mask = allocate_bitmap(h, h, present_processors);
     assert(idle_cpu_mask != INVALID_ADDRESS);
     bitmap_alloc(idle_cpu_mask, present_processors);
 }
+
+closure_function(2, 0, value, sched_get_stat,
+                 u64 *, p, value, v)
+{
+    return value_rewrite_u64(bound(v), *bound(p));
+}
+
+#define register_sched_stat(sq, n, t, name)                             \
+    v = value_from_u64(h, 0);                                           \
+    s = sym(name);                                                      \
+    set(t, s, v);                                                       \
+    tuple_notifier_register_get_notify(n, s, closure(h, sched_get_stat, &(sq)->name, v));
+
+static value sched_queue_management(heap h, sched_queue sq)
+{
+    value v;
+    symbol s;
+    tuple t = allocate_tuple();
+    assert(t != INVALID_ADDRESS);
+    tuple_notifier n = tuple_notifier_wrap(t);
+    assert(n != INVALID_ADDRESS);
+    register_sched_stat(sq, n, t, serviced);
+    register_sched_stat(sq, n, t, stolen);
+    register_sched_stat(sq, n, t, max_depth);
+    register_sched_stat(sq, n, t, service_time);
+    register_sched_stat(sq, n, t, max_service_time);
+    return n;
+}
+
+void init_scheduler_management(tuple root)
+{
+    heap h = heap_locked(get_kernel_heaps());
+    tuple sched = allocate_tuple();
+    assert(sched != INVALID_ADDRESS);
+    for (u64 cpu = 0; cpu < total_processors; cpu++) {
+        cpuinfo ci = cpuinfo_from_id(cpu);
+        tuple t = allocate_tuple();
+        assert(t != INVALID_ADDRESS);
+        set(t, sym(bh), sched_queue_management(h, &ci->bh_queue));
+        set(t, sym(async), sched_queue_management(h, &ci->async_queue));
+        set(t, sym(run), sched_queue_management(h, &ci->run_queue));
+        set(sched, intern_u64(cpu), t);
+    }
+    set(sched, sym(no_encode), null_value);
+    set(root, sym(sched), sched);
+}
@@ -9,8 +9,8 @@
 #include <symtab.h>
 #include <virtio/virtio.h>
 
-closure_function(2, 1, void, program_start,
-                 buffer, elf, process, kp,
+closure_function(3, 1, void, program_start,
+                 buffer, elf, fsfile, f, process, kp,
                  status, s)
 {
     if (!is_ok(s))
@@ -27,7 +27,7 @@ closure_function(2, 1, void, program_start,
                      &bss_ro_after_init_end - &bss_ro_after_init_start,
                      pageflags_memory());
 
-    exec_elf(bound(elf), bound(kp));
+    exec_elf(bound(elf), bound(f), bound(kp));
     closure_finish();
 }
 
@@ -145,6 +145,9 @@ closure_function(6, 0, void, startup,
     /* register root tuple with management and kick off interfaces, if any */
     init_management_root(root);
     init_kernel_heaps_management(root);
+    init_scheduler_management(root);
+    init_pagecache_management(root);
+    init_filesystem_management(fs, root);
 #if 0
     http_listener hl = allocate_http_listener(general, 9090);
     assert(hl != INVALID_ADDRESS);
@@ -163,14 +166,18 @@ closure_function(6, 0, void, startup,
     if (get(root, sym(exec_protection)))
         set(pro, sym(exec), null_value);  /* set executable flag */
     init_network_iface(root);
-    filesystem_read_entire(fs, pro, (heap)heap_page_backed(kh), pg, closure(general, read_program_fail));
+    fsfile f = fsfile_from_node(fs, pro);
+    if (!f || f == INVALID_ADDRESS)
+        halt("unable to open program %b\n", p);
+    closure_member(program_start, start, f) = f;
+    exec_read_headers(f, general, pg, closure(general, read_program_fail));
     closure_finish();
 }
 
 thunk create_init(kernel_heaps kh, tuple root, filesystem fs, merge *m)
 {
     heap h = heap_locked(kh);
-    status_handler start = closure(h, program_start, 0, 0);
+    status_handler start = closure(h, program_start, 0, 0, 0);
     *m = allocate_merge(h, start);
     return closure(h, startup, kh, root, fs, *m, start, apply_merge(*m));
 }
@@ -187,9 +187,11 @@ define_closure_function(2, 1, void, storage_simple_req_handler,
         storage_io_sg(bound(read), req->data, req->blocks, req->completion);
         break;
     case STORAGE_OP_WRITESG:
+    case STORAGE_OP_ZERO:
         storage_io_sg(bound(write), req->data, req->blocks, req->completion);
         break;
     case STORAGE_OP_FLUSH:
+    case STORAGE_OP_DISCARD:
         apply(req->completion, STATUS_OK);
         break;
     case STORAGE_OP_READ:
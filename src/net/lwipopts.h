@@ -56,6 +56,7 @@
 #define TCP_SND_BUF 65535
 #define TCP_SND_QUEUELEN TCP_SNDQUEUELEN_OVERFLOW
 #define TCP_OVERSIZE TCP_MSS
+#define LWIP_TCP_PCB_NUM_EXT_ARGS 1     /* zero-copy transmit state */
 #define TCP_QUEUE_OOSEQ 1
 
 #define TCP_RCV_SCALE 0         /* XXX check */
@@ -39,13 +39,30 @@ enum protocol_type {
 #define MSG_OOB         0x00000001
 #define MSG_PEEK        0x00000002
 #define MSG_DONTROUTE   0x00000004
+#define MSG_CTRUNC      0x00000008
 #define MSG_PROBE       0x00000010
 #define MSG_TRUNC       0x00000020
 #define MSG_DONTWAIT    0x00000040
 #define MSG_EOR         0x00000080
 #define MSG_CONFIRM     0x00000800
+#define MSG_ERRQUEUE    0x00002000
 #define MSG_NOSIGNAL    0x00004000
 #define MSG_MORE        0x00008000
+#define MSG_ZEROCOPY    0x04000000
+
+/* error queue entries (MSG_ERRQUEUE) */
+struct sock_extended_err {
+    u32 ee_errno;
+    u8 ee_origin;
+    u8 ee_type;
+    u8 ee_code;
+    u8 ee_pad;
+    u32 ee_info;
+    u32 ee_data;
+};
+
+#define SO_EE_ORIGIN_ZEROCOPY       5
+#define SO_EE_CODE_ZEROCOPY_COPIED  1
 
 // tuplify
 #define SOCK_NONBLOCK 00004000
@@ -95,17 +95,23 @@ enum udp_socket_state {
     UDP_SOCK_CREATED = 1,
 };
 
+typedef struct tcp_zc *tcp_zc;
+
 typedef struct netsock {
     struct sock sock;             /* must be first */
     process p;
     queue incoming;
     err_t lwip_error;             /* lwIP error code; ERR_OK if normal */
     u8 ipv6only:1;
+    u8 zerocopy:1;                /* SO_ZEROCOPY */
+    u32 zc_next_id;               /* id of the next MSG_ZEROCOPY send */
+    struct list zc_notify;        /* error queue of MSG_ZEROCOPY completions */
     union {
 	struct {
 	    struct tcp_pcb *lw;
 	    tcpflags_t flags;
 	    enum tcp_socket_state state; // half open?
+	    tcp_zc zc;            /* zero-copy transmit state, owned by the pcb */
 	} tcp;
 	struct {
 	    struct udp_pcb *lw;
@@ -137,6 +143,7 @@ static sysreturn netsock_recvmsg(struct sock *sock, struct msghdr *msg,
 
 BSS_RO_AFTER_INIT static thunk net_loop_poll;
 static boolean net_loop_poll_queued;
+BSS_RO_AFTER_INIT static u8 tcp_zc_id;    /* lwIP pcb extension argument */
 
 closure_function(0, 0, void, netsock_poll) {
     /* taking the lock here can block, so clear the flag after acquiring */
@@ -197,6 +204,8 @@ closure_function(1, 1, u32, socket_events,
         assert(s->sock.type == SOCK_DGRAM);
         rv = (in ? EPOLLIN | EPOLLRDNORM : 0) | EPOLLOUT | EPOLLWRNORM;
     }
+    if (!list_empty(&s->zc_notify))
+        rv |= EPOLLERR;
     return rv;
 }
 
@@ -561,7 +570,210 @@ closure_function(1, 6, sysreturn, socket_read,
     return blockq_check(s->sock.rxbq, t, ba, bh);
 }
 
-static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
+/* Zero-copy transmit
+
+   Data passed to tcp_write() without TCP_WRITE_FLAG_COPY stays referenced
+   by lwIP segments until it is acknowledged. Each such write is recorded
+   with the sequence number following its last byte, and completed once
+   lastack moves past it: the reference held on the source buffer (e.g. a
+   pagecache page) is released and, for the last write of a MSG_ZEROCOPY
+   send, a completion is queued on the socket error queue. The state is
+   attached to the pcb as an extension argument, rather than to the socket,
+   so that writes still in flight when the socket is closed are completed
+   when lwIP frees the pcb. */
+
+#define tcp_seq_leq(a, b)   ((s32)((a) - (b)) <= 0)
+
+typedef struct tcp_zc {
+    heap h;
+    netsock s;                  /* cleared on socket close */
+    struct list pending;        /* zc_write, in sequence order */
+} *tcp_zc;
+
+typedef struct zc_write {
+    struct list l;
+    u32 end;                    /* sequence number after the last byte */
+    u32 id;                     /* MSG_ZEROCOPY send id */
+    refcount ref;               /* source buffer reference, if any */
+    u8 notify;                  /* last write of a MSG_ZEROCOPY send */
+    u8 copied;                  /* some of the send had to be copied */
+} *zc_write;
+
+typedef struct zc_notification {
+    struct list l;
+    u32 lo, hi;                 /* range of completed send ids */
+    u8 copied;
+} *zc_notification;
+
+static void netsock_zc_notify(netsock s, u32 id, boolean copied)
+{
+    if (!list_empty(&s->zc_notify)) {
+        /* coalesce with consecutive completions, as Linux does */
+        zc_notification n = struct_from_list(s->zc_notify.prev, zc_notification, l);
+        if (n->hi + 1 == id && n->copied == copied) {
+            n->hi = id;
+            return;
+        }
+    }
+    zc_notification n = allocate(s->sock.h, sizeof(*n));
+    if (n == INVALID_ADDRESS) {
+        msg_err("failed to allocate zero-copy notification\n");
+        return;
+    }
+    n->lo = n->hi = id;
+    n->copied = copied;
+    list_push_back(&s->zc_notify, &n->l);
+    wakeup_sock(s, WAKEUP_SOCK_RX);
+}
+
+static void tcp_zc_complete(tcp_zc zc, zc_write w)
+{
+    list_delete(&w->l);
+    if (w->ref)
+        refcount_release(w->ref);
+    if (w->notify && zc->s)
+        netsock_zc_notify(zc->s, w->id, w->copied);
+    deallocate(zc->h, w, sizeof(*w));
+}
+
+static void tcp_zc_acked(tcp_zc zc, u32 lastack)
+{
+    list_foreach(&zc->pending, l) {
+        zc_write w = struct_from_list(l, zc_write, l);
+        if (!tcp_seq_leq(w->end, lastack))
+            break;
+        tcp_zc_complete(zc, w);
+    }
+}
+
+/* called by lwIP when the pcb is freed */
+static void tcp_zc_destroy(u8 id, void *data)
+{
+    tcp_zc zc = data;
+    list_foreach(&zc->pending, l)
+        tcp_zc_complete(zc, struct_from_list(l, zc_write, l));
+    if (zc->s)
+        zc->s->info.tcp.zc = 0;
+    deallocate(zc->h, zc, sizeof(*zc));
+}
+
+static const struct tcp_ext_arg_callbacks tcp_zc_callbacks = {
+    .destroy = tcp_zc_destroy,
+};
+
+static tcp_zc netsock_get_zc(netsock s)
+{
+    tcp_zc zc = s->info.tcp.zc;
+    if (zc)
+        return zc;
+    zc = allocate(s->sock.h, sizeof(*zc));
+    if (zc == INVALID_ADDRESS)
+        return 0;
+    zc->h = s->sock.h;
+    zc->s = s;
+    list_init(&zc->pending);
+    tcp_ext_arg_set_callbacks(s->info.tcp.lw, tcp_zc_id, &tcp_zc_callbacks);
+    tcp_ext_arg_set(s->info.tcp.lw, tcp_zc_id, zc);
+    s->info.tcp.zc = zc;
+    return zc;
+}
+
+/* the socket no longer refers to its pcb */
+static void netsock_detach_zc(netsock s)
+{
+    if (s->info.tcp.zc) {
+        s->info.tcp.zc->s = 0;
+        s->info.tcp.zc = 0;
+    }
+}
+
+static void netsock_free_zc_notify(netsock s)
+{
+    list_foreach(&s->zc_notify, l) {
+        list_delete(l);
+        deallocate(s->sock.h, struct_from_list(l, zc_notification, l),
+                   sizeof(struct zc_notification));
+    }
+}
+
+/* Queue n bytes from the head of an sg list, consuming them. Buffers
+   holding a reference are transmitted in place; others are copied. User
+   memory has no page references to hold until the data is acknowledged,
+   and may be unmapped or reclaimed (madvise) while a send is in flight, so
+   a MSG_ZEROCOPY send copies it and reports SO_EE_CODE_ZEROCOPY_COPIED in
+   its completion. Writes are split at page boundaries, as drivers map each
+   pbuf payload as a single physical range. */
+static err_t tcp_write_sg(netsock s, sg_list sg, u64 n, u8 apiflags, boolean zerocopy,
+                          u64 *written)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    tcp_zc zc = 0;
+    zc_write last = 0;
+    boolean copied = false;
+    err_t err = ERR_OK;
+    *written = 0;
+    while (*written < n) {
+        sg_buf sgb = sg_list_head_peek(sg);
+        assert(sgb != INVALID_ADDRESS);
+        void *p = sgb->buf + sgb->offset;
+        u64 len = MIN(MIN(sg_buf_len(sgb), n - *written),
+                      PAGESIZE - (u64_from_pointer(p) & PAGEMASK));
+        boolean inplace = sgb->refcount != 0;
+        u8 flags = apiflags | (inplace ? 0 : TCP_WRITE_FLAG_COPY) |
+            ((*written + len < n) ? TCP_WRITE_FLAG_MORE : 0);
+        zc_write w = 0;
+        if (inplace || zerocopy) {
+            if (!zc && !(zc = netsock_get_zc(s))) {
+                err = ERR_MEM;
+                break;
+            }
+            if (last && last->ref == sgb->refcount) {
+                w = last;       /* continuation of the same buffer */
+            } else {
+                w = allocate(zc->h, sizeof(*w));
+                if (w == INVALID_ADDRESS) {
+                    err = ERR_MEM;
+                    break;
+                }
+                w->ref = 0;
+                w->notify = w->copied = 0;
+            }
+        }
+        err = tcp_write(lw, p, len, flags);
+        if (err != ERR_OK) {
+            if (w && w != last)
+                deallocate(zc->h, w, sizeof(*w));
+            break;
+        }
+        if (w) {
+            w->end = lw->snd_lbb;
+            if (w != last) {
+                if (inplace && sgb->refcount) {
+                    w->ref = sgb->refcount;
+                    refcount_reserve(w->ref);
+                }
+                list_push_back(&zc->pending, &w->l);
+                last = w;
+            }
+        }
+        if (!inplace)
+            copied = true;
+        *written += len;
+        sgb->offset += len;
+        if (sgb->offset == sgb->size) {
+            sg_list_head_remove(sg);
+            sg_buf_release(sgb);
+        }
+    }
+    if (zerocopy && last) {
+        last->id = s->zc_next_id++;
+        last->notify = true;
+        last->copied = copied;
+    }
+    return *written > 0 ? ERR_OK : err;
+}
+
+static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf, sg_list sg,
                                               u64 remain, int flags, io_completion completion,
                                               u64 bqflags)
 {
@@ -569,8 +781,8 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
 
     sysreturn rv = 0;
     err_t err = get_lwip_error(s);
-    net_debug("fd %d, thread %ld, buf %p, remain %ld, flags 0x%x, bqflags 0x%lx, lwip err %d\n",
-              s->sock.fd, t->tid, buf, remain, flags, bqflags, err);
+    net_debug("fd %d, thread %ld, buf %p, sg %p, remain %ld, flags 0x%x, bqflags 0x%lx, lwip err %d\n",
+              s->sock.fd, t->tid, buf, sg, remain, flags, bqflags, err);
     assert(remain > 0);
 
     if (err != ERR_OK) {
@@ -613,7 +825,7 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
 
     /* Figure actual length and flags */
     u64 n;
-    u8 apiflags = TCP_WRITE_FLAG_COPY;
+    u8 apiflags = 0;
     if (avail < remain) {
         n = avail;
         apiflags |= TCP_WRITE_FLAG_MORE;
@@ -621,7 +833,11 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
         n = remain;
     }
 
-    err = tcp_write(s->info.tcp.lw, buf, n, apiflags);
+    if (sg) {
+        err = tcp_write_sg(s, sg, n, apiflags, (flags & MSG_ZEROCOPY) && s->zerocopy, &n);
+    } else {
+        err = tcp_write(s->info.tcp.lw, buf, n, apiflags | TCP_WRITE_FLAG_COPY);
+    }
     if (err == ERR_OK) {
         /* XXX prob add a flag to determine whether to continuously
            post data, e.g. if used by send/sendto... */
@@ -657,12 +873,12 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
     return rv;
 }
 
-closure_function(6, 1, sysreturn, socket_write_tcp_bh,
-                 netsock, s, thread, t, void *, buf, u64, remain, int, flags, io_completion, completion,
+closure_function(7, 1, sysreturn, socket_write_tcp_bh,
+                 netsock, s, thread, t, void *, buf, sg_list, sg, u64, remain, int, flags, io_completion, completion,
                  u64, bqflags)
 {
-    sysreturn rv = socket_write_tcp_bh_internal(bound(s), bound(t), bound(buf), bound(remain),
-        bound(flags), bound(completion), bqflags);
+    sysreturn rv = socket_write_tcp_bh_internal(bound(s), bound(t), bound(buf), bound(sg),
+        bound(remain), bound(flags), bound(completion), bqflags);
     if (rv != BLOCKQ_BLOCK_REQUIRED)
         closure_finish();
     return rv;
@@ -705,7 +921,7 @@ static sysreturn socket_write_udp(netsock s, void *source, u64 length,
     return length;
 }
 
-static sysreturn socket_write_internal(struct sock *sock, void *source,
+static sysreturn socket_write_internal(struct sock *sock, void *source, sg_list sg,
                                        u64 length, int flags,
                                        struct sockaddr *dest_addr, socklen_t addrlen,
                                        thread t, boolean bh, io_completion completion)
@@ -724,9 +940,10 @@ static sysreturn socket_write_internal(struct sock *sock, void *source,
             goto out;
         }
         blockq_action ba = contextual_closure(socket_write_tcp_bh, s, t,
-                                              source, length, flags, completion);
+                                              source, sg, length, flags, completion);
         return blockq_check(sock->txbq, t, ba, bh);
     } else if (sock->type == SOCK_DGRAM) {
+        assert(!sg);
         rv = socket_write_udp(s, source, length, dest_addr, addrlen);
     } else {
 	msg_err("socket type %d unsupported\n", sock->type);
@@ -745,7 +962,18 @@ closure_function(1, 6, sysreturn, socket_write,
     struct sock *s = (struct sock *) bound(s);
     net_debug("sock %d, type %d, thread %ld, source %p, length %ld, offset %ld\n",
 	      s->fd, s->type, t->tid, source, length, offset);
-    return socket_write_internal(s, source, length, 0, 0, 0, t, bh, completion);
+    return socket_write_internal(s, source, 0, length, 0, 0, 0, t, bh, completion);
+}
+
+/* TCP only: transmits referenced buffers (e.g. pagecache pages for sendfile) in place */
+closure_function(1, 6, sysreturn, socket_sg_write,
+                 netsock, s,
+                 sg_list, sg, u64, length, u64, offset, thread, t, boolean, bh, io_completion, completion)
+{
+    struct sock *s = (struct sock *) bound(s);
+    net_debug("sock %d, type %d, thread %ld, sg %p, length %ld, offset %ld\n",
+	      s->fd, s->type, t->tid, sg, length, offset);
+    return socket_write_internal(s, 0, sg, length, 0, 0, 0, t, bh, completion);
 }
 
 closure_function(1, 2, sysreturn, netsock_ioctl,
@@ -979,11 +1207,13 @@ closure_function(1, 2, sysreturn, socket_close,
          * using a stale reference to the socket structure, set the callback
          * argument to NULL. */
         lwip_lock();
+        netsock_detach_zc(s);
         if (s->info.tcp.lw) {
             tcp_close(s->info.tcp.lw);
             tcp_arg(s->info.tcp.lw, 0);
             netsock_check_loop();
         }
+        netsock_free_zc_notify(s);
         lwip_unlock();
         break;
     case SOCK_DGRAM:
@@ -995,6 +1225,8 @@ closure_function(1, 2, sysreturn, socket_close,
     deallocate_queue(s->incoming);
     deallocate_closure(s->sock.f.read);
     deallocate_closure(s->sock.f.write);
+    if (s->sock.f.sg_write)
+        deallocate_closure(s->sock.f.sg_write);
     deallocate_closure(s->sock.f.close);
     deallocate_closure(s->sock.f.events);
     deallocate_closure(s->sock.f.ioctl);
@@ -1039,11 +1271,13 @@ static sysreturn netsock_shutdown(struct sock *sock, int how)
         if (shut_rx && shut_tx) {
             /* Shutting down both TX and RX is equivalent to calling
              * tcp_close(), so the pcb should not be referenced anymore. */
+            netsock_detach_zc(s);
             s->info.tcp.lw = 0;
             s->info.tcp.state = TCP_SOCK_UNDEFINED;
         }
         lwip_unlock();
         netsock_check_loop();
+        fdesc_notify_events(&s->sock.f); /* pcb state change isn't signaled by lwIP */
         break;
     case SOCK_DGRAM:
         rv = -ENOTCONN;
@@ -1113,6 +1347,8 @@ static int allocate_sock(process p, int af, int type, u32 flags, netsock *rs)
         goto err_sock_init;
     s->sock.f.read = closure(h, socket_read, s);
     s->sock.f.write = closure(h, socket_write, s);
+    if (type == SOCK_STREAM)
+        s->sock.f.sg_write = closure(h, socket_sg_write, s);
     s->sock.f.close = closure(h, socket_close, s);
     s->sock.f.events = closure(h, socket_events, s);
     s->sock.f.ioctl = closure(h, netsock_ioctl, s);
@@ -1135,6 +1371,9 @@ static int allocate_sock(process p, int af, int type, u32 flags, netsock *rs)
     s->sock.recvmsg = netsock_recvmsg;
     s->sock.shutdown = netsock_shutdown;
     s->ipv6only = 0;
+    s->zerocopy = 0;
+    s->zc_next_id = 0;
+    list_init(&s->zc_notify);
     set_lwip_error(s, ERR_OK);
     fd = s->sock.fd = allocate_fd(p, s);
     if (fd == INVALID_PHYSICAL) {
@@ -1160,6 +1399,7 @@ static int allocate_tcp_sock(process p, int af, struct tcp_pcb *pcb, u32 flags)
 	s->info.tcp.lw = pcb;
 	s->info.tcp.flags = pcb->flags;
 	s->info.tcp.state = TCP_SOCK_CREATED;
+	s->info.tcp.zc = 0;
     }
     return fd;
 }
@@ -1341,6 +1581,8 @@ static err_t lwip_tcp_sent(void * arg, struct tcp_pcb * pcb, u16 len)
     }
     netsock s = (netsock)arg;
     net_debug("fd %d, pcb %p, len %d\n", s->sock.fd, pcb, len);
+    if (s->info.tcp.zc)
+        tcp_zc_acked(s->info.tcp.zc, pcb->lastack);
     wakeup_sock(s, WAKEUP_SOCK_TX);
     return ERR_OK;
 }
@@ -1373,6 +1615,7 @@ closure_function(2, 1, sysreturn, connect_tcp_bh,
                 s->info.tcp.state = TCP_SOCK_ABORTING_CONNECTION;
             }
             lwip_unlock();
+            fdesc_notify_events(&s->sock.f);
             rv = -ERESTARTSYS;
         }
         goto out;
@@ -1527,6 +1770,49 @@ static sysreturn sendto_prepare(struct sock *sock, int flags)
     return 0;
 }
 
+closure_function(2, 2, void, sendmsg_zerocopy_complete,
+                 struct sock *, s, sg_list, sg,
+                 thread, t, sysreturn, rv)
+{
+    sg_list_release(bound(sg));
+    deallocate_sg_list(bound(sg));
+    socket_release(bound(s));
+    apply(syscall_io_complete, t, rv);
+    closure_finish();
+}
+
+/* A MSG_ZEROCOPY send on a TCP socket with SO_ZEROCOPY set; completions are
+   reported on the error queue (see tcp_write_sg()). */
+static sysreturn netsock_sendmsg_zerocopy(struct sock *sock, struct iovec *iov, int iovlen,
+                                          int flags)
+{
+    sysreturn rv;
+    sg_list sg = allocate_sg_list();
+    if (sg == INVALID_ADDRESS) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    if (!iov_to_sg(sg, iov, iovlen))
+        goto err_dealloc_sg;
+    io_completion completion = closure(sock->h, sendmsg_zerocopy_complete, sock, sg);
+    if (completion == INVALID_ADDRESS)
+        goto err_dealloc_sg;
+    return socket_write_internal(sock, 0, sg, sg->count, flags, 0, 0, current, false,
+                                 completion);
+  err_dealloc_sg:
+    sg_list_release(sg);
+    deallocate_sg_list(sg);
+    rv = -ENOMEM;
+  out:
+    socket_release(sock);
+    return rv;
+}
+
+static boolean netsock_is_zerocopy_send(struct sock *sock, int flags)
+{
+    return (flags & MSG_ZEROCOPY) && (sock->type == SOCK_STREAM) && ((netsock)sock)->zerocopy;
+}
+
 static sysreturn netsock_sendto(struct sock *sock, void *buf, u64 len,
         int flags, struct sockaddr *dest_addr, socklen_t addrlen)
 {
@@ -1535,7 +1821,11 @@ static sysreturn netsock_sendto(struct sock *sock, void *buf, u64 len,
         socket_release(sock);
         return set_syscall_return(current, rv);
     }
-    return socket_write_internal(sock, buf, len, flags, dest_addr, addrlen, current, false,
+    if (netsock_is_zerocopy_send(sock, flags)) {
+        struct iovec iov = { .iov_base = buf, .iov_len = len };
+        return netsock_sendmsg_zerocopy(sock, &iov, 1, flags);
+    }
+    return socket_write_internal(sock, buf, 0, len, flags, dest_addr, addrlen, current, false,
             (io_completion)&sock->f.io_complete);
 }
 
@@ -1611,13 +1901,21 @@ static sysreturn netsock_sendmsg(struct sock *s, const struct msghdr *msg,
     u64 len;
     sysreturn rv;
 
+    if (netsock_is_zerocopy_send(s, flags)) {
+        rv = sendto_prepare(s, flags);
+        if (rv < 0) {
+            socket_release(s);
+            return set_syscall_return(current, rv);
+        }
+        return netsock_sendmsg_zerocopy(s, msg->msg_iov, msg->msg_iovlen, flags);
+    }
     rv = sendmsg_prepare(s, msg, flags, &buf, &len);
     if (rv <= 0) {
         socket_release(s);
         return set_syscall_return(current, rv);
     }
     io_completion completion = closure(s->h, sendmsg_complete, s, buf, len);
-    return socket_write_internal(s, buf, len, flags, msg->msg_name, msg->msg_namelen,
+    return socket_write_internal(s, buf, 0, len, flags, msg->msg_name, msg->msg_namelen,
         current, false, completion);
 }
 
@@ -1654,7 +1952,7 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
 
     io_completion completion = closure(s->sock.h, sendmmsg_buf_complete, s, buf,
             len);
-    sysreturn rv = socket_write_tcp_bh_internal(s, t, buf, len, bound(flags), completion,
+    sysreturn rv = socket_write_tcp_bh_internal(s, t, buf, 0, len, bound(flags), completion,
         bqflags | BLOCKQ_ACTION_BLOCKED);
 
     while (true) {
@@ -1790,6 +2088,44 @@ sysreturn recvfrom(int sockfd, void * buf, u64 len, int flags,
     return sock->recvfrom(sock, buf, len, flags, src_addr, addrlen);
 }
 
+/* dequeue a MSG_ZEROCOPY completion from the error queue */
+static sysreturn netsock_recv_errqueue(netsock s, struct msghdr *msg)
+{
+    struct cmsghdr *cmsg = msg->msg_control;
+    if (cmsg && !validate_user_memory(cmsg, msg->msg_controllen, true))
+        return -EFAULT;
+    lwip_lock();
+    if (list_empty(&s->zc_notify)) {
+        lwip_unlock();
+        return -EAGAIN;
+    }
+    zc_notification n = struct_from_list(list_begin(&s->zc_notify), zc_notification, l);
+    list_delete(&n->l);
+    boolean empty = list_empty(&s->zc_notify);
+    lwip_unlock();
+
+    msg->msg_flags = MSG_ERRQUEUE;
+    if (cmsg && msg->msg_controllen >= CMSG_SPACE(sizeof(struct sock_extended_err))) {
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct sock_extended_err));
+        cmsg->cmsg_level = (s->sock.domain == AF_INET) ? SOL_IP : IPPROTO_IPV6;
+        cmsg->cmsg_type = (s->sock.domain == AF_INET) ? IP_RECVERR : IPV6_RECVERR;
+        struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        zero(ee, sizeof(*ee));
+        ee->ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+        ee->ee_code = n->copied ? SO_EE_CODE_ZEROCOPY_COPIED : 0;
+        ee->ee_info = n->lo;
+        ee->ee_data = n->hi;
+        msg->msg_controllen = CMSG_SPACE(sizeof(struct sock_extended_err));
+    } else {
+        msg->msg_controllen = 0;
+        msg->msg_flags |= MSG_CTRUNC;
+    }
+    deallocate(s->sock.h, n, sizeof(*n));
+    if (empty)
+        fdesc_notify_events(&s->sock.f); /* reset a triggered EPOLLERR condition */
+    return 0;
+}
+
 static sysreturn netsock_recvmsg(struct sock *sock, struct msghdr *msg,
                                  int flags)
 {
@@ -1798,6 +2134,10 @@ static sysreturn netsock_recvmsg(struct sock *sock, struct msghdr *msg,
     netsock s = (netsock) sock;
     sysreturn rv;
 
+    if (flags & MSG_ERRQUEUE) {
+        rv = netsock_recv_errqueue(s, msg);
+        goto out;
+    }
     if ((sock->type == SOCK_STREAM) && (s->info.tcp.state != TCP_SOCK_OPEN)) {
         rv = (s->info.tcp.state == TCP_SOCK_UNDEFINED) ? 0 : -ENOTCONN;
         goto out;
@@ -2149,6 +2489,17 @@ sysreturn setsockopt(int sockfd,
             break;
         case SO_REUSEPORT:
             goto unimplemented;
+        case SO_ZEROCOPY:
+            if (optlen != sizeof(int)) {
+                rv = -EINVAL;
+                goto out;
+            }
+            if (s->sock.type != SOCK_STREAM) {
+                rv = -EOPNOTSUPP;
+                goto out;
+            }
+            s->zerocopy = *((int *)optval) != 0;
+            break;
         default:
             goto unimplemented;
         }
@@ -2264,6 +2615,10 @@ sysreturn getsockopt(int sockfd, int level, int optname, void *optval, socklen_t
             ret_optval.val = 0;
             ret_optlen = sizeof(ret_optval.val);
             break;
+        case SO_ZEROCOPY:
+            ret_optval.val = s->zerocopy;
+            ret_optlen = sizeof(ret_optval.val);
+            break;
         default:
             goto unimplemented;
         }
@@ -2348,6 +2703,7 @@ boolean netsyscall_init(unix_heaps uh, tuple cfg)
 	return false;
     uh->socket_cache = socket_cache;
     net_loop_poll = closure(heap_general(kh), netsock_poll);
+    tcp_zc_id = tcp_ext_arg_alloc_id();
     netlink_init();
     return true;
 }
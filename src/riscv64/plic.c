@@ -64,7 +64,7 @@ void init_plic()
 {
 }
 
-void msi_format(u32 *address, u32 *data, int vector)
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu)
 {
 }
 
@@ -49,6 +49,9 @@ heap allocate_wrapped_objcache(heap meta, heap parent, bytes objsize, bytes page
 boolean objcache_validate(heap h);
 heap objcache_from_object(u64 obj, bytes parent_pagesize);
 heap allocate_mcache(heap meta, heap parent, int min_order, int max_order, bytes pagesize);
+int mcache_class(heap h, bytes b);
+bytes mcache_class_size(heap h, int class);
+boolean mcache_class_owns(heap h, int class, u64 a);
 
 // really internals
 
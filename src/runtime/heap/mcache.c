@@ -5,6 +5,13 @@
    size greater than or equal to the alloc size. Allocations of sizes
    greater than the largest cache size are served from the parent heap.
 
+   Besides the power-of-2 caches, an intermediate cache of 1.5 times
+   each power of 2 is kept for objects smaller than
+   U64_FROM_BIT(MCACHE_MID_MAX_ORDER), reducing internal fragmentation
+   for sizes just above a power of 2. Objects of a page or more keep
+   their natural alignment. The cache for a given size is found in
+   constant time from the order of the size.
+
    To facilitate vendor code in the kernel that requires a malloc /
    free interface, deallocations may be made with a size of -1ull,
    provided that allocations are *only* served from one of the cache
@@ -18,6 +25,8 @@
 #include <runtime.h>
 #include <management.h>
 
+#define MCACHE_MID_MAX_ORDER 12
+
 typedef struct mcache {
     struct heap h;
     heap parent;
@@ -26,13 +35,56 @@ typedef struct mcache {
     u64 pagesize;
     u64 allocated;
     u64 parent_threshold;
+    int min_order;
+    heap order_caches[64];  /* objsize 2^order */
+    heap mid_caches[64];    /* objsize 3 * 2^(order - 2), if any */
     tuple mgmt;
 } *mcache;
 
+static inline heap mcache_lookup(mcache m, bytes b)
+{
+    int order = find_order(b);
+    if (order <= m->min_order)
+        return m->order_caches[m->min_order];
+    heap o = m->mid_caches[order];
+    if (o && b <= o->pagesize)
+        return o;
+    return m->order_caches[order];
+}
+
+/* Index, in ascending object size, of the cache serving allocations of size
+   b, or -1 if they are served by the parent heap. Like mcache_lookup(), this
+   takes constant time. */
+int mcache_class(heap h, bytes b)
+{
+    mcache m = (mcache)h;
+    if (b > m->parent_threshold)
+        return -1;
+    int order = find_order(b);
+    if (order <= m->min_order)
+        return 0;
+    int mids = MIN(order, MCACHE_MID_MAX_ORDER) - m->min_order;
+    int class = order - m->min_order + MAX(mids, 0);
+    heap o = m->mid_caches[order];
+    return (o && b <= o->pagesize) ? class - 1 : class;
+}
+
+bytes mcache_class_size(heap h, int class)
+{
+    heap o = vector_get(((mcache)h)->caches, class);
+    return o->pagesize;
+}
+
+/* Returns true if object a was allocated from the cache of the given class. */
+boolean mcache_class_owns(heap h, int class, u64 a)
+{
+    mcache m = (mcache)h;
+    return objcache_from_object(a, m->pagesize) == vector_get(m->caches, class);
+}
+
 u64 mcache_alloc(heap h, bytes b)
 {
     mcache m = (mcache)h;
-    heap o;
 #ifdef MCACHE_DEBUG
     rputs("mcache_alloc:   heap ");
     print_u64(u64_from_pointer(h));
@@ -52,42 +104,34 @@ u64 mcache_alloc(heap h, bytes b)
             print_u64(a);
             rputs("\n");
 #endif
-            return a;
         }
+        return a;
     }
 
-    /* Could become a binary search if search set is large... */
-    vector_foreach(m->caches, o) {
-	if (o && b <= o->pagesize) {
+    heap o = mcache_lookup(m, b);
 #ifdef MCACHE_DEBUG
-	    rputs("match cache ");
-	    print_u64(u64_from_pointer(o));
-	    rputs(" obj size ");
-	    print_u64(o->pagesize);
-	    rputs(", pre validate...");
-	    if (objcache_validate((heap)o))
-		rputs("pass, alloc ");
-	    else
-		halt("failed!\n");
-#endif
-	    u64 a = allocate_u64(o, o->pagesize);
-	    if (a != INVALID_PHYSICAL)
-		m->allocated += o->pagesize;
-#ifdef MCACHE_DEBUG
-	    print_u64(a);
-	    rputs(", post validate...");
-	    if (objcache_validate((heap)o))
-		rputs("pass\n");
-	    else
-		halt("failed!\n");
+    rputs("match cache ");
+    print_u64(u64_from_pointer(o));
+    rputs(" obj size ");
+    print_u64(o->pagesize);
+    rputs(", pre validate...");
+    if (objcache_validate((heap)o))
+        rputs("pass, alloc ");
+    else
+        halt("failed!\n");
 #endif
-	    return a;
-	}
-    }
+    u64 a = allocate_u64(o, o->pagesize);
+    if (a != INVALID_PHYSICAL)
+        m->allocated += o->pagesize;
 #ifdef MCACHE_DEBUG
-    rputs("no matching cache; fail\n");
+    print_u64(a);
+    rputs(", post validate...");
+    if (objcache_validate((heap)o))
+        rputs("pass\n");
+    else
+        halt("failed!\n");
 #endif
-    return INVALID_PHYSICAL;
+    return a;
 }
 
 void mcache_dealloc(heap h, u64 a, bytes b)
@@ -248,6 +292,32 @@ static value mcache_management(heap h)
     return n;
 }
 
+/* destroys the mcache on failure */
+static heap mcache_add_cache(mcache m, int i, u64 obj_size)
+{
+#if defined(MEMDEBUG_MCACHE) || defined(MEMDEBUG_ALL)
+    heap h = mem_debug_objcache(m->meta, m->parent, obj_size, m->pagesize);
+#else
+    heap h = allocate_objcache(m->meta, m->parent, obj_size, m->pagesize);
+#endif
+#ifdef MCACHE_DEBUG
+    rputs(" - cache size ");
+    print_u64(obj_size);
+    rputs(": ");
+    print_u64(u64_from_pointer(h));
+    rputs("\n");
+#endif
+    if (h == INVALID_ADDRESS) {
+        rputs("allocate_mcache: failed to allocate objcache of size ");
+        print_u64(obj_size);
+        rputs("\n");
+        destroy_mcache((heap)m);
+        return INVALID_ADDRESS;
+    }
+    assert(vector_set(m->caches, i, h));
+    return h;
+}
+
 heap allocate_mcache(heap meta, heap parent, int min_order, int max_order, bytes pagesize)
 {
     if (pagesize < parent->pagesize ||
@@ -290,30 +360,21 @@ heap allocate_mcache(heap meta, heap parent, int min_order, int max_order, bytes
     m->pagesize = pagesize;
     m->allocated = 0;
     m->parent_threshold = U64_FROM_BIT(max_order);
+    m->min_order = min_order;
+    zero(m->order_caches, sizeof(m->order_caches));
+    zero(m->mid_caches, sizeof(m->mid_caches));
     m->mgmt = 0;
 
-    for(int i = 0, order = min_order; order <= max_order; i++, order++) {
-	u64 obj_size = U64_FROM_BIT(order);
-#if defined(MEMDEBUG_MCACHE) || defined(MEMDEBUG_ALL)
-	heap h = mem_debug_objcache(meta, parent, obj_size, pagesize);
-#else
-	heap h = allocate_objcache(meta, parent, obj_size, pagesize);
-#endif
-#ifdef MCACHE_DEBUG
-	rputs(" - cache size ");
-	print_u64(obj_size);
-	rputs(": ");
-	print_u64(u64_from_pointer(h));
-	rputs("\n");
-#endif
-	if (h == INVALID_ADDRESS) {
-	    rputs("allocate_mcache: failed to allocate objcache of size ");
-	    print_u64(obj_size);
-	    rputs("\n");
-	    destroy_mcache((heap)m);
-	    return INVALID_ADDRESS;
-	}
-	assert(vector_set(m->caches, i, h));
+    /* caches are kept in ascending object size */
+    for (int i = 0, order = min_order; order <= max_order; order++) {
+        if (order > min_order && order <= MCACHE_MID_MAX_ORDER) {
+            m->mid_caches[order] = mcache_add_cache(m, i++, 3 * U64_FROM_BIT(order - 2));
+            if (m->mid_caches[order] == INVALID_ADDRESS)
+                return INVALID_ADDRESS;
+        }
+        m->order_caches[order] = mcache_add_cache(m, i++, U64_FROM_BIT(order));
+        if (m->order_caches[order] == INVALID_ADDRESS)
+            return INVALID_ADDRESS;
     }
     return (heap)m;
 }
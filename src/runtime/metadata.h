@@ -61,9 +61,9 @@ static inline string contents(tuple x)
 
 static inline tuple lookup(tuple t, symbol a)
 {
-    if (a == sym_this(".."))
+    if (a == sym(..))
         return get_tuple(t, a);
-    if (a == sym_this("."))
+    if (a == sym(.))
         return t;
     tuple c = children(t);
     if (!c)
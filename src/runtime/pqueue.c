@@ -8,13 +8,30 @@ struct pqueue {
     heap h;
     vector body;
     boolean (*sort)(void *, void *);
+    bytes index_offset;         /* of element heap index, or PQUEUE_NO_INDEX */
 };
 
+#define element_index(__q, __v) (*(index *)((__v) + (__q)->index_offset))
+
+/* store v at position x, keeping its heap index current */
+static inline void set_element(pqueue q, index x, void *v)
+{
+    assert(vector_set(q->body, x-1, v));
+    if (q->index_offset != PQUEUE_NO_INDEX)
+        element_index(q, v) = x;
+}
+
+static inline void clear_element_index(pqueue q, void *v)
+{
+    if (q->index_offset != PQUEUE_NO_INDEX)
+        element_index(q, v) = 0;
+}
+
 static inline void swap(pqueue q, index x, index y)
 {
     void *temp = vector_get(q->body, x-1);
-    assert(vector_set(q->body, x-1, vector_get(q->body, y-1)));
-    assert(vector_set(q->body, y-1, temp));
+    set_element(q, x, vector_get(q->body, y-1));
+    set_element(q, y, temp);
 }
 
 #define qcompare(__q, __x, __y)\
@@ -71,30 +88,43 @@ static void add_pqueue(pqueue q, index i)
 void pqueue_insert(pqueue q, void *v)
 {
     vector_push(q->body, v);
+    if (q->index_offset != PQUEUE_NO_INDEX)
+        element_index(q, v) = vector_length(q->body);
     add_pqueue(q, vector_length(q->body));
 #ifdef PQUEUE_PARANOIA
     assert(pqueue_validate(q, 1));
 #endif
 }
 
-boolean pqueue_remove(pqueue q, void *v)
+/* remove the element at position idx */
+static void remove_at(pqueue q, index idx, void *v)
 {
-    index i;
-    for (i = 0; i < vector_length(q->body); i++) {
-        void *e = vector_get(q->body, i);
-        if (e == v) {
-            void *n = vector_pop(q->body);
-            if (n != v) {
-                index idx = i + 1;
-                assert(vector_set(q->body, i, n));
-                if (idx > 1 && qcompare(q, idx >> 1, idx))
-                    heal_up(q, i + 1);
-                else
-                    heal_down(q, i + 1);
-            }
+    void *n = vector_pop(q->body);
+    if (n != v) {
+        set_element(q, idx, n);
+        if (idx > 1 && qcompare(q, idx >> 1, idx))
+            heal_up(q, idx);
+        else
+            heal_down(q, idx);
+    }
+    clear_element_index(q, v);
 #ifdef PQUEUE_PARANOIA
-            assert(pqueue_validate(q, 1));
+    assert(pqueue_validate(q, 1));
 #endif
+}
+
+boolean pqueue_remove(pqueue q, void *v)
+{
+    if (q->index_offset != PQUEUE_NO_INDEX) {
+        index idx = element_index(q, v);
+        if (idx == 0 || idx > vector_length(q->body) || vector_get(q->body, idx - 1) != v)
+            return false;
+        remove_at(q, idx, v);
+        return true;
+    }
+    for (index i = 0; i < vector_length(q->body); i++) {
+        if (vector_get(q->body, i) == v) {
+            remove_at(q, i + 1, v);
             return true;
         }
     }
@@ -109,9 +139,10 @@ void *pqueue_pop(pqueue q)
         result = vector_get(q->body, 0);
         void *n = vector_pop(q->body);
         if (vector_peek(q->body)){
-            assert(vector_set(q->body, 0, n));
+            set_element(q, 1, n);
             heal_down(q, 1);
         }
+        clear_element_index(q, result);
     }
 #ifdef PQUEUE_PARANOIA
     assert(pqueue_validate(q, 1));
@@ -144,16 +175,22 @@ boolean pqueue_walk(pqueue q, pqueue_element_handler h)
     return true;
 }
 
-pqueue allocate_pqueue(heap h, boolean(*sort)(void *, void *))
+pqueue allocate_pqueue_indexed(heap h, boolean(*sort)(void *, void *), bytes index_offset)
 {
     pqueue p = allocate(h, sizeof(struct pqueue));
     assert(p != INVALID_ADDRESS);
     p->h = h;
     p->body = allocate_vector(h, 10);
     p->sort = sort;
+    p->index_offset = index_offset;
     return(p);
 }
 
+pqueue allocate_pqueue(heap h, boolean(*sort)(void *, void *))
+{
+    return allocate_pqueue_indexed(h, sort, PQUEUE_NO_INDEX);
+}
+
 void deallocate_pqueue(pqueue p)
 {
     assert(p);
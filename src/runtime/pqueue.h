@@ -1,5 +1,11 @@
 typedef struct pqueue *pqueue;
 pqueue allocate_pqueue(heap h, boolean(*)(void *, void *));
+
+/* Elements of an indexed pqueue embed a u32 holding their position in the
+   heap (zero when not queued), at the given offset, making pqueue_remove()
+   O(log n). An element may then be in only one such queue at a time. */
+#define PQUEUE_NO_INDEX ((bytes)-1)
+pqueue allocate_pqueue_indexed(heap h, boolean(*)(void *, void *), bytes index_offset);
 void deallocate_pqueue(pqueue q);
 void pqueue_insert(pqueue q, void *v);
 boolean pqueue_remove(pqueue q, void *v);
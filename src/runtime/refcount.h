@@ -15,6 +15,19 @@ static inline void refcount_reserve(refcount r)
     fetch_and_add(&r->c, 1);
 }
 
+/* Take a reference only if the count has not dropped to zero, for objects
+   found without holding a lock that keeps them referenced. */
+static inline boolean refcount_reserve_if_held(refcount r)
+{
+    word c;
+    do {
+        c = r->c;
+        if (c == 0)
+            return false;
+    } while (!__sync_bool_compare_and_swap(&r->c, c, c + 1));
+    return true;
+}
+
 static inline boolean refcount_release(refcount r)
 {
     word n = fetch_and_add(&r->c, (word)-1);
@@ -71,12 +71,18 @@ static inline void partition_write(struct partition_entry *e, boolean active,
 
 struct filesystem;
 
+/* STORAGE_OP_ZERO writes zeroes to the given blocks; its data is an sg list
+   of zero buffers covering the blocks, so that handlers without a native
+   zeroing command can process it like STORAGE_OP_WRITESG. STORAGE_OP_DISCARD
+   is advisory and may complete without doing anything. */
 enum storage_op {
     STORAGE_OP_READ,
     STORAGE_OP_WRITE,
     STORAGE_OP_READSG,
     STORAGE_OP_WRITESG,
     STORAGE_OP_FLUSH,
+    STORAGE_OP_ZERO,
+    STORAGE_OP_DISCARD,
 };
 
 typedef struct storage_req {
@@ -4,31 +4,52 @@
 #include <runtime.h>
 #endif
 
-BSS_RO_AFTER_INIT static table symbols;
+/* The symbol table is split into shards, each with its own lock, so that
+   concurrent interning and lookups of unrelated names (e.g. path components
+   resolved on different cpus) don't serialize on a single lock. A shard is
+   selected with the high bits of the name hash; the low bits index the
+   buckets of the shard table. */
+#define SYMBOL_SHARDS   U64_FROM_BIT(SYMBOL_SHARD_ORDER)
+
+static struct symbol_shard {
+#ifdef KERNEL
+    struct spinlock lock;
+#endif
+    table symbols;
+} shards[SYMBOL_SHARDS];
+
 BSS_RO_AFTER_INIT static heap sheap;
 BSS_RO_AFTER_INIT static heap iheap;
 
 #ifdef KERNEL
 
-static struct spinlock slock;
-
-#define sym_lock_init() spin_lock_init(&slock)
-#define sym_lock()      spin_lock(&slock)
-#define sym_unlock()    spin_unlock(&slock)
+#define sym_lock_init(s) spin_lock_init(&(s)->lock)
+#define sym_lock(s)      spin_lock(&(s)->lock)
+#define sym_unlock(s)    spin_unlock(&(s)->lock)
 
 #else
 
-#define sym_lock_init()
-#define sym_lock()
-#define sym_unlock()
+#define sym_lock_init(s) (void)(s)
+#define sym_lock(s)      (void)(s)
+#define sym_unlock(s)    (void)(s)
 
 #endif
 
+/* A refcount of zero denotes a permanent symbol, as returned by intern();
+   symbols obtained with intern_ref() are destroyed when their last reference
+   is released. Since the result of intern() is never released, interning an
+   existing reclaimable symbol takes a reference on it for the caller. */
 struct symbol {
     string s;
     key k;
+    word refcount;
 };
 
+static inline struct symbol_shard *shard_from_name(string name)
+{
+    return &shards[fnv64(name) >> (64 - SYMBOL_SHARD_ORDER)];
+}
+
 symbol intern_u64(u64 u)
 {
     buffer b = little_stack_buffer(20);
@@ -36,11 +57,22 @@ symbol intern_u64(u64 u)
     return intern(b);
 }
 
-symbol intern(string name)
+symbol intern_u64_ref(u64 u)
 {
+    buffer b = little_stack_buffer(20);
+    print_number(b, u, 10, 0);
+    return intern_ref(b);
+}
+
+static symbol intern_internal(string name, boolean ref)
+{
+    struct symbol_shard *ss = shard_from_name(name);
     symbol s;
-    sym_lock();
-    if (!(s = table_find(symbols, name))) {
+    sym_lock(ss);
+    if ((s = table_find(ss->symbols, name))) {
+        if (s->refcount)
+            fetch_and_add(&s->refcount, 1);
+    } else {
         // shouldnt really be on transient
         buffer b = allocate_buffer(iheap, buffer_length(name));
         if (b == INVALID_ADDRESS)
@@ -51,14 +83,77 @@ symbol intern(string name)
             goto alloc_fail;
         s->k = random_u64();
         s->s = b;
-        table_set(symbols, b, s);
+        s->refcount = ref ? 1 : 0;
+        table_set(ss->symbols, b, s);
     }
-    sym_unlock();
+    sym_unlock(ss);
     return s;
   alloc_fail:
     halt("intern: alloc fail\n");
 }
 
+symbol intern(string name)
+{
+    return intern_internal(name, false);
+}
+
+symbol intern_ref(string name)
+{
+    return intern_internal(name, true);
+}
+
+/* Look up an existing symbol without creating it. A reference is taken on
+   the symbol found, which the caller must release with symbol_release(). */
+symbol symbol_find(string name)
+{
+    struct symbol_shard *ss = shard_from_name(name);
+    sym_lock(ss);
+    symbol s = table_find(ss->symbols, name);
+    if (s && s->refcount)
+        fetch_and_add(&s->refcount, 1);
+    sym_unlock(ss);
+    return s;
+}
+
+/* The caller must already hold a reference to s, or otherwise guarantee that
+   it cannot be released concurrently. */
+void symbol_acquire(symbol s)
+{
+    word c;
+    do {
+        c = s->refcount;
+        if (c == 0)
+            return;
+    } while (!__sync_bool_compare_and_swap(&s->refcount, c, c + 1));
+}
+
+void symbol_release(symbol s)
+{
+    struct symbol_shard *ss = 0;
+    word c;
+    while ((c = s->refcount)) {
+        if (c > 1) {
+            if (__sync_bool_compare_and_swap(&s->refcount, c, c - 1))
+                break;
+            continue;
+        }
+        if (!ss) {
+            /* Dropping the last reference must exclude intern_ref() from
+               finding the symbol while it is being removed. */
+            ss = shard_from_name(s->s);
+            sym_lock(ss);
+            continue;
+        }
+        table_set(ss->symbols, s->s, 0);
+        sym_unlock(ss);
+        deallocate_buffer(s->s);
+        deallocate(sheap, s, sizeof(struct symbol));
+        return;
+    }
+    if (ss)
+        sym_unlock(ss);
+}
+
 string symbol_string(symbol s)
 {
     return s->s;
@@ -73,8 +168,11 @@ key key_from_symbol(void *z)
 void init_symbols(heap h, heap init)
 {
     sheap = h;
-    iheap = init;    
-    symbols = allocate_table(iheap, fnv64, buffer_compare);
-    sym_lock_init();
+    iheap = init;
+    for (int i = 0; i < SYMBOL_SHARDS; i++) {
+        struct symbol_shard *ss = &shards[i];
+        ss->symbols = allocate_table(iheap, fnv64, buffer_compare);
+        assert(ss->symbols != INVALID_ADDRESS);
+        sym_lock_init(ss);
+    }
 }
-
@@ -3,6 +3,15 @@ typedef struct symbol *symbol;
 symbol intern(buffer);
 symbol intern_u64(u64);
 
+/* reclaimable symbols, destroyed when the last reference is released */
+symbol intern_ref(buffer);
+symbol intern_u64_ref(u64);
+void symbol_acquire(symbol s);
+void symbol_release(symbol s);
+
+/* returns a referenced symbol, or 0 if no symbol with this name exists */
+symbol symbol_find(buffer);
+
 string symbol_string(symbol s);
 
 #define sym_intern(name, intern)\
@@ -15,7 +24,12 @@ string symbol_string(symbol s);
 #define sym_this(name)\
     (intern(alloca_wrap_buffer(name, runtime_strlen(name))))
 
-table symbol_table();
+#define sym_this_ref(name)\
+    (intern_ref(alloca_wrap_buffer(name, runtime_strlen(name))))
+
+#define sym_find(name)\
+    (symbol_find(alloca_wrap_buffer(name, runtime_strlen(name))))
+
 key key_from_symbol(void *z);
 
 static inline boolean sym_cstring_compare(symbol s, const char *c)
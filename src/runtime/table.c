@@ -145,6 +145,49 @@ int table_elements(table t)
     return t->count;
 }
 
+static inline u64 reverse_bits(u64 x)
+{
+    x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+    x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f0f0f0f0full) | ((x & 0x0f0f0f0f0f0f0f0full) << 4);
+    x = ((x >> 8) & 0x00ff00ff00ff00ffull) | ((x & 0x00ff00ff00ff00ffull) << 8);
+    x = ((x >> 16) & 0x0000ffff0000ffffull) | ((x & 0x0000ffff0000ffffull) << 16);
+    return (x >> 32) | (x << 32);
+}
+
+/* Positions are kept to 63 bits so that they can be used as file offsets. */
+static inline u64 scan_position(key k)
+{
+    return MAX(reverse_bits(k) >> 1, TABLE_SCAN_START);
+}
+
+/* Entries are scanned in ascending order of their bit-reversed key. Since
+   the bucket of an entry is selected by the low bits of its key, this order
+   doesn't depend on the number of buckets: a scan resumed at a position
+   returned earlier visits every entry that was present throughout the scan
+   exactly once, even if the table has since been modified or resized. */
+entry table_scan(table t, u64 *position)
+{
+    u64 pos = *position;
+    int order = find_order(t->buckets);
+    for (u64 r = pos >> (63 - order); r < t->buckets; r++) {
+        entry next = 0;
+        u64 next_pos = 0;
+        for (entry e = t->entries[reverse_bits(r) >> (64 - order)]; e; e = e->next) {
+            u64 p = scan_position(e->k);
+            if (p > pos && (!next || p < next_pos)) {
+                next = e;
+                next_pos = p;
+            }
+        }
+        if (next) {
+            *position = next_pos;
+            return next;
+        }
+    }
+    return 0;
+}
+
 void table_clear(table t)
 {
     for(int i = 0; i < t->buckets; i++) {
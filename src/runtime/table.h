@@ -27,6 +27,14 @@ void *table_find(table t, void *c);
 void table_set(table t, void *c, void *v);
 void table_clear(table t);
 
+/* Scan positions fit in 63 bits and are never below this value; a scan
+   starts from any lower position, leaving those to the caller (e.g. for "."
+   and ".." in a directory). */
+#define TABLE_SCAN_START    3
+
+/* returns the entry following *position in scan order, or 0 */
+entry table_scan(table t, u64 *position);
+
 #define eZ(x,y) ((entry) x)->y
 
 #define table_foreach(__t, __k, __v)\
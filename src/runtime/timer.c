@@ -15,6 +15,11 @@
 #define timer_debug(x, ...)
 #endif
 
+static inline boolean timer_is_coarse(timer t)
+{
+    return t->id == CLOCK_ID_MONOTONIC_COARSE || t->id == CLOCK_ID_REALTIME_COARSE;
+}
+
 /* The lower time expiry is the higher priority. */
 static boolean timer_compare(void *za, void *zb)
 {
@@ -37,10 +42,16 @@ void register_timer(timerqueue tq, timer t, clock_id id,
     t->handler = n;
 
     timer_lock(tq);
+    timer prev = pqueue_peek(tq->pq);
     pqueue_insert(tq->pq, t);
-    timer next = pqueue_peek(tq->pq);
-    if (next)
-        refresh_timer_update_locked(tq, next);
+
+    /* The platform timer only needs reprogramming if this timer is the new
+       head of the queue. A coarse clock timer expiring shortly before the
+       previous head is left to be serviced along with it. */
+    if (pqueue_peek(tq->pq) == t &&
+        (prev == INVALID_ADDRESS || !timer_is_coarse(t) ||
+         timer_expiry(prev) - timer_expiry(t) > microseconds(TIMER_COARSE_SLACK_US)))
+        refresh_timer_update_locked(tq, t);
     timer_unlock(tq);
     timer_debug("register timer: %p, expiry %T, interval %T, handler %p\n", t, t->expiry, interval, n);
 }
@@ -136,7 +147,7 @@ void timer_reorder(timerqueue tq)
 timerqueue allocate_timerqueue(heap h, const char *name)
 {
     timerqueue tq = allocate(h, sizeof(struct timerqueue));
-    tq->pq = allocate_pqueue(h, timer_compare);
+    tq->pq = allocate_pqueue_indexed(h, timer_compare, offsetof(timer, pq_index));
     if (tq->pq == INVALID_ADDRESS) {
         deallocate(h, tq, sizeof(struct timerqueue));
         return INVALID_ADDRESS;
@@ -47,6 +47,7 @@ struct timer {
     timestamp interval;
     boolean active;
     boolean queued;
+    u32 pq_index;               /* position in timerqueue heap */
     timer_handler handler;
 };
 
@@ -70,6 +71,7 @@ static inline void init_timer(timer t)
 {
     t->active = false;
     t->queued = false;
+    t->pq_index = 0;
 }
 
 static inline boolean timer_is_active(timer t)
@@ -36,7 +36,15 @@ void set(value e, symbol a, value v)
     tuple t = (tuple)e;
     switch (tag) {
     case tag_table_tuple:
-        table_set(&t->t, a, v);
+        /* each key of a table tuple holds a reference to its symbol */
+        if (v) {
+            if (!table_find(&t->t, a))
+                symbol_acquire(a);
+            table_set(&t->t, a, v);
+        } else if (table_find(&t->t, a)) {
+            table_set(&t->t, a, v);
+            symbol_release(a);
+        }
         break;
     case tag_function_tuple:
         apply(t->f.s, a, v);
@@ -64,6 +72,48 @@ boolean iterate(value e, binding_handler h)
     }
 }
 
+closure_function(3, 2, boolean, tuple_scan_each,
+                 u64, skip, symbol *, a, value *, v,
+                 value, s, value, v)
+{
+    if (bound(skip)) {
+        bound(skip)--;
+        return true;
+    }
+    *bound(a) = s;
+    *bound(v) = v;
+    return false;
+}
+
+/* Returns the value of the binding following *position and updates *position
+   and *a, or returns 0 at the end. Bindings of a table tuple are returned in a
+   stable order (see table_scan()), so a scan may be resumed at a position
+   after the tuple has changed. */
+value tuple_scan(tuple t, u64 *position, symbol *a)
+{
+    u16 tag = tagof(t);
+    switch (tag) {
+    case tag_table_tuple: {
+        entry e = table_scan(&t->t, position);
+        if (!e)
+            return 0;
+        *a = e->c;
+        return e->v;
+    }
+    case tag_function_tuple: {
+        /* no stable order; position counts bindings */
+        u64 index = (*position < TABLE_SCAN_START) ? 0 : *position - TABLE_SCAN_START + 1;
+        value v = 0;
+        apply(t->f.i, stack_closure(tuple_scan_each, index, a, &v));
+        if (v)
+            *position = TABLE_SCAN_START + index;
+        return v;
+    }
+    default:
+        assert(0);
+    }
+}
+
 closure_function(1, 2, boolean, tuple_count_each,
                  int *, count,
                  value, s, value, v)
@@ -138,6 +188,8 @@ closure_function(2, 2, boolean, destruct_tuple_each,
     } else if (v != null_value) {
         deallocate_value(v);
     }
+    if (tagof(bound(t)) == tag_table_tuple)
+        symbol_release(s);
     return true;
 }
 
@@ -238,7 +290,9 @@ value decode_value(heap h, table dictionary, buffer source, u64 *total,
             symbol s;
             if (imm) {
                 buffer n = wrap_buffer(transient, buffer_ref(source, 0), nlen);
-                s = intern(n);
+                /* the dictionary holds a reference for as long as the index
+                   may be used */
+                s = intern_ref(n);
                 drecord(dictionary, s);
                 source->start += nlen;                                
             } else {
@@ -288,6 +342,7 @@ void encode_symbol(buffer dest, table dictionary, symbol s)
         buffer sb = symbol_string(s);
         push_header(dest, immediate, type_buffer, buffer_length(sb));
         assert(push_buffer(dest, sb));
+        symbol_acquire(s);
         srecord(dictionary, s);
     }
 }
@@ -383,6 +438,20 @@ void encode_tuple(buffer dest, table dictionary, tuple t, u64 *total)
     iterate(t, stack_closure(encode_tuple_each, dest, dictionary, total));
 }
 
+/* Release the symbol references held by an encoding or decoding dictionary.
+   Dictionary indices are small integers, so whichever side of a pair is not
+   an index is the recorded object. */
+void deallocate_dictionary(table dictionary)
+{
+    u64 count = dictionary->count;
+    table_foreach(dictionary, k, v) {
+        void *x = (u64_from_pointer(k) <= count) ? v : k;
+        if (is_symbol(x))
+            symbol_release(x);
+    }
+    deallocate_table(dictionary);
+}
+
 void deallocate_value(tuple t)
 {
     value_tag tag = tagof(t);
@@ -21,6 +21,7 @@ union tuple {
 value get(value e, symbol a);
 void set(value e, symbol a, value v);
 boolean iterate(value e, binding_handler h);
+value tuple_scan(tuple t, u64 *position, symbol *a);
 
 void init_tuples(heap theap);
 int tuple_count(tuple t);
@@ -30,6 +31,7 @@ void destruct_tuple(tuple t, boolean recursive);
 void deallocate_value(tuple t);
 
 void encode_tuple(buffer dest, table dictionary, tuple t, u64 *total);
+void deallocate_dictionary(table dictionary);
 
 // h is for the bodies, the space for symbols and tuples are both implicit
 void *decode_value(heap h, table dictionary, buffer source, u64 *total,
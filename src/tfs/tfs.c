@@ -79,11 +79,7 @@ void fsfile_set_length(fsfile f, u64 length)
 
 u64 fsfile_get_blocks(fsfile f)
 {
-    u64 blocks = 0;
-    rangemap_foreach(f->extentmap, n) {
-        blocks += range_span(n->r);
-    }
-    return blocks;
+    return f->blocks;
 }
 
 sg_io fsfile_get_reader(fsfile f)
@@ -268,6 +264,7 @@ void ingest_extent(fsfile f, symbol off, tuple value)
     if (get(value, sym(uninited)))
         ex->uninited = INVALID_ADDRESS;
     assert(rangemap_insert(f->extentmap, &ex->node));
+    f->blocks += length;
 }
 
 closure_function(1, 2, boolean, tfs_ingest_extent,
@@ -353,6 +350,8 @@ void zero_blocks(filesystem fs, range blocks, merge m)
         deallocate_sg_list(sg);
         return;
     }
+    /* The zero buffers are only transferred if the device has no native way
+       of zeroing blocks. */
     range r = blocks;
     while (range_span(r) > 0) {
         u64 length = MIN(range_span(r), blocks_per_page);
@@ -364,7 +363,7 @@ void zero_blocks(filesystem fs, range blocks, merge m)
         r.start += length;
     }
     struct storage_req req = {
-        .op = STORAGE_OP_WRITESG,
+        .op = STORAGE_OP_ZERO,
         .blocks = blocks,
         .data = sg,
         .completion = zero_blocks_completion,
@@ -444,11 +443,11 @@ closure_function(2, 3, void, filesystem_storage_read,
 
     /* read extent data and zero gaps */
     range blocks = range_rshift_pad(q, fs->blocksize_order);
-    filesystem_lock(fs);
+    fsfile_lock(f);
     rangemap_range_lookup_with_gaps(f->extentmap, blocks,
                                     stack_closure(read_extent, fs, sg, m, blocks),
                                     stack_closure(zero_hole, fs, sg, blocks));
-    filesystem_unlock(fs);
+    fsfile_unlock(f);
     apply(k, STATUS_OK);
 }
 
@@ -544,45 +543,70 @@ fs_status filesystem_write_eav(filesystem fs, tuple t, symbol a, value v)
         return FS_STATUS_NOSPACE;
 }
 
+/* Called with the fsfile locked. */
 static fs_status filesystem_truncate_locked(filesystem fs, fsfile f, u64 len)
 {
+    fs_status s = FS_STATUS_OK;
+    filesystem_lock(fs);
     if (f->md) {
         value v = value_from_u64(fs->h, len);
-        if (v == INVALID_ADDRESS)
-            return FS_STATUS_NOMEM;
+        if (v == INVALID_ADDRESS) {
+            s = FS_STATUS_NOMEM;
+            goto out;
+        }
         symbol l = sym(filelength);
-        fs_status s = filesystem_write_eav(fs, f->md, l, v);
+        s = filesystem_write_eav(fs, f->md, l, v);
         if (s != FS_STATUS_OK)
-            return s;
+            goto out;
         set(f->md, l, v);
         filesystem_update_mtime(fs, f->md);
     }
-    fsfile_set_length(f, len);
-    return FS_STATUS_OK;
+  out:
+    filesystem_unlock(fs);
+    if (s == FS_STATUS_OK)
+        fsfile_set_length(f, len);
+    return s;
 }
 
 /* create a new extent in the filesystem
 
    The life an extent depends on a particular allocation of contiguous
    storage space. The extent is tied to this allocated area (nominally
-   page size). Only the extent data length may be updated; the file
-   offset, block start and allocation size are immutable. As an
-   optimization, adjacent extents on the disk could be joined into
-   larger extents with only a meta update.
+   page size). The file offset and block start are immutable; the data
+   length may be updated, and the allocation may grow into free storage
+   that follows it (see extent_grow()).
+
+   Storage for a new extent is allocated at or after the goal block, if
+   any, so that consecutive extents of a file tend to be contiguous on
+   disk.
 
 */
 
-static fs_status create_extent(filesystem fs, range blocks, boolean uninited, extent *ex)
+static u64 filesystem_allocate_storage_near(filesystem fs, u64 nblocks, u64 goal)
+{
+    if (fs->storage && goal != INVALID_PHYSICAL) {
+        u64 start_block = id_heap_alloc_subrange(fs->storage, nblocks, goal, infinity);
+        if (start_block != INVALID_PHYSICAL)
+            return start_block;
+    }
+    return filesystem_allocate_storage(fs, nblocks);
+}
+
+static fs_status create_extent(filesystem fs, range blocks, u64 alloc_blocks, u64 goal,
+                               boolean uninited, extent *ex)
 {
     heap h = fs->h;
-    u64 nblocks = MAX(range_span(blocks), MIN_EXTENT_SIZE >> fs->blocksize_order);
+    u64 nblocks = MAX(range_span(blocks), alloc_blocks);
 
     tfs_debug("create_extent: blocks %R, uninited %p, nblocks %ld\n", blocks, uninited, nblocks);
-    if (!filesystem_reserve_log_space(fs, &fs->next_extend_log_offset, 0, 0) ||
-        !filesystem_reserve_log_space(fs, &fs->next_new_log_offset, 0, 0))
+    filesystem_lock(fs);
+    boolean log_space = filesystem_reserve_log_space(fs, &fs->next_extend_log_offset, 0, 0) &&
+        filesystem_reserve_log_space(fs, &fs->next_new_log_offset, 0, 0);
+    filesystem_unlock(fs);
+    if (!log_space)
         return FS_STATUS_NOSPACE;
 
-    u64 start_block = filesystem_allocate_storage(fs, nblocks);
+    u64 start_block = filesystem_allocate_storage_near(fs, nblocks, goal);
     if (start_block == u64_from_pointer(INVALID_ADDRESS))
         return FS_STATUS_NOSPACE;
 
@@ -607,8 +631,11 @@ static void destroy_extent(filesystem fs, extent ex)
     deallocate(fs->h, ex, sizeof(*ex));
 }
 
+/* Extent helpers are called with the fsfile locked; they take the filesystem
+   lock to update the file metadata. */
 static fs_status add_extent_to_file(fsfile f, extent ex)
 {
+    filesystem_lock(f->fs);
     if (f->md) {
         heap h = f->fs->h;
         tuple extents;
@@ -617,6 +644,7 @@ static fs_status add_extent_to_file(fsfile f, extent ex)
             extents = allocate_tuple();
             fs_status s = filesystem_write_eav(f->fs, f->md, a, extents);
             if (s != FS_STATUS_OK) {
+                filesystem_unlock(f->fs);
                 deallocate_value(extents);
                 return s;
             }
@@ -631,19 +659,24 @@ static fs_status add_extent_to_file(fsfile f, extent ex)
         set(e, sym(allocated), value_from_u64(h, ex->allocated));
         if (ex->uninited == INVALID_ADDRESS)
             set(e, sym(uninited), null_value);
-        symbol offs = intern_u64(ex->node.r.start);
+        symbol offs = intern_u64_ref(ex->node.r.start);
         fs_status s = filesystem_write_eav(f->fs, extents, offs, e);
+        if (s == FS_STATUS_OK)
+            set(extents, offs, e);
+        symbol_release(offs);
         if (s != FS_STATUS_OK) {
+            filesystem_unlock(f->fs);
             destruct_tuple(e, true);
             return s;
         }
-        set(extents, offs, e);
     }
+    filesystem_unlock(f->fs);
     tfs_debug("%s: f %p, reserve %R\n", __func__, f, ex->node.r);
     if (!rangemap_insert(f->extentmap, &ex->node)) {
         rbtree_dump(&f->extentmap->t, RB_INORDER);
         assert(0);
     }
+    f->blocks += range_span(ex->node.r);
     return FS_STATUS_OK;
 }
 
@@ -652,14 +685,18 @@ static void remove_extent_from_file(fsfile f, extent ex)
     /* The tuple corresponding to this extent will be destroyed when the
      * filesystem log is compacted. */
 
+    filesystem_lock(f->fs);
     if (f->md) {
         tuple extents = get(f->md, sym(extents));
         assert(extents);
-        symbol offs = intern_u64(ex->node.r.start);
+        symbol offs = intern_u64_ref(ex->node.r.start);
         filesystem_write_eav(f->fs, extents, offs, 0);
         set(extents, offs, 0);
+        symbol_release(offs);
     }
+    filesystem_unlock(f->fs);
     rangemap_remove_node(f->extentmap, &ex->node);
+    f->blocks -= range_span(ex->node.r);
 }
 
 static fs_status add_extents(filesystem fs, range i, rangemap rm)
@@ -668,14 +705,16 @@ static fs_status add_extents(filesystem fs, range i, rangemap rm)
     fs_status fss;
     while (range_span(i) >= MAX_EXTENT_SIZE) {
         range r = {.start = i.start, .end = i.start + MAX_EXTENT_SIZE};
-        fss = create_extent(fs, r, true, &ex);
+        fss = create_extent(fs, r, MIN_EXTENT_SIZE >> fs->blocksize_order, INVALID_PHYSICAL,
+                            true, &ex);
         if (fss != FS_STATUS_OK)
             return fss;
         assert(rangemap_insert(rm, &ex->node));
         i.start += MAX_EXTENT_SIZE;
     }
     if (range_span(i)) {
-        fss = create_extent(fs, i, true, &ex);
+        fss = create_extent(fs, i, MIN_EXTENT_SIZE >> fs->blocksize_order, INVALID_PHYSICAL,
+                            true, &ex);
         if (fss != FS_STATUS_OK)
             return fss;
         assert(rangemap_insert(rm, &ex->node));
@@ -758,18 +797,21 @@ static u64 write_extent(fsfile f, extent ex, sg_list sg, range blocks, merge m)
 
     if (ex->uninited == INVALID_ADDRESS) {
         /* Begin process of normalizing uninited extent */
+        filesystem_lock(fs);
         if (f->md) {
             assert(ex->md);
             symbol a = sym(uninited);
             tfs_debug("%s: log write %p, %p\n", __func__, ex->md, a);
             fs_status fss = filesystem_write_eav(fs, ex->md, a, 0);
             if (fss != FS_STATUS_OK) {
+                filesystem_unlock(fs);
                 apply(apply_merge(m), timm("result", "failed to write log",
                                            "fsstatus", "%d", fss));
                 return i.end;
             }
             set(ex->md, a, 0);
         }
+        filesystem_unlock(fs);
         ex->uninited = allocate_uninited(fs, apply_merge(m));
         tfs_debug("%s: new uninited %p\n", __func__, ex->uninited);
         if (ex->uninited == INVALID_ADDRESS)
@@ -812,13 +854,38 @@ static u64 write_extent(fsfile f, extent ex, sg_list sg, range blocks, merge m)
     return i.end;
 }
 
+/* Space for a file growing at its end is preallocated by rounding up to a
+   power of two. This bounds the unused space by the size of the data, while
+   the number of allocations for a file extended with small appends grows
+   only logarithmically with its size. */
+static u64 extent_prealloc_blocks(fsfile f, u64 nblocks)
+{
+    int order = f->fs->blocksize_order;
+    if (f->blocks > 0)
+        nblocks = U64_FROM_BIT(find_order(nblocks));
+    return MIN(MAX(nblocks, MIN_EXTENT_SIZE >> order), MAX_EXTENT_SIZE >> order);
+}
+
 static fs_status fill_gap(fsfile f, sg_list sg, range blocks, merge m, u64 *edge)
 {
     blocks = irangel(blocks.start, MIN(MAX_EXTENT_SIZE >> f->fs->blocksize_order,
                                        range_span(blocks)));
     tfs_debug("   %s: writing new extent blocks %R\n", __func__, blocks);
+
+    /* place the extent after the storage of the preceding one */
+    u64 alloc_blocks = MIN_EXTENT_SIZE >> f->fs->blocksize_order;
+    u64 goal = INVALID_PHYSICAL;
+    rmnode prev = rangemap_lookup_max_lte(f->extentmap, blocks.start);
+    if (prev != INVALID_ADDRESS) {
+        extent pex = (extent)prev;
+        goal = pex->start_block + pex->allocated;
+        if (rangemap_next_node(f->extentmap, prev) == INVALID_ADDRESS)
+            alloc_blocks = extent_prealloc_blocks(f, range_span(blocks));
+    } else if (rangemap_first_node(f->extentmap) == INVALID_ADDRESS) {
+        alloc_blocks = extent_prealloc_blocks(f, range_span(blocks));
+    }
     extent ex;
-    fs_status fss = create_extent(f->fs, blocks, false, &ex);
+    fs_status fss = create_extent(f->fs, blocks, alloc_blocks, goal, false, &ex);
     if (fss != FS_STATUS_OK)
         return fss;
     fss = add_extent_to_file(f, ex);
@@ -834,28 +901,72 @@ static fs_status fill_gap(fsfile f, sg_list sg, range blocks, merge m, u64 *edge
 
 static fs_status update_extent_length(fsfile f, extent ex, u64 new_length)
 {
+    filesystem_lock(f->fs);
     if (f->md) {
         assert(ex->md);
         value v = value_from_u64(f->fs->h, new_length);
         symbol l = sym(length);
         fs_status s = filesystem_write_eav(f->fs, ex->md, l, v);
-        if (s != FS_STATUS_OK)
+        if (s != FS_STATUS_OK) {
+            filesystem_unlock(f->fs);
             return s;
+        }
         value oldval = get(ex->md, l);
         assert(oldval);
         deallocate_value(oldval);
         set(ex->md, l, v);
     }
+    filesystem_unlock(f->fs);
 
     /* TODO cheating; should be reinsert - update rangemap interface? */
     tfs_debug("   %s: was %R\n", __func__, ex->node.r);
+    f->blocks += new_length - range_span(ex->node.r);
     ex->node.r = irangel(ex->node.r.start, new_length);
     tfs_debug("   %s: now %R\n", __func__, ex->node.r);
     return FS_STATUS_OK;
 }
 
+/* Grow the allocation of an extent into the storage that follows it, if free. */
+static boolean extent_grow(fsfile f, extent ex, u64 nblocks)
+{
+    filesystem fs = f->fs;
+    range r = irangel(ex->start_block + ex->allocated, nblocks - ex->allocated);
+    if (!filesystem_reserve_storage(fs, r))
+        return false;
+    filesystem_lock(fs);
+    if (f->md) {
+        assert(ex->md);
+        value v = value_from_u64(fs->h, nblocks);
+        symbol a = sym(allocated);
+        fs_status s = filesystem_write_eav(fs, ex->md, a, v);
+        if (s != FS_STATUS_OK) {
+            filesystem_unlock(fs);
+            deallocate_value(v);
+            filesystem_free_storage(fs, r);
+            return false;
+        }
+        value oldval = get(ex->md, a);
+        assert(oldval);
+        deallocate_value(oldval);
+        set(ex->md, a, v);
+    }
+    filesystem_unlock(fs);
+    tfs_debug("   %s: ex %p, allocated %ld -> %ld\n", __func__, ex, ex->allocated, nblocks);
+    ex->allocated = nblocks;
+    return true;
+}
+
 static fs_status extend(fsfile f, extent ex, sg_list sg, range blocks, merge m, u64 *edge)
 {
+    u64 needed = MIN(blocks.end - ex->node.r.start, MAX_EXTENT_SIZE >> f->fs->blocksize_order);
+    /* grow only for writes that are contiguous with the allocation, so
+       that holes remain unallocated */
+    if (needed > ex->allocated && !ex->uninited &&
+        blocks.start <= ex->node.r.start + ex->allocated) {
+        u64 prealloc = extent_prealloc_blocks(f, needed);
+        if (!extent_grow(f, ex, prealloc) && prealloc > needed)
+            extent_grow(f, ex, needed);
+    }
     u64 free = ex->allocated - range_span(ex->node.r);
     range r = irangel(ex->node.r.end, free);
     range i = range_intersection(r, blocks);
@@ -963,9 +1074,9 @@ closure_function(2, 1, status, filesystem_check_or_reserve_extent,
     range blocks = range_rshift_pad(q, fs->blocksize_order);
     tfs_debug("%s: file %p range %R blocks %R\n", __func__, f, q, blocks);
 
-    filesystem_lock(fs);
+    fsfile_lock(f);
     status s = extents_range_handler(fs, f, blocks, 0, 0);
-    filesystem_unlock(fs);
+    fsfile_unlock(f);
     return s;
 }
 
@@ -985,7 +1096,7 @@ closure_function(2, 3, void, filesystem_storage_write,
     merge m = allocate_merge(fs->h, complete);
     status_handler sh = apply_merge(m);
 
-    filesystem_lock(fs);
+    fsfile_lock(f);
     status s = extents_range_handler(fs, f, blocks, sg, m);
     if (s != STATUS_OK)
         goto out;
@@ -999,7 +1110,7 @@ closure_function(2, 3, void, filesystem_storage_write,
         }
     }
   out:
-    filesystem_unlock(fs);
+    fsfile_unlock(f);
     apply(sh, s);
 }
 
@@ -1032,11 +1143,13 @@ void filesystem_write_linear(fsfile f, void *src, range q, io_status_handler io_
 
 fs_status filesystem_truncate(filesystem fs, fsfile f, u64 len)
 {
-    filesystem_lock(fs);
+    fsfile_lock(f);
     fs_status fss = filesystem_truncate_locked(fs, f, len);
+    filesystem_lock(fs);
     if (f->md)
         fs_notify_modify(f->md);
     filesystem_unlock(fs);
+    fsfile_unlock(f);
     return fss;
 }
 
@@ -1062,13 +1175,102 @@ closure_function(3, 1, void, log_flush_completed,
     }
 }
 
+static void filesystem_flush_group(filesystem fs);
+
+closure_function(2, 1, void, flush_group_complete,
+                 filesystem, fs, vector, group,
+                 status, s)
+{
+    filesystem fs = bound(fs);
+    vector group = bound(group);
+    filesystem_lock(fs);
+    fs->flushing = false;
+    if (vector_length(fs->flush_waiters) > 0)
+        filesystem_flush_group(fs);
+    filesystem_unlock(fs);
+
+    /* The filesystem may be destroyed by a completion. */
+    status_handler sh;
+    boolean first = true;
+    vector_foreach(group, sh) {
+        /* each completion may consume its status */
+        apply(sh, (first || is_ok(s)) ? s : timm("result", "filesystem flush failed"));
+        first = false;
+    }
+    deallocate_vector(group);
+    closure_finish();
+}
+
+/* With nothing to write, the log flush, volume sync and storage flush may all
+   complete synchronously, within log_flush() and with the filesystem lock
+   held; the group is then completed from the runloop. */
+closure_function(1, 1, void, flush_group_defer,
+                 status_handler, sh,
+                 status, s)
+{
+#ifdef KERNEL
+    async_apply_status_handler(bound(sh), s);
+#else
+    apply(bound(sh), s);
+#endif
+    closure_finish();
+}
+
+/* Flush requests made while a flush is in progress wait for it to complete
+   and are then committed as a group, sharing one log write, one volume sync
+   and one storage flush. */
+static void filesystem_flush_group(filesystem fs)
+{
+    vector group = fs->flush_waiters;
+    fs->flush_waiters = allocate_vector(fs->h, vector_length(group));
+    assert(fs->flush_waiters != INVALID_ADDRESS);
+    status_handler sh = closure(fs->h, flush_group_complete, fs, group);
+    assert(sh != INVALID_ADDRESS);
+    sh = closure(fs->h, flush_group_defer, sh);
+    assert(sh != INVALID_ADDRESS);
+    fs->flushing = true;
+    fs->flush_commits++;
+    log_flush(fs->tl, closure(fs->h, log_flush_completed, fs, sh, false));
+}
+
 void filesystem_flush(filesystem fs, status_handler completion)
 {
     filesystem_lock(fs);
-    log_flush(fs->tl, closure(fs->h, log_flush_completed, fs, completion, false));
+    fs->flush_requests++;
+    vector_push(fs->flush_waiters, completion);
+    if (!fs->flushing)
+        filesystem_flush_group(fs);
     filesystem_unlock(fs);
 }
 
+#ifdef KERNEL
+closure_function(2, 0, value, fs_get_stat,
+                 u64 *, p, value, v)
+{
+    return value_rewrite_u64(bound(v), *bound(p));
+}
+
+#define register_fs_stat(fs, n, t, name)                                \
+    v = value_from_u64(fs->h, 0);                                       \
+    s = sym(name);                                                      \
+    set(t, s, v);                                                       \
+    tuple_notifier_register_get_notify(n, s, closure(fs->h, fs_get_stat, &fs->name, v));
+
+void init_filesystem_management(filesystem fs, tuple root)
+{
+    value v;
+    symbol s;
+    tuple t = allocate_tuple();
+    assert(t != INVALID_ADDRESS);
+    tuple_notifier n = tuple_notifier_wrap(t);
+    assert(n != INVALID_ADDRESS);
+    register_fs_stat(fs, n, t, flush_requests);
+    register_fs_stat(fs, n, t, flush_commits);
+    set(t, sym(no_encode), null_value);
+    set(root, sym(tfs), n);
+}
+#endif
+
 void filesystem_reserve(filesystem fs)
 {
     refcount_reserve(&fs->refcount);
@@ -1148,7 +1350,7 @@ void filesystem_alloc(fsfile f, long offset, long len,
     assert(new_rm != INVALID_ADDRESS);
     fs_status status = FS_STATUS_OK;
 
-    filesystem_lock(fs);
+    fsfile_lock(f);
     u64 lastedge = blocks.start;
     rmnode curr = rangemap_first_node(f->extentmap);
     while (curr != INVALID_ADDRESS) {
@@ -1181,7 +1383,7 @@ void filesystem_alloc(fsfile f, long offset, long len,
 done:
     deallocate_rangemap(new_rm, status == FS_STATUS_OK ? stack_closure(assert_no_node) :
                         stack_closure(destroy_extent_node, fs));
-    filesystem_unlock(fs);
+    fsfile_unlock(f);
     apply(completion, f, status);
 }
 
@@ -1291,7 +1493,7 @@ static void file_unlink(filesystem fs, tuple t)
 fs_status do_mkentry(filesystem fs, tuple parent, const char *name, tuple entry,
                      boolean persistent)
 {
-    symbol name_sym = sym_this(name);
+    symbol name_sym = sym_this_ref(name);
     tuple c = children(parent);
     fs_status s;
 
@@ -1309,6 +1511,7 @@ fs_status do_mkentry(filesystem fs, tuple parent, const char *name, tuple entry,
         fs_notify_create(entry, parent, name_sym);
     }
     fixup_directory(parent, entry);
+    symbol_release(name_sym);
     return s;
 }
 
@@ -1331,7 +1534,12 @@ fs_status filesystem_mkentry(filesystem fs, tuple cwd, const char *fp, tuple ent
     /* find the folder we need to mkentry in */
     while ((token = runtime_strtok_r(rest, "/", &rest))) {
         boolean final = *rest == '\0';
-        tuple t = lookup(parent, sym_this(token));
+        symbol name_sym = sym_find(token);
+        tuple t = 0;
+        if (name_sym) {
+            t = lookup(parent, name_sym);
+            symbol_release(name_sym);
+        }
         if (!t) {
             if (!final) {
                 if (recursive) {
@@ -1402,7 +1610,7 @@ fs_status filesystem_mkdir(filesystem fs, inode cwd, const char *path)
     }
     tuple dir = fs_new_entry(fs);
     set(dir, sym(children), allocate_tuple());
-    symbol name_sym = intern(name);
+    symbol name_sym = intern_ref(name);
     fss = fs_set_dir_entry(fs, parent, name_sym, dir);
     if (fss == FS_STATUS_OK) {
         table_set(fs->files, dir, INVALID_ADDRESS);
@@ -1410,6 +1618,7 @@ fs_status filesystem_mkdir(filesystem fs, inode cwd, const char *path)
     } else {
         destruct_dir_entry(dir);
     }
+    symbol_release(name_sym);
   out:
     filesystem_unlock(fs);
     filesystem_release(fs);
@@ -1459,7 +1668,7 @@ fs_status filesystem_get_node(filesystem *fs, inode cwd, const char *path, boole
             fsf = allocate_fsfile(*fs, t);
             if (fsf != INVALID_ADDRESS) {
                 fsfile_set_length(fsf, 0);
-                symbol name = sym_this(filename_from_path(path));
+                symbol name = sym_this_ref(filename_from_path(path));
                 fss = fs_set_dir_entry(*fs, parent, name, t);
                 if (fss != FS_STATUS_OK) {
                     table_set((*fs)->files, t, 0);
@@ -1467,6 +1676,7 @@ fs_status filesystem_get_node(filesystem *fs, inode cwd, const char *path, boole
                 } else {
                     fs_notify_create(t, parent, name);
                 }
+                symbol_release(name);
             } else {
                 fss = FS_STATUS_NOMEM;
             }
@@ -1539,7 +1749,7 @@ fs_status filesystem_symlink(filesystem fs, inode cwd, const char *path, const c
         goto out;
     tuple link = fs_new_entry(fs);
     set(link, sym(linktarget), buffer_cstring(fs->h, target));
-    symbol name = sym_this(filename_from_path(path));
+    symbol name = sym_this_ref(filename_from_path(path));
     fss = fs_set_dir_entry(fs, parent, name, link);
     if (fss != FS_STATUS_OK) {
         destruct_dir_entry(link);
@@ -1547,6 +1757,7 @@ fs_status filesystem_symlink(filesystem fs, inode cwd, const char *path, const c
         table_set(fs->files, link, INVALID_ADDRESS);
         fs_notify_create(link, parent, name);
     }
+    symbol_release(name);
   out:
     filesystem_unlock(fs);
     filesystem_release(fs);
@@ -1579,10 +1790,12 @@ fs_status filesystem_delete(filesystem fs, inode cwd, const char *path, boolean
             goto out;
         }
     }
-    symbol name = sym_this(filename_from_path(path));
+    symbol name = sym_this_ref(filename_from_path(path));
     fss = fs_set_dir_entry(fs, parent, name, 0);
-    if (fss == FS_STATUS_OK) {
+    if (fss == FS_STATUS_OK)
         fs_notify_delete(t, parent, name);
+    symbol_release(name);
+    if (fss == FS_STATUS_OK) {
         file_unlink(fs, t);
         goto release;
     }
@@ -1671,13 +1884,16 @@ fs_status filesystem_rename(filesystem oldfs, inode oldwd, const char *oldpath,
         s = FS_STATUS_OK;
         goto out;
     }
-    symbol old_s = sym_this(filename_from_path(oldpath));
-    symbol new_s = sym_this(filename_from_path(newpath));
+    symbol old_s = sym_this_ref(filename_from_path(oldpath));
+    symbol new_s = sym_this_ref(filename_from_path(newpath));
     s = fs_set_dir_entry(newfs, newparent, new_s, old);
     if (s == FS_STATUS_OK)
         s = fs_set_dir_entry(oldfs, oldparent, old_s, 0);
-    if (s == FS_STATUS_OK) {
+    if (s == FS_STATUS_OK)
         fs_notify_move(old, oldparent, old_s, newparent, new_s);
+    symbol_release(old_s);
+    symbol_release(new_s);
+    if (s == FS_STATUS_OK) {
         if (new) {
             file_unlink(newfs, new);
             goto release;
@@ -1740,9 +1956,13 @@ fs_status filesystem_exchange(filesystem fs1, inode wd1, const char *path1,
         s = FS_STATUS_INVAL;
         goto out;
     }
-    s = fs_set_dir_entry(fs1, parent1, sym_this(filename_from_path(path1)), n2);
+    symbol name1 = sym_this_ref(filename_from_path(path1));
+    symbol name2 = sym_this_ref(filename_from_path(path2));
+    s = fs_set_dir_entry(fs1, parent1, name1, n2);
     if (s == FS_STATUS_OK)
-        s = fs_set_dir_entry(fs2, parent2, sym_this(filename_from_path(path2)), n1);
+        s = fs_set_dir_entry(fs2, parent2, name2, n1);
+    symbol_release(name1);
+    symbol_release(name2);
   out:
     filesystem_unlock(fs_to_unlock);
     filesystem_release(fs1);
@@ -1825,6 +2045,8 @@ fsfile allocate_fsfile(filesystem fs, tuple md)
     f->fs = fs;
     f->md = md;
     f->length = 0;
+    f->blocks = 0;
+    fsfile_lock_init(f);
     if (md)
         table_set(fs->files, md, f);
     f->cache_node = pn;
@@ -1881,16 +2103,22 @@ boolean filesystem_reserve_log_space(filesystem fs, u64 *next_offset, u64 *offse
 {
     if (size == 0)
         size = filesystem_log_blocks(fs);
+    boolean reserved = true;
+    log_space_lock(fs);
     if (*next_offset == INVALID_PHYSICAL) {
         *next_offset = filesystem_allocate_storage(fs, size);
-        if (*next_offset == INVALID_PHYSICAL)
-            return false;
+        if (*next_offset == INVALID_PHYSICAL) {
+            reserved = false;
+            goto out;
+        }
     }
     if (offset) {
         *offset = *next_offset;
         *next_offset = filesystem_allocate_storage(fs, size);
     }
-    return true;
+  out:
+    log_space_unlock(fs);
+    return reserved;
 }
 
 void create_filesystem(heap h,
@@ -1919,12 +2147,18 @@ void create_filesystem(heap h,
     fs->pv = pagecache_allocate_volume(size, fs->blocksize_order);
     assert(fs->pv != INVALID_ADDRESS);
 #ifndef TFS_READ_ONLY
-    fs->storage = create_id_heap(h, h, 0, size >> fs->blocksize_order, 1, false);
+    /* storage is allocated with either the filesystem or an fsfile locked */
+    fs->storage = create_id_heap(h, h, 0, size >> fs->blocksize_order, 1, true);
     assert(fs->storage != INVALID_ADDRESS);
     fs->temp_log = 0;
+    fs->flush_waiters = allocate_vector(h, 8);
+    assert(fs->flush_waiters != INVALID_ADDRESS);
+    fs->flushing = false;
+    fs->flush_requests = fs->flush_commits = 0;
     init_refcount(&fs->refcount, 1, init_closure(&fs->sync, fs_sync, fs));
     fs->sync_complete = 0;
     filesystem_lock_init(fs);
+    log_space_lock_init(fs);
 #else
     fs->storage = 0;
 #endif
@@ -1965,6 +2199,7 @@ void destroy_filesystem(filesystem fs)
         destruct_dir_entry(fs->root);
     pagecache_dealloc_volume(fs->pv);
     deallocate_table(fs->files);
+    deallocate_vector(fs->flush_waiters);
     destroy_id_heap(fs->storage);
     deallocate(fs->h, fs, sizeof(*fs));
 }
@@ -2034,7 +2269,7 @@ static tuple lookup_follow(filesystem *fs, tuple t, symbol a, tuple *p)
                 t = child_fs->root;
                 *fs = child_fs;
             }
-        } else if ((t == *p) && (a == sym_this("..")) &&
+        } else if ((t == *p) && (a == sym(..)) &&
                    (t != filesystem_getroot(fs_path_helper.get_root_fs()))) {
             /* t is the root of its filesystem: look for a mount point for this
              * filesystem, and if found look up the parent of the mount directory.
@@ -2062,6 +2297,19 @@ static tuple lookup_follow(filesystem *fs, tuple t, symbol a, tuple *p)
     return t;
 }
 
+static tuple lookup_follow_name(filesystem *fs, tuple t, buffer name, tuple *p)
+{
+    /* a name that was never interned cannot be in any directory */
+    symbol a = symbol_find(name);
+    if (!a) {
+        *p = t;
+        return 0;
+    }
+    t = lookup_follow(fs, t, a, p);
+    symbol_release(a);
+    return t;
+}
+
 /* Called with the filesystem pointed to by 'fs' locked.
  * If the file path being resolved crosses a filesystem boundary (i.e. a mount
  * point), the current filesystem is unlocked, the new filesystem is locked, and the 'fs' argument
@@ -2097,7 +2345,7 @@ int filesystem_resolve_cstring(filesystem *fs, tuple cwd, const char *f, tuple *
     while ((y = *f)) {
         if (y == '/') {
             if (buffer_length(a)) {
-                t = lookup_follow(fs, t, intern(a), &p);
+                t = lookup_follow_name(fs, t, a, &p);
                 if (!t) {
                     err = FS_STATUS_NOENT;
                     goto done;
@@ -2127,7 +2375,7 @@ int filesystem_resolve_cstring(filesystem *fs, tuple cwd, const char *f, tuple *
     if (buffer_length(a)) {
         if (!children(t))
             return FS_STATUS_NOTDIR;
-        t = lookup_follow(fs, t, intern(a), &p);
+        t = lookup_follow_name(fs, t, a, &p);
     }
     err = FS_STATUS_NOENT;
 done:
@@ -43,6 +43,7 @@ void filesystem_read_linear(fsfile f, void *dest, range q, io_status_handler com
 void filesystem_write_linear(fsfile f, void *src, range q, io_status_handler completion);
 
 void filesystem_flush(filesystem fs, status_handler completion);
+void init_filesystem_management(filesystem fs, tuple root);
 
 void filesystem_reserve(filesystem fs);
 void filesystem_release(filesystem fs);
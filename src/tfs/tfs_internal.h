@@ -15,12 +15,28 @@
 #define filesystem_lock(fs)         spin_lock(&(fs)->lock)
 #define filesystem_unlock(fs)       spin_unlock(&(fs)->lock)
 
+#define log_space_lock_init(fs)     spin_lock_init(&(fs)->log_space_lock)
+#define log_space_lock(fs)          spin_lock(&(fs)->log_space_lock)
+#define log_space_unlock(fs)        spin_unlock(&(fs)->log_space_lock)
+
+#define fsfile_lock_init(f)         spin_lock_init(&(f)->lock)
+#define fsfile_lock(f)              spin_lock(&(f)->lock)
+#define fsfile_unlock(f)            spin_unlock(&(f)->lock)
+
 #else
 
 #define filesystem_lock_init(fs)
 #define filesystem_lock(fs)         ((void)fs)
 #define filesystem_unlock(fs)       ((void)fs)
 
+#define log_space_lock_init(fs)
+#define log_space_lock(fs)          ((void)fs)
+#define log_space_unlock(fs)        ((void)fs)
+
+#define fsfile_lock_init(f)
+#define fsfile_lock(f)              ((void)f)
+#define fsfile_unlock(f)            ((void)f)
+
 #endif
 
 typedef struct log *log;
@@ -52,8 +68,12 @@ typedef struct filesystem {
     u64 next_extend_log_offset;
     u64 next_new_log_offset;
     tuple root;
+    vector flush_waiters;       /* flush requests for the next group commit */
+    boolean flushing;
+    u64 flush_requests, flush_commits;
 #ifdef KERNEL
     struct spinlock lock;
+    struct spinlock log_space_lock;
 #endif
     struct refcount refcount;
     closure_struct(fs_sync, sync);
@@ -65,12 +85,26 @@ declare_closure_struct(1, 1, void, fsf_sync_complete,
                        struct fsfile *, f,
                        status, s);
 
+/* The filesystem lock protects the namespace (tuples); path walks and
+   namespace operations are serialized per filesystem. Each log has its own
+   lock, protecting its staging buffers, extensions and flush state, so that
+   log flushes don't hold the filesystem lock; log writes, which encode
+   tuples, and log compaction, which encodes the whole namespace, take it
+   after the filesystem lock. The log space lock protects the storage log
+   offsets, shared by the log and the one being rebuilt. The fsfile lock
+   protects the extent map of a file, so that I/O to different files, and
+   reads, don't contend on the filesystem lock; it is taken before the
+   filesystem lock when both are needed. */
 typedef struct fsfile {
     rangemap extentmap;
     filesystem fs;
     pagecache_node cache_node;
     u64 length;
+    u64 blocks;     /* total span of extents, readable without the fsfile lock */
     tuple md;
+#ifdef KERNEL
+    struct spinlock lock;
+#endif
     sg_io read;
     sg_io write;
     struct refcount refcount;
@@ -22,6 +22,7 @@ static const char *tfs_magic = "NVMTFS";
 #define LOG_EXTENSION_LINK 5
 
 #define COMPLETION_QUEUE_SIZE 10
+#define TLOG_REPLAY_DEPTH 4     /* extensions read ahead of the one being replayed */
 
 #define MAX_VARINT_SIZE 10 /* to encode 64 significant bits */
 
@@ -33,21 +34,34 @@ static const char *tfs_magic = "NVMTFS";
 typedef struct log *log;
 typedef struct log_ext *log_ext;
 
-#define tlog_lock(tl)       filesystem_lock((tl)->fs)
-#define tlog_unlock(tl)     filesystem_unlock((tl)->fs)
-
 #ifdef KERNEL
 
+#define tlog_lock_init(tl)         spin_lock_init(&(tl)->lock)
+#define tlog_lock(tl)              spin_lock(&(tl)->lock)
+#define tlog_unlock(tl)            spin_unlock(&(tl)->lock)
+
 #define tlog_ext_lock_init(ext)    spin_lock_init(&(ext)->lock)
 #define tlog_ext_lock(ext)         spin_lock(&(ext)->lock)
 #define tlog_ext_unlock(ext)       spin_unlock(&(ext)->lock)
 
+#define tlog_replay_lock_init(tl)  spin_lock_init(&(tl)->replay_lock)
+#define tlog_replay_lock(tl)       spin_lock(&(tl)->replay_lock)
+#define tlog_replay_unlock(tl)     spin_unlock(&(tl)->replay_lock)
+
 #else
 
+#define tlog_lock_init(tl)
+#define tlog_lock(tl)              ((void)tl)
+#define tlog_unlock(tl)            ((void)tl)
+
 #define tlog_ext_lock_init(ext)
 #define tlog_ext_lock(ext)
 #define tlog_ext_unlock(ext)
 
+#define tlog_replay_lock_init(tl)
+#define tlog_replay_lock(tl)
+#define tlog_replay_unlock(tl)
+
 #endif
 
 declare_closure_struct(1, 1, void, log_ext_sync_complete,
@@ -60,6 +74,11 @@ struct log_ext {
     log tl;
     buffer staging;
     boolean open;
+    boolean loaded;             /* read from storage during replay */
+    boolean chained;            /* read of the linked extension claimed */
+    status read_status;
+    range link;                 /* linked extension, if any, found on load */
+    log_ext next;               /* replay read-ahead queue */
 
     pagecache_node cache_node;
     range sectors;
@@ -88,11 +107,28 @@ struct log {
     u64 tuple_bytes_remain;
 
     struct timer flush_timer;
-    vector flush_completions;
-    boolean dirty;
+    vector flush_completions;   /* waiting for the flush in progress */
+    vector flush_next;          /* waiting for the next flush */
+    boolean dirty;              /* written since the last flush started */
     boolean flushing;
+    boolean flush_again;        /* flush requested while flushing */
     boolean compacting;
     boolean failed;             /* unrecoverable log failure */
+#ifdef KERNEL
+    struct spinlock lock;
+#endif
+
+    /* replay state */
+    log_ext replay_tail;        /* last extension read ahead */
+    u64 replay_depth;           /* extensions queued after current */
+    status_handler replay_complete;
+    status replay_status;
+    boolean replay_done;
+    boolean replaying;
+#ifdef KERNEL
+    struct spinlock replay_lock;
+#endif
+
     struct refcount refcount;
     closure_struct(log_free, free);
 };
@@ -151,6 +187,11 @@ static log_ext open_log_extension(log tl, range sectors)
     if (ext->staging == INVALID_ADDRESS)
         goto fail_dealloc;
     ext->open = false;
+    ext->loaded = false;
+    ext->chained = false;
+    ext->read_status = STATUS_OK;
+    ext->link = irange(0, 0);
+    ext->next = 0;
     sg_io r_op = closure(tl->h, log_storage_op, tl->fs, sectors.start, false);
     sg_io w_op = closure(tl->h, log_storage_op, tl->fs, sectors.start, true);
     ext->cache_node = pagecache_allocate_node(tl->fs->pv, r_op, w_op, 0);
@@ -230,14 +271,24 @@ static log log_new(heap h, filesystem fs)
     tl->flush_completions = allocate_vector(tl->h, COMPLETION_QUEUE_SIZE);
     if (tl->flush_completions == INVALID_ADDRESS)
         goto fail_dealloc_encoding_lengths;
+    tl->flush_next = allocate_vector(tl->h, COMPLETION_QUEUE_SIZE);
+    if (tl->flush_next == INVALID_ADDRESS)
+        goto fail_dealloc_completions;
+    tl->flush_again = false;
     tl->total_entries = tl->obsolete_entries = 0;
+    tl->replay_tail = 0;
+    tl->replay_depth = 0;
+    tl->replay_done = false;
+    tl->replaying = false;
+    tlog_replay_lock_init(tl);
 #ifndef TLOG_READ_ONLY
     tl->extensions = allocate_rangemap(h);
     if (tl->extensions == INVALID_ADDRESS) {
-        goto fail_dealloc_completions;
+        goto fail_dealloc_next;
     }
     tl->compacting = false;
     tl->failed = false;
+    tlog_lock_init(tl);
     init_refcount(&tl->refcount, 1, init_closure(&tl->free, log_free, tl));
 #endif
     range sectors = irange(0, TFS_LOG_INITIAL_SIZE >> fs->blocksize_order);
@@ -246,9 +297,11 @@ static log log_new(heap h, filesystem fs)
 #ifndef TLOG_READ_ONLY
         deallocate_rangemap(tl->extensions, stack_closure(log_dealloc_ext_node, tl));
 #endif
-        goto fail_dealloc_completions;
+        goto fail_dealloc_next;
     }
     return tl;
+  fail_dealloc_next:
+    deallocate_vector(tl->flush_next);
   fail_dealloc_completions:
     deallocate_vector(tl->flush_completions);
   fail_dealloc_encoding_lengths:
@@ -475,16 +528,28 @@ static void run_flush_completions(log tl, status s)
     }
 }
 
+static void log_flush_start(log tl);
+
 closure_function(1, 1, void, log_flush_complete,
                  log, tl,
                  status, s)
 {
+    log tl = bound(tl);
     /* would need to move these to runqueue if a flush is ever invoked from a tfs op */
-    tlog_lock(bound(tl));
-    bound(tl)->dirty = false;
-    run_flush_completions(bound(tl), s);
-    bound(tl)->flushing = false;
-    tlog_unlock(bound(tl));
+    tlog_lock(tl);
+    run_flush_completions(tl, s);
+    tl->flushing = false;
+    if (tl->flush_again) {
+        /* Requests made during the flush are committed together with a
+           single flush, unless they wait for a compaction to finish. */
+        tl->flush_again = false;
+        vector v = tl->flush_completions;
+        tl->flush_completions = tl->flush_next;
+        tl->flush_next = v;
+        if (!tl->compacting)
+            log_flush_start(tl);
+    }
+    tlog_unlock(tl);
     closure_finish();
 }
 
@@ -497,6 +562,7 @@ closure_function(2, 1, void, log_switch_complete,
     log new_tl = bound(new_tl);
     filesystem fs = old_tl->fs;
     filesystem_lock(fs);
+    tlog_lock(old_tl);
     log to_be_used, to_be_destroyed;
     if (is_ok(s)) {
         to_be_used = new_tl;
@@ -522,6 +588,7 @@ closure_function(2, 1, void, log_switch_complete,
     }
 
     run_flush_completions(old_tl, s);
+    tlog_unlock(old_tl);
     filesystem_unlock(fs);
 
     refcount_release(&to_be_destroyed->refcount);
@@ -529,22 +596,41 @@ closure_function(2, 1, void, log_switch_complete,
     closure_finish();
 }
 
-void log_flush(log tl, status_handler completion)
+/* Called with the log locked; a clean log with no flush in progress is
+   handled by log_flush(). */
+static void log_flush_locked(log tl, status_handler completion)
 {
     tlog_debug("%s: log %p, completion %p, dirty %d\n", __func__, tl, completion, tl->dirty);
-    if (!tl->dirty && !tl->compacting) {
+    if (tl->compacting) {
         if (completion)
-            apply(completion, STATUS_OK);
+            vector_push(tl->flush_completions, completion);
+        return;
+    }
+    if (!tl->dirty) {
+        /* anything written is covered by the flush in progress, if any */
+        if (tl->flushing && completion)
+            vector_push(tl->flush_completions, completion);
+        return;
+    }
+    if (tl->flushing) {
+        /* group commit: share the flush that follows the one in progress */
+        if (completion)
+            vector_push(tl->flush_next, completion);
+        tl->flush_again = true;
         return;
     }
     if (completion)
         vector_push(tl->flush_completions, completion);
-    if (tl->flushing || tl->compacting)
-        return;
+    log_flush_start(tl);
+}
+
+static void log_flush_start(log tl)
+{
 #ifdef KERNEL
     remove_timer(kernel_timers, &tl->flush_timer, 0);
 #endif
     tl->flushing = true;
+    tl->dirty = false;
     merge m = allocate_merge(tl->h, closure(tl->h, log_flush_complete, tl));
     status_handler sh = apply_merge(m);
 
@@ -554,44 +640,68 @@ void log_flush(log tl, status_handler completion)
         tl->failed = true;
 
     /* completion merge will close out with the flush; compaction is independent */
+    log_ext ext = tl->current;
     tlog_unlock(tl);    /* to allow flush completion to run synchronously */
-    flush_log_extension(tl->current, false, sh);
+    flush_log_extension(ext, false, sh);
     tlog_lock(tl);
+}
 
-    if (!tl->failed && !tl->compacting && (tl->obsolete_entries >= TFS_LOG_COMPACT_OBSOLETE) &&
-        (tl->total_entries <= TFS_LOG_COMPACT_RATIO * tl->obsolete_entries)) {
-        tlog_debug("%ld obsolete entries out of %ld, starting log compaction\n",
-            tl->obsolete_entries, tl->total_entries);
-        filesystem fs = tl->fs;
-        log new_tl = log_new(fs->h, fs);
-        if (new_tl == INVALID_ADDRESS)
-            return;
-        log_ext new_ext = log_ext_new(new_tl);
-        if (new_ext == INVALID_ADDRESS)
-            goto fail_log_destroy;
-        status_handler switch_complete = closure(new_tl->h, log_switch_complete,
-            tl, new_tl);
-        if (switch_complete == INVALID_ADDRESS)
-            goto fail_log_ext_close;
-        status_handler rebuild_complete = closure(tl->h, log_extend_link,
-            new_tl->current, new_ext->sectors, switch_complete);
-        if (rebuild_complete == INVALID_ADDRESS)
-            goto fail_log_dealloc_closure;
-        log_extension_init(new_tl->current);
-        log_extension_init(new_ext);
-        new_tl->current = new_ext;
-        tl->compacting = true;
-        filesystem_log_rebuild(fs, new_tl, rebuild_complete);
+/* Called with the filesystem and the log locked, as compaction encodes the
+   whole namespace into the new log. */
+static void log_compact(log tl)
+{
+    filesystem fs = tl->fs;
+    if (tl->failed || tl->compacting || tl != fs->tl ||
+        (tl->obsolete_entries < TFS_LOG_COMPACT_OBSOLETE) ||
+        (tl->total_entries > TFS_LOG_COMPACT_RATIO * tl->obsolete_entries))
+        return;
+    tlog_debug("%ld obsolete entries out of %ld, starting log compaction\n",
+        tl->obsolete_entries, tl->total_entries);
+    log new_tl = log_new(fs->h, fs);
+    if (new_tl == INVALID_ADDRESS)
         return;
+    log_ext new_ext = log_ext_new(new_tl);
+    if (new_ext == INVALID_ADDRESS)
+        goto fail_log_destroy;
+    status_handler switch_complete = closure(new_tl->h, log_switch_complete,
+        tl, new_tl);
+    if (switch_complete == INVALID_ADDRESS)
+        goto fail_log_ext_close;
+    status_handler rebuild_complete = closure(tl->h, log_extend_link,
+        new_tl->current, new_ext->sectors, switch_complete);
+    if (rebuild_complete == INVALID_ADDRESS)
+        goto fail_log_dealloc_closure;
+    log_extension_init(new_tl->current);
+    log_extension_init(new_ext);
+    new_tl->current = new_ext;
+    tl->compacting = true;
+
+    /* a failed rebuild completes the switch, which takes the log lock */
+    tlog_unlock(tl);
+    filesystem_log_rebuild(fs, new_tl, rebuild_complete);
+    tlog_lock(tl);
+    return;
   fail_log_dealloc_closure:
-        deallocate_closure(switch_complete);
+    deallocate_closure(switch_complete);
   fail_log_ext_close:
-        close_log_extension(new_ext);
-        if (!filesystem_free_storage(fs, new_ext->sectors))
-            msg_err("failed to mark new_ext at %R as free", new_ext->sectors);
+    close_log_extension(new_ext);
+    if (!filesystem_free_storage(fs, new_ext->sectors))
+        msg_err("failed to mark new_ext at %R as free", new_ext->sectors);
   fail_log_destroy:
-        log_destroy(new_tl);
-    }
+    log_destroy(new_tl);
+}
+
+/* Called with the filesystem locked. */
+void log_flush(log tl, status_handler completion)
+{
+    tlog_lock(tl);
+    boolean clean = !tl->compacting && !tl->dirty && !tl->flushing;
+    if (!clean)
+        log_flush_locked(tl, completion);
+    log_compact(tl);
+    tlog_unlock(tl);
+    if (clean && completion)
+        apply(completion, STATUS_OK);
 }
 
 #ifdef KERNEL
@@ -601,7 +711,7 @@ closure_function(1, 2, void, log_flush_timer_expired,
 {
     if (overruns != timer_disabled) {
         tlog_lock(bound(tl));
-        log_flush(bound(tl), 0);
+        log_flush_locked(bound(tl), 0);
         tlog_unlock(bound(tl));
     }
     closure_finish();
@@ -611,8 +721,10 @@ static void log_set_dirty(log tl)
 {
     if (tl->dirty) {
         if (buffer_length(tl->tuple_staging) >= bytes_from_sectors(tl->fs,
-                range_span(tl->current->sectors)) / 2)
-            log_flush(tl, 0);
+                range_span(tl->current->sectors)) / 2) {
+            log_flush_locked(tl, 0);
+            log_compact(tl);
+        }
         return;
     }
     tl->dirty = true;
@@ -627,7 +739,8 @@ static void log_set_dirty(log tl)
     tl->dirty = true;
     if (buffer_length(tl->tuple_staging) >=
             bytes_from_sectors(tl->fs, range_span(tl->current->sectors))) {
-        log_flush(tl, 0);
+        log_flush_locked(tl, 0);
+        log_compact(tl);
     }
 }
 #endif
@@ -635,28 +748,36 @@ static void log_set_dirty(log tl)
 boolean log_write_eav(log tl, tuple e, symbol a, value v)
 {
     tlog_debug("log_write_eav: tl %p, e %p, a %b, v %p\n", tl, e, symbol_string(a), v);
+    tlog_lock(tl);
     u64 len = buffer_length(tl->tuple_staging);
-    if (tl->failed || len >= TFS_LOG_MAX_TUPLE_STAGING_BYTES)
-        return false;
-    encode_eav(tl->tuple_staging, tl->dictionary, e, a, v, &tl->obsolete_entries);
-    tl->total_entries++;
-    len = buffer_length(tl->tuple_staging) - len;
-    vector_push(tl->encoding_lengths, (void *)len);
-    log_set_dirty(tl);
-    return !tl->failed;
+    boolean written = !tl->failed && len < TFS_LOG_MAX_TUPLE_STAGING_BYTES;
+    if (written) {
+        encode_eav(tl->tuple_staging, tl->dictionary, e, a, v, &tl->obsolete_entries);
+        tl->total_entries++;
+        len = buffer_length(tl->tuple_staging) - len;
+        vector_push(tl->encoding_lengths, (void *)len);
+        log_set_dirty(tl);
+        written = !tl->failed;
+    }
+    tlog_unlock(tl);
+    return written;
 }
 
 boolean log_write(log tl, tuple t)
 {
     tlog_debug("log_write: tl %p, t %p\n", tl, t);
+    tlog_lock(tl);
     u64 len = buffer_length(tl->tuple_staging);
-    if (tl->failed || len >= TFS_LOG_MAX_TUPLE_STAGING_BYTES)
-        return false;
-    encode_tuple(tl->tuple_staging, tl->dictionary, t, &tl->total_entries);
-    len = buffer_length(tl->tuple_staging) - len;
-    vector_push(tl->encoding_lengths, (void *)len);
-    log_set_dirty(tl);
-    return !tl->failed;
+    boolean written = !tl->failed && len < TFS_LOG_MAX_TUPLE_STAGING_BYTES;
+    if (written) {
+        encode_tuple(tl->tuple_staging, tl->dictionary, t, &tl->total_entries);
+        len = buffer_length(tl->tuple_staging) - len;
+        vector_push(tl->encoding_lengths, (void *)len);
+        log_set_dirty(tl);
+        written = !tl->failed;
+    }
+    tlog_unlock(tl);
+    return written;
 }
 
 #endif /* !TLOG_READ_ONLY */
@@ -697,39 +818,172 @@ static status log_hdr_parse(buffer b, boolean first_ext, u64 *length, u8 *uuid,
     return STATUS_OK;
 }
 
-static void log_read(log tl, status_handler sh);
+/* Scan the frames of an extension, without decoding tuples, for the link to
+   the next extension. */
+static boolean log_find_link(buffer b, range *r)
+{
+    struct buffer scan = *b;
+    u64 sector, length;
+    while (buffer_length(&scan) > 0) {
+        switch (pop_u8(&scan)) {
+        case END_OF_SEGMENT:
+            break;
+        case LOG_EXTENSION_LINK:
+            sector = pop_varint(&scan);
+            length = pop_varint(&scan);
+            if (length == 0)
+                return false;
+            *r = irangel(sector, length);
+            return true;
+        case TUPLE_AVAILABLE:
+            pop_varint(&scan);  /* tuple length */
+            /* fall through */
+        case TUPLE_EXTENDED:
+            length = pop_varint(&scan);
+            if (length > buffer_length(&scan))
+                return false;
+            buffer_consume(&scan, length);
+            break;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+static void log_replay(log tl);
 
-closure_function(4, 1, void, log_read_complete,
-                 log_ext, ext, sg_list, sg, u64, length, status_handler, sh,
+/* Find the link in a loaded extension, skipping the header on a copy so that
+   the staging buffer is left for decoding. */
+static void log_ext_find_link(log_ext ext)
+{
+    struct buffer scan = *ext->staging;
+    u8 uuid[UUID_LEN];
+    char label[VOLUME_LABEL_MAX_LEN];
+    u64 length;
+    status s = log_hdr_parse(&scan, ext->sectors.start == 0, &length, uuid, label);
+    if (is_ok(s))
+        log_find_link(&scan, &ext->link);
+    else
+        timm_dealloc(s);
+}
+
+/* Called with the replay lock held: claim the read of the extension that the
+   tail of the read-ahead queue links to, unless the queue is full. */
+static boolean log_read_ahead_claim(log tl, log_ext tail)
+{
+    if (tail != tl->replay_tail || tail->chained || !range_span(tail->link) ||
+        tl->replay_done || tl->replay_depth >= TLOG_REPLAY_DEPTH)
+        return false;
+    tail->chained = true;
+    return true;
+}
+
+static status log_read_ahead(log tl, range r);
+
+closure_function(3, 1, void, log_read_complete,
+                 log_ext, ext, sg_list, sg, u64, length,
                  status, read_status)
 {
     log_ext ext = bound(ext);
     log tl = ext->tl;
-    status s = STATUS_OK;
-    status_handler sh = bound(sh);
-    u8 frame = 0;
-    u64 sector, length, tuple_length;
-
-    if (!is_ok(read_status)) {
+    sg_list sg = bound(sg);
+    if (is_ok(read_status)) {
+        /* staging is preallocated to size */
+        buffer b = ext->staging;
+        u64 n = sg_copy_to_buf_and_release(buffer_ref(b, 0), sg, bound(length));
+        buffer_produce(b, n);
+        dump_staging(ext);
+        log_ext_find_link(ext);
+    } else {
         tlog_debug("log_read failure: %v\n", read_status);
-        apply(sh, timm_up(read_status, "result", "read failed"));
-        closure_finish();
+        sg_list_release(sg);
+        deallocate_sg_list(sg);
+        ext->read_status = timm_up(read_status, "result", "read failed");
+    }
+    tlog_debug("log_read_complete: ext %p, buffer len %d, status %v\n", ext,
+               buffer_length(ext->staging), read_status);
+
+    /* Keep the pipeline going before this extension is marked loaded, so
+       that replay never finds it loaded with its successor still unqueued.
+       A failure here is reported by replay when it reaches the link. */
+    tlog_replay_lock(tl);
+    boolean chain = log_read_ahead_claim(tl, ext);
+    tlog_replay_unlock(tl);
+    if (chain) {
+        status s = log_read_ahead(tl, ext->link);
+        if (!is_ok(s))
+            timm_dealloc(s);
+    }
+
+    /* resume replay if it was waiting for this extension */
+    tlog_replay_lock(tl);
+    ext->loaded = true;
+    boolean resume = !tl->replaying;
+    tl->replaying = true;
+    tlog_replay_unlock(tl);
+    if (resume)
+        log_replay(tl);
+    closure_finish();
+}
+
+static void log_read(log tl, log_ext ext)
+{
+    assert(!ext->open);
+    sg_list sg = allocate_sg_list();
+    if (sg == INVALID_ADDRESS) {
+        ext->read_status = timm("result", "failed to allocate sg list");
+        ext->loaded = true;
         return;
     }
+    range r = irangel(0, bytes_from_sectors(tl->fs, range_span(ext->sectors)));
+    status_handler tlc = closure(tl->h, log_read_complete, ext, sg, range_span(r));
+    tlog_debug("%s: issuing sg read, sg %p, r %R\n", __func__, sg, r);
+    apply(ext->read, sg, r, tlc);
+}
+
+/* Open the extension at r, append it to the read-ahead queue and issue its
+   read. Only the context that claimed the tail's link, or replay once the
+   queue has run dry, calls this. */
+static status log_read_ahead(log tl, range r)
+{
+    log_ext ext = open_log_extension(tl, r);
+    if (ext == INVALID_ADDRESS)
+        return timm("result", "unable to open log extension");
+#ifndef TLOG_READ_ONLY
+    if (!filesystem_reserve_storage(tl->fs, r)) {
+        close_log_extension(ext);
+        return timm("result", "failed to reserve sectors %R in log extension", r);
+    }
+#endif
+    tlog_debug("reading ahead log extension %R\n", r);
+    tlog_replay_lock(tl);
+    tl->replay_tail->next = ext;
+    tl->replay_tail = ext;
+    tl->replay_depth++;
+    tlog_replay_unlock(tl);
+    log_read(tl, ext);
+    return STATUS_OK;
+}
 
-    /* staging is preallocated to size */
+/* Decode the tuples of a loaded extension. On reaching a link, the next
+   extension becomes current; otherwise replay is done. */
+static void log_replay_extension(log tl, log_ext ext)
+{
+    status s = ext->read_status;
+    u8 frame = 0;
+    u64 sector, length, tuple_length;
+
+    if (!is_ok(s))
+        goto out_done;
     buffer b = ext->staging;
-    u64 n = sg_copy_to_buf_and_release(buffer_ref(b, 0), bound(sg), bound(length));
-    buffer_produce(b, n);
-    dump_staging(ext);
-    tlog_debug("log_read_complete: buffer len %d, status %v\n", buffer_length(b), read_status);
-    tlog_debug("-> new log extension, checking magic and version\n");
     if (!ext->open) {
+        tlog_debug("-> new log extension, checking magic and version\n");
         length = 0;
         s = log_hdr_parse(b, ext->sectors.start == 0, &length, tl->fs->uuid,
             tl->fs->label);
         if (!is_ok(s))
-            goto out_apply_status;
+            goto out_done;
         /* XXX the length is really for validation...so hook it up */
         tlog_debug("%ld sectors\n", length);
         ext->open = true;
@@ -747,31 +1001,34 @@ closure_function(4, 1, void, log_read_complete,
             length = pop_varint(b);
             if (length == 0) {
                 s = timm("result", "zero-length extension");
-                goto out_apply_status;
+                goto out_done;
             }
-            range r = irangel(sector, length);
-            close_log_extension(ext);
-            ext = open_log_extension(tl, r);
-            if (ext == INVALID_ADDRESS) {
-                s = timm("result", "unable to open log extension");
-                goto out_apply_status;
+            if (!ext->next) {
+                /* read-ahead stopped short of this link; read it now */
+                s = log_read_ahead(tl, irangel(sector, length));
+                if (!is_ok(s))
+                    goto out_done;
             }
-            tl->current = ext;
-#ifndef TLOG_READ_ONLY
-            if (!filesystem_reserve_storage(tl->fs, r)) {
-                s = timm("result", "failed to reserve sectors %R in log extension", r);
-                goto out_apply_status;
+            close_log_extension(ext);
+            tlog_replay_lock(tl);
+            tl->current = ext->next;
+            tl->replay_depth--;
+            /* resume read-ahead held back by a full queue */
+            log_ext tail = tl->replay_tail;
+            boolean chain = tail->loaded && log_read_ahead_claim(tl, tail);
+            tlog_replay_unlock(tl);
+            if (chain) {
+                s = log_read_ahead(tl, tail->link);
+                if (!is_ok(s))
+                    timm_dealloc(s);
             }
-#endif
-            /* chain to next log extension, carrying status handler to end */
-            log_read(tl, sh);
-            goto out;
+            return;
         case TUPLE_AVAILABLE:
             tlog_debug("-> tuple available\n");
             if (tl->tuple_bytes_remain > 0) {
                 s = timm("result", "TUPLE_AVAILABLE read while already parsing tuple (%ld remaining)",
                          tl->tuple_bytes_remain);
-                goto out_apply_status;
+                goto out_done;
             }
             tuple_length = pop_varint(b);
             length = pop_varint(b); /* of segment */
@@ -780,7 +1037,7 @@ closure_function(4, 1, void, log_read_complete,
                 s = timm("result", "TUPLE_AVAILABLE read with invalid or short available "
                          "length (%ld, tuple_length: %ld, buffer length: %ld)",
                          length, tuple_length, buffer_length(b));
-                goto out_apply_status;
+                goto out_done;
             }
             if (length == tuple_length) {
                 /* read at once from log staging */
@@ -798,7 +1055,7 @@ closure_function(4, 1, void, log_read_complete,
             if (length > tl->tuple_bytes_remain) {
                 s = timm("result", "TUPLE_EXTENDED read of length %ld, exceeding remainder %ld",
                          length, tl->tuple_bytes_remain);
-                goto out_apply_status;
+                goto out_done;
             }
             tlog_debug("need %ld, available %ld\n", tl->tuple_bytes_remain, length);
             log_tuple_produce(tl, b, length);
@@ -810,7 +1067,7 @@ closure_function(4, 1, void, log_read_complete,
         default:
             tlog_debug("-> unknown encoding type %d, offset %ld\n", frame, b->start);
             s = timm("result", "unknown frame identifier 0x%x", frame);
-            goto out_apply_status;
+            goto out_done;
         }
     }
 
@@ -841,28 +1098,54 @@ closure_function(4, 1, void, log_read_complete,
         tl->dictionary = newdict;
     }
 
-  out_apply_status:
-    tlog_debug("log_read_complete exit with status %v\n", s);
+  out_done:
+    tlog_debug("log replay done with status %v\n", s);
     buffer_clear(tl->tuple_staging);
-    apply(sh, s);
-  out:
-    closure_finish();
+    tl->replay_status = s;
+    tl->replay_done = true;
 }
 
-static void log_read(log tl, status_handler sh)
+/* Log replay is pipelined: up to TLOG_REPLAY_DEPTH extensions are read
+   ahead of the one being decoded, each read completion issuing the read of
+   the extension it links to. Only one context replays at a time; it returns
+   when the extension it needs is not loaded yet, and the read completion of
+   that extension resumes it. Replay completes once no read is outstanding. */
+static boolean log_replay_idle(log tl)
 {
-    log_ext ext = tl->current;
-    assert(ext);
-    assert(!ext->open);
-    sg_list sg = allocate_sg_list();
-    if (sg == INVALID_ADDRESS) {
-        apply(sh, timm("result", "failed to allocate sg list"));
-        return;
+    for (log_ext ext = tl->current->next; ext; ext = ext->next) {
+        if (!ext->loaded)
+            return false;
     }
-    range r = irangel(0, bytes_from_sectors(tl->fs, range_span(ext->sectors)));
-    status_handler tlc = closure(tl->h, log_read_complete, ext, sg, range_span(r), sh);
-    tlog_debug("%s: issuing sg read, sg %p, r %R\n", __func__, sg, r);
-    apply(ext->read, sg, r, tlc);
+    return true;
+}
+
+static void log_replay(log tl)
+{
+    while (true) {
+        tlog_replay_lock(tl);
+        if (tl->replay_done ? !log_replay_idle(tl) : !tl->current->loaded) {
+            tl->replaying = false;
+            tlog_replay_unlock(tl);
+            return;
+        }
+        tlog_replay_unlock(tl);
+        if (tl->replay_done)
+            break;
+        log_replay_extension(tl, tl->current);
+    }
+    log_ext ext = tl->current->next;
+    tl->current->next = 0;
+    tl->replay_tail = tl->current;
+    tl->replay_depth = 0;
+    while (ext) {
+        /* read ahead, but not replayed due to an error */
+        log_ext next = ext->next;
+        if (!is_ok(ext->read_status))
+            timm_dealloc(ext->read_status);
+        close_log_extension(ext);
+        ext = next;
+    }
+    apply(tl->replay_complete, tl->replay_status);
 }
 
 boolean filesystem_probe(u8 *first_sector, u8 *uuid, char *label)
@@ -911,7 +1194,11 @@ log log_create(heap h, filesystem fs, boolean initialize, status_handler sh)
               STATUS_OK);
 #endif
     } else {
-        log_read(tl, sh);
+        tl->replay_complete = sh;
+        tl->replay_tail = tl->current;
+        tl->replaying = true;
+        log_read(tl, tl->current);
+        log_replay(tl);
     }
     return tl;
 #ifndef TLOG_READ_ONLY
@@ -931,6 +1218,7 @@ void log_destroy(log tl)
     remove_timer(kernel_timers, &tl->flush_timer, 0);
 #endif
     deallocate_vector(tl->flush_completions);
+    deallocate_vector(tl->flush_next);
 #ifndef TLOG_READ_ONLY
     deallocate_rangemap(tl->extensions, stack_closure(log_dealloc_ext_node,
         tl));
@@ -938,6 +1226,6 @@ void log_destroy(log tl)
     deallocate_vector(tl->encoding_lengths);
     deallocate_buffer(tl->tuple_staging);
     close_log_extension(tl->current);
-    deallocate_table(tl->dictionary);
+    deallocate_dictionary(tl->dictionary);
     deallocate(tl->h, tl, sizeof(*tl));
 }
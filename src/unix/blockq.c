@@ -142,6 +142,26 @@ thread blockq_wake_one(blockq bq)
     return INVALID_ADDRESS;
 }
 
+/* Wake the first waiter whose action is accepted by the filter. As with
+   blockq_wake_one(), the wake flag is set if no waiter could be found. */
+thread blockq_wake_one_filtered(blockq bq, blockq_action_filter filter)
+{
+    blockq_debug("%p (\"%s\") \n", bq, blockq_name(bq));
+    blockq_lock(bq);
+    list_foreach(&bq->waiters_head, l) {
+        thread t = struct_from_list(l, thread, bq_l);
+        if (!apply(filter, t->bq_action))
+            continue;
+        thread_lock(t);
+        blockq_wake_internal_locked(bq, t, BLOCKQ_ACTION_BLOCKED);
+        return t;
+    }
+    bq->wake = true;
+    write_barrier();
+    blockq_unlock(bq);
+    return INVALID_ADDRESS;
+}
+
 boolean blockq_wake_one_for_thread(blockq bq, thread t, boolean nullify)
 {
     thread_log(current, "%s: tid %d", __func__, t->tid);
@@ -163,51 +163,222 @@ closure_function(0, 1, void, load_interp_fail,
     halt("read interp failed %v\n", s);
 }
 
-closure_function(3, 4, u64, exec_elf_map,
-                 process, p, kernel_heaps, kh, u32, allowed_flags,
-                 u64, vaddr, u64, paddr, u64, size, pageflags, flags)
+/* Bytes at the start of the file needed to hold the ELF header, the program
+   headers and the interpreter path. */
+static u64 elf_headers_length(buffer b)
 {
-    kernel_heaps kh = bound(kh);
-    u64 vmflags = VMAP_FLAG_READABLE;
-    if (pageflags_is_exec(flags))
-        vmflags |= VMAP_FLAG_EXEC;
-    if (pageflags_is_writable(flags))
-        vmflags |= VMAP_FLAG_WRITABLE;
-
-    range r = irangel(vaddr, size);
-    boolean is_bss = paddr == INVALID_PHYSICAL;
-    exec_debug("%s: add to vmap: %R vmflags 0x%lx%s\n",
-               __func__, r, vmflags, is_bss ? " bss" : "");
-    assert(allocate_vmap(bound(p)->vmaps, r, ivmap(vmflags, bound(allowed_flags), 0, 0)) !=
-            INVALID_ADDRESS);
-    if (is_bss) {
-        /* bss */
-        paddr = allocate_u64((heap)heap_physical(kh), size);
-        assert(paddr != INVALID_PHYSICAL);
+    u64 len = buffer_length(b);
+    if (len < sizeof(Elf64_Ehdr))
+        return sizeof(Elf64_Ehdr);
+    Elf64_Ehdr *e = buffer_ref(b, 0);
+    u64 end = e->e_phoff + e->e_phnum * e->e_phentsize;
+    if (end > len)
+        return end;
+    foreach_phdr(e, p) {
+        if (p->p_type == PT_INTERP && p->p_offset + p->p_filesz > end)
+            end = p->p_offset + p->p_filesz;
     }
-    map(vaddr, paddr, size, pageflags_user(pageflags_minpage(flags)));
-    if (is_bss)
-        zero(pointer_from_u64(vaddr), size);
-    return vaddr;
+    return end;
 }
 
-closure_function(2, 1, status, load_interp_complete,
-                 thread, t, kernel_heaps, kh,
+static void exec_read_headers_length(fsfile f, heap h, u64 length, buffer_handler bh,
+                                     status_handler sh);
+
+closure_function(5, 2, void, exec_read_headers_complete,
+                 fsfile, f, heap, h, buffer, b, buffer_handler, bh, status_handler, sh,
+                 status, s, bytes, length)
+{
+    fsfile f = bound(f);
+    heap h = bound(h);
+    buffer b = bound(b);
+    buffer_handler bh = bound(bh);
+    status_handler sh = bound(sh);
+    closure_finish();
+    if (!is_ok(s)) {
+        deallocate_buffer(b);
+        apply(sh, s);
+        return;
+    }
+    buffer_produce(b, length);
+    u64 needed = elf_headers_length(b);
+    if (needed > length && length < fsfile_get_length(f)) {
+        /* headers extend past the initial read */
+        exec_debug("%s: re-reading 0x%lx bytes of headers\n", __func__, needed);
+        deallocate_buffer(b);
+        exec_read_headers_length(f, h, needed, bh, sh);
+        return;
+    }
+    apply(bh, b);
+}
+
+static void exec_read_headers_length(fsfile f, heap h, u64 length, buffer_handler bh,
+                                     status_handler sh)
+{
+    length = MIN(length, fsfile_get_length(f));
+    buffer b = allocate_buffer(h, length);
+    if (b == INVALID_ADDRESS) {
+        apply(sh, timm("result", "failed to allocate ELF header buffer"));
+        return;
+    }
+    io_status_handler io_complete = closure(h, exec_read_headers_complete, f, h, b, bh, sh);
+    if (io_complete == INVALID_ADDRESS) {
+        deallocate_buffer(b);
+        apply(sh, timm("result", "failed to allocate ELF header completion"));
+        return;
+    }
+    filesystem_read_linear(f, buffer_ref(b, 0), irange(0, length), io_complete);
+}
+
+/* Only the ELF and program headers are read up front; segment contents are
+   demand paged from the pagecache once mapped by exec_elf_map(). */
+void exec_read_headers(fsfile f, heap h, buffer_handler bh, status_handler sh)
+{
+    exec_read_headers_length(f, h, PAGESIZE, bh, sh);
+}
+
+closure_function(1, 2, void, exec_elf_tail_complete,
+                 status_handler, sh,
+                 status, s, bytes, length)
+{
+    apply(bound(sh), s);
+    closure_finish();
+}
+
+/* File data of each PT_LOAD segment is mapped as a private (copy-on-write)
+   file-backed vmap, so pages are faulted in from the pagecache, with
+   readahead, rather than copied at exec time. The bss is an anonymous vmap,
+   except for the page straddling the end of file data, which is filled here
+   under merge m. */
+static void *exec_elf_map(process p, fsfile f, buffer hdr, u64 load_offset,
+                          u32 allowed_flags, merge m)
+{
+    kernel_heaps kh = get_kernel_heaps();
+    pagecache_node pn = fsfile_get_cachenode(f);
+    Elf64_Ehdr *e = buffer_ref(hdr, 0);
+    if (elf_headers_length(hdr) > buffer_length(hdr))
+        halt("exec_elf failed: truncated ELF headers\n");
+    foreach_phdr(e, ph) {
+        if (ph->p_type != PT_LOAD)
+            continue;
+        u32 vmflags = VMAP_FLAG_MMAP | VMAP_FLAG_READABLE;
+        if (ph->p_flags & PF_X)
+            vmflags |= VMAP_FLAG_EXEC;
+        if (ph->p_flags & PF_W)
+            vmflags |= VMAP_FLAG_WRITABLE;
+
+        u64 aligned = ph->p_vaddr & ~MASK(PAGELOG);
+        u64 trim_offset = ph->p_vaddr & MASK(PAGELOG);
+        if ((ph->p_offset & MASK(PAGELOG)) != trim_offset)
+            halt("exec_elf failed: PT_LOAD p_offset 0x%lx incongruent with p_vaddr 0x%lx\n",
+                 ph->p_offset, ph->p_vaddr);
+        if (ph->p_memsz < ph->p_filesz)
+            halt("exec_elf failed: PT_LOAD p_memsz (%ld) < p_filesz (%ld)\n",
+                 ph->p_memsz, ph->p_filesz);
+        u64 node_offset = ph->p_offset - trim_offset;
+        u64 bss_size = ph->p_memsz - ph->p_filesz;
+        u64 bss_start = ph->p_vaddr + load_offset + ph->p_filesz;
+        u64 ssize = ph->p_filesz + trim_offset;
+
+        /* As in load_elf(), the page holding both file data and the start of
+           the bss goes with the bss mapping. */
+        u64 tail_copy = ssize & MASK(PAGELOG);
+        if (bss_size > 0 && tail_copy != 0)
+            ssize &= ~MASK(PAGELOG);
+
+        if (ssize > 0) {
+            range r = irangel(aligned + load_offset, pad(ssize, PAGESIZE));
+            exec_debug("%s: file map %R, node_offset 0x%lx, vmflags 0x%x\n",
+                       __func__, r, node_offset, vmflags);
+            assert(allocate_vmap(p->vmaps, r, ivmap(vmflags | VMAP_MMAP_TYPE_FILEBACKED,
+                                                    allowed_flags, node_offset, f)) !=
+                   INVALID_ADDRESS);
+            /* get the first pages in flight while the process is set up */
+            pagecache_node_fetch_pages(pn, irangel(node_offset,
+                                                   MIN(range_span(r), FILE_READAHEAD_DEFAULT)));
+        }
+
+        if (bss_size > 0) {
+            u64 map_start = bss_start & ~MASK(PAGELOG);
+            range r = irangel(map_start, pad(tail_copy + bss_size, PAGESIZE));
+            exec_debug("%s: bss map %R, tail_copy 0x%lx, vmflags 0x%x\n",
+                       __func__, r, tail_copy, vmflags);
+            assert(allocate_vmap(p->vmaps, r, ivmap(vmflags | VMAP_MMAP_TYPE_ANONYMOUS,
+                                                    allowed_flags, 0, 0)) != INVALID_ADDRESS);
+            if (tail_copy > 0) {
+                void *tail = allocate((heap)heap_linear_backed(kh), PAGESIZE);
+                assert(tail != INVALID_ADDRESS);
+                zero(tail, PAGESIZE);
+                map(map_start, phys_from_linear_backed_virt(u64_from_pointer(tail)), PAGESIZE,
+                    pageflags_from_vmflags(vmflags));
+                io_status_handler io_complete = closure(heap_locked(kh), exec_elf_tail_complete,
+                                                        apply_merge(m));
+                assert(io_complete != INVALID_ADDRESS);
+                filesystem_read_linear(f, tail, irangel(node_offset + ssize, tail_copy),
+                                       io_complete);
+            }
+        }
+    }
+    return pointer_from_u64(e->e_entry + load_offset);
+}
+
+closure_function(2, 1, void, exec_elf_start,
+                 thread, t, void *, start,
+                 status, s)
+{
+    if (!is_ok(s))
+        halt("exec_elf failed: %v\n", s);
+    exec_debug("starting process tid %d, start %p\n", bound(t)->tid, bound(start));
+    start_process(bound(t), bound(start));
+    closure_finish();
+}
+
+closure_function(4, 1, status, load_interp_complete,
+                 thread, t, fsfile, f, status_handler, start, status_handler, sh,
                  buffer, b)
 {
     thread t = bound(t);
-    kernel_heaps kh = bound(kh);
 
-    exec_debug("interpreter load complete, reading elf\n");
+    exec_debug("interpreter headers read, mapping elf\n");
     u64 where = process_get_virt_range(t->p, HUGE_PAGESIZE);
     assert(where != INVALID_PHYSICAL);
-    void * start = load_elf(b, where, stack_closure(exec_elf_map, t->p, kh, 0));
-    exec_debug("starting process tid %d, start %p\n", t->tid, start);
-    start_process(t, start);
+    merge m = allocate_merge(heap_locked(get_kernel_heaps()), bound(sh));
+    assert(m != INVALID_ADDRESS);
+    status_handler sh = apply_merge(m);
+    closure_member(exec_elf_start, bound(start), start) = exec_elf_map(t->p, bound(f), b, where,
+                                                                        0, m);
+    deallocate_buffer(b);
+    apply(sh, STATUS_OK);
     closure_finish();
     return STATUS_OK;
 }
 
+closure_function(3, 2, void, exec_syms_complete,
+                 buffer, b, u64, load_offset, status_handler, sh,
+                 status, s, bytes, length)
+{
+    buffer b = bound(b);
+    if (is_ok(s)) {
+        buffer_produce(b, length);
+        add_elf_syms(b, bound(load_offset));
+    } else {
+        msg_err("failed to read program symbols: %v\n", s);
+    }
+    deallocate_buffer(b);
+    apply(bound(sh), STATUS_OK);
+    closure_finish();
+}
+
+/* Symbols live outside of the loadable segments, so the whole file is read. */
+static void exec_ingest_symbols(fsfile f, heap h, u64 load_offset, status_handler sh)
+{
+    u64 length = fsfile_get_length(f);
+    buffer b = allocate_buffer(h, length);
+    assert(b != INVALID_ADDRESS);
+    io_status_handler io_complete = closure(h, exec_syms_complete, b, load_offset, sh);
+    assert(io_complete != INVALID_ADDRESS);
+    filesystem_read_linear(f, buffer_ref(b, 0), irange(0, length), io_complete);
+}
+
 closure_function(1, 1, boolean, trace_notify,
                  process, p,
                  value, v)
@@ -216,7 +387,7 @@ closure_function(1, 1, boolean, trace_notify,
     return true;
 }
 
-process exec_elf(buffer ex, process kp)
+process exec_elf(buffer ex, fsfile f, process kp)
 {
     // is process md always root?
     unix_heaps uh = kp->uh;
@@ -232,6 +403,8 @@ process exec_elf(buffer ex, process kp)
     proc->brk = 0;
 
     exec_debug("exec_elf enter\n");
+    if (elf_headers_length(ex) > buffer_length(ex))
+        halt("exec_elf failed: truncated ELF headers\n");
 
     range load_range = irange(infinity, 0);
     foreach_phdr(e, p) {
@@ -274,7 +447,14 @@ process exec_elf(buffer ex, process kp)
                load_offset, load_range, range_span(load_range));
     u32 allowed_flags = proc_is_exec_protected(proc) ? 0 :
             (VMAP_FLAG_READABLE | VMAP_FLAG_WRITABLE | VMAP_FLAG_EXEC);
-    void * entry = load_elf(ex, load_offset, stack_closure(exec_elf_map, proc, kh, allowed_flags));
+    heap h = heap_locked(kh);
+    status_handler start = closure(h, exec_elf_start, t, 0);
+    assert(start != INVALID_ADDRESS);
+    merge m = allocate_merge(h, start);
+    assert(m != INVALID_ADDRESS);
+    status_handler sh = apply_merge(m);
+    void * entry = exec_elf_map(proc, f, ex, load_offset, allowed_flags, m);
+    closure_member(exec_elf_start, start, start) = entry;
 
     u64 brk_offset = aslr ? get_aslr_offset(PROCESS_HEAP_ASLR_RANGE) : 0;
     u64 brk = pad(load_range.end, PAGESIZE) + brk_offset;
@@ -292,17 +472,21 @@ process exec_elf(buffer ex, process kp)
 
     if (get(proc->process_root, sym(ingest_program_symbols))) {
         exec_debug("ingesting symbols...\n");
-        add_elf_syms(ex, load_offset);
-        exec_debug("...done\n");
+        exec_ingest_symbols(f, h, load_offset, apply_merge(m));
     }
 
-    register_root_notify(sym(trace), closure(heap_locked(kh), trace_notify, proc));
+    register_root_notify(sym(trace), closure(h, trace_notify, proc));
+    deallocate_buffer(ex);
 
     if (interp) {
         exec_debug("reading interp...\n");
-        filesystem_read_entire(fs, interp, (heap)heap_page_backed(kh),
-                               closure(heap_locked(kh), load_interp_complete, t, kh),
-                               closure(heap_locked(kh), load_interp_fail));
+        fsfile interp_f = fsfile_from_node(fs, interp);
+        if (!interp_f || interp_f == INVALID_ADDRESS)
+            halt("couldn't open program interpreter %v\n", interp);
+        exec_read_headers(interp_f, h,
+                          closure(h, load_interp_complete, t, interp_f, start, apply_merge(m)),
+                          closure(h, load_interp_fail));
+        apply(sh, STATUS_OK);
         return proc;
     }
 
@@ -314,8 +498,8 @@ process exec_elf(buffer ex, process kp)
             halt("unable to change cwd to \"%b\"; %s\n", cwd, string_from_fs_status(fss));
     }
 
-    exec_debug("starting process...\n");
-    start_process(t, entry);
-    return proc;    
+    exec_debug("starting process once segment tails are read...\n");
+    apply(sh, STATUS_OK);
+    return proc;
 }
 
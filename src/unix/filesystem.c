@@ -51,22 +51,50 @@ sysreturn sysreturn_from_fs_status_value(status s)
     return rv;
 }
 
+/* The readahead state is updated without locking; concurrent readers of the
+   same file description can at worst cause a redundant or skipped fetch. */
 void file_readahead(file f, u64 offset, u64 len)
 {
-    u64 ra_size = 0;
+    u64 ra_max;
     switch (f->fadv) {
     case POSIX_FADV_NORMAL:
-        ra_size = FILE_READAHEAD_DEFAULT;
-        break;
-    case POSIX_FADV_RANDOM: /* no read-ahead */
+        ra_max = FILE_READAHEAD_MAX;
         break;
     case POSIX_FADV_SEQUENTIAL:
-        ra_size = 2 * FILE_READAHEAD_DEFAULT;
+        ra_max = 2 * FILE_READAHEAD_MAX;
         break;
+    default:    /* POSIX_FADV_RANDOM: no read-ahead */
+        return;
+    }
+    struct file_readahead *ra = &f->ra;
+    u64 end = offset + len;
+    u64 ra_start, ra_size;
+    if ((offset == ra->prev_end) ||
+        ((offset >= ra->start) && (offset < ra->start + ra->size))) {
+        if (ra->size == 0) {
+            /* first sequential access: start with the initial window */
+            ra_start = end;
+            ra_size = (f->fadv == POSIX_FADV_SEQUENTIAL) ? 2 * FILE_READAHEAD_DEFAULT :
+                                                           FILE_READAHEAD_DEFAULT;
+        } else if (end > ra->marker) {
+            /* the reader entered the last window fetched: fetch the next one (twice as large)
+               asynchronously, so that it is in the cache by the time the reader gets there */
+            ra_start = MAX(ra->start + ra->size, end);
+            ra_size = MIN(2 * ra->size, ra_max);
+        } else {
+            ra->prev_end = end;
+            return;
+        }
+    } else {
+        /* random access: shrink the window */
+        ra_start = end;
+        ra_size = MAX(ra->size / 2, FILE_READAHEAD_MIN);
     }
-    if (ra_size > 0)
-        pagecache_node_fetch_pages(fsfile_get_cachenode(f->fsf),
-            irangel(offset + len, ra_size));
+    ra->start = ra_start;
+    ra->size = ra_size;
+    ra->marker = ra_start;
+    ra->prev_end = end;
+    pagecache_node_fetch_pages(fsfile_get_cachenode(f->fsf), irangel(ra_start, ra_size));
 }
 
 fs_status filesystem_chdir(process p, const char *path)
@@ -359,7 +387,10 @@ sysreturn fadvise64(int fd, s64 off, u64 len, int advice)
     case POSIX_FADV_NORMAL:
     case POSIX_FADV_RANDOM:
     case POSIX_FADV_SEQUENTIAL:
-        f->fadv = advice;
+        if (advice != f->fadv) {
+            f->fadv = advice;
+            zero(&f->ra, sizeof(f->ra));
+        }
         break;
     case POSIX_FADV_WILLNEED: {
         pagecache_node pn = fsfile_get_cachenode(f->fsf);
@@ -1,111 +1,136 @@
 #include <unix_internal.h>
 
+/* Futexes are kept in a fixed-size hash table per process. Each bucket lock
+   protects the bucket's chain of futexes, their reference counts and the
+   compare-and-block / wake sequences on them, so that operations on futexes
+   in different buckets don't serialize. A futex is created on demand, is
+   referenced by each operation in progress and each waiter, and is freed
+   once the last reference is dropped. */
+
+typedef struct futex_bucket {
+    struct spinlock lock;
+    struct list futices;
+} *futex_bucket;
+
 struct futex {
-    heap h;
+    struct list l;              /* bucket chain */
+    u64 key;
+    futex_bucket b;
+    u64 refcount;               /* protected by bucket lock */
     blockq bq;
-    struct spinlock lock;
 };
 
-#define futex_lock(f)   spin_lock(&(f)->lock)
-#define futex_unlock(f) spin_unlock(&(f)->lock)
+#define FUTEX_HASH_BUCKETS  U64_FROM_BIT(FUTEX_HASH_ORDER)
 
-static u64 futex_key_function(void *x)
-{
-    return u64_from_pointer(x);
-}
+#define futex_lock(f)   spin_lock(&(f)->b->lock)
+#define futex_unlock(f) spin_unlock(&(f)->b->lock)
 
-static boolean futex_key_equal(void *a, void *b)
+static heap futex_heap;
+
+static futex_bucket futex_bucket_from_key(process p, u64 key)
 {
-    return a == b;
+    /* Fibonacci hashing; the low two bits of a futex address are always zero */
+    u64 h = (key >> 2) * 0x9e3779b97f4a7c15ull;
+    return &p->futices[h >> (64 - FUTEX_HASH_ORDER)];
 }
 
-static struct futex * soft_create_futex(process p, u64 key)
+/* Returns the futex for key with a reference taken and the bucket lock held,
+   0 if it doesn't exist and create is false, or INVALID_ADDRESS on
+   allocation failure (without the lock held). */
+static struct futex *futex_get(process p, u64 key, boolean create)
 {
-    heap h = heap_locked(get_kernel_heaps());
-    struct futex * f;
-
-    process_lock(p);
-
-    f = table_find(p->futices, pointer_from_u64(key));
-    if (f)
-        goto out;
-
-    f = allocate(h, sizeof(struct futex));
-    if (f == INVALID_ADDRESS) {
-        msg_err("failed to allocate futex\n");
-        goto out;
+    futex_bucket b = futex_bucket_from_key(p, key);
+    struct futex *f;
+    spin_lock(&b->lock);
+    list_foreach(&b->futices, l) {
+        f = struct_from_list(l, struct futex *, l);
+        if (f->key == key)
+            goto found;
     }
-
-    f->h = h;
-    f->bq = allocate_blockq(f->h, "futex");
+    if (!create) {
+        spin_unlock(&b->lock);
+        return 0;
+    }
+    f = allocate(futex_heap, sizeof(struct futex));
+    if (f == INVALID_ADDRESS)
+        goto alloc_fail;
+    f->bq = allocate_blockq(futex_heap, "futex");
     if (f->bq == INVALID_ADDRESS) {
-        msg_err("failed to allocate futex blockq\n");
-        deallocate(f->h, f, sizeof(struct futex));
-        f = INVALID_ADDRESS;
-        goto out;
+        deallocate(futex_heap, f, sizeof(struct futex));
+        goto alloc_fail;
     }
-
-    spin_lock_init(&f->lock);
-    table_set(p->futices, pointer_from_u64(key), f);
-  out:
-    process_unlock(p);
+    f->key = key;
+    f->b = b;
+    f->refcount = 0;
+    list_push_back(&b->futices, &f->l);
+  found:
+    f->refcount++;
     return f;
+  alloc_fail:
+    spin_unlock(&b->lock);
+    msg_err("failed to allocate futex\n");
+    return INVALID_ADDRESS;
 }
 
-static thread futex_wake_one(struct futex * f)
+/* called with bucket lock held */
+static void futex_put_locked(struct futex *f)
 {
-    thread t = blockq_wake_one(f->bq);
-    if (t != INVALID_ADDRESS)
-        return t;
-    kern_pause();
-    return t;
+    assert(f->refcount > 0);
+    if (--f->refcount == 0) {
+        list_delete(&f->l);
+        deallocate_blockq(f->bq);
+        deallocate(futex_heap, f, sizeof(struct futex));
+    }
 }
 
-/*
- * Wake up to 'val' waiters
- * Return the number woken
- */
-static int futex_wake_many(struct futex * f, int val)
+/* drop a reference and release the bucket lock */
+static void futex_put_unlock(struct futex *f)
 {
-    int nr_woken;
-
-    for (nr_woken = 0; nr_woken < val; nr_woken++) {
-        thread w = futex_wake_one(f);
-        if (w == INVALID_ADDRESS)
-            break;
-    }
-
-    return nr_woken;
+    futex_bucket b = f->b;
+    futex_put_locked(f);
+    spin_unlock(&b->lock);
 }
 
-boolean futex_wake_many_by_uaddr(process p, int *uaddr, int val)
+static void futex_put(struct futex *f)
 {
-    struct futex * f;
+    futex_lock(f);
+    futex_put_unlock(f);
+}
 
-    process_lock(p);
-    f = table_find(p->futices, (void *)uaddr);
-    process_unlock(p);
-    if (!f)
-        return false;
+/* Lock the buckets of two futexes, which may be one and the same. */
+static void futex_lock_2(struct futex *f1, struct futex *f2)
+{
+    if (f1->b == f2->b)
+        futex_lock(f1);
+    else
+        spin_lock_2(&f1->b->lock, &f2->b->lock);
+}
 
-    futex_lock(f);
-    futex_wake_many(f, val);
-    futex_unlock(f);
-    return true;
+static void futex_put_unlock_2(struct futex *f1, struct futex *f2)
+{
+    futex_bucket b1 = f1->b, b2 = f2->b;
+    futex_put_locked(f1);
+    futex_put_locked(f2);
+    if (b1 != b2)
+        spin_unlock(&b2->lock);
+    spin_unlock(&b1->lock);
 }
 
 /*
  * futex_bh is invoked either by the bh processor in response
  * to timeout/signal delivery/etc., or by another thread in sys_futex
  *
+ * The waiter holds a reference to f, taken over from the waiting
+ * operation, which is dropped here once the wait is over.
+ *
  * Return:
  *  BLOCKQ_BLOCK_REQUIRED: top half, going to block
  *  -ETIMEDOUT: if we timed out
  *  -EINTR: if we're being nullified
  *  0: thread woken up
  */
-closure_function(3, 1, sysreturn, futex_bh,
-                 struct futex *, f, thread, t, timestamp, timeout,
+closure_function(4, 1, sysreturn, futex_bh,
+                 struct futex *, f, thread, t, timestamp, timeout, u32, bitset,
                  u64, flags)
 {
     thread t = bound(t);
@@ -128,15 +153,64 @@ closure_function(3, 1, sysreturn, futex_bh,
     }
 
     thread_log(t, "%s: struct futex: %p, flags 0x%lx, rv %ld", __func__, f, flags, rv);
+    futex_put(f);
     closure_finish();
     return syscall_return(t, rv);
 }
 
+closure_function(1, 1, boolean, futex_bitset_match,
+                 u32, bitset,
+                 blockq_action, action)
+{
+    return (closure_member(futex_bh, action, bitset) & bound(bitset)) != 0;
+}
+
+static thread futex_wake_one(struct futex * f, u32 bitset)
+{
+    thread t = (bitset == FUTEX_BITSET_MATCH_ANY) ? blockq_wake_one(f->bq) :
+        blockq_wake_one_filtered(f->bq, stack_closure(futex_bitset_match, bitset));
+    if (t != INVALID_ADDRESS)
+        return t;
+    kern_pause();
+    return t;
+}
+
+/*
+ * Wake up to 'val' waiters whose bitset intersects the given one
+ * Return the number woken
+ */
+static int futex_wake_many(struct futex * f, int val, u32 bitset)
+{
+    int nr_woken;
+
+    for (nr_woken = 0; nr_woken < val; nr_woken++) {
+        thread w = futex_wake_one(f, bitset);
+        if (w == INVALID_ADDRESS)
+            break;
+    }
+
+    return nr_woken;
+}
+
+boolean futex_wake_many_by_uaddr(process p, int *uaddr, int val)
+{
+    struct futex *f = futex_get(p, u64_from_pointer(uaddr), false);
+    if (!f || f == INVALID_ADDRESS)
+        return false;
+    futex_wake_many(f, val, FUTEX_BITSET_MATCH_ANY);
+    futex_put_unlock(f);
+    return true;
+}
+
+/* Moving a waiter moves its reference; called with both bucket locks held. */
 closure_function(1, 1, void, futex_requeue_handler,
                  struct futex *, dest,
                  blockq_action, action)
 {
+    struct futex *src = closure_member(futex_bh, action, f);
     closure_member(futex_bh, action, f) = bound(dest);
+    bound(dest)->refcount++;
+    futex_put_locked(src);      /* the requeueing operation holds another */
 }
 
 static timestamp get_timeout_timestamp(int futex_op, u64 val2)
@@ -152,6 +226,45 @@ static timestamp get_timeout_timestamp(int futex_op, u64 val2)
     }
 }
 
+/* Apply the FUTEX_WAKE_OP operation to *uaddr2 atomically, returning
+   the old value in *oldval */
+static boolean futex_atomic_op(int *uaddr2, unsigned int op, int oparg, int *oldval)
+{
+    int old, new;
+    do {
+        old = *(volatile int *)uaddr2;
+        switch (op) {
+        case FUTEX_OP_SET:   new = oparg; break;
+        case FUTEX_OP_ADD:   new = old + oparg; break;
+        case FUTEX_OP_OR:    new = old | oparg; break;
+        case FUTEX_OP_ANDN:  new = old & ~oparg; break;
+        case FUTEX_OP_XOR:   new = old ^ oparg; break;
+        default:
+            return false;
+        }
+    } while (!compare_and_swap_32((u32 *)uaddr2, old, new));
+    *oldval = old;
+    return true;
+}
+
+static boolean futex_wake_op_cmp(unsigned int cmp, int oldval, int cmparg, boolean *c)
+{
+    switch (cmp) {
+    case FUTEX_OP_CMP_EQ: *c = (oldval == cmparg); break;
+    case FUTEX_OP_CMP_NE: *c = (oldval != cmparg); break;
+    case FUTEX_OP_CMP_LT: *c = (oldval < cmparg); break;
+    case FUTEX_OP_CMP_LE: *c = (oldval <= cmparg); break;
+    case FUTEX_OP_CMP_GT: *c = (oldval > cmparg); break;
+    case FUTEX_OP_CMP_GE: *c = (oldval >= cmparg); break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* sign-extend a 12-bit field */
+#define futex_op_arg(x) (((int)((x) << 20)) >> 20)
+
 static boolean futex_verbose;
 
 sysreturn futex(int *uaddr, int futex_op, int val,
@@ -164,150 +277,150 @@ sysreturn futex(int *uaddr, int futex_op, int val,
     if (!validate_user_memory(uaddr, sizeof(int), false))
         return set_syscall_error(current, EFAULT);
 
-    f = soft_create_futex(current->p, u64_from_pointer(uaddr));
-    if (f == INVALID_ADDRESS)
-        return set_syscall_error(current, ENOMEM);
-    
     op = futex_op & 127; // chuck the private bit
+    switch (op) {
+    case FUTEX_WAIT_BITSET:
+    case FUTEX_WAKE_BITSET:
+        if (val3 == 0)
+            return set_syscall_error(current, EINVAL);
+        break;
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+    case FUTEX_WAKE_OP:
+        if (!validate_user_memory(uaddr2, sizeof(int), op == FUTEX_WAKE_OP))
+            return set_syscall_error(current, EFAULT);
+        break;
+    }
+
     ts = get_timeout_timestamp(op, val2);
     clock_id clkid = (futex_op & FUTEX_CLOCK_REALTIME) ? CLOCK_ID_REALTIME :
             CLOCK_ID_MONOTONIC;
 
     switch (op) {
-    case FUTEX_WAIT: {
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET: {
+        u32 bitset = (op == FUTEX_WAIT) ? FUTEX_BITSET_MATCH_ANY : val3;
         if (futex_verbose)
-            thread_log(current, "futex_wait [%ld %p %d] %d 0x%ld",
-                current->tid, uaddr, *uaddr, val, val2);
+            thread_log(current, "futex_wait [%ld %p %d] %d 0x%ld 0x%x",
+                current->tid, uaddr, *uaddr, val, val2, bitset);
+
+        f = futex_get(current->p, u64_from_pointer(uaddr), true);
+        if (f == INVALID_ADDRESS)
+            return set_syscall_error(current, ENOMEM);
+        if (*uaddr != val) {
+            futex_put_unlock(f);
+            return -EAGAIN;
+        }
 
-        sysreturn rv;
-        futex_lock(f);
-        if (*uaddr != val)
-            rv = -EAGAIN;
-        else
-            rv = blockq_check_timeout(f->bq, current,
-                                      contextual_closure(futex_bh, f, current, ts),
-                                      false, clkid, ts, false);
-        futex_unlock(f);
-        return rv;
+        /* the reference is handed to the waiter; futex_bh releases the lock */
+        return blockq_check_timeout(f->bq, current,
+                                    contextual_closure(futex_bh, f, current, ts, bitset),
+                                    false, clkid, ts, op == FUTEX_WAIT_BITSET);
     }
 
-    case FUTEX_WAKE: {
+    case FUTEX_WAKE:
+    case FUTEX_WAKE_BITSET: {
+        u32 bitset = (op == FUTEX_WAKE) ? FUTEX_BITSET_MATCH_ANY : val3;
         if (futex_verbose)
-            thread_log(current, "futex_wake [%ld %p %d] %d",
-                current->tid, uaddr, *uaddr, val);
-        futex_lock(f);
-        int nr_woken = futex_wake_many(f, val);
-        futex_unlock(f);
+            thread_log(current, "futex_wake [%ld %p %d] %d 0x%x",
+                current->tid, uaddr, *uaddr, val, bitset);
+        f = futex_get(current->p, u64_from_pointer(uaddr), false);
+        if (!f)
+            return 0;           /* no waiters */
+        int nr_woken = futex_wake_many(f, val, bitset);
+        futex_put_unlock(f);
         return nr_woken;
     }
 
+    case FUTEX_REQUEUE:
     case FUTEX_CMP_REQUEUE: {
         int woken, requeued;
 
-        if (!validate_user_memory(uaddr2, sizeof(int), false))
-            return set_syscall_error(current, EFAULT);
-
         if (futex_verbose)
             thread_log(current, "futex_cmp_requeue [%ld %p %d] val: %d val2: %d uaddr2: %p %d val3: %d",
                        current->tid, uaddr, *uaddr, val, val2, uaddr2, *uaddr2, val3);
 
+        /* take both references up front to avoid inverting the bucket lock order */
+        struct futex *new = futex_get(current->p, u64_from_pointer(uaddr2), true);
+        if (new == INVALID_ADDRESS)
+            return set_syscall_error(current, ENOMEM);
+        futex_unlock(new);
+        f = futex_get(current->p, u64_from_pointer(uaddr), true);
+        if (f == INVALID_ADDRESS) {
+            futex_put(new);
+            return set_syscall_error(current, ENOMEM);
+        }
+        futex_unlock(f);
+
         sysreturn rv;
-        futex_lock(f);
-        if (*uaddr != val3) {
+        futex_lock_2(f, new);
+        if (op == FUTEX_CMP_REQUEUE && *uaddr != val3) {
             rv = -EAGAIN;
-            goto cmp_requeue_done;
+            goto requeue_done;
         }
 
-        woken = futex_wake_many(f, val);
+        woken = futex_wake_many(f, val, FUTEX_BITSET_MATCH_ANY);
 
         requeued = 0;
-        if (val2 > 0) {
-            struct futex * new = soft_create_futex(current->p, u64_from_pointer(uaddr2));
-            if (new == INVALID_ADDRESS) {
-                rv = -ENOMEM;
-                goto cmp_requeue_done;
-            }
+        if (val2 > 0 && new != f) {
             requeued = blockq_transfer_waiters(new->bq, f->bq, val2,
                                                stack_closure(futex_requeue_handler, new));
             if (futex_verbose)
                 thread_log(current, " awoken: %d, re-queued %d", woken, requeued);
         }
         rv = woken + requeued;
-      cmp_requeue_done:
-        futex_unlock(f);
+      requeue_done:
+        futex_put_unlock_2(f, new);
         return rv;
     }
 
     case FUTEX_WAKE_OP: {
-        unsigned int cmparg = val3 & MASK(12);
-        unsigned int oparg = (val3 >> 12) & MASK(12);
-        unsigned int cmp = (val3 >> 24) & MASK(4);
         unsigned int op = (val3 >> 28) & MASK(4);
-        int oldval, wake1, wake2, c;
-
-        if (!validate_user_memory(uaddr2, sizeof(int), true))
-            return set_syscall_error(current, EFAULT);
+        unsigned int cmp = (val3 >> 24) & MASK(4);
+        int oparg = futex_op_arg((val3 >> 12) & MASK(12));
+        int cmparg = futex_op_arg(val3 & MASK(12));
+        int oldval, wake1, wake2;
+        boolean c;
+
+        if (op & FUTEX_OP_OPARG_SHIFT) {
+            if (oparg < 0 || oparg > 31)
+                return set_syscall_error(current, EINVAL);
+            oparg = 1 << oparg;
+            op &= ~FUTEX_OP_OPARG_SHIFT;
+        }
 
         if (futex_verbose) {
             thread_log(current, "futex_wake_op: [%ld %p %d] %p %d %d %d %d",
                 current->tid, uaddr, *uaddr, uaddr2, cmparg, oparg, cmp, op);
         }
 
-        struct futex *f2 = soft_create_futex(current->p, u64_from_pointer(uaddr2));
+        struct futex *f2 = futex_get(current->p, u64_from_pointer(uaddr2), true);
         if (f2 == INVALID_ADDRESS)
-            return -ENOMEM;
-        spin_lock_2(&f->lock, &f2->lock);
-        oldval = *(int *) uaddr2;
-        
-        switch (op) {
-        case FUTEX_OP_SET:   *uaddr2 = oparg; break;
-        case FUTEX_OP_ADD:   *uaddr2 += oparg; break;
-        case FUTEX_OP_OR:    *uaddr2 |= oparg; break;
-        case FUTEX_OP_ANDN:  *uaddr2 &= ~oparg; break;
-        case FUTEX_OP_XOR:   *uaddr2 ^= oparg; break;
-        }
-
-        wake1 = futex_wake_many(f, val);
-        
-        c = 0;
-        switch (cmp) {
-        case FUTEX_OP_CMP_EQ: c = (oldval == cmparg) ; break;
-        case FUTEX_OP_CMP_NE: c = (oldval != cmparg); break;
-        case FUTEX_OP_CMP_LT: c = (oldval < cmparg); break;
-        case FUTEX_OP_CMP_LE: c = (oldval <= cmparg); break;
-        case FUTEX_OP_CMP_GT: c = (oldval > cmparg) ; break;
-        case FUTEX_OP_CMP_GE: c = (oldval >= cmparg) ; break;
-        }
-        
-        wake2 = 0;
-        if (c) {
-            wake2 = futex_wake_many(f2, val2);
-        }
-
+            return set_syscall_error(current, ENOMEM);
         futex_unlock(f2);
+        f = futex_get(current->p, u64_from_pointer(uaddr), true);
+        if (f == INVALID_ADDRESS) {
+            futex_put(f2);
+            return set_syscall_error(current, ENOMEM);
+        }
         futex_unlock(f);
-        return set_syscall_return(current, wake1 + wake2);
-    }
-
-    case FUTEX_WAIT_BITSET: {
-        if (futex_verbose)
-            thread_log(current, "futex_wait_bitset [%ld %p %d] %d 0x%ld %d",
-                current->tid, uaddr, *uaddr, val, val2, val3);
 
         sysreturn rv;
-        futex_lock(f);
-        if (*uaddr != val)
-            rv = -EAGAIN;
-        else
-            rv = blockq_check_timeout(f->bq, current,
-                                      contextual_closure(futex_bh, f, current, ts),
-                                      false, clkid, ts, true);
-        futex_unlock(f);
+        futex_lock_2(f, f2);
+        if (!futex_atomic_op(uaddr2, op, oparg, &oldval) ||
+            !futex_wake_op_cmp(cmp, oldval, cmparg, &c)) {
+            rv = -ENOSYS;
+            goto wake_op_done;
+        }
+
+        wake1 = futex_wake_many(f, val, FUTEX_BITSET_MATCH_ANY);
+        wake2 = c ? futex_wake_many(f2, val2, FUTEX_BITSET_MATCH_ANY) : 0;
+        rv = wake1 + wake2;
+      wake_op_done:
+        futex_put_unlock_2(f, f2);
         return rv;
     }
 
-    case FUTEX_REQUEUE: rprintf("futex_requeue not implemented\n"); break;
-    case FUTEX_WAKE_BITSET: rprintf("futex_wake_bitset not implemented\n"); break;
     case FUTEX_LOCK_PI: rprintf("futex_lock_pi not implemented\n"); break;
     case FUTEX_TRYLOCK_PI: rprintf("futex_trylock_pi not implemented\n"); break;
     case FUTEX_UNLOCK_PI: rprintf("futex_unlock_pi not implemented\n"); break;
@@ -330,9 +443,14 @@ void
 init_futices(process p)
 {
     heap h = heap_locked(&p->uh->kh);
-    p->futices = allocate_table(h, futex_key_function, futex_key_equal);
+    futex_heap = h;
+    p->futices = allocate(h, FUTEX_HASH_BUCKETS * sizeof(struct futex_bucket));
     if (p->futices == INVALID_ADDRESS)
         halt("failed to allocate futex table\n");
+    for (int i = 0; i < FUTEX_HASH_BUCKETS; i++) {
+        spin_lock_init(&p->futices[i].lock);
+        list_init(&p->futices[i].futices);
+    }
     register_root_notify(sym(futex_trace), closure(h, futex_trace_notify));
 }
 
@@ -16,6 +16,13 @@ typedef struct vmap_heap {
     boolean randomize;
 } *vmap_heap;
 
+/* transparent_hugepage manifest option */
+enum {
+    THP_ALWAYS,
+    THP_MADVISE,
+    THP_NEVER,
+};
+
 declare_closure_function(0, 2, int, pending_fault_compare,
                          rbnode, a, rbnode, b);
 declare_closure_function(0, 1, boolean, pending_fault_print,
@@ -24,6 +31,7 @@ static struct {
     heap h;
     id_heap physical;
     backed_heap linear_backed;
+    int thp_mode;
 
     closure_struct(pending_fault_compare, pf_compare);
     closure_struct(pending_fault_print, pf_print);
@@ -132,13 +140,116 @@ u64 new_zeroed_pages(u64 v, u64 length, pageflags flags, status_handler complete
     return p;
 }
 
-static boolean demand_anonymous_page(pending_fault pf, vmap vm, u64 vaddr)
+static boolean vmap_hugepage_enabled(u32 flags)
 {
-    if (new_zeroed_pages(vaddr & ~MASK(PAGELOG), PAGESIZE, pageflags_from_vmflags(vm->flags),
-                         (status_handler)&pf->complete) == INVALID_PHYSICAL)
+    if ((flags & VMAP_MMAP_TYPE_MASK) != VMAP_MMAP_TYPE_ANONYMOUS ||
+        (flags & (VMAP_FLAG_PREALLOC | VMAP_FLAG_NOHUGEPAGE)))
         return false;
-    count_minor_fault();
-    return true;
+    switch (mmap_info.thp_mode) {
+    case THP_ALWAYS:
+        return true;
+    case THP_MADVISE:
+        return (flags & VMAP_FLAG_HUGEPAGE) != 0;
+    default:
+        return false;
+    }
+}
+
+/* Returns the address of the 2MB page that may back vaddr, or
+   INVALID_PHYSICAL if the vmap doesn't cover all of it. */
+static u64 vmap_huge_page_addr(vmap vm, u64 vaddr)
+{
+    if (!vmap_hugepage_enabled(vm->flags))
+        return INVALID_PHYSICAL;
+    u64 huge_addr = vaddr & ~MASK(PAGELOG_2M);
+    if (!range_contains(vm->node.r, irangel(huge_addr, PAGESIZE_2M)))
+        return INVALID_PHYSICAL;
+    return huge_addr;
+}
+
+/* A block mapping can only be installed where there is neither a page nor a
+   page table at the 2MB level. */
+closure_function(0, 3, boolean, huge_page_range_unmapped,
+                 int, level, u64, addr, pteptr, entry)
+{
+    pte e = pte_from_pteptr(entry);
+    if (!pte_is_present(e))
+        return true;
+    return pt_level_shift(level) > PAGELOG_2M && !pte_is_mapping(level, e);
+}
+
+/* Split huge pages straddling the ends of q, so that q can be unmapped or
+   reprotected without affecting the pages around it. */
+boolean split_range_mappings(range q)
+{
+    return split_block_mapping(q.start) && split_block_mapping(q.end);
+}
+
+static inline vmap vmap_from_vaddr_locked(process p, u64 vaddr)
+{
+    return (vmap)rangemap_lookup(p->vmaps, vaddr);
+}
+
+/* Whether a block mapping could currently be installed at huge_addr (a page
+   already mapped in the range implies a page table at the 2MB level). Page
+   tables may be freed by a concurrent unmap, so they are only walked with the
+   vmap lock held. */
+static boolean huge_page_mappable(process p, u64 huge_addr)
+{
+    vmap_lock(p);
+    boolean mappable = traverse_ptes(huge_addr, PAGESIZE_2M,
+                                     stack_closure(huge_page_range_unmapped));
+    vmap_unlock(p);
+    return mappable;
+}
+
+/* Back the fault with a block mapping of the 2MB range at huge_addr if
+   possible, and with a single page otherwise. The fault was keyed on an
+   address derived from a vmap that may since have been split, reprotected or
+   removed, and a fault keyed on another address may have mapped the page
+   meanwhile, so both are checked again with the vmap lock held. The 2MB
+   page is only allocated and zeroed if the range looks unmapped beforehand;
+   the common case of a fault next to existing pages costs a single page. */
+static boolean demand_anonymous_page(pending_fault pf, process p, u64 vaddr, u64 huge_addr)
+{
+    void *m = INVALID_ADDRESS;
+    if (huge_addr != INVALID_PHYSICAL && huge_page_mappable(p, huge_addr)) {
+        m = allocate((heap)mmap_info.linear_backed, PAGESIZE_2M);
+        if (m != INVALID_ADDRESS) {
+            zero(m, PAGESIZE_2M);
+            write_barrier();
+        }
+    }
+    u64 page_addr = vaddr & ~MASK(PAGELOG);
+    status_handler complete = (status_handler)&pf->complete;
+    boolean retry = false;
+    boolean result = true;
+    vmap_lock(p);
+    vmap vm = vmap_from_vaddr_locked(p, vaddr);
+    if (vm == INVALID_ADDRESS || (vm->flags & VMAP_MMAP_TYPE_MASK) != VMAP_MMAP_TYPE_ANONYMOUS ||
+        physical_from_virtual(pointer_from_u64(page_addr)) != INVALID_PHYSICAL) {
+        retry = true;
+    } else if (m != INVALID_ADDRESS && vmap_huge_page_addr(vm, vaddr) == huge_addr &&
+               traverse_ptes(huge_addr, PAGESIZE_2M, stack_closure(huge_page_range_unmapped))) {
+        pf_debug("%s: huge page at 0x%lx\n", __func__, huge_addr);
+        map_with_complete(huge_addr, phys_from_linear_backed_virt(u64_from_pointer(m)),
+                          PAGESIZE_2M, pageflags_no_minpage(pageflags_from_vmflags(vm->flags)),
+                          complete);
+        m = INVALID_ADDRESS;
+    } else {
+        result = new_zeroed_pages(page_addr, PAGESIZE, pageflags_from_vmflags(vm->flags),
+                                  complete) != INVALID_PHYSICAL;
+    }
+    vmap_unlock(p);
+    if (m != INVALID_ADDRESS)
+        deallocate((heap)mmap_info.linear_backed, m, PAGESIZE_2M);
+    if (retry) {
+        /* nothing to map here; the access is retried and faults again if need be */
+        apply(complete, STATUS_OK);
+    } else if (result) {
+        count_minor_fault();
+    }
+    return result;
 }
 
 define_closure_function(5, 0, void, thread_demand_file_page,
@@ -154,8 +265,10 @@ define_closure_function(5, 0, void, thread_demand_file_page,
     range ra = irange(bound(node_offset) + PAGESIZE,
         vm->node_offset + range_span(vm->node.r));
     if (range_valid(ra)) {
-        if (range_span(ra) > FILE_READAHEAD_DEFAULT)
-            ra.end = ra.start + FILE_READAHEAD_DEFAULT;
+        u64 ra_size = (vm->flags & VMAP_FLAG_SEQUENTIAL) ? FILE_READAHEAD_MAX :
+                                                           FILE_READAHEAD_DEFAULT;
+        if (range_span(ra) > ra_size)
+            ra.end = ra.start + ra_size;
         pagecache_node_fetch_pages(pn, ra);
     }
 }
@@ -226,14 +339,17 @@ static boolean demand_filebacked_page(thread t, context ctx, vmap vm, u64 vaddr,
 
 boolean do_demand_page(thread t, context ctx, u64 vaddr, vmap vm)
 {
-    u64 page_addr = vaddr & ~PAGEMASK;
-
     if ((vm->flags & VMAP_FLAG_MMAP) == 0) {
         msg_err("vaddr 0x%lx matched vmap with invalid flags (0x%x)\n",
                 vaddr, vm->flags);
         return false;
     }
 
+    /* Faults on a range that may be backed by a huge page are serialized on
+       the huge page address, even if they end up mapping a single page. */
+    u64 huge_addr = vmap_huge_page_addr(vm, vaddr);
+    u64 page_addr = huge_addr != INVALID_PHYSICAL ? huge_addr : vaddr & ~PAGEMASK;
+
     pf_debug("%s: %s context, %s, vaddr %p, vm flags 0x%02lx,\n", __func__,
              context_type_strings[ctx->type],
              string_from_mmap_type(vm->flags & VMAP_MMAP_TYPE_MASK),
@@ -256,7 +372,7 @@ boolean do_demand_page(thread t, context ctx, u64 vaddr, vmap vm)
         int mmap_type = vm->flags & VMAP_MMAP_TYPE_MASK;
         switch (mmap_type) {
         case VMAP_MMAP_TYPE_ANONYMOUS:
-            return demand_anonymous_page(pf, vm, vaddr);
+            return demand_anonymous_page(pf, p, vaddr, huge_addr);
         case VMAP_MMAP_TYPE_FILEBACKED:
             if (demand_filebacked_page(t, ctx, vm, vaddr, pf))
                 return true;
@@ -268,11 +384,6 @@ boolean do_demand_page(thread t, context ctx, u64 vaddr, vmap vm)
     kern_yield();
 }
 
-static inline vmap vmap_from_vaddr_locked(process p, u64 vaddr)
-{
-    return (vmap)rangemap_lookup(p->vmaps, vaddr);
-}
-
 vmap vmap_from_vaddr(process p, u64 vaddr)
 {
     vmap_lock(p);
@@ -359,40 +470,49 @@ void deallocate_vmap(rangemap rm, vmap vm)
     deallocate(rm->h, vm, sizeof(struct vmap));
 }
 
-closure_function(3, 1, void, proc_virt_gap_handler,
-                 u64, size, boolean, randomize, u64 *, addr,
+closure_function(4, 1, void, proc_virt_gap_handler,
+                 u64, size, u64, align, boolean, randomize, u64 *, addr,
                  range, r)
 {
     if (*bound(addr) != INVALID_PHYSICAL)
         return; /* A suitable gap has been found already. */
     u64 size = bound(size);
-    if (range_span(r) > size) {
+    u64 align = bound(align);
+    u64 start = pad(r.start, align);
+    if (start < r.end && r.end - start > size) {
+        u64 slots = (r.end - start - size) / align;
         u64 offset;
-        if (bound(randomize))
-            offset = (random_u64() % ((range_span(r) - size) >> PAGELOG)) << PAGELOG;
+        if (bound(randomize) && slots)
+            offset = (random_u64() % slots) * align;
         else
             offset = 0;
-        *bound(addr) = r.start + offset;
+        *bound(addr) = start + offset;
     }
 }
 
-/* Does NOT mark the returned address as allocated in the virtual heap. */
-u64 process_get_virt_range(process p, u64 size)
+static u64 process_get_virt_range_aligned(process p, u64 size, u64 align)
 {
     assert(!(size & PAGEMASK));
     vmap_heap vmh = (vmap_heap)p->virtual;
     u64 addr = INVALID_PHYSICAL;
     rangemap_range_find_gaps(p->vmaps,
                              irange(PROCESS_VIRTUAL_HEAP_START, PROCESS_VIRTUAL_HEAP_LIMIT),
-                             stack_closure(proc_virt_gap_handler, size, vmh->randomize, &addr));
+                             stack_closure(proc_virt_gap_handler, size, align, vmh->randomize,
+                                           &addr));
     return addr;
 }
 
-static vmap proc_get_vmap(process p, u64 size, u64 vmflags)
+/* Does NOT mark the returned address as allocated in the virtual heap. */
+u64 process_get_virt_range(process p, u64 size)
+{
+    return process_get_virt_range_aligned(p, size, PAGESIZE);
+}
+
+static vmap proc_get_vmap(process p, u64 size, u64 align, u64 vmflags)
 {
     vmap vm;
     vmap_lock(p);
-    u64 virt_addr = process_get_virt_range(p, size);
+    u64 virt_addr = process_get_virt_range_aligned(p, size, align);
     if (virt_addr == INVALID_PHYSICAL)
         vm = INVALID_ADDRESS;
     else
@@ -403,7 +523,7 @@ static vmap proc_get_vmap(process p, u64 size, u64 vmflags)
 
 void *process_map_physical(process p, u64 phys_addr, u64 size, u64 vmflags)
 {
-    vmap vm = proc_get_vmap(p, size, vmflags);
+    vmap vm = proc_get_vmap(p, size, PAGESIZE, vmflags);
     if (vm == INVALID_ADDRESS)
         return INVALID_ADDRESS;
     u64 virt_addr = vm->node.r.start;
@@ -633,14 +753,16 @@ closure_function(2, 1, void, vmap_update_protections_validate,
 */
 
 /* refactor with vmap_remove_intersection? might be better as-is. */
-closure_function(4, 1, void, vmap_update_protections_intersection,
-                 heap, h, rangemap, pvmap, range, q, u32, newflags,
+closure_function(5, 1, void, vmap_update_flags_intersection,
+                 heap, h, rangemap, pvmap, range, q, u32, mask, u32, newflags,
                  rmnode, node)
 {
     rangemap pvmap = bound(pvmap);
 
-    u32 newflags = bound(newflags);
     vmap match = (vmap)node;
+
+    /* only the flags in mask are replaced */
+    u32 newflags = (match->flags & ~bound(mask)) | bound(newflags);
     if (newflags == match->flags)
         return;
 
@@ -651,9 +773,6 @@ closure_function(4, 1, void, vmap_update_protections_intersection,
     boolean head = ri.start > rn.start;
     boolean tail = ri.end < rn.end;
 
-    /* protection flags only */
-    newflags = (match->flags & ~(VMAP_FLAG_WRITABLE | VMAP_FLAG_EXEC)) | newflags;
-
     if (!head && !tail) {
         /* key (range) remains the same, no need to reinsert */
         match->flags = newflags;
@@ -717,7 +836,12 @@ static sysreturn vmap_update_protections(heap h, rangemap pvmap, range q, u32 ne
     else if (prot_violation)
         return -EACCES;
 
-    rmnode_handler nh = stack_closure(vmap_update_protections_intersection, h, pvmap, q, newflags);
+    /* huge pages straddling the range are reprotected in part */
+    if (!split_range_mappings(q))
+        return -ENOMEM;
+
+    rmnode_handler nh = stack_closure(vmap_update_flags_intersection, h, pvmap, q,
+                                      VMAP_FLAG_WRITABLE | VMAP_FLAG_EXEC, newflags);
     rangemap_range_lookup(pvmap, q, nh);
 
     update_map_flags(q.start, range_span(q), pageflags_from_vmflags(newflags));
@@ -870,13 +994,17 @@ closure_function(1, 1, void, vmap_unmap,
     vmap_unmap_page_range(bound(p), v);
 }
 
-static void process_unmap_range(process p, range q)
+static boolean process_unmap_range(process p, range q)
 {
     vmap_lock(p);
-    vmap_handler vh = stack_closure(vmap_unmap, p);
-    rangemap_range_lookup(p->vmaps, q, stack_closure(vmap_remove_intersection,
-                                                     p->vmaps, q, vh, false));
+    boolean split = split_range_mappings(q);
+    if (split) {
+        vmap_handler vh = stack_closure(vmap_unmap, p);
+        rangemap_range_lookup(p->vmaps, q, stack_closure(vmap_remove_intersection,
+                                                         p->vmaps, q, vh, false));
+    }
     vmap_unlock(p);
+    return split;
 }
 
 void unmap_and_free_phys(u64 virtual, u64 length)
@@ -1018,6 +1146,15 @@ static sysreturn msync(void *addr, u64 length, int flags)
     return have_gap ? -ENOMEM : 0;
 }
 
+/* Place mappings that may be backed by huge pages on a 2MB boundary. */
+static u64 mmap_alloc_virtual(process p, u64 len, u32 vmflags)
+{
+    if (len < PAGESIZE_2M || !vmap_hugepage_enabled(vmflags))
+        return allocate_u64(p->virtual, len);
+    vmap vm = proc_get_vmap(p, len, PAGESIZE_2M, 0);
+    return vm == INVALID_ADDRESS ? INVALID_PHYSICAL : vm->node.r.start;
+}
+
 static sysreturn mmap(void *addr, u64 length, int prot, int flags, int fd, u64 offset)
 {
     process p = current->p;
@@ -1067,7 +1204,8 @@ static sysreturn mmap(void *addr, u64 length, int prot, int flags, int fd, u64 o
         /* Release intersecting portions of existing maps */
         range q = irangel(where, len);
         thread_log(current, "   fixed map %R, release intersections and reserve virtual space", q);
-        process_unmap_range(p, q);
+        if (!process_unmap_range(p, q))
+            return -ENOMEM;
 
         /* A specified address is only allowed in certain areas. Programs may specify
            a fixed address to augment some existing mapping. */
@@ -1110,15 +1248,17 @@ static sysreturn mmap(void *addr, u64 length, int prot, int flags, int fd, u64 o
         goto out;
     }
     vmflags |= vmap_mmap_type;
+    if ((flags & MAP_HUGETLB) && vmap_mmap_type == VMAP_MMAP_TYPE_ANONYMOUS)
+        vmflags |= VMAP_FLAG_HUGEPAGE;
 
     if (!fixed && (vmap_mmap_type == VMAP_MMAP_TYPE_ANONYMOUS ||
                    vmap_mmap_type == VMAP_MMAP_TYPE_FILEBACKED)) {
 #ifdef __x86_64__
         boolean is_32bit = (flags & MAP_32BIT) != 0; /* allocate from 32-bit address space */
         where = is_32bit ? id_heap_alloc_subrange(p->virtual32, len, 0x80000000, 0x100000000) :
-            allocate_u64(p->virtual, len);
+            mmap_alloc_virtual(p, len, vmflags);
 #else
-        where = allocate_u64(p->virtual, len);
+        where = mmap_alloc_virtual(p, len, vmflags);
 #endif
         if (where == (u64)INVALID_ADDRESS) {
             /* We'll always want to know about low memory conditions, so just bark. */
@@ -1180,10 +1320,191 @@ static sysreturn munmap(void *addr, u64 length)
     if ((where & MASK(PAGELOG)) || length == 0)
         return -EINVAL;
 
-    process_unmap_range(p, irangel(where, pad(length, PAGESIZE)));
+    if (!process_unmap_range(p, irangel(where, pad(length, PAGESIZE))))
+        return -ENOMEM;
     return 0;
 }
 
+closure_function(0, 1, void, madvise_gap,
+                 range, r)
+{
+    thread_log(current, "   found gap [0x%lx, 0x%lx)", r.start, r.end);
+}
+
+/* MADV_FREE only applies to private anonymous memory */
+closure_function(2, 1, void, madvise_free_validate,
+                 boolean *, invalid, u64 *, lazyfree,
+                 rmnode, n)
+{
+    vmap vm = (vmap)n;
+    if (!(vm->flags & VMAP_FLAG_MMAP))
+        return;
+    if ((vm->flags & VMAP_MMAP_TYPE_MASK) != VMAP_MMAP_TYPE_ANONYMOUS ||
+        (vm->flags & VMAP_FLAG_SHARED))
+        *bound(invalid) = true;
+    else if (!(vm->flags & VMAP_FLAG_LAZYFREE))
+        (*bound(lazyfree))++;
+}
+
+closure_function(2, 1, void, madvise_vmap,
+                 range, q, int, advice,
+                 rmnode, n)
+{
+    vmap vm = (vmap)n;
+    if (!(vm->flags & VMAP_FLAG_MMAP) || (vm->flags & VMAP_FLAG_PREALLOC))
+        return;
+    range r = range_intersection(bound(q), n->r);
+    u64 node_offset = vm->node_offset + (r.start - n->r.start);
+    switch (vm->flags & VMAP_MMAP_TYPE_MASK) {
+    case VMAP_MMAP_TYPE_ANONYMOUS:
+        /* there is no object to refill shared pages from */
+        if (bound(advice) == MADV_DONTNEED && !(vm->flags & VMAP_FLAG_SHARED))
+            unmap_and_free_phys(r.start, range_span(r));
+        break;
+    case VMAP_MMAP_TYPE_FILEBACKED:
+        if (bound(advice) == MADV_DONTNEED)
+            pagecache_node_unmap_pages(vm->cache_node, r, node_offset);
+        else if (bound(advice) == MADV_WILLNEED)
+            pagecache_node_fetch_pages(vm->cache_node, irangel(node_offset, range_span(r)));
+        break;
+    }
+}
+
+/* advice flags only apply to (and only split) mmapped vmaps; the brk heap
+   vmap in particular must stay whole */
+closure_function(1, 1, void, madvise_update_flags,
+                 rmnode_handler, update,
+                 rmnode, n)
+{
+    if (((vmap)n)->flags & VMAP_FLAG_MMAP)
+        apply(bound(update), n);
+}
+
+static sysreturn madvise(void *addr, s64 length, int advice)
+{
+    thread_log(current, "madvise: addr %p, length 0x%lx, advice %d", addr, length, advice);
+    u64 where = u64_from_pointer(addr);
+    if ((where & PAGEMASK) || length < 0)
+        return -EINVAL;
+    if (length == 0)
+        return 0;
+
+    process p = current->p;
+    range q = irangel(where, pad(length, PAGESIZE));
+    u32 mask = 0, newflags = 0;
+    switch (advice) {
+    case MADV_NORMAL:
+        mask = VMAP_FLAG_SEQUENTIAL;
+        break;
+    case MADV_SEQUENTIAL:
+        mask = newflags = VMAP_FLAG_SEQUENTIAL;
+        break;
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+        break;
+    case MADV_FREE:
+#ifndef __aarch64__
+        mask = newflags = VMAP_FLAG_LAZYFREE;
+#endif
+        break;
+    case MADV_HUGEPAGE:
+        mask = VMAP_FLAG_HUGEPAGE | VMAP_FLAG_NOHUGEPAGE;
+        newflags = VMAP_FLAG_HUGEPAGE;
+        break;
+    case MADV_NOHUGEPAGE:
+        mask = VMAP_FLAG_HUGEPAGE | VMAP_FLAG_NOHUGEPAGE;
+        newflags = VMAP_FLAG_NOHUGEPAGE;
+        break;
+    default:
+        return 0;
+    }
+
+    sysreturn rv = 0;
+    boolean invalid = false;
+    u64 lazyfree = 0;
+    vmap_lock(p);
+    if (rangemap_range_find_gaps(p->vmaps, q, stack_closure(madvise_gap))) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    if (advice == MADV_FREE) {
+        rangemap_range_lookup(p->vmaps, q, stack_closure(madvise_free_validate, &invalid,
+                                                            &lazyfree));
+        if (invalid) {
+            rv = -EINVAL;
+            goto out;
+        }
+#ifdef __aarch64__
+        /* ptes don't track dirty state here, so release the pages right away */
+        advice = MADV_DONTNEED;
+#endif
+    }
+
+    /* the range is released or reclaimed in whole pages */
+    if ((advice == MADV_DONTNEED || advice == MADV_FREE) && !split_range_mappings(q)) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    if (mask) {
+        rmnode_handler update = stack_closure(vmap_update_flags_intersection, mmap_info.h,
+                                              p->vmaps, q, mask, newflags);
+        rangemap_range_lookup(p->vmaps, q, stack_closure(madvise_update_flags, update));
+        if (newflags & VMAP_FLAG_LAZYFREE)
+            p->lazyfree_vmaps += lazyfree;
+    }
+    if (advice == MADV_DONTNEED || advice == MADV_WILLNEED)
+        rangemap_range_lookup(p->vmaps, q, stack_closure(madvise_vmap, q, advice));
+    else if (advice == MADV_FREE)
+        clean_mapped_pages(q.start, range_span(q));
+  out:
+    vmap_unlock(p);
+    return rv;
+}
+
+closure_function(2, 1, void, lazyfree_dealloc_page,
+                 id_heap, physical, u64 *, freed,
+                 range, r)
+{
+    if (id_heap_set_area(bound(physical), r.start, range_span(r), true, false))
+        *bound(freed) += range_span(r);
+    else
+        msg_err("some of physical range %R not allocated in heap\n", r);
+}
+
+/* Reclaim pages that have not been written since MADV_FREE. The pages that
+   remain after a vmap is scanned were written since and must be kept.
+   lazyfree_vmaps may overcount (vmaps split or unmapped after madvise), so it
+   is only reset to zero once a scan finds no flagged vmap left. */
+closure_function(1, 1, u64, mmap_lazyfree_cleaner,
+                 process, p,
+                 u64, clean_bytes)
+{
+    process p = bound(p);
+    if (!p->lazyfree_vmaps)
+        return 0;
+    u64 freed = 0;
+    range_handler rh = stack_closure(lazyfree_dealloc_page, mmap_info.physical, &freed);
+    boolean complete = true;
+    vmap_lock(p);
+    rangemap_foreach(p->vmaps, n) {
+        vmap vm = (vmap)n;
+        if (!(vm->flags & VMAP_FLAG_LAZYFREE))
+            continue;
+        if (freed >= clean_bytes) {
+            complete = false;
+            break;
+        }
+        unmap_clean_pages_with_handler(n->r.start, range_span(n->r), rh);
+        vm->flags &= ~VMAP_FLAG_LAZYFREE;
+        if (p->lazyfree_vmaps > 1)
+            p->lazyfree_vmaps--;
+    }
+    if (complete)
+        p->lazyfree_vmaps = 0;
+    vmap_unlock(p);
+    return freed;
+}
+
 /* kernel start */
 extern void * START;
 
@@ -1200,7 +1521,7 @@ static void add_varea(process p, u64 start, u64 end, id_heap vheap, boolean allo
 static u64 vmh_alloc(struct heap *h, bytes b)
 {
     vmap_heap vmh = (vmap_heap)h;
-    vmap vm = proc_get_vmap(vmh->p, b, 0);
+    vmap vm = proc_get_vmap(vmh->p, b, PAGESIZE, 0);
     if (vm == INVALID_ADDRESS)
         return INVALID_PHYSICAL;
     return vm->node.r.start;
@@ -1293,13 +1614,23 @@ boolean fault_in_user_memory(const void *buf, bytes length,
     return true;
 }
 
-void mmap_process_init(process p, boolean aslr)
+void mmap_process_init(process p, tuple root, boolean aslr)
 {
     kernel_heaps kh = &p->uh->kh;
     heap h = heap_locked(kh);
     mmap_info.h = h;
     mmap_info.physical = heap_physical(kh);
     mmap_info.linear_backed = heap_linear_backed(kh);
+    mmap_info.thp_mode = THP_ALWAYS;
+    string thp = get_string(root, sym(transparent_hugepage));
+    if (thp) {
+        if (buffer_compare_with_cstring(thp, "madvise"))
+            mmap_info.thp_mode = THP_MADVISE;
+        else if (buffer_compare_with_cstring(thp, "never"))
+            mmap_info.thp_mode = THP_NEVER;
+        else if (!buffer_compare_with_cstring(thp, "always"))
+            msg_err("invalid transparent_hugepage value \"%b\"; using \"always\"\n", thp);
+    }
     spin_lock_init(&p->vmap_lock);
     p->vareas = allocate_rangemap(h);
     p->vmaps = allocate_rangemap(h);
@@ -1352,6 +1683,11 @@ void mmap_process_init(process p, boolean aslr)
                 init_closure(&mmap_info.pf_compare, pending_fault_compare),
                 init_closure(&mmap_info.pf_print, pending_fault_print));
     list_init(&mmap_info.pf_freelist);
+
+    p->lazyfree_vmaps = 0;
+    mem_cleaner mc = closure(h, mmap_lazyfree_cleaner, p);
+    assert(mc != INVALID_ADDRESS);
+    mm_register_mem_cleaner(mc);
 }
 
 void register_mmap_syscalls(struct syscall *map)
@@ -1362,5 +1698,5 @@ void register_mmap_syscalls(struct syscall *map)
     register_syscall(map, msync, msync, SYSCALL_F_SET_MEM);
     register_syscall(map, munmap, munmap, SYSCALL_F_SET_MEM);
     register_syscall(map, mprotect, mprotect, SYSCALL_F_SET_MEM);
-    register_syscall(map, madvise, syscall_ignore, SYSCALL_F_SET_MEM);
+    register_syscall(map, madvise, madvise, SYSCALL_F_SET_MEM);
 }
@@ -15,7 +15,7 @@ declare_closure_struct(1, 0, void, epollfd_free,
 typedef struct epollfd {
     int fd;
     fdesc f;
-    struct spinlock lock;   /* protects zombie/registered/eventmask/lastevents */
+    struct spinlock lock;   /* protects zombie/registered/eventmask/lastevents/ready */
     u32 eventmask;  /* epoll events registered  */
     u32 lastevents; /* retain last received events; for edge trigger */
     u64 data;       /* may be multiple versions of data? */
@@ -24,7 +24,9 @@ typedef struct epollfd {
     epoll e;
     boolean registered;
     boolean zombie; /* freed or masked by oneshot */
+    boolean thread_events;  /* events may differ by thread (e.g. signalfd) */
     notify_entry notify_handle;
+    struct list ready;      /* epoll ready list membership */
 } *epollfd;
 
 typedef struct epoll_blocked *epoll_blocked;
@@ -79,6 +81,8 @@ struct epoll {
     vector events;              /* epollfds indexed by fd */
     int nfds;
     bitmap fds;                 /* fds being watched / epollfd registered */
+    struct spinlock ready_lock;
+    struct list ready;          /* epollfds that may have events to report (epoll only) */
 };
 
 define_closure_function(1, 0, void, epoll_free,
@@ -104,6 +108,8 @@ static epoll epoll_alloc_internal(int epoll_type)
     init_refcount(&e->refcount, 1, init_closure(&e->free, epoll_free, e));
     spin_lock_init(&e->blocked_lock);
     spin_lock_init(&e->fds_lock);
+    spin_lock_init(&e->ready_lock);
+    list_init(&e->ready);
     e->h = epoll_heap;
     e->events = allocate_vector(e->h, 8);
     if (e->events == INVALID_ADDRESS)
@@ -137,6 +143,7 @@ static void reset_epollfd(epollfd efd, u32 eventmask, u64 data)
     efd->eventmask = eventmask;
     efd->lastevents = 0;
     efd->zombie = false;
+    efd->thread_events = false;
     efd->data = data;
 }
 
@@ -187,10 +194,23 @@ static void release_epollfd(epollfd efd)
 }
 
 static inline void poll_notify(epollfd efd, epoll_blocked w, u64 events);
-static inline void epoll_wait_notify(epollfd efd, epoll_blocked w, u64 report);
+static inline boolean epoll_wait_notify(epollfd efd, epoll_blocked w, u64 report);
 static inline void select_notify(epollfd efd, epoll_blocked w, u64 report);
 static inline u32 report_from_notify_events(epollfd efd, u64 notify_events);
 
+/* Queue an epollfd to be checked by epoll_wait. The ready list holds a
+   reference to the epollfd. Called with efd->lock held. */
+static void epollfd_ready(epollfd efd)
+{
+    if (list_inserted(&efd->ready))
+        return;
+    epoll e = efd->e;
+    refcount_reserve(&efd->refcount);
+    spin_lock(&e->ready_lock);
+    list_push_back(&e->ready, &efd->ready);
+    spin_unlock(&e->ready_lock);
+}
+
 closure_function(1, 2, boolean, wait_notify,
                  epollfd, efd,
                  u64, notify_events, void *, t)
@@ -213,6 +233,13 @@ closure_function(1, 2, boolean, wait_notify,
         return false;
     }
 
+    if (efd->e->epoll_type == EPOLL_TYPE_EPOLL) {
+        if (t)
+            efd->thread_events = true;
+        if (notify_events || t)
+            epollfd_ready(efd);
+    }
+
     spin_lock(&efd->e->blocked_lock);
     list l = list_get_next(&efd->e->blocked_head);
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -280,6 +307,17 @@ static void epoll_release_epollfds(epoll e)
         release_epollfd(efd);
     }
     spin_unlock(&e->fds_lock);
+
+    /* all epollfds are unregistered now, so the ready list can't be refilled */
+    struct list ready;
+    spin_lock(&e->ready_lock);
+    list_move(&ready, &e->ready);
+    spin_unlock(&e->ready_lock);
+    list_foreach(&ready, l) {
+        epollfd efd = struct_from_list(l, epollfd, ready);
+        list_delete(l);
+        refcount_release(&efd->refcount);
+    }
 }
 
 void epoll_finish(epoll e)
@@ -368,17 +406,17 @@ static inline u32 report_from_notify_events(epollfd efd, u64 notify_events)
     return edge_detect ? ~efd->lastevents & events : events;
 }
 
-static inline void epoll_wait_notify(epollfd efd, epoll_blocked w, u64 report)
+static inline boolean epoll_wait_notify(epollfd efd, epoll_blocked w, u64 report)
 {
     if (report == 0)
-        return;
+        return false;
 
     spin_lock(&w->lock);
     if (!w->user_events || (w->user_events->length - w->user_events->end) <= 0) {
         spin_unlock(&w->lock);
         /* XXX here we should advance to the next blocked head, probably */
         epoll_debug("   user_events null or full\n");
-        return;
+        return false;
     }
     context ctx = get_current_context(current_cpu());
     if (is_kernel_context(ctx)) {
@@ -412,6 +450,7 @@ static inline void epoll_wait_notify(epollfd efd, epoll_blocked w, u64 report)
     /* now that we've reported these events, update last */
     efd->lastevents |= report;
     blockq_wake_one(w->t->thread_bq);
+    return true;
 }
 
 static epoll_blocked alloc_epoll_blocked(epoll e)
@@ -457,6 +496,48 @@ static void check_fdesc(epollfd efd, epoll_blocked w)
     }
 }
 
+/* Check an epollfd taken from the ready list, returning true if it should
+   remain queued: a level-triggered condition that still holds, events that
+   didn't fit in the user buffer, or events that depend on the thread. */
+static boolean epoll_check_ready_fdesc(epollfd efd, epoll_blocked w)
+{
+    if (efd->zombie || !efd->registered)
+        return false;
+    u32 events = apply(efd->f->events, w->t) & (efd->eventmask | (EPOLLERR | EPOLLHUP));
+    u32 report = report_from_notify_events(efd, events);
+    boolean reported = epoll_wait_notify(efd, w, report);
+    if (efd->zombie)
+        return false;
+    if (efd->thread_events || (report && !reported))
+        return true;
+    return events && !(efd->eventmask & EPOLLET);
+}
+
+/* Report events from the ready list. Only epollfds that received events
+   since they were last found idle are on this list, so the cost is
+   proportional to the number of ready fds rather than registered ones. */
+static void epoll_check_ready(epoll e, epoll_blocked w)
+{
+    struct list ready;
+    spin_lock(&e->ready_lock);
+    list_move(&ready, &e->ready);
+    spin_unlock(&e->ready_lock);
+    list_foreach(&ready, l) {
+        epollfd efd = struct_from_list(l, epollfd, ready);
+        spin_lock(&efd->lock);
+        list_delete(l);
+        boolean requeue = epoll_check_ready_fdesc(efd, w);
+        if (requeue) {
+            spin_lock(&e->ready_lock);
+            list_push_back(&e->ready, l);
+            spin_unlock(&e->ready_lock);
+        }
+        spin_unlock(&efd->lock);
+        if (!requeue)
+            refcount_release(&efd->refcount);
+    }
+}
+
 /* It would be nice to devise a way to allow a poll waiter to continue
    to collect events between wakeup (first event) and running. */
 
@@ -527,23 +608,9 @@ sysreturn epoll_wait(int epfd,
     w->user_events->end = 0;
     spin_unlock(&w->lock);
 
-    spin_lock(&e->fds_lock);
-    bitmap_foreach_set(e->fds, fd) {
-        epollfd efd = vector_get(e->events, fd);
-        assert(efd);
-        assert(efd->fd == fd);
-
-        if (efd->zombie)
-            continue;
-
-        /* event transitions may in some cases need to be polled for
-           (e.g. due to change in lwIP internal state), so request a check */
-        spin_lock(&efd->lock);
-        if (efd->registered)
-            check_fdesc(efd, w);
-        spin_unlock(&efd->lock);
-    }
-    spin_unlock(&e->fds_lock);
+    /* event sources notify on every transition, so only epollfds on the
+       ready list need to be checked */
+    epoll_check_ready(e, w);
 
     timestamp ts = (timeout > 0) ? milliseconds(timeout) : 0;
     return blockq_check_timeout(w->t->thread_bq, current,
@@ -601,6 +668,7 @@ static sysreturn epoll_add_fd(epoll e, int fd, u32 events, u64 data)
         reset_epollfd(efd, events, data);
     }
     register_epollfd(efd);
+    epollfd_ready(efd);
 
     /* apply check(s) for any current waiters */
     epollfd_update(efd);
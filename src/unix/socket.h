@@ -20,6 +20,17 @@ struct msghdr {
     int msg_flags;
 };
 
+struct cmsghdr {
+    u64 cmsg_len;
+    int cmsg_level;
+    int cmsg_type;
+};
+
+#define CMSG_ALIGN(len) pad(len, sizeof(u64))
+#define CMSG_SPACE(len) (sizeof(struct cmsghdr) + CMSG_ALIGN(len))
+#define CMSG_LEN(len)   (sizeof(struct cmsghdr) + (len))
+#define CMSG_DATA(c)    ((u8 *)((struct cmsghdr *)(c) + 1))
+
 #define IFNAMSIZ    16
 
 struct ifmap {
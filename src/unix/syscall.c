@@ -378,7 +378,8 @@ closure_function(9, 2, void, sendfile_bh,
                 thread_log(t, "   rewound %ld bytes to %ld", rewind, f_in->offset);
             }
             rv = bound(written) == 0 ? -EAGAIN : bound(written);
-            sg_buf_release(bound(cur_buf));
+            if (bound(cur_buf))
+                sg_buf_release(bound(cur_buf));
             thread_log(t, "   write would block, returning %ld", rv);
         } else {
             thread_log(t, "   zero or error, rv %ld", rv);
@@ -397,10 +398,23 @@ closure_function(9, 2, void, sendfile_bh,
            (io_status_handler for linear) in the middle */
         if (bound(offset))
             *bound(offset) += rv;
+        thread_log(t, "   read %ld bytes\n", rv);
+        if (bound(out)->type == FDESC_TYPE_SOCKET && bound(out)->sg_write) {
+            /* the socket takes the page references and transmits from the pagecache
+               (cur_buf stays null in this mode) */
+            goto sg_write;
+        }
         bound(cur_buf) = sg_list_head_remove(bound(sg)); /* initial dequeue */
         assert(bound(cur_buf) != INVALID_ADDRESS);
         bound(cur_buf)->offset = 0; /* offset for our use */
-        thread_log(t, "   read %ld bytes\n", rv);
+    } else if (!bound(cur_buf)) {
+        /* the socket consumed the written data from the sg list */
+        bound(written) += rv;
+        if (bound(written) == bound(readlen)) {
+            rv = bound(written);
+            goto out_complete;
+        }
+        goto sg_write;
     } else {
         bound(written) += rv;
         bound(cur_buf)->offset += rv;
@@ -424,6 +438,10 @@ closure_function(9, 2, void, sendfile_bh,
     thread_log(t, "   writing %d bytes from %p", rv, n, buf);
     apply(bound(out)->write, buf, n, 0, t, true, (io_completion)closure_self());
     return;
+sg_write:
+    apply(bound(out)->sg_write, bound(sg), bound(readlen) - bound(written), 0, t, true,
+          (io_completion)closure_self());
+    return;
 out_complete:
     sg_list_release(bound(sg));
     deallocate_sg_list(bound(sg));
@@ -871,6 +889,7 @@ sysreturn open_internal(filesystem fs, inode cwd, const char *name, int flags,
         f->fs_write = fsfile_get_writer(fsf);
         assert(f->fs_write);
         f->fadv = POSIX_FADV_NORMAL;
+        zero(&f->ra, sizeof(f->ra));
         fsfile_reserve(fsf);
         if (flags & O_TMPFILE)
             fsfile_release(fsf);
@@ -1059,64 +1078,42 @@ sysreturn getrandom(void *buf, u64 buflen, unsigned int flags)
     return random_buffer(b);
 }
 
+/* Directory offsets: 0 is the start of the directory, 1 and 2 follow the "."
+   and ".." entries, and higher values are scan positions in the children
+   tuple, which remain valid across directory modifications and are always
+   positive, so that lseek() accepts them. */
+#define DIRENT_OFFSET_DOT       1
+#define DIRENT_OFFSET_DOTDOT    2
+
 static int try_write_dirent(void *dirp, boolean dirent64, char *p,
-        int *read_sofar, int *written_sofar, u64 *f_offset,
-        unsigned int *count, tuple n)
+        unsigned int *count, u64 next_offset, tuple n)
 {
     int len = runtime_strlen(p);
-    *read_sofar += len;
-    if (*read_sofar > *f_offset) {
-        int reclen = (dirent64 ? sizeof(struct linux_dirent64) : sizeof(struct linux_dirent)) +
-                     len + 3;
-        // include this element in the getdents output
-        if (reclen > *count) {
-            // can't include, there's no space
-            *read_sofar -= len;
-            return -1;
-        } else {
-            // include the entry in the buffer
-            runtime_memset((u8*)dirp, 0, reclen);
-            if (dirent64) {
-                struct linux_dirent64 *dp = dirp;
-                dp->d_ino = u64_from_pointer(n);
-                dp->d_reclen = reclen;
-                runtime_memcpy(dp->d_name, p, len + 1);
-                dp->d_off = dp->d_reclen;   // XXX: in the future, pad this.
-                dp->d_name[len + 2] = 0;    /* some zero padding */
-            } else {
-                struct linux_dirent *dp = dirp;
-                dp->d_ino = u64_from_pointer(n);
-                dp->d_reclen = reclen;
-                runtime_memcpy(dp->d_name, p, len + 1);
-                dp->d_off = dp->d_reclen;   // XXX: in the future, pad this.
-                dp->d_name[len + 2] = 0;    /* some zero padding */
-            }
-            ((char *)dirp)[reclen - 1] = dt_from_tuple(n);
-
-            // advance dirp
-            *written_sofar += reclen;
-            *count -= reclen;
-            return reclen;
-        }
+    int reclen = (dirent64 ? sizeof(struct linux_dirent64) : sizeof(struct linux_dirent)) +
+                 len + 3;
+    if (reclen > *count)
+        return -1;  // can't include, there's no space
+
+    runtime_memset((u8*)dirp, 0, reclen);
+    if (dirent64) {
+        struct linux_dirent64 *dp = dirp;
+        dp->d_ino = u64_from_pointer(n);
+        dp->d_reclen = reclen;
+        dp->d_type = dt_from_tuple(n);
+        runtime_memcpy(dp->d_name, p, len + 1);
+        dp->d_off = next_offset;
+        dp->d_name[len + 2] = 0;    /* some zero padding */
+    } else {
+        struct linux_dirent *dp = dirp;
+        dp->d_ino = u64_from_pointer(n);
+        dp->d_reclen = reclen;
+        runtime_memcpy(dp->d_name, p, len + 1);
+        dp->d_off = next_offset;
+        dp->d_name[len + 2] = 0;    /* some zero padding */
+        ((char *)dirp)[reclen - 1] = dt_from_tuple(n);
     }
-    return 0;
-}
-
-closure_function(7, 2, boolean, getdents_each,
-                 file, f, void **, dirp, boolean, dirent64, int *, read_sofar, int *, written_sofar, unsigned int *, count, int *, r,
-                 value, k, value, v)
-{
-    assert(is_symbol(k));
-    buffer tmpbuf = little_stack_buffer(NAME_MAX + 1);
-    char *p = cstring(symbol_string(k), tmpbuf);
-    *bound(r) = try_write_dirent(*bound(dirp), bound(dirent64), p,
-                                 bound(read_sofar), bound(written_sofar), &bound(f)->offset, bound(count),
-                                 v);
-    if (*bound(r) < 0)
-        return false;
-
-    *bound(dirp) = *bound(dirp) + *bound(r);
-    return true;
+    *count -= reclen;
+    return reclen;
 }
 
 static sysreturn getdents_internal(int fd, void *dirp, unsigned int count, boolean dirent64)
@@ -1135,20 +1132,48 @@ static sysreturn getdents_internal(int fd, void *dirp, unsigned int count, boole
         goto out;
     }
 
+    /* Resuming at the offset of the last returned entry costs the same
+       regardless of how many entries precede it. */
+    buffer tmpbuf = little_stack_buffer(NAME_MAX + 1);
     int r = 0;
-    int read_sofar = 0, written_sofar = 0;
-    binding_handler h = stack_closure(getdents_each, f, &dirp, dirent64,
-                                      &read_sofar, &written_sofar, &count, &r);
-    symbol parent_sym = sym_this("..");
-    if (apply(h, sym_this("."), md) && apply(h, parent_sym, get_tuple(md, parent_sym)))
-        iterate(c, h);
+    int written = 0;
+    u64 offset = f->offset;
+    if (offset < DIRENT_OFFSET_DOT) {
+        r = try_write_dirent(dirp + written, dirent64, ".", &count, DIRENT_OFFSET_DOT, md);
+        if (r < 0)
+            goto done;
+        written += r;
+        offset = DIRENT_OFFSET_DOT;
+    }
+    if (offset < DIRENT_OFFSET_DOTDOT) {
+        r = try_write_dirent(dirp + written, dirent64, "..", &count, DIRENT_OFFSET_DOTDOT,
+                             get_tuple(md, sym_this("..")));
+        if (r < 0)
+            goto done;
+        written += r;
+        offset = DIRENT_OFFSET_DOTDOT;
+    }
+    while (1) {
+        u64 next = offset;
+        symbol s;
+        value v = tuple_scan(c, &next, &s);
+        if (!v)
+            break;
+        r = try_write_dirent(dirp + written, dirent64, cstring(symbol_string(s), tmpbuf),
+                             &count, next, v);
+        if (r < 0)
+            break;
+        written += r;
+        offset = next;
+    }
+  done:
     fs_notify_event(md, IN_ACCESS);
     filesystem_update_atime(f->fs, md);
-    f->offset = read_sofar;
-    if (r < 0 && written_sofar == 0)
+    f->offset = offset;
+    if (r < 0 && written == 0)
         rv = -EINVAL;
     else
-        rv = written_sofar;
+        rv = written;
   out:
     if (md)
         filesystem_put_meta(f->fs, md);
@@ -1731,6 +1756,7 @@ static sysreturn brk(void *addr)
     u64 new_end = pad(u64_from_pointer(addr), PAGESIZE);
     if (old_end > new_end) {
         if (u64_from_pointer(addr) < p->heap_base ||
+            !split_range_mappings(irange(new_end, old_end)) ||
             !adjust_process_heap(p, irange(p->heap_base, new_end)))
             goto out;
         write_barrier();
@@ -2118,6 +2144,17 @@ sysreturn sched_setaffinity(int pid, u64 cpusetsize, u64 *mask)
     if (!(t = lookup_thread(pid)))
             return set_syscall_error(current, EINVAL);                
     u64 cpus = pad(MIN(total_processors, 64 * (cpusetsize / sizeof(u64))), 64);
+
+    /* the scheduler needs at least one online cpu to place the thread on */
+    u64 cpu;
+    for (cpu = 0; cpu < MIN(cpus, total_processors); cpu++) {
+        if (mask[cpu >> 6] & (1ull << (cpu & 63)))
+            break;
+    }
+    if (cpu >= MIN(cpus, total_processors)) {
+        thread_release(t);
+        return set_syscall_error(current, EINVAL);
+    }
     thread_lock(t);
     runtime_memcpy(bitmap_base(t->affinity), mask, cpus / 8);
     if (cpus < total_processors)
@@ -2143,6 +2180,188 @@ sysreturn sched_getaffinity(int pid, u64 cpusetsize, u64 *mask)
     return cpusetsize;
 }
 
+static void thread_set_nice(thread t, int nice)
+{
+    t->task.nice = MAX(SCHED_NICE_MIN, MIN(SCHED_NICE_MAX, nice));
+}
+
+closure_function(1, 1, boolean, set_nice_handler,
+                 int, nice,
+                 rbnode, n)
+{
+    thread_set_nice(struct_from_field(n, thread, n), bound(nice));
+    return true;
+}
+
+closure_function(1, 1, boolean, get_nice_handler,
+                 int *, nice,
+                 rbnode, n)
+{
+    thread t = struct_from_field(n, thread, n);
+    *bound(nice) = MIN(*bound(nice), t->task.nice);
+    return true;
+}
+
+/* Only a single process exists, so process groups and users are all of its
+   threads, while PRIO_PROCESS addresses individual threads as on Linux. */
+sysreturn setpriority(int which, int who, int prio)
+{
+    switch (which) {
+    case PRIO_PROCESS: {
+        thread t = lookup_thread(who);
+        if (!t)
+            return -ESRCH;
+        thread_set_nice(t, prio);
+        thread_release(t);
+        return 0;
+    }
+    case PRIO_PGRP:
+    case PRIO_USER: {
+        process p = current->p;
+        spin_lock(&p->threads_lock);
+        rbtree_traverse(p->threads, RB_INORDER, stack_closure(set_nice_handler, prio));
+        spin_unlock(&p->threads_lock);
+        return 0;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+/* returns 20 - nice, as the raw Linux syscall does */
+sysreturn getpriority(int which, int who)
+{
+    int nice;
+    switch (which) {
+    case PRIO_PROCESS: {
+        thread t = lookup_thread(who);
+        if (!t)
+            return -ESRCH;
+        nice = t->task.nice;
+        thread_release(t);
+        break;
+    }
+    case PRIO_PGRP:
+    case PRIO_USER: {
+        process p = current->p;
+        nice = SCHED_NICE_MAX;
+        spin_lock(&p->threads_lock);
+        rbtree_traverse(p->threads, RB_INORDER, stack_closure(get_nice_handler, &nice));
+        spin_unlock(&p->threads_lock);
+        break;
+    }
+    default:
+        return -EINVAL;
+    }
+    return 20 - nice;
+}
+
+static boolean sched_policy_is_rt(int policy)
+{
+    return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static sysreturn thread_set_scheduler(thread t, int policy, int prio)
+{
+    switch (policy) {
+    case SCHED_FIFO:
+    case SCHED_RR:
+        if (prio < SCHED_RT_PRIO_MIN || prio > SCHED_RT_PRIO_MAX)
+            return -EINVAL;
+        break;
+    case SCHED_OTHER:
+    case SCHED_BATCH:
+    case SCHED_IDLE:
+        if (prio != 0)
+            return -EINVAL;
+        break;
+    default:
+        return -EINVAL;
+    }
+    thread_lock(t);
+    if (policy == SCHED_IDLE) {
+        if (t->sched_policy != SCHED_IDLE)
+            t->idle_saved_nice = t->task.nice;
+        thread_set_nice(t, SCHED_NICE_MAX);
+    } else if (t->sched_policy == SCHED_IDLE) {
+        thread_set_nice(t, t->idle_saved_nice);
+    }
+    t->sched_policy = policy;
+    t->task.rt_priority = prio;
+    t->task.class = sched_policy_is_rt(policy) ? SCHED_CLASS_RT : SCHED_CLASS_FAIR;
+    t->task.rt_fifo = policy == SCHED_FIFO;
+    thread_unlock(t);
+    return 0;
+}
+
+sysreturn sched_setscheduler(int pid, int policy, struct sched_param *param)
+{
+    if (pid < 0)
+        return -EINVAL;
+    if (!validate_user_memory(param, sizeof(*param), false))
+        return -EFAULT;
+    thread t = lookup_thread(pid);
+    if (!t)
+        return -ESRCH;
+    sysreturn rv = thread_set_scheduler(t, policy & ~SCHED_RESET_ON_FORK, param->sched_priority);
+    thread_release(t);
+    return rv;
+}
+
+sysreturn sched_getscheduler(int pid)
+{
+    if (pid < 0)
+        return -EINVAL;
+    thread t = lookup_thread(pid);
+    if (!t)
+        return -ESRCH;
+    sysreturn rv = t->sched_policy;
+    thread_release(t);
+    return rv;
+}
+
+sysreturn sched_setparam(int pid, struct sched_param *param)
+{
+    if (pid < 0)
+        return -EINVAL;
+    if (!validate_user_memory(param, sizeof(*param), false))
+        return -EFAULT;
+    thread t = lookup_thread(pid);
+    if (!t)
+        return -ESRCH;
+    sysreturn rv = thread_set_scheduler(t, t->sched_policy, param->sched_priority);
+    thread_release(t);
+    return rv;
+}
+
+sysreturn sched_getparam(int pid, struct sched_param *param)
+{
+    if (pid < 0)
+        return -EINVAL;
+    if (!validate_user_memory(param, sizeof(*param), true))
+        return -EFAULT;
+    thread t = lookup_thread(pid);
+    if (!t)
+        return -ESRCH;
+    param->sched_priority = t->task.rt_priority;
+    thread_release(t);
+    return 0;
+}
+
+sysreturn sched_get_priority_max(int policy)
+{
+    if (sched_policy_is_rt(policy))
+        return SCHED_RT_PRIO_MAX;
+    return (policy == SCHED_OTHER || policy == SCHED_BATCH || policy == SCHED_IDLE) ? 0 : -EINVAL;
+}
+
+sysreturn sched_get_priority_min(int policy)
+{
+    if (sched_policy_is_rt(policy))
+        return SCHED_RT_PRIO_MIN;
+    return (policy == SCHED_OTHER || policy == SCHED_BATCH || policy == SCHED_IDLE) ? 0 : -EINVAL;
+}
+
 sysreturn capget(cap_user_header_t hdrp, cap_user_data_t datap)
 {
     if (datap) {
@@ -2291,6 +2510,14 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, fchdir, fchdir, SYSCALL_F_SET_DESC);
     register_syscall(map, sched_getaffinity, sched_getaffinity, 0);
     register_syscall(map, sched_setaffinity, sched_setaffinity, 0);
+    register_syscall(map, getpriority, getpriority, 0);
+    register_syscall(map, setpriority, setpriority, 0);
+    register_syscall(map, sched_setparam, sched_setparam, 0);
+    register_syscall(map, sched_getparam, sched_getparam, 0);
+    register_syscall(map, sched_setscheduler, sched_setscheduler, 0);
+    register_syscall(map, sched_getscheduler, sched_getscheduler, 0);
+    register_syscall(map, sched_get_priority_max, sched_get_priority_max, 0);
+    register_syscall(map, sched_get_priority_min, sched_get_priority_min, 0);
     register_syscall(map, getuid, syscall_ignore, 0);
     register_syscall(map, geteuid, syscall_ignore, 0);
     register_syscall(map, setgroups, syscall_ignore, 0);
@@ -170,11 +170,22 @@ struct flock {
 #define MREMAP_MAYMOVE      1
 #define MREMAP_FIXED        2
 #define MAP_STACK           0x20000
+#define MAP_HUGETLB         0x40000
 
 #define PROT_READ       0x1
 #define PROT_WRITE      0x2
 #define PROT_EXEC       0x4
 
+/* madvise */
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+#define MADV_FREE       8
+#define MADV_HUGEPAGE   14
+#define MADV_NOHUGEPAGE 15
+
 /* msync */
 #define MS_ASYNC      1
 #define MS_INVALIDATE 2
@@ -243,12 +254,16 @@ struct utimbuf {
 
 #define FUTEX_CLOCK_REALTIME    (1 << 8)
 
+#define FUTEX_BITSET_MATCH_ANY  0xffffffff
+
 #define  FUTEX_OP_SET        0  /* uaddr2 = oparg; */
 #define  FUTEX_OP_ADD        1  /* uaddr2 += oparg; */
 #define  FUTEX_OP_OR         2  /* uaddr2 |= oparg; */
 #define  FUTEX_OP_ANDN       3  /* uaddr2 &= ~oparg; */
 #define  FUTEX_OP_XOR        4  /* uaddr2 ^= oparg; */
 
+#define  FUTEX_OP_OPARG_SHIFT 8 /* use (1 << oparg) as operand */
+
 #define FUTEX_OP_CMP_EQ     0  /* if (oldval == cmparg) wake */
 #define FUTEX_OP_CMP_NE     1  /* if (oldval != cmparg) wake */
 #define FUTEX_OP_CMP_LT     2  /* if (oldval < cmparg) wake */
@@ -286,6 +301,21 @@ struct rlimit {
 #define RLIMIT_RTPRIO		14	/* maximum realtime priority */
 #define RLIMIT_RTTIME		15	/* timeout for RT tasks in us */
 
+#define PRIO_PROCESS    0
+#define PRIO_PGRP       1
+#define PRIO_USER       2
+
+#define SCHED_OTHER     0
+#define SCHED_FIFO      1
+#define SCHED_RR        2
+#define SCHED_BATCH     3
+#define SCHED_IDLE      5
+#define SCHED_RESET_ON_FORK 0x40000000
+
+struct sched_param {
+    int sched_priority;
+};
+
 #define RUSAGE_SELF     0
 #define RUSAGE_CHILDREN (-1)
 #define RUSAGE_BOTH     (-2)
@@ -743,6 +773,7 @@ struct io_uring_params {
 };
 
 /* Socket option levels */
+#define SOL_IP          0
 #define SOL_SOCKET      1
 #define SOL_TCP         6
 #define IPPROTO_IPV6    41
@@ -758,7 +789,10 @@ struct io_uring_params {
 #define SO_LINGER       13
 #define SO_REUSEPORT    15
 #define SO_ACCEPTCONN   30
+#define SO_ZEROCOPY     60
 
+#define IP_RECVERR      11
+#define IPV6_RECVERR    25
 #define IPV6_V6ONLY     26
 
 /* eventfd flags */
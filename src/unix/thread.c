@@ -80,6 +80,13 @@ sysreturn clone(unsigned long flags, void *child_stack, int *ptid, unsigned long
     /* clone frame processor state */
     clone_frame_pstate(f, thread_frame(current));
     thread_clone_sigmask(t, current);
+    bitmap_copy(t->affinity, current->affinity);
+    t->sched_policy = current->sched_policy;
+    t->idle_saved_nice = current->idle_saved_nice;
+    t->task.class = current->task.class;
+    t->task.rt_priority = current->task.rt_priority;
+    t->task.rt_fifo = current->task.rt_fifo;
+    t->task.nice = current->task.nice;
 
     /* clone behaves like fork at the syscall level, returning 0 to the child */
     set_syscall_return(t, 0);
@@ -187,7 +194,7 @@ static void thread_resume(context ctx)
 static void thread_schedule_return(context ctx)
 {
     thread t = (thread)ctx;
-    enqueue_irqsafe(t->scheduling_queue, &t->thread_return);
+    schedule_task(&t->task, t->scheduling_cpu);
 }
 
 define_closure_function(1, 0, void, thread_return,
@@ -212,7 +219,7 @@ define_closure_function(1, 0, void, thread_return,
     t->syscall = 0;
 
     /* If we migrated to a new CPU, remain on its thread queue. */
-    t->scheduling_queue = ci->thread_queue;    
+    t->scheduling_cpu = ci;
     thread_unlock(t);
 
     context_frame f = t->context.frame;
@@ -251,6 +258,7 @@ void thread_yield(void)
     thread_log(current, "yield %d, RIP=0x%lx", current->tid, thread_frame(current)[SYSCALL_FRAME_PC]);
     assert(!current->blocked_on);
     current->syscall = 0;
+    current->task.yielded = true;
     set_syscall_return(current, 0);
     syscall_finish(false);
 }
@@ -350,7 +358,7 @@ thread create_thread(process p, u64 tid)
 
     init_thread_fault_handler(t);
     
-    t->scheduling_queue = current_cpu()->thread_queue;
+    t->scheduling_cpu = current_cpu();
     context_frame f = thread_frame(t);
 #ifdef __x86_64__
     f[FRAME_CS] = 0x2b & ~1; // CS 0x28 + CPL 3 but clear bit 0 to indicate syscall
@@ -368,6 +376,9 @@ thread create_thread(process p, u64 tid)
     if (t->affinity == INVALID_ADDRESS)
         goto fail_affinity;
     bitmap_range_check_and_set(t->affinity, 0, total_processors, false, true);
+    init_sched_task(&t->task, (thunk)&t->thread_return, t->affinity);
+    t->sched_policy = SCHED_OTHER;
+    t->idle_saved_nice = 0;
     t->blocked_on = 0;
     blockq_thread_init(t);
     init_sigstate(&t->signals);
@@ -433,6 +444,7 @@ void exit_thread(thread t)
     blockq_flush(t->thread_bq);
     deallocate_blockq(t->thread_bq);
     t->thread_bq = INVALID_ADDRESS;
+    sched_task_exit(&t->task);
     thread_release(t);
 }
 
@@ -409,7 +409,7 @@ process create_process(unix_heaps uh, tuple root, filesystem fs)
         if (aslr)
             id_heap_set_randomize(p->virtual32, true);
 #endif
-        mmap_process_init(p, aslr);
+        mmap_process_init(p, root, aslr);
         init_vdso(p);
     } else {
 #ifdef __x86_64__
@@ -7,7 +7,8 @@ process init_unix(kernel_heaps kh, tuple root, filesystem fs);
 process create_process(unix_heaps uh, tuple root, filesystem fs);
 void process_get_cwd(process p, filesystem *cwd_fs, inode *cwd);
 thread create_thread(process p, u64 tid);
-process exec_elf(buffer ex, process kernel_process);
+void exec_read_headers(fsfile f, heap h, buffer_handler bh, status_handler sh);
+process exec_elf(buffer ex, fsfile f, process kernel_process);
 
 void dump_mem_stats(buffer b);
 
@@ -14,6 +14,10 @@
 #define VMAP_FLAG_MMAP     0x0010
 #define VMAP_FLAG_SHARED   0x0020 /* vs private; same semantics as unix */
 #define VMAP_FLAG_PREALLOC 0x0040
+#define VMAP_FLAG_HUGEPAGE   0x0080 /* MAP_HUGETLB or MADV_HUGEPAGE */
+#define VMAP_FLAG_NOHUGEPAGE 0x1000 /* MADV_NOHUGEPAGE */
+#define VMAP_FLAG_LAZYFREE   0x2000 /* MADV_FREE: clean pages may be reclaimed */
+#define VMAP_FLAG_SEQUENTIAL 0x4000 /* MADV_SEQUENTIAL */
 
 #define VMAP_MMAP_TYPE_MASK       0x0f00
 #define VMAP_MMAP_TYPE_ANONYMOUS  0x0100
@@ -214,6 +218,9 @@ sysreturn blockq_check_timeout(blockq bq, thread t, blockq_action a, boolean in_
                                clock_id id, timestamp timeout, boolean absolute);
 int blockq_transfer_waiters(blockq dest, blockq src, int n, blockq_action_handler handler);
 
+typedef closure_type(blockq_action_filter, boolean, blockq_action action);
+thread blockq_wake_one_filtered(blockq bq, blockq_action_filter filter);
+
 static inline sysreturn blockq_check(blockq bq, thread t, blockq_action a, boolean in_bh)
 {
     return blockq_check_timeout(bq, t, a, in_bh, 0, 0, false);
@@ -272,7 +279,8 @@ typedef struct thread {
 
     char name[16]; /* thread name */
     syscall_context syscall;
-    queue scheduling_queue;
+    cpuinfo scheduling_cpu;
+    struct sched_task task;
     process p;
 
     /* Heaps in the unix world are typically found through
@@ -331,6 +339,8 @@ typedef struct thread {
     u64 signal_stack_length;
 
     bitmap affinity;
+    int sched_policy;
+    int idle_saved_nice;        /* restored on leaving SCHED_IDLE */
     struct list l_faultwait;
     struct spinlock lock;   /* generic lock for struct members without a specific lock */
 } *thread;
@@ -380,6 +390,18 @@ typedef struct fdesc {
 #define IOV_MAX 1024
 
 #define FILE_READAHEAD_DEFAULT  (128 * KB)
+#define FILE_READAHEAD_MIN      (16 * KB)
+#define FILE_READAHEAD_MAX      (2 * MB)
+
+/* Per-open-file readahead window. The window grows while reads are sequential
+   and shrinks on random access; once a read crosses the marker, the next
+   window is fetched ahead of the reader. */
+struct file_readahead {
+    u64 start;          /* start of the last window fetched */
+    u64 size;           /* size of the last window fetched */
+    u64 marker;         /* reading past this offset triggers the next window */
+    u64 prev_end;       /* end of the previous read */
+};
 
 struct file {
     struct fdesc f;             /* must be first */
@@ -389,6 +411,7 @@ struct file {
         sg_io fs_read;
         sg_io fs_write;
         int fadv;           /* posix_fadvise advice */
+        struct file_readahead ra;
     };
     inode n;                /* filesystem inode number */
     u64 offset;
@@ -474,7 +497,7 @@ typedef struct process {
     filesystem        cwd_fs;
     tuple             process_root;
     inode             cwd;
-    table             futices;
+    struct futex_bucket *futices;   /* FUTEX_HASH_BUCKETS */
     fault_handler     handler;
     rbtree            threads;
     struct spinlock   threads_lock;
@@ -485,6 +508,7 @@ typedef struct process {
     rangemap          vmaps;    /* process mappings */
     vmap              stack_map;
     vmap              heap_map;
+    u64               lazyfree_vmaps; /* MADV_FREE vmaps not yet scanned; may overcount */
     struct rbtree     pending_faults; /* pending_faults in progress */
     struct spinlock   faulting_lock;
     struct sigstate   signals;
@@ -663,7 +687,7 @@ boolean validate_user_memory_permissions(process p, const void *buf, bytes lengt
 boolean fault_in_user_memory(const void *buf, bytes length,
                              u64 required_flags, u64 disallowed_flags);
 
-void mmap_process_init(process p, boolean aslr);
+void mmap_process_init(process p, tuple root, boolean aslr);
 
 /* This "validation" is just a simple limit check right now, but this
    could optionally expand to do more rigorous validation (e.g. vmap
@@ -829,6 +853,7 @@ boolean unix_timers_init(unix_heaps uh);
 
 extern sysreturn syscall_ignore();
 u64 new_zeroed_pages(u64 v, u64 length, pageflags flags, status_handler complete);
+boolean split_range_mappings(range q);
 boolean do_demand_page(thread t, context ctx, u64 vaddr, vmap vm);
 vmap vmap_from_vaddr(process p, u64 vaddr);
 void vmap_iterator(process p, vmap_handler vmh);
@@ -28,6 +28,18 @@ void vtdev_cfg_write_1(vtdev dev, u64 offset, u8 value)
     }
 }
 
+u16 vtdev_cfg_read_2(vtdev dev, u64 offset)
+{
+    switch (dev->transport) {
+    case VTIO_TRANSPORT_MMIO:
+        return vtmmio_get_u16((vtmmio)dev, VTMMIO_OFFSET_CONFIG + offset);
+    case VTIO_TRANSPORT_PCI:
+        return pci_bar_read_2(&((vtpci)dev)->device_config, offset);
+    default:
+        return 0;
+    }
+}
+
 u32 vtdev_cfg_read_4(vtdev dev, u64 offset)
 {
     switch (dev->transport) {
@@ -81,13 +93,16 @@ void vtdev_set_status(vtdev dev, u8 status)
     }
 }
 
-status virtio_alloc_virtqueue(vtdev dev, const char *name, int idx, struct virtqueue **result)
+/* The queue interrupt is steered to target_cpu where the transport allows it;
+   all MMIO queues share a single interrupt. */
+status virtio_alloc_virtqueue_cpu(vtdev dev, const char *name, int idx, u32 target_cpu,
+                                  struct virtqueue **result)
 {
     switch (dev->transport) {
     case VTIO_TRANSPORT_MMIO:
         return vtmmio_alloc_virtqueue((vtmmio)dev, name, idx, result);
     case VTIO_TRANSPORT_PCI:
-        return vtpci_alloc_virtqueue((vtpci)dev, name, idx, result);
+        return vtpci_alloc_virtqueue((vtpci)dev, name, idx, target_cpu, result);
     default:
         return timm("status", "unknown transport %d", dev->transport);
     }
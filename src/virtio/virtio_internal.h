@@ -76,6 +76,7 @@ typedef struct vtdev {
 } *vtdev;
 
 u8 vtdev_cfg_read_1(vtdev dev, u64 offset);
+u16 vtdev_cfg_read_2(vtdev dev, u64 offset);
 u32 vtdev_cfg_read_4(vtdev dev, u64 offset);
 void vtdev_cfg_write_1(vtdev dev, u64 offset, u8 value);
 void vtdev_cfg_write_4(vtdev dev, u64 offset, u32 value);
@@ -95,7 +96,15 @@ static inline void virtio_attach(heap h, backed_heap page_allocator,
     d->transport = transport;
 }
 
-status virtio_alloc_virtqueue(vtdev dev, const char *name, int idx, struct virtqueue **result);
+status virtio_alloc_virtqueue_cpu(vtdev dev, const char *name, int idx, u32 target_cpu,
+                                  struct virtqueue **result);
+
+static inline status virtio_alloc_virtqueue(vtdev dev, const char *name, int idx,
+                                            struct virtqueue **result)
+{
+    return virtio_alloc_virtqueue_cpu(dev, name, idx, 0, result);
+}
+
 status virtio_register_config_change_handler(vtdev dev, thunk handler);
 
 status virtqueue_alloc(vtdev dev,
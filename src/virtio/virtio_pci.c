@@ -249,6 +249,7 @@ static void vtpci_register_non_msix_config_handler(vtpci dev, thunk handler)
 status vtpci_alloc_virtqueue(vtpci dev,
                              const char *name,
                              int idx,
+                             u32 target_cpu,
                              struct virtqueue **result)
 {
     // allocate virtqueue
@@ -270,7 +271,7 @@ status vtpci_alloc_virtqueue(vtpci dev,
     if (dev->msix_enabled) {
         // setup virtqueue MSI-X interrupt
         int msi_slot = idx + 1; /* 0 reserved for config change */
-        if (pci_setup_msix(dev->dev, msi_slot, handler, name) == INVALID_PHYSICAL)
+        if (pci_setup_msix_cpu(dev->dev, msi_slot, handler, name, target_cpu) == INVALID_PHYSICAL)
             return timm("status", "failed to allocate MSI-X vector");
         pci_bar_write_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR], msi_slot);
         int check_idx = pci_bar_read_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR]);
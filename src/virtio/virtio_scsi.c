@@ -417,11 +417,15 @@ define_closure_function(0, 1, void, virtio_scsi_req_handler,
         virtio_scsi_io_sg(d, false, req->data, req->blocks, req->completion);
         break;
     case STORAGE_OP_WRITESG:
+    case STORAGE_OP_ZERO:
         virtio_scsi_io_sg(d, true, req->data, req->blocks, req->completion);
         break;
     case STORAGE_OP_FLUSH:
         virtio_scsi_flush(d, req->completion);
         break;
+    case STORAGE_OP_DISCARD:
+        apply(req->completion, STATUS_OK);
+        break;
     case STORAGE_OP_READ:
         virtio_scsi_io(d, SCSI_CMD_READ_16, req->data, req->blocks, req->completion);
         break;
@@ -651,11 +655,11 @@ static void virtio_scsi_attach(heap general, storage_attach a, backed_heap page_
     s->max_lun = pci_bar_read_4(&s->v->device_config, VIRTIO_SCSI_R_MAX_LUN);
     virtio_scsi_debug("max lun %d\n", s->max_lun);
 
-    status st = vtpci_alloc_virtqueue(s->v, "virtio scsi command", 0, &s->command);
+    status st = vtpci_alloc_virtqueue(s->v, "virtio scsi command", 0, 0, &s->command);
     assert(st == STATUS_OK);
-    st = vtpci_alloc_virtqueue(s->v, "virtio scsi event", 1, &s->eventq);
+    st = vtpci_alloc_virtqueue(s->v, "virtio scsi event", 1, 0, &s->eventq);
     assert(st == STATUS_OK);
-    st = vtpci_alloc_virtqueue(s->v, "virtio scsi request", 2, &s->requestq);
+    st = vtpci_alloc_virtqueue(s->v, "virtio scsi request", 2, 0, &s->requestq);
     assert(st == STATUS_OK);
 
     // On reset, the device MUST set sense_size to 96 and cdb_size to 32
@@ -18,6 +18,11 @@ typedef struct virtio_blk_req {
     u32 reserved;
     u64 sector;
     u8 status;
+    struct virtio_blk_dwz_seg { /* discard and write zeroes payload */
+        u64 sector;
+        u32 num_sectors;
+        u32 flags;
+    } seg;
 } __attribute__((packed)) *virtio_blk_req;
 
 // device configuration offsets
@@ -42,7 +47,8 @@ struct virtio_blk_config {
        u32 opt_io_size;
     } topology;
     u8 writeback;
-    u8 unused0[3];
+    u8 unused0;
+    u16 num_queues;
     u32 max_discard_sectors;
     u32 max_discard_seg;
     u32 discard_sector_alignment;
@@ -60,6 +66,12 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_F_FLUSH      U64_FROM_BIT(9)
 #define VIRTIO_BLK_F_TOPOLOGY   U64_FROM_BIT(10)
 #define VIRTIO_BLK_F_CONFIG_WCE U64_FROM_BIT(11)
+#define VIRTIO_BLK_F_MQ         U64_FROM_BIT(12)
+#define VIRTIO_BLK_F_DISCARD    U64_FROM_BIT(13)
+#define VIRTIO_BLK_F_WRITE_ZEROES   U64_FROM_BIT(14)
+
+#define VIRTIO_BLK_FEATURES (VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_CONFIG_WCE | VIRTIO_BLK_F_FLUSH | \
+                             VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES)
 
 #define VIRTIO_BLK_R_CAPACITY_LOW                (offsetof(struct virtio_blk_config *, capacity))
 #define VIRTIO_BLK_R_CAPACITY_HIGH               (offsetof(struct virtio_blk_config *, capacity) + 4)
@@ -74,6 +86,7 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_R_TOPOLOGY_MIN_IO_SIZE        (offsetof(struct virtio_blk_config *, topology) + offsetof(struct virtio_blk_topology *, min_io_size))
 #define VIRTIO_BLK_R_TOPOLOGY_OPT_IO_SIZE        (offsetof(struct virtio_blk_config *, topology) + offsetof(struct virtio_blk_topology *, opt_io_size))
 #define VIRTIO_BLK_R_WRITEBACK                   (offsetof(struct virtio_blk_config *, writeback))
+#define VIRTIO_BLK_R_NUM_QUEUES                  (offsetof(struct virtio_blk_config *, num_queues))
 #define VIRTIO_BLK_R_MAX_DISCARD_SECTORS         (offsetof(struct virtio_blk_config *, max_discard_sectors))
 #define VIRTIO_BLK_R_MAX_DISCARD_SEG             (offsetof(struct virtio_blk_config *, max_discard_seg))
 #define VIRTIO_BLK_R_DISCARD_SECTOR_ALIGNMENT    (offsetof(struct virtio_blk_config *, discard_sector_alignment))
@@ -87,6 +100,10 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
+#define VIRTIO_BLK_T_WRITE_ZEROES   13
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP  1
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
@@ -94,16 +111,50 @@ struct virtio_blk_config {
 
 declare_closure_struct(0, 1, void, virtio_storage_req_handler,
                        storage_req, req);
+declare_closure_struct(1, 0, void, virtio_blk_service,
+                       struct virtio_blk_queue *, q);
 
 typedef struct storage {
     vtdev v;
     closure_struct(virtio_storage_req_handler, req_handler);
-    struct virtqueue *command;
+    struct virtio_blk_queue **queues;
+    int nqueues;
     u64 capacity;
     u64 block_size;
     u32 seg_max;
+    u32 max_discard_sectors;        /* zero if discard is not supported */
+    u32 max_write_zeroes_sectors;   /* zero if write zeroes is not supported */
+    u32 write_zeroes_flags;
 } *storage;
 
+/* A virtqueue with its pending request list. Each cpu submits to the queue
+ * given by its id, and the queue interrupt is steered to the first such cpu.
+ * Read and write requests are held in the pending list, sorted by block
+ * address, until the queue is serviced from the bottom half; runs of requests
+ * for adjacent blocks in the same direction (e.g. from pagecache writeback)
+ * are then merged into as few device requests as possible. */
+typedef struct virtio_blk_queue {
+    storage st;
+    virtqueue vq;
+    struct list pending;
+    boolean service_scheduled;
+    closure_struct(virtio_blk_service, service);
+    struct spinlock lock;
+} *virtio_blk_queue;
+
+typedef struct virtio_blk_io {
+    struct list l;  /* pending list, then ring of merged requests */
+    boolean write;
+    sg_list sg;
+    range blocks;
+    status_handler sh;
+} *virtio_blk_io;
+
+static inline virtio_blk_queue virtio_blk_current_queue(storage st)
+{
+    return st->queues[current_cpu()->id % st->nqueues];
+}
+
 static virtio_blk_req allocate_virtio_blk_req(storage st, u32 type, u64 sector, u64 *phys)
 {
     virtio_blk_req req = alloc_map(st->v->contiguous, sizeof(struct virtio_blk_req), phys);
@@ -149,7 +200,7 @@ static inline void storage_rw_internal(storage st, boolean write, void * buf,
     u64 req_phys;
     virtio_blk_req req = allocate_virtio_blk_req(st, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
                                                  start_sector, &req_phys);
-    virtqueue vq = st->command;
+    virtqueue vq = virtio_blk_current_queue(st)->vq;
     vqmsg m = allocate_vqmsg(vq);
     assert(m != INVALID_ADDRESS);
     vqmsg_push(vq, m, req_phys, VIRTIO_BLK_REQ_HEADER_SIZE, false);
@@ -173,42 +224,80 @@ static void virtio_storage_io_commit(storage st, virtqueue vq, vqmsg msg, virtio
     vqmsg_commit(vq, msg, c);
 }
 
-static void virtio_storage_io_sg(storage st, boolean write, sg_list sg, range blocks,
-                                 status_handler sh)
+/* The requests of a merged run are linked in a ring through their list
+ * entries, starting with first. */
+closure_function(2, 1, void, virtio_blk_merged_complete,
+                 storage, st, virtio_blk_io, first,
+                 status, s)
 {
-    virtio_blk_debug("SG %c, blocks %R, sh %F\n", write ? 'w' : 'r', blocks, sh);
+    heap h = bound(st)->v->general;
+    virtio_blk_io io = bound(first);
+    status io_status = s;
+    do {
+        virtio_blk_io next = struct_from_list(io->l.next, virtio_blk_io, l);
+        apply(io->sh, io_status);
+        deallocate(h, io, sizeof(*io));
+        if (!is_ok(s))
+            io_status = timm("result", "merged request failed");
+        io = next;
+    } while (io != bound(first));
+    closure_finish();
+}
+
+/* Submit a run of requests for contiguous blocks, splitting it into device
+ * requests of at most seg_max data descriptors. */
+static void virtio_blk_submit(storage st, virtqueue vq, virtio_blk_io first)
+{
+    boolean write = first->write;
+    virtio_blk_debug("submit %c, blocks from 0x%lx\n", write ? 'w' : 'r', first->blocks.start);
+    heap h = st->v->general;
+    boolean merged = first->l.next != &first->l;
+    status_handler sh;
+    if (merged) {
+        sh = closure(h, virtio_blk_merged_complete, st, first);
+        assert(sh != INVALID_ADDRESS);
+    } else {
+        sh = first->sh;
+    }
     virtio_blk_req req = 0;
     u64 req_phys;
-    heap h = st->v->general;
-    virtqueue vq = st->command;
     vqmsg msg;
     u32 desc_count;
     merge m = 0;
-    while (range_span(blocks)) {
-        if (!req) {
-            req = allocate_virtio_blk_req(st, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-                                          blocks.start, &req_phys);
-            msg = allocate_vqmsg(vq);
-            assert(msg != INVALID_ADDRESS);
-            vqmsg_push(vq, msg, req_phys, VIRTIO_BLK_REQ_HEADER_SIZE, false);
-            desc_count = 0;
-        }
-        sg_buf sgb = sg_list_head_peek(sg);
-        u64 length = sg_buf_len(sgb);
-        assert((length & (st->block_size - 1)) == 0);
-        length = MIN(range_span(blocks) * st->block_size, length);
-        vqmsg_push(vq, msg, physical_from_virtual(sgb->buf + sgb->offset), length, !write);
-        sg_consume(sg, length);
-        blocks.start += length / st->block_size;
-        if (++desc_count == st->seg_max) {
-            if (!m && range_span(blocks)) {
-                m = allocate_merge(h, sh);
-                sh = apply_merge(m);
+    virtio_blk_io io = first;
+    do {
+        virtio_blk_io next = struct_from_list(io->l.next, virtio_blk_io, l);
+        sg_list sg = io->sg;
+        range blocks = io->blocks;
+        while (range_span(blocks)) {
+            if (!req) {
+                req = allocate_virtio_blk_req(st, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+                                              blocks.start, &req_phys);
+                msg = allocate_vqmsg(vq);
+                assert(msg != INVALID_ADDRESS);
+                vqmsg_push(vq, msg, req_phys, VIRTIO_BLK_REQ_HEADER_SIZE, false);
+                desc_count = 0;
+            }
+            sg_buf sgb = sg_list_head_peek(sg);
+            u64 length = sg_buf_len(sgb);
+            assert((length & (st->block_size - 1)) == 0);
+            length = MIN(range_span(blocks) * st->block_size, length);
+            vqmsg_push(vq, msg, physical_from_virtual(sgb->buf + sgb->offset), length, !write);
+            sg_consume(sg, length);
+            blocks.start += length / st->block_size;
+            if (++desc_count == st->seg_max) {
+                if (!m && (range_span(blocks) || (next != first))) {
+                    m = allocate_merge(h, sh);
+                    sh = apply_merge(m);
+                }
+                virtio_storage_io_commit(st, vq, msg, req, req_phys, m ? apply_merge(m) : sh);
+                req = 0;
             }
-            virtio_storage_io_commit(st, vq, msg, req, req_phys, m ? apply_merge(m) : sh);
-            req = 0;
         }
-    }
+        if (!merged)
+            deallocate(h, io, sizeof(*io));
+        io = next;
+    } while (io != first);
     if (req) {
         virtio_storage_io_commit(st, vq, msg, req, req_phys, m ? apply_merge(m) : sh);
     }
@@ -216,12 +305,120 @@ static void virtio_storage_io_sg(storage st, boolean write, sg_list sg, range bl
         apply(sh, STATUS_OK);
 }
 
+/* Submit all pending requests of a queue, merging runs of adjacent ones. */
+static void virtio_blk_service_pending(virtio_blk_queue q)
+{
+    storage st = q->st;
+    struct list pending;
+    u64 irqflags = spin_lock_irq(&q->lock);
+    list_move(&pending, &q->pending);
+    q->service_scheduled = false;
+    spin_unlock_irq(&q->lock, irqflags);
+    list l;
+    while ((l = list_get_next(&pending))) {
+        virtio_blk_io first = struct_from_list(l, virtio_blk_io, l);
+        list_delete(l);
+        list_init(&first->l);
+        range blocks = first->blocks;
+        while ((l = list_get_next(&pending))) {
+            virtio_blk_io io = struct_from_list(l, virtio_blk_io, l);
+            if ((io->write != first->write) || (io->blocks.start != blocks.end) ||
+                ((range_span(blocks) + range_span(io->blocks)) * st->block_size >
+                 VIRTIO_BLK_MERGE_MAX))
+                break;
+            list_delete(l);
+            list_insert_before(&first->l, l);
+            blocks.end = io->blocks.end;
+        }
+        virtio_blk_submit(st, q->vq, first);
+    }
+}
+
+define_closure_function(1, 0, void, virtio_blk_service,
+                        virtio_blk_queue, q)
+{
+    virtio_blk_service_pending(bound(q));
+}
+
+static void virtio_storage_io_sg(storage st, boolean write, sg_list sg, range blocks,
+                                 status_handler sh)
+{
+    virtio_blk_debug("SG %c, blocks %R, sh %F\n", write ? 'w' : 'r', blocks, sh);
+    if (range_span(blocks) == 0) {
+        apply(sh, STATUS_OK);
+        return;
+    }
+    virtio_blk_io io = allocate(st->v->general, sizeof(*io));
+    if (io == INVALID_ADDRESS) {
+        apply(sh, timm("result", "failed to allocate request"));
+        return;
+    }
+    io->write = write;
+    io->sg = sg;
+    io->blocks = blocks;
+    io->sh = sh;
+    virtio_blk_queue q = virtio_blk_current_queue(st);
+    u64 irqflags = spin_lock_irq(&q->lock);
+
+    /* Requests mostly arrive in ascending block order, so look for the
+     * insertion point from the tail. */
+    list l = q->pending.prev;
+    while ((l != &q->pending) &&
+           (struct_from_list(l, virtio_blk_io, l)->blocks.start > blocks.start))
+        l = l->prev;
+    list_insert_after(l, &io->l);
+    boolean schedule = !q->service_scheduled;
+    q->service_scheduled = true;
+    spin_unlock_irq(&q->lock, irqflags);
+    if (schedule && !enqueue(bhqueue, &q->service))
+        virtio_blk_service_pending(q);
+}
+
+/* Discard or write zeroes, without data transfer. */
+static void virtio_blk_dwz(storage st, u32 type, range blocks, u32 max_sectors, u32 flags,
+                           status_handler sh)
+{
+    virtio_blk_debug("%s: type %d, blocks %R\n", __func__, type, blocks);
+    if (range_span(blocks) == 0) {
+        apply(sh, STATUS_OK);
+        return;
+    }
+    virtio_blk_queue q = virtio_blk_current_queue(st);
+
+    /* keep ordering with respect to read and write requests already issued */
+    virtio_blk_service_pending(q);
+    virtqueue vq = q->vq;
+    merge m = 0;
+    while (range_span(blocks)) {
+        u64 nsectors = MIN(range_span(blocks), max_sectors);
+        u64 req_phys;
+        virtio_blk_req req = allocate_virtio_blk_req(st, type, 0, &req_phys);
+        req->seg.sector = blocks.start;
+        req->seg.num_sectors = nsectors;
+        req->seg.flags = flags;
+        blocks.start += nsectors;
+        if (!m && range_span(blocks)) {
+            m = allocate_merge(st->v->general, sh);
+            sh = apply_merge(m);
+        }
+        vqmsg msg = allocate_vqmsg(vq);
+        assert(msg != INVALID_ADDRESS);
+        vqmsg_push(vq, msg, req_phys, VIRTIO_BLK_REQ_HEADER_SIZE, false);
+        vqmsg_push(vq, msg, req_phys + offsetof(virtio_blk_req, seg), sizeof(req->seg), false);
+        virtio_storage_io_commit(st, vq, msg, req, req_phys, m ? apply_merge(m) : sh);
+    }
+    if (m)
+        apply(sh, STATUS_OK);
+}
+
 static void storage_flush(storage st, status_handler s)
 {
     virtio_blk_debug("%s: handler %p (%F)\n", __func__, s, s);
+    virtio_blk_queue q = virtio_blk_current_queue(st);
+    virtio_blk_service_pending(q);
     u64 req_phys;
     virtio_blk_req req = allocate_virtio_blk_req(st, VIRTIO_BLK_T_FLUSH, 0, &req_phys);
-    virtqueue vq = st->command;
+    virtqueue vq = q->vq;
     vqmsg m = allocate_vqmsg(vq);
     assert(m != INVALID_ADDRESS);
     vqmsg_push(vq, m, req_phys, VIRTIO_BLK_REQ_HEADER_SIZE, false);
@@ -248,6 +445,20 @@ define_closure_function(0, 1, void, virtio_storage_req_handler,
         else
             apply(req->completion, STATUS_OK);
         break;
+    case STORAGE_OP_ZERO:
+        if (st->max_write_zeroes_sectors)
+            virtio_blk_dwz(st, VIRTIO_BLK_T_WRITE_ZEROES, req->blocks,
+                           st->max_write_zeroes_sectors, st->write_zeroes_flags, req->completion);
+        else
+            virtio_storage_io_sg(st, true, req->data, req->blocks, req->completion);
+        break;
+    case STORAGE_OP_DISCARD:
+        if (st->max_discard_sectors)
+            virtio_blk_dwz(st, VIRTIO_BLK_T_DISCARD, req->blocks, st->max_discard_sectors, 0,
+                           req->completion);
+        else
+            apply(req->completion, STATUS_OK);
+        break;
     case STORAGE_OP_READ:
         storage_rw_internal(st, false, req->data, req->blocks, req->completion);
         break;
@@ -257,7 +468,38 @@ define_closure_function(0, 1, void, virtio_storage_req_handler,
     }
 }
 
-static void virtio_blk_attach(heap general, storage_attach a, vtdev v)
+static boolean virtio_blk_alloc_queues(storage s, int max_queues)
+{
+    vtdev v = s->v;
+    int nqueues = 1;
+    if (v->features & VIRTIO_BLK_F_MQ)
+        nqueues = MIN(MIN(vtdev_cfg_read_2(v, VIRTIO_BLK_R_NUM_QUEUES), total_processors),
+                      max_queues);
+    nqueues = MAX(nqueues, 1);
+    s->queues = allocate(v->general, nqueues * sizeof(s->queues[0]));
+    assert(s->queues != INVALID_ADDRESS);
+    for (s->nqueues = 0; s->nqueues < nqueues; s->nqueues++) {
+        virtio_blk_queue q = allocate(v->general, sizeof(*q));
+        assert(q != INVALID_ADDRESS);
+        status st = virtio_alloc_virtqueue_cpu(v, "virtio blk", s->nqueues, s->nqueues, &q->vq);
+        if (!is_ok(st)) {
+            msg_err("failed to allocate virtqueue %d: %v\n", s->nqueues, st);
+            timm_dealloc(st);
+            deallocate(v->general, q, sizeof(*q));
+            break;
+        }
+        q->st = s;
+        list_init(&q->pending);
+        q->service_scheduled = false;
+        init_closure(&q->service, virtio_blk_service, q);
+        spin_lock_init(&q->lock);
+        s->queues[s->nqueues] = q;
+    }
+    virtio_blk_debug("%s: %d queue(s)\n", __func__, s->nqueues);
+    return (s->nqueues > 0);
+}
+
+static void virtio_blk_attach(heap general, storage_attach a, vtdev v, int max_queues)
 {
     storage s = allocate(general, sizeof(struct storage));
     assert(s != INVALID_ADDRESS);
@@ -268,13 +510,23 @@ static void virtio_blk_attach(heap general, storage_attach a, vtdev v)
     s->capacity = (vtdev_cfg_read_4(v, VIRTIO_BLK_R_CAPACITY_LOW) |
 		   ((u64) vtdev_cfg_read_4(v, VIRTIO_BLK_R_CAPACITY_HIGH) << 32)) * s->block_size;
     virtio_blk_debug("%s: capacity 0x%lx, block size 0x%x\n", __func__, s->capacity, s->block_size);
-    virtio_alloc_virtqueue(v, "virtio blk", 0, &s->command);
+    if (!virtio_blk_alloc_queues(s, max_queues)) {
+        deallocate(general, s, sizeof(struct storage));
+        return;
+    }
 
     /* If the device does not support the SEG_MAX feature, assume that an I/O request can have up to
      * (virtqueue_size - 2) scatter-gather list elements (2 descriptors are needed for the request
      * header and status). */
     s->seg_max = (v->features & VIRTIO_BLK_F_SEG_MAX) ?
-            vtdev_cfg_read_4(v, VIRTIO_BLK_R_SEG_MAX) : virtqueue_entries(s->command) - 2;
+            vtdev_cfg_read_4(v, VIRTIO_BLK_R_SEG_MAX) : virtqueue_entries(s->queues[0]->vq) - 2;
+    s->max_discard_sectors = (v->features & VIRTIO_BLK_F_DISCARD) ?
+            vtdev_cfg_read_4(v, VIRTIO_BLK_R_MAX_DISCARD_SECTORS) : 0;
+    s->max_write_zeroes_sectors = (v->features & VIRTIO_BLK_F_WRITE_ZEROES) ?
+            vtdev_cfg_read_4(v, VIRTIO_BLK_R_MAX_WRITE_ZEROS_SECTORS) : 0;
+    s->write_zeroes_flags = (s->max_write_zeroes_sectors &&
+                             vtdev_cfg_read_1(v, VIRTIO_BLK_R_WRITE_ZEROS_MAY_UNMAP)) ?
+            VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
 
     if (v->features & VIRTIO_BLK_F_FLUSH) {
         if (v->features & VIRTIO_BLK_F_CONFIG_WCE)
@@ -295,9 +547,11 @@ closure_function(3, 1, boolean, vtpci_blk_probe,
 
     virtio_blk_debug("   attaching\n");
     heap general = bound(general);
-    vtdev v = (vtdev)attach_vtpci(general, bound(page_allocator), d,
-                                  VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_CONFIG_WCE | VIRTIO_BLK_F_FLUSH);
-    virtio_blk_attach(general, bound(a), v);
+    vtdev v = (vtdev)attach_vtpci(general, bound(page_allocator), d, VIRTIO_BLK_FEATURES);
+
+    /* one MSI-X vector per queue, plus one for configuration changes */
+    int msix_count = pci_get_msix_count(d);
+    virtio_blk_attach(general, bound(a), v, msix_count ? msix_count - 1 : total_processors);
     return true;
 }
 
@@ -312,9 +566,8 @@ closure_function(3, 1, void, vtmmio_blk_probe,
         return;
     virtio_blk_debug("   attaching\n");
     heap general = bound(general);
-    if (attach_vtmmio(general, bound(page_allocator), d,
-                      VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_CONFIG_WCE | VIRTIO_BLK_F_FLUSH))
-        virtio_blk_attach(general, bound(a), (vtdev)d);
+    if (attach_vtmmio(general, bound(page_allocator), d, VIRTIO_BLK_FEATURES))
+        virtio_blk_attach(general, bound(a), (vtdev)d, total_processors);
 }
 
 void init_virtio_blk(kernel_heaps kh, storage_attach a)
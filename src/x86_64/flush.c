@@ -43,15 +43,12 @@ define_closure_function(1, 0, void, flush_complete, flush_entry, f)
     queue_flush_service();
 }
 
-/* must be called with interrupts off */
-static void _flush_handler(void)
+/* Walk entries newer than this cpu's generation, releasing them. Only valid
+   for a cpu counted among the targets of these entries, i.e. one that was
+   not lazy when they were queued. Returns true if a full tlb flush is
+   needed. Called with flush_lock held for read and interrupts off. */
+static boolean flush_entries(cpuinfo ci, boolean full_flush)
 {
-    cpuinfo ci = current_cpu();
-    /* Each generation has at least one page, so if the gen difference is
-     * greater than FLUSH_THRESHOLD, just do a full tlb flush */
-    boolean full_flush = inval_gen - ci->inval_gen > FLUSH_THRESHOLD;
-
-    spin_rlock(&flush_lock);
     while (ci->inval_gen != inval_gen) {
         word oldgen = ci->inval_gen;
         ci->inval_gen = inval_gen;
@@ -72,6 +69,37 @@ static void _flush_handler(void)
             refcount_release(&f->ref);
         }
     }
+    return full_flush;
+}
+
+/* must be called with interrupts off */
+static void _flush_handler(void)
+{
+    cpuinfo ci = current_cpu();
+
+    /* Clear before looking at the generation, so that a shootdown queued
+       after this point either sees the flag clear and sends an ipi, or is
+       picked up below. */
+    ci->inval_ipi_pending = false;
+    memory_barrier();
+
+    /* Each generation has at least one page, so if the gen difference is
+     * greater than FLUSH_THRESHOLD, just do a full tlb flush */
+    boolean full_flush = inval_gen - ci->inval_gen > FLUSH_THRESHOLD;
+
+    spin_rlock(&flush_lock);
+    if (ci->inval_lazy) {
+        /* Waking from idle: entries queued in the meantime did not target
+           this cpu and may already have been recycled, so the list can't
+           be trusted to hold them. Flush everything if any were missed. */
+        ci->inval_lazy = false;
+        if (ci->inval_gen != inval_gen) {
+            ci->inval_gen = inval_gen;
+            full_flush = true;
+        }
+    } else {
+        full_flush = flush_entries(ci, full_flush);
+    }
     spin_runlock(&flush_lock);
 
     if (full_flush)
@@ -88,6 +116,23 @@ void page_invalidate_flush(void)
     _flush_handler();
 }
 
+/* Called with interrupts off by a cpu about to go idle. Pending
+   invalidations are completed, after which shootdowns skip this cpu until
+   it wakes and catches up in page_invalidate_flush(). */
+void page_invalidate_idle(void)
+{
+    if (!initialized)
+        return;
+    cpuinfo ci = current_cpu();
+    boolean full_flush = inval_gen - ci->inval_gen > FLUSH_THRESHOLD;
+    spin_rlock(&flush_lock);
+    full_flush = flush_entries(ci, full_flush);
+    ci->inval_lazy = true;
+    spin_runlock(&flush_lock);
+    if (full_flush)
+        flush_tlb();
+}
+
 void page_invalidate(flush_entry f, u64 p)
 {
     if (initialized) {
@@ -135,6 +180,36 @@ closure_function(0, 0, void, do_flush_service)
     }
 }
 
+/* A cpu with an ipi already pending will see the new generation when it
+   services that ipi, so shootdowns issued in quick succession are batched
+   into a single interrupt per cpu. */
+static void send_flush_ipis(cpuinfo ci)
+{
+    int count = 0;
+    for (int i = 0; i < total_processors; i++) {
+        cpuinfo c = cpuinfo_from_id(i);
+        if (c != ci && !c->inval_lazy && !c->inval_ipi_pending)
+            count++;
+    }
+    if (count == 0)
+        return;
+    if (count == total_processors - 1) {
+        for (int i = 0; i < total_processors; i++) {
+            cpuinfo c = cpuinfo_from_id(i);
+            if (c != ci)
+                c->inval_ipi_pending = true;
+        }
+        apic_ipi(TARGET_EXCLUSIVE_BROADCAST, ICR_ASSERT, flush_ipi);
+        return;
+    }
+    for (int i = 0; i < total_processors; i++) {
+        cpuinfo c = cpuinfo_from_id(i);
+        if (c != ci && !c->inval_lazy &&
+            compare_and_swap_8(&c->inval_ipi_pending, false, true))
+            send_ipi(i, flush_ipi);
+    }
+}
+
 static void queue_flush_service(void)
 {
     if (!service_scheduled) {
@@ -158,10 +233,10 @@ void page_invalidate_sync(flush_entry f, status_handler completion)
             }
             return;
         }
-        init_refcount(&f->ref, total_processors, init_closure(&f->finish, flush_complete, f));
         f->completion = completion;
 
         u64 flags = irq_disable_save();
+        cpuinfo ci = current_cpu();
         spin_wlock(&flush_lock);
 
         /* The service thunk doesn't always get a chance to run before
@@ -178,12 +253,24 @@ void page_invalidate_sync(flush_entry f, status_handler completion)
                     ff->flush = true;
             }
         }
+
+        /* Idle cpus hold no translations in use and flush on wakeup, so only
+           running cpus need to acknowledge the entry. The lazy state only
+           changes with flush_lock held for read. */
+        int targets = 0;
+        for (int i = 0; i < total_processors; i++) {
+            cpuinfo c = cpuinfo_from_id(i);
+            if (c != ci && !c->inval_lazy)
+                targets++;
+        }
+        init_refcount(&f->ref, targets + 1, init_closure(&f->finish, flush_complete, f));
         list_push_back(&entries, &f->l);
         entries_count++;
         f->gen = fetch_and_add((word *)&inval_gen, 1) + 1;
         spin_wunlock(&flush_lock);
 
-        apic_ipi(TARGET_EXCLUSIVE_BROADCAST, ICR_ASSERT, flush_ipi);
+        if (targets > 0)
+            send_flush_ipis(ci);
         _flush_handler();
         irq_restore(flags);
     } else {
@@ -126,7 +126,7 @@ static void timer_config(int timer, timestamp rate, thunk t, boolean periodic)
         tim->interrupt = allocate_interrupt();
         if (hpet->timers[timer].config & TCONF(FSB_INT_DEL_CAP)) {
             u32 a, d;
-            msi_format(&a, &d, tim->interrupt);
+            msi_format(&a, &d, tim->interrupt, 0);
             hpet->timers[timer].fsb_int = ((u64)a << 32) | d;
             tim->config |= TCONF(FSB_EN_CNF);
         } else {
@@ -235,6 +235,10 @@ void common_handler()
     if (i == spurious_int_vector)
         frame_return(f);        /* direct return, no EOI */
 
+    /* invalidates were deferred while idle */
+    if (saved_state == cpu_idle)
+        page_invalidate_flush();
+
     if (ci->state == cpu_interrupt) {
         console("\nexception during interrupt handling\n");
         goto exit_fault;
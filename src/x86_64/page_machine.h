@@ -150,7 +150,8 @@ static inline pageflags pageflags_from_pte(pte pte)
 
 static inline u64 page_pte(u64 phys, u64 flags)
 {
-    return phys | (flags & ~PAGE_NO_PS) | PAGE_PRESENT;
+    /* PS is the PAT bit in a 4K pte; drop it when flags come from a block */
+    return phys | (flags & ~(PAGE_NO_PS | PAGE_PS)) | PAGE_PRESENT;
 }
 
 static inline u64 block_pte(u64 phys, u64 flags)
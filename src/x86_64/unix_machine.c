@@ -243,14 +243,6 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, personality, 0, 0);
     register_syscall(map, ustat, 0, 0);
     register_syscall(map, sysfs, 0, 0);
-    register_syscall(map, getpriority, 0, 0);
-    register_syscall(map, setpriority, 0, 0);
-    register_syscall(map, sched_setparam, 0, 0);
-    register_syscall(map, sched_getparam, 0, 0);
-    register_syscall(map, sched_setscheduler, 0, 0);
-    register_syscall(map, sched_getscheduler, 0, 0);
-    register_syscall(map, sched_get_priority_max, 0, 0);
-    register_syscall(map, sched_get_priority_min, 0, 0);
     register_syscall(map, sched_rr_get_interval, 0, 0);
     register_syscall(map, mlock, syscall_ignore, 0);
     register_syscall(map, munlock, syscall_ignore, 0);
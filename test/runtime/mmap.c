@@ -1128,6 +1128,86 @@ void multithread_filebacked_test(heap h, int n_threads)
     close(mt.fd);
 }
 
+static boolean page_filled(unsigned char *p, unsigned char v)
+{
+    for (int i = 0; i < PAGESIZE; i++)
+        if (p[i] != v)
+            return false;
+    return true;
+}
+
+static void madvise_test(void)
+{
+    unsigned char vec[4];
+    unsigned char *p;
+
+    printf("** starting madvise tests\n");
+    p = mmap(NULL, 4 * PAGESIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (p == MAP_FAILED)
+        handle_err("mmap");
+    memset(p, 0xaa, 4 * PAGESIZE);
+
+    printf("  MADV_WILLNEED leaves contents in place...\n");
+    if (madvise(p, 4 * PAGESIZE, MADV_WILLNEED) < 0)
+        handle_err("madvise MADV_WILLNEED");
+    for (int i = 0; i < 4; i++) {
+        if (!page_filled(p + i * PAGESIZE, 0xaa)) {
+            fprintf(stderr, "page %d changed after MADV_WILLNEED\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("  MADV_DONTNEED releases pages and refaults them zeroed...\n");
+    if (madvise(p, 2 * PAGESIZE, MADV_DONTNEED) < 0)
+        handle_err("madvise MADV_DONTNEED");
+    if (mincore(p, 4 * PAGESIZE, vec) < 0)
+        handle_err("mincore");
+    if ((vec[0] & 1) || (vec[1] & 1) || !(vec[2] & 1) || !(vec[3] & 1)) {
+        fprintf(stderr, "unexpected residency after MADV_DONTNEED: %d %d %d %d\n",
+                vec[0], vec[1], vec[2], vec[3]);
+        exit(EXIT_FAILURE);
+    }
+    if (!page_filled(p, 0) || !page_filled(p + PAGESIZE, 0)) {
+        fprintf(stderr, "pages not zeroed after MADV_DONTNEED\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("  MADV_FREE keeps pages written after the advice...\n");
+    if (madvise(p + 2 * PAGESIZE, 2 * PAGESIZE, MADV_FREE) < 0)
+        handle_err("madvise MADV_FREE");
+    memset(p + 3 * PAGESIZE, 0x55, PAGESIZE);
+    if (!page_filled(p + 2 * PAGESIZE, 0xaa) && !page_filled(p + 2 * PAGESIZE, 0)) {
+        fprintf(stderr, "lazily freed page neither kept nor zeroed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!page_filled(p + 3 * PAGESIZE, 0x55)) {
+        fprintf(stderr, "page written after MADV_FREE lost its contents\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("  madvise error cases...\n");
+    if (madvise(p + 1, PAGESIZE, MADV_DONTNEED) == 0 || errno != EINVAL) {
+        fprintf(stderr, "madvise on unaligned address should fail with EINVAL\n");
+        exit(EXIT_FAILURE);
+    }
+    __munmap(p + 3 * PAGESIZE, PAGESIZE);
+    if (madvise(p, 4 * PAGESIZE, MADV_WILLNEED) == 0 || errno != ENOMEM) {
+        fprintf(stderr, "madvise over unmapped range should fail with ENOMEM\n");
+        exit(EXIT_FAILURE);
+    }
+    __munmap(p, 3 * PAGESIZE);
+
+    p = mmap(NULL, PAGESIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (p == MAP_FAILED)
+        handle_err("mmap");
+    if (madvise(p, PAGESIZE, MADV_FREE) == 0 || errno != EINVAL) {
+        fprintf(stderr, "MADV_FREE on shared mapping should fail with EINVAL\n");
+        exit(EXIT_FAILURE);
+    }
+    __munmap(p, PAGESIZE);
+    printf("** madvise tests passed\n");
+}
+
 static volatile int expect_sigbus = 0;
 static sigjmp_buf sjb;
 
@@ -1266,6 +1346,7 @@ int main(int argc, char * argv[])
     mincore_test();
     mremap_test();
     mprotect_test();
+    madvise_test();
     filebacked_test(h);
     multithread_filebacked_test(h, MT_N_THREADS);
     filebacked_sigbus_test();
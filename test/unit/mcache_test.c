@@ -0,0 +1,141 @@
+#include <runtime.h>
+#include <stdlib.h>
+#define EXIT_FAILURE 1
+#define EXIT_SUCCESS 0
+
+#define TEST_PAGESIZE   U64_FROM_BIT(21)
+#define TEST_MIN_ORDER  5
+#define TEST_MAX_ORDER  16
+#define BENCH_OBJS      4096
+#define BENCH_ROUNDS    256
+
+#define test_assert(expr) do { \
+        if (!(expr)) { \
+            msg_err("%s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+            return false; \
+        } \
+    } while (0)
+
+struct size_mix {
+    const char *name;
+    int nsizes;
+    bytes sizes[8];
+};
+
+/* rough shapes of kernel allocation traffic */
+static struct size_mix mixes[] = {
+    { "closures", 6, { 24, 40, 56, 72, 88, 136 } },
+    { "syscall", 6, { 48, 96, 160, 200, 320, 520 } },
+    { "buffers", 5, { 600, 1500, 2100, 2900, 4000 } },
+    { "uniform", 8, { 17, 100, 333, 700, 1100, 2500, 5000, 9000 } },
+};
+
+static u64 seed = 0x2545f4914f6cdd1dull;
+
+static u64 next_rand(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+/* smallest mcache class, including intermediate classes below 4KB */
+static bytes expected_class(bytes b)
+{
+    int order = find_order(b);
+    if (order <= TEST_MIN_ORDER)
+        return U64_FROM_BIT(TEST_MIN_ORDER);
+    bytes mid = 3 * U64_FROM_BIT(order - 2);
+    if (order <= 12 && b <= mid)
+        return mid;
+    return U64_FROM_BIT(order);
+}
+
+static boolean class_test(heap m)
+{
+    for (bytes b = 1; b <= U64_FROM_BIT(TEST_MAX_ORDER); b += (b < 8192 ? 1 : 61)) {
+        void *p = allocate(m, b);
+        test_assert(p != INVALID_ADDRESS);
+        heap o = objcache_from_object(u64_from_pointer(p), TEST_PAGESIZE);
+        test_assert(o != INVALID_ADDRESS);
+        if (o->pagesize != expected_class(b)) {
+            msg_err("size %ld served from class %ld, expected %ld\n", b, o->pagesize,
+                    expected_class(b));
+            return false;
+        }
+        test_assert(heap_allocated(m) == o->pagesize);
+        int class = mcache_class(m, b);
+        test_assert(class >= 0 && mcache_class_size(m, class) == o->pagesize);
+        test_assert(mcache_class_owns(m, class, u64_from_pointer(p)));
+        test_assert(class == 0 || !mcache_class_owns(m, class - 1, u64_from_pointer(p)));
+        deallocate(m, p, b);
+        test_assert(heap_allocated(m) == 0);
+    }
+
+    /* beyond the largest class falls back to the parent */
+    test_assert(mcache_class(m, U64_FROM_BIT(TEST_MAX_ORDER) + 1) == -1);
+    void *p = allocate(m, U64_FROM_BIT(TEST_MAX_ORDER) + 1);
+    test_assert(p != INVALID_ADDRESS);
+    deallocate(m, p, U64_FROM_BIT(TEST_MAX_ORDER) + 1);
+    test_assert(heap_allocated(m) == 0);
+    return true;
+}
+
+static boolean bench_mix(heap m, struct size_mix *mix, void **objs, bytes *sizes)
+{
+    bytes requested = 0;
+    for (int i = 0; i < BENCH_OBJS; i++) {
+        sizes[i] = mix->sizes[next_rand() % mix->nsizes];
+        requested += sizes[i];
+    }
+
+    timestamp start = now(CLOCK_ID_MONOTONIC);
+    bytes allocated = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_OBJS; i++) {
+            objs[i] = allocate(m, sizes[i]);
+            test_assert(objs[i] != INVALID_ADDRESS);
+        }
+        if (r == 0)
+            allocated = heap_allocated(m);
+        for (int i = 0; i < BENCH_OBJS; i++)
+            deallocate(m, objs[i], sizes[i]);
+    }
+    u64 usec = usec_from_timestamp(now(CLOCK_ID_MONOTONIC) - start);
+    test_assert(heap_allocated(m) == 0);
+
+    u64 ops = (u64)BENCH_OBJS * BENCH_ROUNDS;
+    rprintf("%s:\t%ld allocs/sec, %ld bytes requested, %ld allocated, %ld.%ld%% wasted\n",
+            mix->name, usec ? ops * 1000000 / usec : 0, requested, allocated,
+            (allocated - requested) * 100 / allocated,
+            ((allocated - requested) * 1000 / allocated) % 10);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+    heap mm = allocate_mmapheap(h, TEST_PAGESIZE);
+    heap pageheap = (heap)create_id_heap_backed(h, h, mm, TEST_PAGESIZE, false);
+    heap m = allocate_mcache(h, pageheap, TEST_MIN_ORDER, TEST_MAX_ORDER, TEST_PAGESIZE);
+    if (m == INVALID_ADDRESS) {
+        msg_err("failed to allocate mcache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!class_test(m))
+        exit(EXIT_FAILURE);
+
+    void **objs = allocate(h, BENCH_OBJS * sizeof(void *));
+    bytes *sizes = allocate(h, BENCH_OBJS * sizeof(bytes));
+    for (int i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        if (!bench_mix(m, &mixes[i], objs, sizes))
+            exit(EXIT_FAILURE);
+    }
+    deallocate(h, objs, BENCH_OBJS * sizeof(void *));
+    deallocate(h, sizes, BENCH_OBJS * sizeof(bytes));
+    destroy_heap(m);
+    msg_debug("test passed\n");
+    exit(EXIT_SUCCESS);
+}
@@ -6,6 +6,7 @@
 
 struct pqueue_test_elem {
     int val;
+    u32 index;
 };
 
 boolean basic_sort(void * a, void * b)
@@ -326,6 +327,69 @@ static boolean remove_test(heap h, int passes)
     return false;
 }
 
+static boolean indexed_remove_test(heap h, int passes)
+{
+    const int max_elems = 512;
+    struct pqueue_test_elem elems[max_elems];
+    boolean removed[max_elems];
+    int num_elems;
+    int val;
+    char *err_msg = NULL;
+
+    pqueue q = allocate_pqueue_indexed(h, reorder_sort, offsetof(struct pqueue_test_elem *, index));
+    for (int pass = 0; pass < passes; pass++) {
+        num_elems = (rand() % max_elems) + 1;
+        for (int i = 0; i < num_elems; i++) {
+            elems[i].val = rand();
+            removed[i] = false;
+            pqueue_insert(q, &elems[i]);
+        }
+        int n_remove = rand() % num_elems;
+        for (int i = 0; i < n_remove; i++) {
+            int r = rand() % num_elems;
+            if (pqueue_remove(q, &elems[r]) == removed[r]) {
+                err_msg = removed[r] ? "removed element found in queue" :
+                    "pqueue_remove returned false";
+                goto done;
+            }
+            if (elems[r].index != 0) {
+                err_msg = "index not cleared on removal";
+                goto done;
+            }
+            removed[r] = true;
+        }
+        val = RAND_MAX;
+        for (int i = 0; i < num_elems; i++) {
+            if (removed[i])
+                continue;
+            struct pqueue_test_elem *elem = pqueue_pop(q);
+            if (elem == INVALID_ADDRESS || elem->val > val) {
+                err_msg = "pop out of order";
+                goto done;
+            }
+            if (elem->index != 0) {
+                err_msg = "index not cleared on pop";
+                goto done;
+            }
+            val = elem->val;
+        }
+        if (pqueue_pop(q) != INVALID_ADDRESS) {
+            err_msg = "popped one too many elements";
+            goto done;
+        }
+        if (pqueue_remove(q, &elems[0])) {
+            err_msg = "removal from empty queue";
+            goto done;
+        }
+    }
+  done:
+    deallocate_pqueue(q);
+    if (!err_msg)
+        return true;
+    msg_err("%s\n", err_msg);
+    return false;
+}
+
 static boolean reorder_test(heap h, int passes)
 {
     const int max_elems = 512;
@@ -378,6 +442,9 @@ int main(int argc, char **argv)
     if (!remove_test(h, 100))
         goto fail;
 
+    if (!indexed_remove_test(h, 100))
+        goto fail;
+
     if (!reorder_test(h, 1000))
         goto fail;
 
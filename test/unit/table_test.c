@@ -200,6 +200,66 @@ static boolean one_elem_table_tests(heap h, u64 n_elem)
     return true;
 }
 
+static inline key mixed_key(void *a)
+{
+    return (u64)a * 0x9e3779b97f4a7c15ull;
+}
+
+/* A scan resumed across insertions, removals and resizes must visit each
+   element present throughout exactly once. */
+static boolean scan_table_tests(heap h, u64 n_elem)
+{
+    u64 heap_occupancy = heap_allocated(h);
+    table t = allocate_table(h, mixed_key, pointer_equal);
+    u8 *seen = allocate_zero(h, 2 * n_elem);
+    u64 count, visited = 0;
+
+    for (count = 1; count <= n_elem; count++)
+        table_set(t, (void *)count, (void *)count);
+
+    u64 pos = 0;
+    entry e;
+    while ((e = table_scan(t, &pos))) {
+        u64 n = (u64)e->c;
+        if (pos < TABLE_SCAN_START || (s64)pos < 0) {
+            msg_err("table_scan() invalid position %ld\n", pos);
+            return false;
+        }
+        if (n == 0 || n >= 2 * n_elem || seen[n]) {
+            msg_err("table_scan() invalid or repeated element %ld\n", n);
+            return false;
+        }
+        seen[n] = 1;
+        visited++;
+        if (visited == n_elem / 2) {
+            /* grow the table, then remove the odd elements not yet visited */
+            for (count = n_elem + 1; count < 2 * n_elem; count++)
+                table_set(t, (void *)count, (void *)count);
+            for (count = 1; count <= n_elem; count += 2) {
+                if (!seen[count]) {
+                    table_set(t, (void *)count, 0);
+                    seen[count] = 2;
+                }
+            }
+        }
+    }
+    table_validate(t, "scan_table_tests: after scan");
+
+    for (count = 1; count <= n_elem; count++) {
+        if (!seen[count]) {
+            msg_err("table_scan() missed element %ld\n", count);
+            return false;
+        }
+    }
+    deallocate(h, seen, 2 * n_elem);
+    deallocate_table(t);
+    if (heap_allocated(h) != heap_occupancy) {
+        msg_err("leak: heap_allocated(h) %ld, originally %ld\n", heap_allocated(h), heap_occupancy);
+        return false;
+    }
+    return true;
+}
+
 #define BASIC_ELEM_COUNT  512
 #define STRESS_ELEM_COUNT (1ull << 20)
 
@@ -227,6 +287,11 @@ int main(int argc, char **argv)
         goto fail;
     }
 
+    if (!scan_table_tests(h, BASIC_ELEM_COUNT)) {
+        msg_err("Table scan test failed\n");
+        goto fail;
+    }
+
     if (!basic_table_tests(h, identity_key, STRESS_ELEM_COUNT)) {
         msg_err("Stress table test failed\n");
         goto fail;
@@ -0,0 +1,124 @@
+#include <tfs_internal.h>
+#include <stdlib.h>
+#define EXIT_FAILURE 1
+#define EXIT_SUCCESS 0
+
+#define TEST_FS_SIZE    (8 * MB)
+
+#define test_assert(expr) do { \
+        if (!(expr)) { \
+            msg_err("%s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static u8 *disk;
+static u64 storage_flushes;
+
+/* in-memory device; every request completes synchronously */
+closure_function(0, 1, void, mem_storage,
+                 storage_req, req)
+{
+    u64 offset = req->blocks.start << SECTOR_OFFSET;
+    u64 total = range_span(req->blocks) << SECTOR_OFFSET;
+    sg_list sg = req->data;
+    switch (req->op) {
+    case STORAGE_OP_READSG:
+        sg_list_foreach(sg, sgb) {
+            u64 len = MIN(sg_buf_len(sgb), total);
+            runtime_memcpy(sgb->buf + sgb->offset, disk + offset, len);
+            offset += len;
+            total -= len;
+            if (total == 0)
+                break;
+        }
+        sg_consume(sg, range_span(req->blocks) << SECTOR_OFFSET);
+        break;
+    case STORAGE_OP_WRITESG:
+        sg_list_foreach(sg, sgb) {
+            u64 len = MIN(sg_buf_len(sgb), total);
+            runtime_memcpy(disk + offset, sgb->buf + sgb->offset, len);
+            offset += len;
+            total -= len;
+            if (total == 0)
+                break;
+        }
+        sg_consume(sg, range_span(req->blocks) << SECTOR_OFFSET);
+        break;
+    case STORAGE_OP_ZERO:
+        zero(disk + offset, total);
+        break;
+    case STORAGE_OP_FLUSH:
+        storage_flushes++;
+        break;
+    case STORAGE_OP_DISCARD:
+        break;
+    default:
+        halt("%s: invalid storage op %d\n", __func__, req->op);
+    }
+    apply(req->completion, STATUS_OK);
+}
+
+closure_function(1, 2, void, fs_created,
+                 filesystem *, fsp,
+                 filesystem, fs, status, s)
+{
+    test_assert(is_ok(s));
+    *bound(fsp) = fs;
+}
+
+closure_function(1, 1, void, flush_done,
+                 u64 *, count,
+                 status, s)
+{
+    test_assert(is_ok(s));
+    (*bound(count))++;
+    closure_finish();
+}
+
+/* a flush requested from the completion of another joins the next group */
+closure_function(2, 1, void, flush_again,
+                 filesystem, fs, u64 *, count,
+                 status, s)
+{
+    test_assert(is_ok(s));
+    (*bound(count))++;
+    filesystem_flush(bound(fs), closure(bound(fs)->h, flush_done, bound(count)));
+    closure_finish();
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+    init_pagecache(h, h, 0, PAGESIZE);
+    disk = allocate_zero(h, TEST_FS_SIZE);
+    test_assert(disk != INVALID_ADDRESS);
+
+    filesystem fs = 0;
+    create_filesystem(h, SECTOR_SIZE, TEST_FS_SIZE, closure(h, mem_storage), false, "",
+                      stack_closure(fs_created, &fs));
+    test_assert(fs);
+
+    /* Flushes of a clean filesystem complete synchronously down to the
+       storage flush; each must still complete exactly once. */
+    u64 count = 0;
+    u64 requests = fs->flush_requests;
+    u64 commits = fs->flush_commits;
+    u64 flushes = storage_flushes;
+    filesystem_flush(fs, closure(h, flush_done, &count));
+    test_assert(count == 1);
+    filesystem_flush(fs, closure(h, flush_done, &count));
+    test_assert(count == 2);
+    test_assert(fs->flush_requests == requests + 2);
+    test_assert(fs->flush_commits == commits + 2);
+    test_assert(storage_flushes == flushes + 2);
+    test_assert(!fs->flushing && vector_length(fs->flush_waiters) == 0);
+
+    filesystem_flush(fs, closure(h, flush_again, fs, &count));
+    test_assert(count == 4);
+    test_assert(fs->flush_commits == commits + 4);
+    test_assert(!fs->flushing && vector_length(fs->flush_waiters) == 0);
+
+    msg_debug("test passed\n");
+    exit(EXIT_SUCCESS);
+}
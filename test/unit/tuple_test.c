@@ -190,6 +190,56 @@ fail:
     return failure;
 }
 
+/* symbol_find() takes a reference, which is dropped here */
+static boolean symbol_found(buffer name, symbol s)
+{
+    symbol f = symbol_find(name);
+    if (f)
+        symbol_release(f);
+    return f == s;
+}
+
+boolean symbol_refcount_test(heap h)
+{
+    boolean failure = true;
+    buffer name = wrap_buffer_cstring(h, "tuple_test_refcounted");
+    tuple t = allocate_tuple();
+
+    // lookups don't create symbols
+    test_assert(symbol_found(name, 0));
+    symbol s = intern_ref(name);
+    test_assert(symbol_found(name, s));
+    test_assert(intern_ref(name) == s);
+    symbol_release(s);
+
+    // a tuple key keeps the symbol alive
+    set(t, s, wrap_buffer_cstring(h, "1"));
+    symbol_release(s);
+    test_assert(symbol_found(name, s));
+
+    // and so does an encoding dictionary
+    buffer b = allocate_buffer(h, 128);
+    table dict = allocate_table(h, identity_key, pointer_equal);
+    encode_eav(b, dict, t, s, get(t, s), 0);
+    set(t, s, 0);
+    test_assert(symbol_found(name, s));
+    deallocate_dictionary(dict);
+    test_assert(symbol_found(name, 0));
+
+    // intern() holds a reference that is never released
+    s = intern_u64_ref(123456789);
+    test_assert(intern_u64(123456789) == s);
+    symbol_release(s);
+    test_assert(symbol_found(symbol_string(s), s));
+
+    deallocate_buffer(b);
+    failure = false;
+fail:
+    destruct_tuple(t, true);
+    deallocate_buffer(name);
+    return failure;
+}
+
 int main(int argc, char **argv)
 {
     heap h = init_process_runtime();
@@ -200,6 +250,7 @@ int main(int argc, char **argv)
     failure |= encode_decode_test(h);
     failure |= encode_decode_reference_test(h);
     failure |= encode_decode_lengthy_test(h);
+    failure |= symbol_refcount_test(h);
 
     if (failure) {
         msg_err("Test failed\n");
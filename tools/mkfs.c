@@ -254,11 +254,13 @@ closure_function(2, 1, void, bwrite,
 {
     switch (req->op) {
     case STORAGE_OP_WRITESG:
+    case STORAGE_OP_ZERO:
         break;
     case STORAGE_OP_READSG:
         sg_zero_fill(req->data, range_span(req->blocks) << SECTOR_OFFSET);
         /* no break */
     case STORAGE_OP_FLUSH:
+    case STORAGE_OP_DISCARD:
         apply(req->completion, STATUS_OK);
         return;
     default:
@@ -206,7 +206,8 @@ closure_function(2, 1, void, req_handle,
     switch (req->op) {
     case STORAGE_OP_READSG:
     case STORAGE_OP_WRITESG:
-        write = (req->op == STORAGE_OP_WRITESG);
+    case STORAGE_OP_ZERO:
+        write = (req->op != STORAGE_OP_READSG);
         sg = req->data;
         offset = bound(fs_offset) + (req->blocks.start << SECTOR_OFFSET);
         total = range_span(req->blocks) << SECTOR_OFFSET;
@@ -246,6 +247,7 @@ closure_function(2, 1, void, req_handle,
         }
         break;
     case STORAGE_OP_FLUSH:
+    case STORAGE_OP_DISCARD:
         break;
     default:
         halt("%s: invalid storage op %d\n", __func__, req->op);